@@ -24,8 +24,13 @@
  * console.c:
  * Refered to Wine code
  */
+#include <linux/anon_inodes.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "unistr.h"
 #include "handle.h"
+#include "file.h"
 #include "winuser.h"
 #include "wineserver/wincon.h" 
 
@@ -38,6 +43,9 @@
 struct screen_buffer;
 struct console_input_events;
 
+extern struct fd *create_anon_fd_for_filp(const struct fd_ops *fd_user_ops,
+		struct file *filp, struct object *user, unsigned int options);
+
 struct console_input
 {
 	struct object                obj;           /* object header */
@@ -69,6 +77,8 @@ static void console_input_destroy(struct object *obj);
 static int console_input_events_signaled(struct object *obj, struct w32thread *thread);
 static void screen_buffer_dump(struct object *obj, int verbose);
 static void screen_buffer_destroy(struct object *obj);
+static struct fd *screen_buffer_get_fd(struct object *obj);
+static enum server_fd_type screen_buffer_get_fd_type(struct fd *fd);
 
 static const struct object_ops console_input_ops =
 {
@@ -134,14 +144,40 @@ struct screen_buffer
 	unsigned short        attr;          /* default attribute for screen buffer */
 	rectangle_t           win;           /* current visible window on the screen buffer *
 										  * as seen in wineconsole */
+	struct console_shm   *shm;           /* memory holding data, shared with the renderer */
+	struct fd            *fd;            /* fd the renderer maps shm through */
 };
 
+/*
+ * the memory of a screen buffer, also mapped by the renderer
+ * it outlives the screen buffer while the fd file is open
+ *
+ * the header page is mapped read only, the rest is writable since the renderer
+ * clears the dirty rows; the layout is kept here and never read back from
+ * the shared pages, which any holder of a screen buffer handle can map
+ */
+struct console_shm
+{
+	struct kref                 ref;
+	struct mutex                lock;            /* area against mmap */
+	struct console_output_shm  *area;            /* header, dirty rows, cells, replaced on resize */
+	int                        *update_pending;  /* in area, an update event is queued */
+	unsigned long              *dirty;           /* in area, rows changed since the renderer looked */
+	struct mm_struct           *renderer;        /* mm of the renderer reading the dirty rows, NULL if none */
+};
+
+/*
+ * the renderer registers its mapping once it is complete, until the mapping
+ * goes the dirty rows are left to it; wineconsole keeps the value in sync
+ */
+#define CONSOLE_SHM_RENDERER	_IO('c', 0xd0)
+
 static const struct object_ops screen_buffer_ops =
 {
 	sizeof(struct screen_buffer),     /* size */
 	screen_buffer_dump,               /* dump */
 	no_get_type,                      /* get_type */
-	no_get_fd,                        /* get_fd */
+	screen_buffer_get_fd,             /* get_fd */
 	console_map_access,               /* map_access */
 	no_lookup_name,                   /* lookup_name */
 	no_open_file,                     /* open_file */
@@ -155,6 +191,20 @@ static const struct object_ops screen_buffer_ops =
 	default_set_sd             /* set_sd */
 };
 
+static const struct fd_ops screen_buffer_fd_ops =
+{
+	default_fd_get_poll_events,     /* get_poll_events */
+	default_poll_event,             /* poll_event */
+	no_flush,                       /* flush */
+	screen_buffer_get_fd_type,      /* get_fd_type */
+	default_fd_removable,           /* removable */
+	default_fd_ioctl,               /* ioctl */
+	default_fd_queue_async,         /* queue_async */
+	default_fd_async_event,         /* async_event */
+	default_fd_async_terminated,    /* async_terminated */
+	default_fd_cancel_async         /* cancel_async */
+};
+
 static struct list_head screen_buffer_list = LIST_INIT(screen_buffer_list);
 
 static const char_info_t empty_char_info = { ' ', 0x000f };  /* white on black space */
@@ -307,6 +357,209 @@ static void console_input_events_append(struct console_input_events* evts,
 	uk_wake_up(&evts->obj, 0);
 }
 
+static void console_shm_free(struct kref *ref)
+{
+	struct console_shm *shm = container_of(ref, struct console_shm, ref);
+
+	vfree(shm->area);
+	kfree(shm);
+}
+
+static const struct file_operations console_shm_fops;
+
+/* any part of the renderer's mapping going away ends its registration */
+static void console_shm_vma_close(struct vm_area_struct *vma)
+{
+	struct console_shm *shm = vma->vm_private_data;
+
+	mutex_lock(&shm->lock);
+	if (shm->renderer == vma->vm_mm)
+		shm->renderer = NULL;
+	mutex_unlock(&shm->lock);
+}
+
+static const struct vm_operations_struct console_shm_vm_ops = {
+	.close		= console_shm_vma_close,
+};
+
+static int console_shm_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct console_shm *shm = filp->private_data;
+	int ret;
+
+	/* the header is only written by the kernel */
+	if (!vma->vm_pgoff) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	mutex_lock(&shm->lock);
+	ret = remap_vmalloc_range(vma, shm->area, vma->vm_pgoff);
+	mutex_unlock(&shm->lock);
+	if (!ret) {
+		vma->vm_ops = &console_shm_vm_ops;
+		vma->vm_private_data = shm;
+	}
+	return ret;
+}
+
+/* make the caller the renderer, it must have mapped the writable pages already */
+static long console_shm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct console_shm *shm = filp->private_data;
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	long ret = -EINVAL;
+
+	if (cmd != CONSOLE_SHM_RENDERER)
+		return -ENOTTY;
+	if (!mm)
+		return -EINVAL;
+
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_file && vma->vm_file->f_op == &console_shm_fops
+				&& vma->vm_file->private_data == shm && (vma->vm_flags & VM_WRITE)) {
+			mutex_lock(&shm->lock);
+			shm->renderer = mm;
+			*shm->update_pending = 0;  /* a renderer gone before it cleared it */
+			mutex_unlock(&shm->lock);
+			ret = 0;
+			break;
+		}
+	}
+	up_read(&mm->mmap_sem);
+	return ret;
+}
+
+static int console_shm_release(struct inode *inode, struct file *filp)
+{
+	struct console_shm *shm = filp->private_data;
+
+	kref_put(&shm->ref, console_shm_free);
+	return 0;
+}
+
+static const struct file_operations console_shm_fops = {
+	.owner		= THIS_MODULE,
+	.mmap		= console_shm_mmap,
+	.unlocked_ioctl	= console_shm_ioctl,
+	.release	= console_shm_release,
+};
+
+/* where update_pending, the dirty rows and the cells of a screen buffer go, returns the size */
+static unsigned int console_area_layout(int width, int height, unsigned int *pending_offset,
+		unsigned int *dirty_offset, unsigned int *data_offset)
+{
+	*pending_offset = PAGE_SIZE;
+	*dirty_offset = PAGE_SIZE + sizeof(u64);
+	*data_offset = *dirty_offset + DIV_ROUND_UP(height, 64) * sizeof(u64);
+	return PAGE_ALIGN(*data_offset + width * height * sizeof(char_info_t));
+}
+
+/* allocate the header, dirty rows and cells of a width x height screen buffer */
+static struct console_output_shm *alloc_console_area(int width, int height)
+{
+	struct console_output_shm *area;
+	unsigned int pending_offset, dirty_offset, data_offset, size;
+
+	/* the renderer events carry sizes as shorts */
+	if (width <= 0 || height <= 0 || width > 0x7fff || height > 0x7fff)
+		return NULL;
+
+	size = console_area_layout(width, height, &pending_offset, &dirty_offset, &data_offset);
+
+	/* zeroed, so no row is dirty */
+	if (!(area = vmalloc_user(size)))
+		return NULL;
+	area->size = size;
+	area->width = width;
+	area->height = height;
+	area->pending_offset = pending_offset;
+	area->dirty_offset = dirty_offset;
+	area->data_offset = data_offset;
+	return area;
+}
+
+/* the cells of an area allocated for a width x height screen buffer */
+static char_info_t *console_area_data(struct console_output_shm *area, int width, int height)
+{
+	unsigned int pending_offset, dirty_offset, data_offset;
+
+	console_area_layout(width, height, &pending_offset, &dirty_offset, &data_offset);
+	return (char_info_t *)((char *)area + data_offset);
+}
+
+/* switch a screen buffer to a new width x height area, the old one lives on in the renderer's mapping */
+static void set_console_area(struct screen_buffer *screen_buffer, struct console_output_shm *area,
+		int width, int height)
+{
+	struct console_shm *shm = screen_buffer->shm;
+	struct console_output_shm *old;
+	unsigned int pending_offset, dirty_offset, data_offset;
+
+	console_area_layout(width, height, &pending_offset, &dirty_offset, &data_offset);
+
+	mutex_lock(&shm->lock);
+	old = shm->area;
+	shm->area = area;
+	shm->update_pending = (int *)((char *)area + pending_offset);
+	shm->dirty = (unsigned long *)((char *)area + dirty_offset);
+	mutex_unlock(&shm->lock);
+
+	screen_buffer->data = (char_info_t *)((char *)area + data_offset);
+	vfree(old);
+}
+
+/* create the shared memory of a screen buffer and the fd it is mapped through */
+static int create_console_shm(struct screen_buffer *screen_buffer)
+{
+	struct console_shm *shm;
+	struct file *filp;
+
+	if (!(shm = kzalloc(sizeof(*shm), GFP_KERNEL)))
+		return 0;
+	kref_init(&shm->ref);
+	mutex_init(&shm->lock);
+	screen_buffer->shm = shm;
+
+	kref_get(&shm->ref);
+	filp = anon_inode_getfile("[uk_console]", &console_shm_fops, shm, O_RDWR);
+	if (IS_ERR(filp)) {
+		kref_put(&shm->ref, console_shm_free);
+		return 0;
+	}
+	screen_buffer->fd = create_anon_fd_for_filp(&screen_buffer_fd_ops, filp, &screen_buffer->obj, 0);
+	fput(filp);
+	return screen_buffer->fd != NULL;
+} /* end create_console_shm */
+
+/*
+ * tell the renderer rows top to bottom changed
+ * once it registers its mapping of the cells, it is sent a single event for
+ * all the rows marked dirty until it reads them
+ */
+static void screen_buffer_update(struct screen_buffer *screen_buffer, int top, int bottom)
+{
+	struct console_shm *shm = screen_buffer->shm;
+	struct console_renderer_event evt;
+	int row;
+
+	if (ACCESS_ONCE(shm->renderer)) {
+		for (row = max(top, 0); row <= bottom && row < screen_buffer->height; row++)
+			set_bit(row, shm->dirty);
+		if (xchg(shm->update_pending, 1))
+			return;
+	}
+
+	evt.event = CONSOLE_RENDERER_UPDATE_EVENT;
+	memset(&evt.u, 0, sizeof(evt.u));
+	evt.u.update.top    = top;
+	evt.u.update.bottom = bottom;
+	console_input_events_append(screen_buffer->input->evt, &evt);
+}
+
 /* retrieves events from the console's renderer events list */
 static void console_input_events_get(struct console_input_events* evts)
 {
@@ -418,10 +671,7 @@ static void generate_sb_initial_events(struct console_input *console_input)
 	evt.u.display.height = screen_buffer->win.bottom - screen_buffer->win.top + 1;
 	console_input_events_append(console_input->evt, &evt);
 
-	evt.event = CONSOLE_RENDERER_UPDATE_EVENT;
-	evt.u.update.top    = 0;
-	evt.u.update.bottom = screen_buffer->height - 1;
-	console_input_events_append(console_input->evt, &evt);
+	screen_buffer_update(screen_buffer, 0, screen_buffer->height - 1);
 
 	evt.event = CONSOLE_RENDERER_CURSOR_GEOM_EVENT;
 	evt.u.cursor_geom.size    = screen_buffer->cursor_size;
@@ -437,6 +687,7 @@ static void generate_sb_initial_events(struct console_input *console_input)
 static struct screen_buffer *create_console_output(struct console_input *console_input)
 {
 	struct screen_buffer *screen_buffer;
+	struct console_output_shm *area;
 	int    i;
 	NTSTATUS status;
 
@@ -475,11 +726,12 @@ static struct screen_buffer *create_console_output(struct console_input *console
 
 	list_add_head(&screen_buffer_list, &screen_buffer->entry);
 
-	if (!(screen_buffer->data = malloc(screen_buffer->width * screen_buffer->height *
-					sizeof(*screen_buffer->data)))) {
+	if (!create_console_shm(screen_buffer) ||
+			!(area = alloc_console_area(screen_buffer->width, screen_buffer->height))) {
 		release_object(screen_buffer);
 		return NULL;
 	}
+	set_console_area(screen_buffer, area, screen_buffer->width, screen_buffer->height);
 	/* clear the first row */
 	for (i = 0; i < screen_buffer->width; i++)
 		screen_buffer->data[i] = empty_char_info;
@@ -835,12 +1087,14 @@ static int change_screen_buffer_size(struct screen_buffer *screen_buffer,
 						int new_width, int new_height)
 {
 	int i, old_width, old_height, copy_width, copy_height;
+	struct console_output_shm *new_area;
 	char_info_t *new_data;
 
-	if (!(new_data = malloc(new_width * new_height * sizeof(*new_data)))) {
+	if (!(new_area = alloc_console_area(new_width, new_height))) {
 		set_error(STATUS_NO_MEMORY);
 		return 0;
 	}
+	new_data = console_area_data(new_area, new_width, new_height);
 	old_width = screen_buffer->width;
 	old_height = screen_buffer->height;
 	copy_width = min(old_width, new_width);
@@ -873,8 +1127,7 @@ static int change_screen_buffer_size(struct screen_buffer *screen_buffer,
 			memcpy(&new_data[i * new_width], &new_data[old_height * new_width],
 					new_width * sizeof(char_info_t));
 	}
-	free(screen_buffer->data);
-	screen_buffer->data = new_data;
+	set_console_area(screen_buffer, new_area, new_width, new_height);
 	screen_buffer->width = new_width;
 	screen_buffer->height = new_height;
 	return 1;
@@ -935,10 +1188,7 @@ static int set_console_output_info(struct screen_buffer *screen_buffer,
 		evt.u.resize.height = req->height;
 		console_input_events_append(screen_buffer->input->evt, &evt);
 
-		evt.event = CONSOLE_RENDERER_UPDATE_EVENT;
-		evt.u.update.top    = 0;
-		evt.u.update.bottom = screen_buffer->height - 1;
-		console_input_events_append(screen_buffer->input->evt, &evt);
+		screen_buffer_update(screen_buffer, 0, screen_buffer->height - 1);
 
 		/* scroll window to display sb */
 		if (screen_buffer->win.right >= req->width) {       
@@ -1121,7 +1371,26 @@ static void screen_buffer_destroy(struct object *obj)
 			}
 		}
 	}
-	free(screen_buffer->data);
+	if (screen_buffer->fd)
+		release_object(screen_buffer->fd);
+	if (screen_buffer->shm)
+		kref_put(&screen_buffer->shm->ref, console_shm_free);
+}
+
+static struct fd *screen_buffer_get_fd(struct object *obj)
+{
+	struct screen_buffer *screen_buffer = (struct screen_buffer *)obj;
+
+	if (!screen_buffer->fd) {
+		set_error(STATUS_OBJECT_TYPE_MISMATCH);
+		return NULL;
+	}
+	return (struct fd *)grab_object(screen_buffer->fd);
+}
+
+static enum server_fd_type screen_buffer_get_fd_type(struct fd *fd)
+{
+	return FD_TYPE_CHAR;
 }
 
 /* write data into a screen buffer */
@@ -1176,14 +1445,9 @@ static int write_console_output(struct screen_buffer *screen_buffer, data_size_t
 			return 0;
 	}
 
-	if (i && screen_buffer == screen_buffer->input->active) {
-		struct console_renderer_event evt;
-		evt.event = CONSOLE_RENDERER_UPDATE_EVENT;
-		memset(&evt.u, 0, sizeof(evt.u));
-		evt.u.update.top    = y + x / screen_buffer->width;
-		evt.u.update.bottom = y + (x + i - 1) / screen_buffer->width;
-		console_input_events_append(screen_buffer->input->evt, &evt);
-	}
+	if (i && screen_buffer == screen_buffer->input->active)
+		screen_buffer_update(screen_buffer, y + x / screen_buffer->width,
+				y + (x + i - 1) / screen_buffer->width);
 	return i;
 }
 
@@ -1229,14 +1493,9 @@ static int fill_console_output(struct screen_buffer *screen_buffer, char_info_t
 			return 0;
 	}
 
-	if (count && screen_buffer == screen_buffer->input->active) {
-		struct console_renderer_event evt;
-		evt.event = CONSOLE_RENDERER_UPDATE_EVENT;
-		memset(&evt.u, 0, sizeof(evt.u));
-		evt.u.update.top    = y;
-		evt.u.update.bottom = (y * screen_buffer->width + x + count - 1) / screen_buffer->width;
-		console_input_events_append(screen_buffer->input->evt, &evt);
-	}
+	if (count && screen_buffer == screen_buffer->input->active)
+		screen_buffer_update(screen_buffer, y,
+				(y * screen_buffer->width + x + count - 1) / screen_buffer->width);
 	return i;
 }
 
@@ -1299,7 +1558,6 @@ static void scroll_console_output(obj_handle_t handle, int xsrc, int ysrc, int x
 	struct screen_buffer *screen_buffer;
 	int                j;
 	char_info_t *psrc, *pdst;
-	struct console_renderer_event evt;
 
 	if (!(screen_buffer = (struct screen_buffer *)get_wine_handle_obj(get_current_w32process(), handle,
 					CONSOLE_READ, &screen_buffer_ops)))
@@ -1340,11 +1598,7 @@ static void scroll_console_output(obj_handle_t handle, int xsrc, int ysrc, int x
 	}
 
 	/* FIXME: this could be enhanced, by signalling scroll */
-	evt.event = CONSOLE_RENDERER_UPDATE_EVENT;
-	memset(&evt.u, 0, sizeof(evt.u));
-	evt.u.update.top    = min(ysrc, ydst);
-	evt.u.update.bottom = max(ysrc, ydst) + h - 1;
-	console_input_events_append(screen_buffer->input->evt, &evt);
+	screen_buffer_update(screen_buffer, min(ysrc, ydst), max(ysrc, ydst) + h - 1);
 
 	release_object(screen_buffer);
 }
@@ -30,6 +30,7 @@
 #include "unistr.h"
 #include "handle.h"
 #include "file.h"
+#include "pipe_ring.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
@@ -37,13 +38,6 @@
 #define FILE_SYNCHRONOUS_IO_ALERT       0x00000010
 #define FILE_SYNCHRONOUS_IO_NONALERT    0x00000020
 
-#define AF_UNIX     1   /* Unix domain sockets      */
-#define PF_UNIX                    AF_UNIX
-#define SOCK_STREAM 1
-#define SOL_SOCKET                 0xffff
-#define SO_SNDBUF                  0x1001
-#define SO_RCVBUF                  0x1002
-
 #define FIELD_OFFSET(type, field) (/*(LONG)(INT_PTR)&*/(((type *)0)->field))  /* D.M. TBD */
 
 typedef struct _FILE_PIPE_WAIT_FOR_BUFFER {
@@ -54,6 +48,17 @@ typedef struct _FILE_PIPE_WAIT_FOR_BUFFER {
 } FILE_PIPE_WAIT_FOR_BUFFER, *PFILE_PIPE_WAIT_FOR_BUFFER;
 typedef signed __int64   INT_PTR, *PINT_PTR;
 
+typedef struct _FILE_PIPE_PEEK_BUFFER {
+    ULONG           NamedPipeState;
+    ULONG           ReadDataAvailable;
+    ULONG           NumberOfMessages;
+    ULONG           MessageLength;
+    CHAR            Data[1];
+} FILE_PIPE_PEEK_BUFFER, *PFILE_PIPE_PEEK_BUFFER;
+
+#define FILE_PIPE_CONNECTED_STATE       0x00000003
+#define FILE_PIPE_CLOSING_STATE         0x00000004
+
 extern HANDLE device_handle;
 extern struct object_type *get_object_type(const struct unicode_str*);
 POBJECT_TYPE namedpipe_object_type;
@@ -156,6 +161,7 @@ static enum server_fd_type pipe_server_get_fd_type(struct fd *fd);
 static obj_handle_t pipe_server_ioctl(struct fd *fd, ioctl_code_t code, const async_data_t *async,
 								const void *data, data_size_t size);
 extern unsigned int default_fd_map_access(struct object *obj, unsigned int access);
+extern struct file *get_unix_file(struct fd *fd);
 
 static const struct object_ops pipe_server_ops =
 {
@@ -196,6 +202,8 @@ static struct fd *pipe_client_get_fd(struct object *obj);
 static void pipe_client_destroy(struct object *obj);
 static void pipe_client_flush(struct fd *fd, struct kevent **event);
 static enum server_fd_type pipe_client_get_fd_type(struct fd *fd);
+static obj_handle_t pipe_client_ioctl(struct fd *fd, ioctl_code_t code, const async_data_t *async,
+								const void *data, data_size_t size);
 
 static const struct object_ops pipe_client_ops =
 {
@@ -223,7 +231,7 @@ static const struct fd_ops pipe_client_fd_ops =
 	pipe_client_flush,            /* flush */
 	pipe_client_get_fd_type,      /* get_fd_type */
 	default_fd_removable,         /* removable */
-	default_fd_ioctl,             /* ioctl */
+	pipe_client_ioctl,            /* ioctl */
 	default_fd_queue_async,       /* queue_async */
 	default_fd_async_event,       /* async_event */
 	default_fd_async_terminated,  /* async_terminated */
@@ -547,7 +555,7 @@ static void do_disconnect(struct pipe_server *server)
 		release_object(server->client->fd);
 		server->client->fd = NULL;
 	}
-	shutdown(get_unix_fd(server->fd), SHUT_RDWR);
+	pipe_ring_shutdown(get_unix_file(server->fd));
 	release_object(server->fd);
 	server->fd = NULL;
 }
@@ -776,6 +784,83 @@ static obj_handle_t alloc_wait_event(struct w32process *process)
 	return handle;
 }
 
+/* FSCTL_PIPE_PEEK, answered from the ring without a second call */
+static void pipe_peek(struct fd *pipe_fd)
+{
+	FILE_PIPE_PEEK_BUFFER *buffer;
+	struct pipe_ring_info info;
+	data_size_t size = get_reply_max_size();
+	int copied;
+
+	if (size < offsetof(FILE_PIPE_PEEK_BUFFER, Data)) {
+		set_error(STATUS_INFO_LENGTH_MISMATCH);
+		return;
+	}
+	if (!(buffer = mem_alloc(size)))
+		return;
+
+	copied = pipe_ring_peek(get_unix_file(pipe_fd), buffer->Data,
+			size - offsetof(FILE_PIPE_PEEK_BUFFER, Data), &info);
+	if (copied < 0 || (!info.avail && info.broken)) {
+		free(buffer);
+		set_error(STATUS_PIPE_BROKEN);
+		return;
+	}
+
+	buffer->NamedPipeState    = info.broken ? FILE_PIPE_CLOSING_STATE : FILE_PIPE_CONNECTED_STATE;
+	buffer->ReadDataAvailable = info.avail;
+	buffer->NumberOfMessages  = info.messages;
+	buffer->MessageLength     = info.message_left;
+	set_reply_data_ptr(buffer, offsetof(FILE_PIPE_PEEK_BUFFER, Data) + copied);
+}
+
+/* FSCTL_PIPE_TRANSCEIVE, write the request and wait for the answer in one call */
+static void pipe_transact(struct fd *pipe_fd, const void *data, data_size_t size)
+{
+	data_size_t out_size = get_reply_max_size();
+	struct file *filp;
+	unsigned int left = 0;
+	void *out = NULL;
+	long ret;
+
+	if (out_size && !(out = mem_alloc(out_size)))
+		return;
+
+	/* the answer may take long, a disconnect must not free the file meanwhile */
+	if ((filp = get_unix_file(pipe_fd)))
+		get_file(filp);
+	ret = pipe_ring_transact(filp, data, size, out, out_size, &left);
+	if (filp)
+		fput(filp);
+	if (ret < 0) {
+		free(out);
+		switch (ret) {
+			case -EINVAL:
+				set_error(STATUS_INVALID_READ_MODE);
+				break;
+			case -EBUSY:
+				set_error(STATUS_PIPE_BUSY);
+				break;
+			case -EINTR:
+			case -ERESTARTSYS:
+				set_error(STATUS_CANCELLED);
+				break;
+			default:
+				set_error(STATUS_PIPE_BROKEN);
+				break;
+		}
+		return;
+	}
+
+	/* an empty answer, or no room for the answer, is not an error */
+	if (ret)
+		set_reply_data_ptr(out, ret);
+	else
+		free(out);
+	if (left)
+		set_error(STATUS_BUFFER_OVERFLOW);
+}
+
 static obj_handle_t pipe_server_ioctl(struct fd *fd, ioctl_code_t code, const async_data_t *async_data,
 						const void *data, data_size_t size)
 {
@@ -824,6 +909,18 @@ static obj_handle_t pipe_server_ioctl(struct fd *fd, ioctl_code_t code, const as
 			}
 			return 0;
 
+		case FSCTL_PIPE_PEEK:
+		case FSCTL_PIPE_TRANSCEIVE:
+			if (server->state != ps_connected_server) {
+				set_error(server->state == ps_wait_disconnect ? STATUS_PIPE_BROKEN : STATUS_INVALID_PIPE_STATE);
+				return 0;
+			}
+			if (code == FSCTL_PIPE_PEEK)
+				pipe_peek(server->fd);
+			else
+				pipe_transact(server->fd, data, size);
+			return 0;
+
 		case FSCTL_PIPE_DISCONNECT:
 			switch(server->state) {
 				case ps_connected_server:
@@ -855,6 +952,30 @@ static obj_handle_t pipe_server_ioctl(struct fd *fd, ioctl_code_t code, const as
 }
 
 
+static obj_handle_t pipe_client_ioctl(struct fd *fd, ioctl_code_t code, const async_data_t *async_data,
+						const void *data, data_size_t size)
+{
+	struct pipe_client *client = get_fd_user(fd);
+
+	switch(code) {
+		case FSCTL_PIPE_PEEK:
+		case FSCTL_PIPE_TRANSCEIVE:
+			if (!client->fd || !client->server) {
+				set_error(STATUS_PIPE_BROKEN);
+				return 0;
+			}
+			if (code == FSCTL_PIPE_PEEK)
+				pipe_peek(client->fd);
+			else
+				pipe_transact(client->fd, data, size);
+			return 0;
+
+		default:
+			return default_fd_ioctl(fd, code, async_data, data, size);
+	}
+}
+
+
 static struct named_pipe *create_named_pipe(obj_handle_t root, const struct unicode_str *name,
 						unsigned int attr)
 {
@@ -981,6 +1102,21 @@ static struct pipe_server *find_available_server(struct named_pipe *pipe)
 	return NULL;
 }
 
+/*
+ * the client end has no SetNamedPipeHandleState yet to choose its read mode,
+ * so it reads messages from a pipe that writes them
+ */
+static unsigned int pipe_ring_flags(struct named_pipe *pipe)
+{
+	unsigned int flags = 0;
+
+	if (pipe->flags & NAMED_PIPE_MESSAGE_STREAM_WRITE)
+		flags |= PIPE_RING_MESSAGE | PIPE_RING_CLIENT_READ_MESSAGE;
+	if (pipe->flags & NAMED_PIPE_MESSAGE_STREAM_READ)
+		flags |= PIPE_RING_SERVER_READ_MESSAGE;
+	return flags;
+}
+
 
 struct object *named_pipe_open_file(struct object *obj, unsigned int access,
 					unsigned int sharing, unsigned int options)
@@ -996,7 +1132,7 @@ struct object *named_pipe_open_file(struct object *obj, unsigned int access,
 	}
 
 	if ((client = create_pipe_client(options))) {
-		if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds) >= 0) {
+		if (create_pipe_ring(pipe_ring_flags(pipe), pipe->insize, pipe->outsize, fds) >= 0) {
 			/* for performance reasons, only set nonblocking mode when using
 			 * overlapped I/O. Otherwise, we will be doing too much busy
 			 * looping */
@@ -1005,15 +1141,6 @@ struct object *named_pipe_open_file(struct object *obj, unsigned int access,
 			if (is_overlapped(server->options))
 				fcntl(fds[0], F_SETFL, O_NONBLOCK);
 
-			if (pipe->insize) {
-				setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &pipe->insize, sizeof(pipe->insize));
-				setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &pipe->insize, sizeof(pipe->insize));
-			}
-			if (pipe->outsize) {
-				setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &pipe->outsize, sizeof(pipe->outsize));
-				setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &pipe->outsize, sizeof(pipe->outsize));
-			}
-
 			client->fd = create_anonymous_fd(&pipe_client_fd_ops, fds[1], &client->obj, options);
 			server->fd = create_anonymous_fd(&pipe_server_fd_ops, fds[0], &server->obj, server->options);
 			if (client->fd && server->fd) {
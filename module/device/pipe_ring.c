@@ -0,0 +1,675 @@
+/*
+ * pipe_ring.c
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * pipe_ring.c: the transport under a connected named pipe instance
+ *
+ * The two ends are anonymous inode files sharing a link with one ring of
+ * pages for each direction.  read() and write() copy straight between the
+ * caller's buffer and the ring pages, a page at a time.  On a message pipe
+ * every message is stored behind its length, so a reader in message mode
+ * never gets more than one, and gets the rest of a long one from the next
+ * read.  A reader in byte mode skips the lengths.
+ */
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/log2.h>
+#include <asm/ioctls.h>
+#include "pipe_ring.h"
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+#define PIPE_RING_MIN_PAGES	4
+#define PIPE_RING_MAX_PAGES	256
+
+/*
+ * the bytes going one way; head and tail count the bytes ever written and read
+ * a message is written whole under write_lock, one its writer gives up on is
+ * cut to what was written
+ */
+struct pipe_ring
+{
+	struct page	**pages;
+	unsigned int	nr_pages;	/* power of 2 */
+	unsigned int	head;
+	unsigned int	tail;
+	struct mutex	write_lock;	/* held by the writer of a message */
+	unsigned int	write_start;	/* position of the header of the last message */
+	unsigned int	write_left;	/* bytes still to be written of the last message */
+	unsigned int	read_left;	/* bytes still to be read of the message at tail */
+	unsigned int	messages;	/* messages not completely read */
+	unsigned int	write_want;	/* room a writer without blocking waits for */
+};
+
+struct pipe_link
+{
+	struct mutex		lock;
+	wait_queue_head_t	wait;		/* both directions */
+	struct pipe_ring	ring[2];	/* ring[0] is read by the server end */
+	unsigned int		flags;
+	atomic_t		ends;		/* ends open, the last one frees the link */
+	int			broken;
+};
+
+struct pipe_end
+{
+	struct pipe_link	*link;
+	int			side;		/* 0 for the server end */
+	int			read_message;
+};
+
+static const struct file_operations pipe_ring_fops;
+
+static inline unsigned int ring_size(struct pipe_ring *ring)
+{
+	return ring->nr_pages << PAGE_SHIFT;
+}
+
+static inline unsigned int ring_space(struct pipe_ring *ring)
+{
+	return ring_size(ring) - (ring->head - ring->tail);
+}
+
+static inline struct pipe_ring *read_ring(struct pipe_end *end)
+{
+	return &end->link->ring[end->side];
+}
+
+static inline struct pipe_ring *write_ring(struct pipe_end *end)
+{
+	return &end->link->ring[!end->side];
+}
+
+static int alloc_ring(struct pipe_ring *ring, unsigned int size)
+{
+	unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	unsigned int i;
+
+	nr_pages = clamp_t(unsigned int, nr_pages, PIPE_RING_MIN_PAGES, PIPE_RING_MAX_PAGES);
+	nr_pages = roundup_pow_of_two(nr_pages);
+	mutex_init(&ring->write_lock);
+
+	if (!(ring->pages = kcalloc(nr_pages, sizeof(struct page *), GFP_KERNEL)))
+		return -ENOMEM;
+	ring->nr_pages = nr_pages;
+	for (i = 0; i < nr_pages; i++)
+		if (!(ring->pages[i] = alloc_page(GFP_KERNEL)))
+			return -ENOMEM;
+	return 0;
+}
+
+static void free_ring(struct pipe_ring *ring)
+{
+	unsigned int i;
+
+	if (!ring->pages)
+		return;
+	for (i = 0; i < ring->nr_pages; i++)
+		if (ring->pages[i])
+			__free_page(ring->pages[i]);
+	kfree(ring->pages);
+}
+
+static void free_pipe_link(struct pipe_link *link)
+{
+	free_ring(&link->ring[0]);
+	free_ring(&link->ring[1]);
+	kfree(link);
+}
+
+/* copy len bytes between buf and the ring at pos, a page at a time */
+static int ring_copy(struct pipe_ring *ring, unsigned int pos, void *buf,
+		unsigned int len, int to_ring, int user)
+{
+	while (len) {
+		unsigned int off = pos & (ring_size(ring) - 1);
+		unsigned int in_page = off & ~PAGE_MASK;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - in_page);
+		char *page = page_address(ring->pages[off >> PAGE_SHIFT]) + in_page;
+
+		if (!user) {
+			if (to_ring)
+				memcpy(page, buf, chunk);
+			else
+				memcpy(buf, page, chunk);
+		}
+		else if (to_ring ? copy_from_user(page, (const void __user *)buf, chunk)
+				: copy_to_user((void __user *)buf, page, chunk))
+			return -EFAULT;
+
+		pos += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/* cut the message being written to what was written of it, link->lock held */
+static void ring_cut_message(struct pipe_ring *ring)
+{
+	u32 len;
+
+	if ((int)(ring->tail - ring->write_start) <= 0) {
+		/* the header is still there to be fixed */
+		ring_copy(ring, ring->write_start, &len, sizeof(len), 0, 0);
+		len -= ring->write_left;
+		ring_copy(ring, ring->write_start, &len, sizeof(len), 1, 0);
+	}
+	else if (!(ring->read_left -= ring->write_left))
+		ring->messages--;	/* the reader is in the message, and had all of it */
+	ring->write_left = 0;
+}
+
+static ssize_t ring_write(struct pipe_end *end, const char *buf, size_t count,
+		int user, int nonblock)
+{
+	struct pipe_link *link = end->link;
+	struct pipe_ring *ring = write_ring(end);
+	int message = link->flags & PIPE_RING_MESSAGE;
+	int header = message;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	if (nonblock ? !mutex_trylock(&ring->write_lock) : mutex_lock_interruptible(&ring->write_lock))
+		return nonblock ? -EAGAIN : -ERESTARTSYS;
+
+	mutex_lock(&link->lock);
+	for (;;) {
+		unsigned int chunk;
+
+		if (link->broken) {
+			ret = -EPIPE;
+			break;
+		}
+
+		if (header) {
+			u32 len = count;
+
+			/*
+			 * without blocking, a message is written whole or not at all;
+			 * one larger than the ring is written as with blocking
+			 */
+			if (nonblock && ring_space(ring) < sizeof(len) + count
+					&& sizeof(len) + count <= ring_size(ring)) {
+				ring->write_want = sizeof(len) + count;
+				ret = -EAGAIN;
+				break;
+			}
+			ring->write_want = 0;
+			if (ring_space(ring) < sizeof(len))
+				goto wait;
+			ring->write_start = ring->head;
+			ring_copy(ring, ring->head, &len, sizeof(len), 1, 0);
+			ring->head += sizeof(len);
+			ring->write_left = len;
+			ring->messages++;
+			header = 0;
+			nonblock = 0;
+			wake_up_interruptible_poll(&link->wait, POLLIN);
+		}
+
+		if (done == count)
+			break;
+
+		chunk = min_t(size_t, ring_space(ring), count - done);
+		if (chunk) {
+			if (ring_copy(ring, ring->head, (char *)buf + done, chunk, 1, user)) {
+				ret = -EFAULT;
+				break;
+			}
+			ring->head += chunk;
+			done += chunk;
+			if (message)
+				ring->write_left -= chunk;
+			wake_up_interruptible_poll(&link->wait, POLLIN);
+			continue;
+		}
+
+wait:
+		if (nonblock) {
+			ret = -EAGAIN;
+			break;
+		}
+		mutex_unlock(&link->lock);
+		/* once a message is started only a fatal signal stops it */
+		if (message && !header)
+			ret = wait_event_killable(link->wait, ring_space(ring) || link->broken);
+		else
+			ret = wait_event_interruptible(link->wait,
+					ring_space(ring) >= (header ? sizeof(u32) : 1) || link->broken);
+		mutex_lock(&link->lock);
+		if (ret)
+			break;
+	}
+	if (ring->write_left)
+		ring_cut_message(ring);
+	mutex_unlock(&link->lock);
+	mutex_unlock(&ring->write_lock);
+	/* a writer without blocking may have given up on write_lock */
+	wake_up_interruptible_poll(&link->wait, POLLOUT);
+
+	if (message && !header)
+		return done;
+	return done ? done : ret;
+} /* end ring_write */
+
+static ssize_t ring_read(struct pipe_end *end, char *buf, size_t count,
+		int user, int nonblock)
+{
+	struct pipe_link *link = end->link;
+	struct pipe_ring *ring = read_ring(end);
+	int framed = link->flags & PIPE_RING_MESSAGE;
+	int message = framed && end->read_message;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	/* a message reader still waits for a message, and starts it */
+	if (!count && !message)
+		return 0;
+
+	mutex_lock(&link->lock);
+	for (;;) {
+		unsigned int avail = ring->head - ring->tail;
+		unsigned int chunk;
+
+		if (framed && !ring->read_left) {
+			u32 len;
+
+			if (done && message)
+				break;	/* one message at a time */
+			if (avail >= sizeof(len)) {
+				ring_copy(ring, ring->tail, &len, sizeof(len), 0, 0);
+				ring->tail += sizeof(len);
+				if (!(ring->read_left = len))
+					ring->messages--;
+				wake_up_interruptible_poll(&link->wait, POLLOUT);
+				/* an empty message is read as such, a byte reader skips it */
+				if (message && (!len || !count))
+					break;
+				continue;
+			}
+		}
+		else if (!count)
+			break;	/* a message reader in a message already */
+		else {
+			chunk = min_t(size_t, avail, count - done);
+			if (framed)
+				chunk = min(chunk, ring->read_left);
+			/* without blocking, wait for the whole message unless it cannot fit */
+			if (message && nonblock && !done && ring->read_left > avail && ring_space(ring))
+				chunk = 0;
+			if (chunk) {
+				if (ring_copy(ring, ring->tail, buf + done, chunk, 0, user)) {
+					ret = -EFAULT;
+					break;
+				}
+				ring->tail += chunk;
+				done += chunk;
+				if (framed && !(ring->read_left -= chunk))
+					ring->messages--;
+				wake_up_interruptible_poll(&link->wait, POLLOUT);
+				if (done == count || (message && !ring->read_left))
+					break;
+				continue;
+			}
+		}
+
+		if ((done && !message) || link->broken)
+			break;
+		if (nonblock) {
+			ret = -EAGAIN;
+			break;
+		}
+		mutex_unlock(&link->lock);
+		ret = wait_event_interruptible(link->wait, ring->head != ring->tail || link->broken);
+		mutex_lock(&link->lock);
+		if (ret)
+			break;
+	}
+	mutex_unlock(&link->lock);
+
+	return done ? done : ret;
+} /* end ring_read */
+
+/* walk what can be read without moving it, copying up to size bytes to buf */
+static unsigned int ring_peek(struct pipe_end *end, void *buf, unsigned int size,
+		struct pipe_ring_info *info)
+{
+	struct pipe_ring *ring = read_ring(end);
+	int framed = end->link->flags & PIPE_RING_MESSAGE;
+	int message = framed && end->read_message;
+	unsigned int pos = ring->tail, left = ring->read_left;
+	unsigned int copied = 0;
+	int first = !left;	/* no message started yet */
+
+	info->avail = 0;
+	info->messages = framed ? ring->messages : 0;
+	info->message_left = left;
+	info->broken = end->link->broken;
+
+	while (pos != ring->head) {
+		unsigned int chunk = ring->head - pos;
+
+		if (framed && !left) {
+			u32 len;
+
+			if (chunk < sizeof(len))
+				break;
+			ring_copy(ring, pos, &len, sizeof(len), 0, 0);
+			pos += sizeof(len);
+			if (!(left = len))
+				continue;	/* skipped by readers too */
+			if (first)
+				info->message_left = len;
+			else if (message)
+				size = copied;	/* only the first message */
+			first = 0;
+			continue;
+		}
+
+		if (framed)
+			chunk = min(chunk, left);
+		if (copied < size) {
+			unsigned int n = min(chunk, size - copied);
+
+			ring_copy(ring, pos, buf + copied, n, 0, 0);
+			copied += n;
+		}
+		info->avail += chunk;
+		pos += chunk;
+		if (framed)
+			left -= chunk;
+	}
+	return copied;
+} /* end ring_peek */
+
+/*
+ * the readiness tests of poll, the same as ring_read and ring_write without
+ * blocking; poll can't sleep on link->lock, so they are only hints while the
+ * other end moves the ring
+ */
+static int ring_readable(struct pipe_end *end)
+{
+	struct pipe_ring *ring = read_ring(end);
+	unsigned int tail = ACCESS_ONCE(ring->tail);
+	unsigned int avail = ACCESS_ONCE(ring->head) - tail;
+	unsigned int want = ACCESS_ONCE(ring->read_left);
+	u32 len;
+
+	if (!avail)
+		return 0;
+	if (!(end->link->flags & PIPE_RING_MESSAGE) || !end->read_message)
+		return 1;
+	/* a message reader waits for the whole message, unless it cannot fit */
+	if (!want) {
+		if (avail < sizeof(len))
+			return 0;
+		ring_copy(ring, tail, &len, sizeof(len), 0, 0);
+		want = sizeof(len) + len;
+	}
+	return avail >= want || !ring_space(ring);
+}
+
+static int ring_writable(struct pipe_end *end)
+{
+	struct pipe_ring *ring = write_ring(end);
+	unsigned int want = 1;
+
+	if (mutex_is_locked(&ring->write_lock))
+		return 0;
+	if (end->link->flags & PIPE_RING_MESSAGE)
+		want = max_t(unsigned int, sizeof(u32), ACCESS_ONCE(ring->write_want));
+	return ring_space(ring) >= want;
+}
+
+static ssize_t pipe_ring_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	return ring_read(filp->private_data, (char *)buf, count, 1, filp->f_flags & O_NONBLOCK);
+}
+
+static ssize_t pipe_ring_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+	return ring_write(filp->private_data, (const char *)buf, count, 1, filp->f_flags & O_NONBLOCK);
+}
+
+static unsigned int pipe_ring_poll(struct file *filp, poll_table *wait)
+{
+	struct pipe_end *end = filp->private_data;
+	struct pipe_link *link = end->link;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &link->wait, wait);
+
+	if (ring_readable(end))
+		mask |= POLLIN | POLLRDNORM;
+	if (ring_writable(end))
+		mask |= POLLOUT | POLLWRNORM;
+	if (link->broken)
+		mask |= POLLHUP;
+	return mask;
+}
+
+static long pipe_ring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct pipe_end *end = filp->private_data;
+	struct pipe_ring_info info;
+	int value;
+
+	mutex_lock(&end->link->lock);
+	switch (cmd) {
+		case FIONREAD:
+			ring_peek(end, NULL, 0, &info);
+			value = info.avail;
+			break;
+		case PIPE_RING_MORE_DATA:
+			value = end->read_message ? read_ring(end)->read_left : 0;
+			break;
+		case PIPE_RING_BROKEN:
+			value = end->link->broken && read_ring(end)->head == read_ring(end)->tail;
+			break;
+		default:
+			mutex_unlock(&end->link->lock);
+			return -ENOTTY;
+	}
+	mutex_unlock(&end->link->lock);
+
+	return put_user(value, (int __user *)arg);
+}
+
+static int pipe_ring_release(struct inode *inode, struct file *filp)
+{
+	struct pipe_end *end = filp->private_data;
+	struct pipe_link *link = end->link;
+
+	mutex_lock(&link->lock);
+	link->broken = 1;
+	wake_up_interruptible_poll(&link->wait, POLLHUP);
+	mutex_unlock(&link->lock);
+
+	/* the other end may be released meanwhile, the link goes with the last */
+	if (atomic_dec_and_test(&link->ends))
+		free_pipe_link(link);
+	kfree(end);
+	return 0;
+}
+
+static const struct file_operations pipe_ring_fops = {
+	.owner		= THIS_MODULE,
+	.llseek		= no_llseek,
+	.read		= pipe_ring_read,
+	.write		= pipe_ring_write,
+	.poll		= pipe_ring_poll,
+	.unlocked_ioctl	= pipe_ring_ioctl,
+	.release	= pipe_ring_release,
+};
+
+static struct file *open_pipe_end(struct pipe_link *link, int side, int read_message)
+{
+	struct pipe_end *end;
+	struct file *filp;
+
+	if (!(end = kmalloc(sizeof(*end), GFP_KERNEL)))
+		return ERR_PTR(-ENOMEM);
+	end->link = link;
+	end->side = side;
+	end->read_message = read_message;
+
+	filp = anon_inode_getfile("[uk_pipe]", &pipe_ring_fops, end, O_RDWR);
+	if (IS_ERR(filp))
+		kfree(end);
+	return filp;
+}
+
+/*
+ * create the two ends of a pipe instance in the current process, as socketpair
+ * fds[0] is the server end, insize and outsize are the server's buffer sizes
+ */
+int create_pipe_ring(unsigned int flags, unsigned int insize, unsigned int outsize, int fds[2])
+{
+	struct pipe_link *link;
+	struct file *files[2] = { NULL, NULL };
+	int i, opened = 0, ret;
+
+	if (!(link = kzalloc(sizeof(*link), GFP_KERNEL)))
+		return -ENOMEM;
+	mutex_init(&link->lock);
+	init_waitqueue_head(&link->wait);
+	link->flags = flags;
+
+	if ((ret = alloc_ring(&link->ring[0], insize)) || (ret = alloc_ring(&link->ring[1], outsize))) {
+		free_pipe_link(link);
+		return ret;
+	}
+
+	fds[0] = fds[1] = -1;
+	for (i = 0; i < 2; i++) {
+		files[i] = open_pipe_end(link, i,
+				flags & (i ? PIPE_RING_CLIENT_READ_MESSAGE : PIPE_RING_SERVER_READ_MESSAGE));
+		if (IS_ERR(files[i])) {
+			ret = PTR_ERR(files[i]);
+			files[i] = NULL;
+			goto failed;
+		}
+		atomic_inc(&link->ends);
+		opened++;
+		if ((fds[i] = get_unused_fd_flags(0)) < 0) {
+			ret = fds[i];
+			goto failed;
+		}
+	}
+
+	fd_install(fds[0], files[0]);
+	fd_install(fds[1], files[1]);
+	return 0;
+
+failed:
+	for (i = 0; i < 2; i++) {
+		if (fds[i] >= 0)
+			put_unused_fd(fds[i]);
+		if (files[i])
+			fput(files[i]);	/* the last one frees the link */
+	}
+	if (!opened)
+		free_pipe_link(link);
+	return ret;
+} /* end create_pipe_ring */
+
+/* is filp a pipe end, whose poll neither sleeps nor takes link->lock */
+int is_pipe_ring_file(struct file *filp)
+{
+	return filp && filp->f_op == &pipe_ring_fops;
+}
+
+/* break the link for both ends, what is left can still be read */
+void pipe_ring_shutdown(struct file *filp)
+{
+	struct pipe_end *end;
+
+	if (!filp || filp->f_op != &pipe_ring_fops)
+		return;
+	end = filp->private_data;
+
+	mutex_lock(&end->link->lock);
+	end->link->broken = 1;
+	mutex_unlock(&end->link->lock);
+	wake_up_interruptible_poll(&end->link->wait, POLLHUP);
+}
+
+/* copy what the end could read to buf, without removing it */
+int pipe_ring_peek(struct file *filp, void *buf, unsigned int size, struct pipe_ring_info *info)
+{
+	struct pipe_end *end;
+	int ret;
+
+	if (!filp || filp->f_op != &pipe_ring_fops)
+		return -EINVAL;
+	end = filp->private_data;
+
+	mutex_lock(&end->link->lock);
+	ret = ring_peek(end, buf, size, info);
+	mutex_unlock(&end->link->lock);
+	return ret;
+}
+
+/*
+ * write a message and wait for the one that answers it, as TransactNamedPipe
+ * left is set to what did not fit in out of the answer
+ */
+long pipe_ring_transact(struct file *filp, const void *in, unsigned int in_size,
+		void *out, unsigned int out_size, unsigned int *left)
+{
+	struct pipe_end *end;
+	struct pipe_ring *ring;
+	long ret;
+
+	if (!filp || filp->f_op != &pipe_ring_fops)
+		return -EINVAL;
+	end = filp->private_data;
+	ring = read_ring(end);
+
+	if (!(end->link->flags & PIPE_RING_MESSAGE) || !end->read_message)
+		return -EINVAL;
+	mutex_lock(&end->link->lock);
+	ret = (ring->head != ring->tail) ? -EBUSY : 0;	/* the answer would get mixed with what is there */
+	mutex_unlock(&end->link->lock);
+	if (ret)
+		return ret;
+
+	ret = ring_write(end, in, in_size, 0, 0);
+	if (ret < 0)
+		return ret;
+	if ((unsigned long)ret != in_size)
+		return -EINTR;
+
+	ret = ring_read(end, out, out_size, 0, 0);
+	mutex_lock(&end->link->lock);
+	*left = ring->read_left;
+	mutex_unlock(&end->link->lock);
+	return ret;
+} /* end pipe_ring_transact */
+#endif /* CONFIG_UNIFIED_KERNEL */
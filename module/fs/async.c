@@ -225,9 +225,7 @@ void async_terminate(struct async *async, unsigned int status)
 //		set_tsk_thread_flag(thread->et_task, TIF_APC);
 
 		if (thread->et_task) {
-			thread->tcb.wait_status = STATUS_USER_APC;
-			set_tsk_need_resched(current);
-			wake_up_process(thread->et_task);
+			abort_wait_thread(&thread->tcb, STATUS_USER_APC, IO_NO_INCREMENT);
 
 			sys_kill(thread->et_task->pid, SIGUSR2);
 		}
@@ -23,9 +23,18 @@
 /*
  * completion.c:
  * Refered to Wine code
+ *
+ * A port works like an NT kernel queue: threads that dequeue from it become
+ * associated with it, and at most maximum_count of them are let run at once.
+ * An associated thread that blocks anywhere else gives its place to the most
+ * recent waiter, waiters are woken last in first out so that a busy port keeps
+ * running on the same few threads.
  */
+#include <linux/slab.h>
 #include "unistr.h"
 #include "handle.h"
+#include "thread.h"
+#include "w32syscall.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
@@ -33,15 +42,26 @@
 #define IO_COMPLETION_MODIFY_STATE 0x0002
 #define IO_COMPLETION_ALL_ACCESS   (STANDARD_RIGHTS_REQUIRED|SYNCHRONIZE|0x3)
 
+#define COMPLETION_BATCH	64	/* most packets NtRemoveIoCompletionEx takes at once */
+
 extern struct object_type *get_object_type(const struct unicode_str *name);
 
+/*
+ * kqueue.entry_list_head	queued packets
+ * kqueue.current_count		associated threads that are running
+ * kqueue.maximum_count		concurrency limit
+ * kqueue.thread_list_head	threads waiting for a packet, most recent first
+ */
 struct uk_completion
 {
 	struct object  obj;
-	struct list_head    queue;
+	struct kqueue  kqueue;
+	spinlock_t     lock;
 	unsigned int   depth;
 };
 
+#define kqueue_to_completion(kq)	container_of(kq, struct uk_completion, kqueue)
+
 static void completion_dump(struct object*, int);
 static struct object_type *completion_get_type(struct object *obj);
 static void completion_destroy(struct object *);
@@ -75,6 +95,8 @@ struct comp_msg
 	unsigned int  status;
 };
 
+static struct kmem_cache *comp_msg_cache;
+
 static WCHAR completion_type_name[] = {'C', 'o', 'm', 'p', 'l', 'e', 't', 'i', 'o', 'n', 0};
 
 POBJECT_TYPE completion_object_type = NULL;
@@ -88,12 +110,17 @@ static GENERIC_MAPPING completion_mapping =
 	STANDARD_RIGHTS_REQUIRED | SYNCHRONIZE | 0x3
 };
 
-VOID
+int
 init_completion_implement(VOID)
 {
 	OBJECT_TYPE_INITIALIZER ObjectTypeInitializer;
 	UNICODE_STRING Name;
 
+	/* every completion message comes from the cache, there is no fallback */
+	comp_msg_cache = kmem_cache_create("uk_comp_msg", sizeof(struct comp_msg), 0, 0, NULL);
+	if (!comp_msg_cache)
+		return -ENOMEM;
+
 	memset(&ObjectTypeInitializer, 0, sizeof(ObjectTypeInitializer));
 	init_unistr(&Name, completion_type_name);
 	ObjectTypeInitializer.Length = sizeof(ObjectTypeInitializer);
@@ -103,6 +130,14 @@ init_completion_implement(VOID)
 	ObjectTypeInitializer.ValidAccessMask = EVENT_ALL_ACCESS;
 	ObjectTypeInitializer.UseDefaultObject = TRUE;
 	create_type_object(&ObjectTypeInitializer, &Name, &completion_object_type);
+	return 0;
+}
+
+VOID
+exit_completion_implement(VOID)
+{
+	if (comp_msg_cache)
+		kmem_cache_destroy(comp_msg_cache);
 }
 
 static void completion_destroy(struct object *obj)
@@ -110,8 +145,8 @@ static void completion_destroy(struct object *obj)
 	struct uk_completion *completion = (struct uk_completion *) obj;
 	struct comp_msg *tmp, *next;
 
-	LIST_FOR_EACH_ENTRY_SAFE(tmp, next, &completion->queue, struct comp_msg, queue_entry) {
-		free(tmp);
+	LIST_FOR_EACH_ENTRY_SAFE(tmp, next, &completion->kqueue.entry_list_head, struct comp_msg, queue_entry) {
+		kmem_cache_free(comp_msg_cache, tmp);
 	}
 }
 
@@ -130,7 +165,7 @@ static int completion_signaled(struct object *obj, struct w32thread *thread)
 {
 	struct uk_completion *completion = (struct uk_completion *)obj;
 
-	return !list_empty(&completion->queue);
+	return completion->depth != 0;
 }
 
 static struct uk_completion *create_completion(struct directory *root, 
@@ -142,7 +177,11 @@ static struct uk_completion *create_completion(struct directory *root,
 		if (get_error() != STATUS_OBJECT_NAME_EXISTS) {
 			INIT_DISP_HEADER(&completion->obj.header, COMPLETION,
 					sizeof(struct completion) / sizeof(ULONG), 0);
-			INIT_LIST_HEAD(&completion->queue);
+			INIT_LIST_HEAD(&completion->kqueue.entry_list_head);
+			INIT_LIST_HEAD(&completion->kqueue.thread_list_head);
+			completion->kqueue.current_count = 0;
+			completion->kqueue.maximum_count = concurrent ? concurrent : num_online_cpus();
+			spin_lock_init(&completion->lock);
 			completion->depth = 0;
 		}
 	}
@@ -155,23 +194,298 @@ struct uk_completion *get_completion_obj(struct w32process *process, obj_handle_
 	return (struct uk_completion *)get_wine_handle_obj(process, handle, access, &completion_ops);
 }
 
+/*
+ * let the most recent waiters run while there are packets for them
+ * and the port is under its concurrency limit
+ * must be called with the port lock held
+ */
+static void wake_completion_waiters(struct uk_completion *completion)
+{
+	struct kqueue *kq = &completion->kqueue;
+	struct kthread *thread;
+	unsigned int packets = completion->depth;
+
+	while (packets && kq->current_count < kq->maximum_count
+			&& !list_empty(&kq->thread_list_head)) {
+		thread = list_entry(kq->thread_list_head.next, struct kthread, queue_list_entry);
+		/* an empty entry tells the waiter it has been let run, and counted */
+		list_del_init(&thread->queue_list_entry);
+		kq->current_count++;
+		packets--;
+		wake_up_process(((struct ethread *)thread)->et_task);
+	}
+}
+
 void add_completion(struct uk_completion *completion, unsigned long ckey,
 				unsigned long cvalue, unsigned int status, unsigned long information)
 {
-	struct comp_msg *msg = mem_alloc(sizeof(*msg));
+	struct comp_msg *msg = kmem_cache_alloc(comp_msg_cache, GFP_KERNEL);
 
-	if (!msg)
+	if (!msg) {
+		set_error(STATUS_NO_MEMORY);
 		return;
+	}
 
 	msg->ckey = ckey;
 	msg->cvalue = cvalue;
 	msg->status = status;
 	msg->information = information;
-	list_add_before(&completion->queue, &msg->queue_entry);
+
+	spin_lock(&completion->lock);
+	list_add_tail(&msg->queue_entry, &completion->kqueue.entry_list_head);
 	completion->depth++;
+	wake_completion_waiters(completion);
+	spin_unlock(&completion->lock);
+
+	/* for NtWaitForSingleObject on the port */
 	uk_wake_up(&completion->obj, 0);
 }
 
+/* the thread stops running on its port, and is no longer associated with it */
+static void leave_completion(struct kthread *thread)
+{
+	struct uk_completion *completion;
+
+	if (!thread->queue)
+		return;
+
+	completion = kqueue_to_completion(thread->queue);
+	spin_lock(&completion->lock);
+	completion->kqueue.current_count--;
+	wake_completion_waiters(completion);
+	spin_unlock(&completion->lock);
+
+	thread->queue = NULL;
+	release_object(completion);
+}
+
+/* an associated thread is about to block in some other wait */
+void completion_thread_block(struct kthread *thread)
+{
+	struct uk_completion *completion = kqueue_to_completion(thread->queue);
+
+	spin_lock(&completion->lock);
+	completion->kqueue.current_count--;
+	wake_completion_waiters(completion);
+	spin_unlock(&completion->lock);
+}
+
+/* an associated thread is running again, even beyond the limit */
+void completion_thread_unblock(struct kthread *thread)
+{
+	struct uk_completion *completion = kqueue_to_completion(thread->queue);
+
+	spin_lock(&completion->lock);
+	completion->kqueue.current_count++;
+	spin_unlock(&completion->lock);
+}
+
+void completion_thread_exit(struct kthread *thread)
+{
+	leave_completion(thread);
+}
+
+/*
+ * take up to count packets off the port, waiting for the first one
+ * the current thread is associated with the port from now on
+ */
+static NTSTATUS remove_completion_packets(struct uk_completion *completion, struct comp_msg **msgs,
+		unsigned int count, unsigned int *removed, long *timeout, BOOLEAN alertable)
+{
+	struct kthread *thread = (struct kthread *)get_current_ethread();
+	struct kqueue *kq = &completion->kqueue;
+	struct list_head *entry;
+	NTSTATUS status = STATUS_SUCCESS;
+	unsigned int n = 0;
+
+	if (thread->queue != kq) {
+		leave_completion(thread);
+		thread->queue = kq;
+		grab_object(completion);
+		INIT_LIST_HEAD(&thread->queue_list_entry);
+		spin_lock(&completion->lock);
+	} else {
+		/* our place is given back while we look for a packet */
+		spin_lock(&completion->lock);
+		kq->current_count--;
+	}
+
+	for (;;) {
+		if (completion->depth && kq->current_count < kq->maximum_count) {
+			while (n < count && (entry = list_head(&kq->entry_list_head))) {
+				list_del(entry);
+				completion->depth--;
+				msgs[n++] = LIST_ENTRY(entry, struct comp_msg, queue_entry);
+			}
+			break;
+		}
+		if (alertable && thread->apc_state.uapc_pending) {
+			status = STATUS_USER_APC;
+			set_tsk_thread_flag(current, TIF_APC);
+			break;
+		}
+		if (!*timeout) {
+			status = STATUS_TIMEOUT;
+			break;
+		}
+		if (signal_pending(current)) {
+			status = -EINTR;
+			break;
+		}
+
+		list_add(&thread->queue_list_entry, &kq->thread_list_head);
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_unlock(&completion->lock);
+
+		*timeout = schedule_timeout(*timeout);
+
+		spin_lock(&completion->lock);
+		if (list_empty(&thread->queue_list_entry))
+			kq->current_count--;	/* let run, see again if a packet is left */
+		else
+			list_del_init(&thread->queue_list_entry);
+	}
+
+	/* whatever the outcome, the thread runs again */
+	kq->current_count++;
+	spin_unlock(&completion->lock);
+
+	*removed = n;
+	return status;
+}
+
+/* NT timeout to jiffies, a NULL timeout is infinite */
+static long completion_timeout(PLARGE_INTEGER Timeout, LARGE_INTEGER *timeout)
+{
+	struct timespec ts;
+	s64 rel;
+	s32 rem;
+
+	if (!Timeout)
+		return MAX_SCHEDULE_TIMEOUT;
+	if (copy_from_user(timeout, Timeout, sizeof(*timeout)))
+		return -1;
+
+	rel = timeout->QuadPart < 0 ? -timeout->QuadPart : timeout->QuadPart - get_current_time();
+	if (rel <= 0)
+		return 0;
+	ts.tv_sec = div_s64_rem(rel * 100, 1000000000, &rem);
+	ts.tv_nsec = rem;
+	return timespec_to_jiffies(&ts) + (ts.tv_sec || ts.tv_nsec);
+}
+
+/* an interrupted wait is restarted by ntdll with what is left of a relative timeout */
+static void completion_timeout_left(PLARGE_INTEGER Timeout, LARGE_INTEGER *timeout, long left)
+{
+	struct timespec ts;
+
+	if (!Timeout || timeout->QuadPart >= 0)
+		return;
+	jiffies_to_timespec(left, &ts);
+	timeout->QuadPart = -(ts.tv_sec * 10000000LL + ts.tv_nsec / 100);
+	if (copy_to_user(Timeout, timeout, sizeof(*timeout)))
+		return;
+}
+
+/*
+ * NtRemoveIoCompletion
+ * dequeue one packet, blocking in the kernel until there is one
+ */
+NTSTATUS SERVICECALL
+NtRemoveIoCompletion(IN  HANDLE		  IoCompletionHandle,
+		OUT PVOID 		  *CompletionKey,
+		OUT PVOID 		  *CompletionContext,
+		OUT PIO_STATUS_BLOCK IoStatusBlock,
+		IN  PLARGE_INTEGER   Timeout OPTIONAL)
+{
+	struct uk_completion *completion;
+	struct comp_msg *msg;
+	LARGE_INTEGER _timeout;
+	unsigned int removed;
+	long timeout;
+	NTSTATUS status;
+
+	ktrace("handle %p\n", IoCompletionHandle);
+	if (!get_current_ethread())
+		return STATUS_INVALID_PARAMETER;
+	if ((timeout = completion_timeout(Timeout, &_timeout)) < 0)
+		return STATUS_ACCESS_VIOLATION;
+
+	if (!(completion = get_completion_obj(get_current_w32process(),
+					IoCompletionHandle, IO_COMPLETION_MODIFY_STATE)))
+		return get_error();
+
+	status = remove_completion_packets(completion, &msg, 1, &removed, &timeout, FALSE);
+	if (status == -EINTR)
+		completion_timeout_left(Timeout, &_timeout, timeout);
+	release_object(completion);
+	if (!removed)
+		return status;
+
+	if (put_user((PVOID)msg->ckey, CompletionKey)
+			|| put_user((PVOID)msg->cvalue, CompletionContext)
+			|| put_user(msg->status, &IoStatusBlock->Status)
+			|| put_user(msg->information, &IoStatusBlock->Information))
+		status = STATUS_ACCESS_VIOLATION;
+	else
+		status = STATUS_SUCCESS;
+	kmem_cache_free(comp_msg_cache, msg);
+	return status;
+} /* end NtRemoveIoCompletion */
+EXPORT_SYMBOL(NtRemoveIoCompletion);
+
+/*
+ * NtRemoveIoCompletionEx
+ * dequeue up to Count packets in one call, blocking until there is one
+ */
+NTSTATUS SERVICECALL
+NtRemoveIoCompletionEx(IN  HANDLE		  IoCompletionHandle,
+		OUT PFILE_IO_COMPLETION_INFORMATION IoCompletionInformation,
+		IN  ULONG 		  Count,
+		OUT PULONG 		  NumEntriesRemoved,
+		IN  PLARGE_INTEGER   Timeout OPTIONAL,
+		IN  BOOLEAN 		  Alertable)
+{
+	struct uk_completion *completion;
+	struct comp_msg *msgs[COMPLETION_BATCH];
+	FILE_IO_COMPLETION_INFORMATION info;
+	LARGE_INTEGER _timeout;
+	unsigned int removed, i;
+	long timeout;
+	NTSTATUS status;
+
+	ktrace("handle %p, count %d\n", IoCompletionHandle, Count);
+	if (!get_current_ethread() || !Count)
+		return STATUS_INVALID_PARAMETER;
+	if (Count > COMPLETION_BATCH)
+		Count = COMPLETION_BATCH;
+	if ((timeout = completion_timeout(Timeout, &_timeout)) < 0)
+		return STATUS_ACCESS_VIOLATION;
+
+	if (!(completion = get_completion_obj(get_current_w32process(),
+					IoCompletionHandle, IO_COMPLETION_MODIFY_STATE)))
+		return get_error();
+
+	status = remove_completion_packets(completion, msgs, Count, &removed, &timeout, Alertable);
+	if (status == -EINTR)
+		completion_timeout_left(Timeout, &_timeout, timeout);
+	release_object(completion);
+
+	for (i = 0; i < removed; i++) {
+		info.CompletionKey = msgs[i]->ckey;
+		info.CompletionValue = msgs[i]->cvalue;
+		info.Status = msgs[i]->status;
+		info.Information = msgs[i]->information;
+		if (copy_to_user(IoCompletionInformation + i, &info, sizeof(info)))
+			status = STATUS_ACCESS_VIOLATION;
+		kmem_cache_free(comp_msg_cache, msgs[i]);
+	}
+	if (removed && put_user(removed, NumEntriesRemoved))
+		status = STATUS_ACCESS_VIOLATION;
+	return status;
+} /* end NtRemoveIoCompletionEx */
+EXPORT_SYMBOL(NtRemoveIoCompletionEx);
+
 /* create a completion */
 DECL_HANDLER(create_completion)
 {
@@ -241,18 +555,22 @@ DECL_HANDLER(remove_completion)
 	if (!completion)
 		return;
 
-	entry = list_head(&completion->queue);
+	spin_lock(&completion->lock);
+	if ((entry = list_head(&completion->kqueue.entry_list_head))) {
+		list_del(entry);
+		completion->depth--;
+	}
+	spin_unlock(&completion->lock);
+
 	if (!entry)
 		set_error(STATUS_PENDING);
 	else {
-		list_del(entry);
-		completion->depth--;
 		msg = LIST_ENTRY(entry, struct comp_msg, queue_entry);
 		reply->ckey = msg->ckey;
 		reply->cvalue = msg->cvalue;
 		reply->status = msg->status;
 		reply->information = msg->information;
-		free(msg);
+		kmem_cache_free(comp_msg_cache, msg);
 	}
 
 	release_object(completion);
@@ -183,8 +183,7 @@ static struct object *directory_lookup_name(struct object *obj, struct unicode_s
 
 static void directory_destroy(struct object *obj)
 {
-	POBJECT_DIRECTORY dir = (POBJECT_DIRECTORY)obj;
-	delete_obdir_entry(dir);
+	free_obdir_table(obj);
 }
 
 static POBJECT_DIRECTORY create_directory(HANDLE root, const struct unicode_str *name,
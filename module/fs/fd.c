@@ -27,9 +27,18 @@
 #include <linux/security.h>
 #include <linux/major.h>
 #include <linux/poll.h>
+#include <linux/interrupt.h>
+#include <linux/mutex.h>
+#include <linux/net.h>
+#include <linux/file.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/fdtable.h>
+#include <linux/completion.h>
 
 #include "handle.h"
 #include "file.h"
+#include "pipe_ring.h"
 #include "wineserver/file.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
@@ -104,6 +113,8 @@ extern void add_completion(struct uk_completion *completion, unsigned long ckey,
 
 /* file descriptor object */
 
+#define FD_WAIT_HEADS	2	/* wait queues of a unix file we can hook, like a socket's */
+
 /* closed_fd is used to keep track of the unix fd belonging to a closed fd object */
 struct closed_fd
 {
@@ -130,11 +141,17 @@ struct fd
 	int                   signaled :1; /* is the fd signaled? */
 	int                   fs_locks :1; /* can we use filesystem locks for this fd? */
 	int                   poll_index;  /* index of fd in poll array */
+	struct poll_loop     *poll_loop;   /* event loop the fd is polled by */
 	struct async_queue   *read_q;      /* async readers of this fd */
 	struct async_queue   *write_q;     /* async writers of this fd */
 	struct async_queue   *wait_q;      /* other async waiters of this fd */
 	struct uk_completion *completion;  /* completion object attached to this fd */
 	unsigned long         comp_key;    /* completion key to set in completion events */
+	int                   wait_hooked; /* are we on the unix file's wait queues? */
+	int                   wait_heads;  /* number of wait queues hooked */
+	wait_queue_head_t    *wait_head[FD_WAIT_HEADS]; /* wait queues of the unix file */
+	wait_queue_t          wait[FD_WAIT_HEADS];      /* our entries on them */
+	struct tasklet_struct wait_tasklet; /* wakes the user's waiters */
 };
 
 static void fd_dump(struct object *obj, int verbose);
@@ -268,28 +285,40 @@ static file_pos_t max_unix_offset = OFF_T_MAX;
 /****************************************************************/
 /* timeouts support */
 
+/*
+ * Every timeout carries its own hrtimer, so adding or removing one does not
+ * walk the other timeouts.  The hrtimer only moves the timeout to the
+ * expired list and wakes the timer thread, the callback runs there.
+ */
+
+enum timeout_state
+{
+	TIMEOUT_PENDING,      /* hrtimer armed */
+	TIMEOUT_EXPIRED,      /* on the expired list */
+	TIMEOUT_RUNNING,      /* callback in progress */
+	TIMEOUT_REMOVED       /* removed while running, freed by the timer thread */
+};
+
 struct timeout_user
 {
-	struct list_head      entry;      /* entry in sorted timeout list */
+	struct list_head      entry;      /* entry in the pending or the expired list */
+	struct hrtimer        timer;      /* fires at the expiry time */
 	timeout_t             when;       /* timeout expiry (absolute time) */
 	timeout_callback      callback;   /* callback function */
 	void                 *private;    /* callback private data */
+	int                   state;      /* enum timeout_state */
 };
 
-static struct list_head timeout_list = LIST_INIT(timeout_list);   /* sorted timeouts list */
+static struct list_head timeout_list = LIST_INIT(timeout_list);   /* pending timeouts */
+static struct list_head expired_list = LIST_INIT(expired_list);   /* timeouts waiting for their callback */
+static DEFINE_SPINLOCK(timeout_lock);
+static DECLARE_WAIT_QUEUE_HEAD(timeout_wait);
+static struct kmem_cache *timeout_cache;
 
 # define EPOLL_CTL_ADD 1
 # define EPOLL_CTL_DEL 2
 # define EPOLL_CTL_MOD 3
 
-static struct fd **poll_users;              /* users array */
-static struct pollfd *pollfd;               /* poll fd array */
-static struct fd **freelist;                /* list of free entries in the array */
-static int nb_users;                        /* count of array entries actually in use */
-static int allocated_users;                 /* count of allocated entries in the array */
-static int active_users = 0;
-static int epoll_fd = -1;
-
 typedef union epoll_data
 {
   void *ptr;
@@ -304,79 +333,389 @@ struct epoll_event
   epoll_data_t data;
 };
 
-void init_epoll(void)
+extern int uk_epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout);
+
+static inline void fd_poll_event( struct fd *fd, int event )
+{
+    fd->fd_ops->poll_event( fd, event );
+}
+
+/*
+ * fd event loop
+ * each process has its own epoll set and poll users table, served by a
+ * kernel thread sharing the process file table, as the unix fds are numbers
+ * in that table; the thread takes that table over before opening its fds,
+ * the loop may be created on behalf of the process by a task outside it.  The thread sleeps in epoll_wait until an fd is ready and
+ * dispatches its events at once.  Registration changes asked for from
+ * another process can't use those numbers, they are left to the thread,
+ * woken up through a socket pair.
+ */
+
+#define POLL_LOOP_WAKE  (~0U)           /* epoll data of the wake up socket */
+#define POLL_LOOP_EVENTS 128            /* events taken in one epoll_wait */
+
+/* what epoll waits for on behalf of a user */
+struct epoll_reg
+{
+	int                  fd;              /* unix fd registered, -1 if none */
+	int                  events;
+};
+
+struct poll_loop
+{
+	atomic_t             refcount;        /* the process, the thread and the users */
+	struct mutex         lock;            /* protects the users table and wake_fd */
+	struct files_struct *files;           /* file table of the fd numbers */
+	struct task_struct  *task;            /* a task of the process, until the thread started */
+	struct completion    started;         /* the thread set up epoll_fd, or failed to */
+	int                  epoll_fd;
+	int                  wake_fd;         /* read end of the wake up socket, -1 once closed */
+	struct file         *wake_file;       /* write end of the wake up socket */
+	int                  stop;            /* the process is gone, the thread should exit */
+	int                  pending;         /* registrations left for the thread to update */
+	struct fd          **poll_users;      /* users array */
+	struct pollfd       *pollfd;          /* poll fd array */
+	struct epoll_reg    *epoll_reg;       /* epoll registration of each user */
+	struct fd          **freelist;        /* list of free entries in the array */
+	int                  nb_users;        /* count of array entries actually in use */
+	int                  allocated_users; /* count of allocated entries in the array */
+	int                  active_users;
+};
+
+static void release_poll_loop(struct poll_loop *loop)
+{
+	if (!atomic_dec_and_test(&loop->refcount))
+		return;
+	if (loop->wake_file)
+		fput(loop->wake_file);
+	free(loop->poll_users);
+	free(loop->pollfd);
+	free(loop->epoll_reg);
+	kfree(loop);
+}
+
+static inline int poll_loop_is_local(struct poll_loop *loop)
+{
+	return current->files == loop->files;
+}
+
+/* make the loop thread look at loop->stop and loop->pending, loop->lock held */
+static void wake_poll_loop(struct poll_loop *loop)
 {
-	pid_t thread_id;
-    current->ethread->threads_process->epoll_fd = sys_epoll_create( 128 );
-   
-	thread_id = kernel_thread((void *)main_loop, NULL, CLONE_KERNEL);
-	if (thread_id < 0)
-		printk("kernel_thread error %d\n", thread_id);
+	char c = 0;
+
+	/* once the read end is closed a write would raise SIGPIPE */
+	if (loop->wake_file && loop->wake_fd != -1)
+		filp_write(loop->wake_file, &c, 1);  /* nothing lost if the socket is full */
+}
+
+/* take a reference on an fd, unless it is already being destroyed */
+static struct fd *grab_live_fd(struct fd *fd)
+{
+	return atomic_inc_not_zero(&BODY_TO_HEADER(fd)->PointerCount) ? fd : NULL;
+}
+
+/* bring the epoll registration of a user in line with its pollfd, must be local */
+static void sync_epoll_user(struct poll_loop *loop, int user)
+{
+	struct epoll_reg *reg = &loop->epoll_reg[user];
+	struct epoll_event ev;
+	int fd = loop->pollfd[user].fd, events = loop->pollfd[user].events;
+	int ctl, ret;
+
+	if (loop->epoll_fd == -1) {
+		reg->fd = -1;  /* epoll is gone with everything registered */
+		return;
+	}
+	if (fd == -1) {
+		if (reg->fd == -1)
+			return;
+		ctl = EPOLL_CTL_DEL;
+	}
+	else if (reg->fd != fd) {
+		if (reg->fd != -1)
+			sys_epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, reg->fd, &ev);
+		ctl = EPOLL_CTL_ADD;
+	}
+	else if (reg->events != events)
+		ctl = EPOLL_CTL_MOD;
 	else
-		printk("kernel_thread id %d\n", thread_id);
+		return;  /* nothing to do */
+
+	ev.events = events;
+	memset(&ev.data, 0, sizeof(ev.data));
+	ev.data.u32 = user;
+
+	ret = sys_epoll_ctl(loop->epoll_fd, ctl, ctl == EPOLL_CTL_DEL ? reg->fd : fd, &ev);
+	reg->fd = fd;
+	reg->events = events;
+	if (ret >= 0)
+		return;
+	if (ret == -ENOMEM) {  /* not enough memory, give up on epoll */
+		close(loop->epoll_fd);
+		loop->epoll_fd = -1;
+	}
+	else if (ctl != EPOLL_CTL_DEL)  /* the fd may be closed already */
+		kdebug("epoll_ctl %d on fd %d failed %d\n", ctl, fd, ret);
 }
 
-/* add a timeout user */
-struct timeout_user *add_timeout_user(timeout_t when, timeout_callback func, void *private)
+/* put a user back on the free list, once epoll no longer reports it */
+static void free_poll_user(struct poll_loop *loop, int user)
 {
-	struct timeout_user *user;
-	struct list_head *ptr;
+	loop->poll_users[user] = (struct fd *)loop->freelist;
+	loop->freelist = &loop->poll_users[user];
+	loop->active_users--;
+}
 
-	if (!(user = mem_alloc(sizeof(*user))))
+/* update the registrations left by other processes; called from the loop thread */
+static void sync_poll_loop(struct poll_loop *loop)
+{
+	int user;
+
+	mutex_lock(&loop->lock);
+	loop->pending = 0;
+	for (user = 0; user < loop->nb_users; user++) {
+		if (loop->pollfd[user].fd == -1 && loop->epoll_reg[user].fd == -1)
+			continue;
+		sync_epoll_user(loop, user);
+		if (!loop->poll_users[user])  /* removed while registered */
+			free_poll_user(loop, user);
+	}
+	mutex_unlock(&loop->lock);
+}
+
+/* open the epoll set and wake up socket in the process file table */
+static int start_poll_loop(struct poll_loop *loop)
+{
+	struct files_struct *files;
+	struct epoll_event ev;
+	int sv[2];
+
+	/* the creator may be a helper of the process, take its file table explicitly */
+	if (!(files = get_files_struct(loop->task)))
+		return -1;
+	reset_files_struct(files);
+	loop->files = files;
+
+	if ((loop->epoll_fd = sys_epoll_create(128)) < 0)
+		return -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -1;
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	loop->wake_fd = sv[0];
+	loop->wake_file = fget(sv[1]);
+	close(sv[1]);
+
+	ev.events = POLLIN;
+	ev.data.u32 = POLL_LOOP_WAKE;
+	if (!loop->wake_file || sys_epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0)
+		return -1;
+	return 0;
+}
+
+static int poll_loop_thread(void *arg)
+{
+	struct poll_loop *loop = arg;
+	struct epoll_event events[POLL_LOOP_EVENTS];
+	char buf[64];
+	int i, ret;
+
+	if (start_poll_loop(loop) < 0) {
+		if (loop->epoll_fd >= 0)
+			close(loop->epoll_fd);
+		loop->epoll_fd = -1;
+		if (loop->wake_fd != -1)
+			close(loop->wake_fd);
+		loop->wake_fd = -1;
+		complete(&loop->started);
+		release_poll_loop(loop);
+		return 0;
+	}
+	complete(&loop->started);
+
+	while (!loop->stop) {
+		if (loop->pending)
+			sync_poll_loop(loop);
+
+		ret = uk_epoll_wait(loop->epoll_fd, events, POLL_LOOP_EVENTS, -1);
+		if (ret <= 0) {
+			if (ret < 0 && ret != -EINTR)
+				break;  /* epoll gone */
+			continue;
+		}
+
+		/* put the events into the pollfd array first, like poll does */
+		mutex_lock(&loop->lock);
+		for (i = 0; i < ret; i++) {
+			unsigned int user = events[i].data.u32;
+
+			if (user == POLL_LOOP_WAKE) {
+				while (read(loop->wake_fd, buf, sizeof(buf)) > 0)
+					;
+				continue;
+			}
+			if (user < loop->nb_users && loop->poll_users[user])
+				loop->pollfd[user].revents = events[i].events;
+		}
+		mutex_unlock(&loop->lock);
+
+		/* read events from the pollfd array, as set_fd_events may modify them */
+		for (i = 0; i < ret; i++) {
+			unsigned int user = events[i].data.u32;
+			struct fd *fd = NULL;
+			int revents = 0;
+
+			if (user == POLL_LOOP_WAKE)
+				continue;
+			mutex_lock(&loop->lock);
+			if (user < loop->nb_users && (revents = loop->pollfd[user].revents)) {
+				loop->pollfd[user].revents = 0;
+				/* removed from the loop once the lock is dropped, unless referenced */
+				if (loop->poll_users[user])
+					fd = grab_live_fd(loop->poll_users[user]);
+			}
+			mutex_unlock(&loop->lock);
+			if (fd) {
+				fd_poll_event(fd, revents);
+				release_object(fd);
+			}
+		}
+	}
+
+	mutex_lock(&loop->lock);
+	loop->stop = 1;
+	if (loop->epoll_fd != -1)
+		close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+	close(loop->wake_fd);
+	loop->wake_fd = -1;
+	mutex_unlock(&loop->lock);
+	release_poll_loop(loop);
+	return 0;
+}
+
+static DEFINE_MUTEX(poll_loop_create_lock);
+
+/* create the event loop of a process, task is one of its threads */
+static struct poll_loop *create_poll_loop(struct eprocess *process, struct task_struct *task)
+{
+	struct poll_loop *loop;
+	int pid;
+
+	if (!(loop = kzalloc(sizeof(*loop), GFP_KERNEL)))
 		return NULL;
-	user->when     = (when > 0) ? when : current_time - when;
-	user->callback = func;
-	user->private  = private;
+	atomic_set(&loop->refcount, 2);  /* the process and the thread */
+	mutex_init(&loop->lock);
+	init_completion(&loop->started);
+	loop->task = task;
+	loop->epoll_fd = -1;
+	loop->wake_fd = -1;
+
+	/* no CLONE_SIGHAND, the thread must not take part in the process signals */
+	if ((pid = kernel_thread(poll_loop_thread, loop, CLONE_FS | CLONE_FILES)) < 0) {
+		kdebug("kernel_thread error %d\n", pid);
+		kfree(loop);
+		return NULL;
+	}
+	wait_for_completion(&loop->started);
+	loop->task = NULL;
+
+	if (loop->epoll_fd == -1) {  /* the thread is gone */
+		release_poll_loop(loop);
+		return NULL;
+	}
+	process->poll_loop = loop;
+	return loop;
+}
 
-	/* Now insert it in the linked list */
+/* the last thread of a process is gone, stop its event loop */
+void stop_poll_loop(struct eprocess *process)
+{
+	struct poll_loop *loop;
 
-	LIST_FOR_EACH(ptr, &timeout_list) {
-		struct timeout_user *timeout = LIST_ENTRY(ptr, struct timeout_user, entry);
-		if (timeout->when >= user->when)
-			break;
+	mutex_lock(&poll_loop_create_lock);
+	loop = process->poll_loop;
+	process->poll_loop = NULL;
+	mutex_unlock(&poll_loop_create_lock);
+	if (!loop)
+		return;
+
+	mutex_lock(&loop->lock);
+	loop->stop = 1;
+	wake_poll_loop(loop);
+	mutex_unlock(&loop->lock);
+	release_poll_loop(loop);
+}
+
+static enum hrtimer_restart timeout_expired(struct hrtimer *timer)
+{
+	struct timeout_user *user = container_of(timer, struct timeout_user, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&timeout_lock, flags);
+	if (user->state == TIMEOUT_PENDING) {
+		list_del(&user->entry);
+		list_add_before(&expired_list, &user->entry);
+		user->state = TIMEOUT_EXPIRED;
 	}
-	list_add_before(ptr, &user->entry);
-	return user;
+	spin_unlock_irqrestore(&timeout_lock, flags);
+	wake_up(&timeout_wait);
+	return HRTIMER_NORESTART;
 }
 
-/* add a linux timer */
-struct timer_list *add_linux_timer(timeout_t when, timeout_callback func, void *private)
+/* add a timeout user */
+struct timeout_user *add_timeout_user(timeout_t when, timeout_callback func, void *private)
 {
-	struct timer_list *timer;
-	struct timespec ts = { 0, 0 };
+	struct timeout_user *user;
+	timeout_t delay;
+	unsigned long flags;
 
-	kdebug("\n");
-	timer = (struct timer_list *)kmalloc(sizeof(struct timer_list), GFP_ATOMIC);
-	if (!timer) {
-		kdebug("kmalloc(timer_list) atomic error.\n");
+	if (!(user = kmem_cache_alloc(timeout_cache, GFP_KERNEL))) {
 		set_error(STATUS_NO_MEMORY);
 		return NULL;
 	}
-	init_timer(timer);
-	timespec_add_ns(&ts, when * 100);
-	kdebug("jiffies = %ld\n", jiffies);
-	timer->expires = jiffies + timespec_to_jiffies(&ts);
-	kdebug("timer->expires = %ld\n", timer->expires);
-	timer->data = (unsigned long)private;
-	timer->function = (void *)func;
-	add_timer(timer);
+	user->when     = (when > 0) ? when : current_time - when;
+	user->callback = func;
+	user->private  = private;
+	user->state    = TIMEOUT_PENDING;
+
+	delay = user->when - current_time;
+	if (delay < 0)
+		delay = 0;
+	if (delay > KTIME_MAX / 100)
+		delay = KTIME_MAX / 100;
+
+	hrtimer_init(&user->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	user->timer.function = timeout_expired;
+
+	spin_lock_irqsave(&timeout_lock, flags);
+	list_add_before(&timeout_list, &user->entry);
+	spin_unlock_irqrestore(&timeout_lock, flags);
 
-	return timer;
+	hrtimer_start(&user->timer, ns_to_ktime(delay * 100), HRTIMER_MODE_REL);
+	return user;
 }
 
 /* remove a timeout user */
 void remove_timeout_user(struct timeout_user *user)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&timeout_lock, flags);
+	if (user->state == TIMEOUT_RUNNING) {
+		/* called from its own callback, or while it runs */
+		user->state = TIMEOUT_REMOVED;
+		spin_unlock_irqrestore(&timeout_lock, flags);
+		return;
+	}
 	list_del(&user->entry);
-	free(user);
-}
+	user->state = TIMEOUT_REMOVED;
+	spin_unlock_irqrestore(&timeout_lock, flags);
 
-/* remove a linux timer */
-void remove_linux_timer(struct timer_list *timer)
-{
-	kdebug("\n");
-	del_timer(timer);
-	kfree(timer);
+	/* not under the lock, the hrtimer may be waiting for it */
+	hrtimer_cancel(&user->timer);
+	kmem_cache_free(timeout_cache, user);
 }
 
 /* return a text description of a timeout for debugging purposes */
@@ -385,54 +724,63 @@ const char *get_timeout_str(timeout_t timeout)
 	return NULL;
 }
 
-/* process pending timeouts and return the time until the next timeout, in milliseconds */
-int get_next_timeout(void)
+/* call the callbacks of the expired timeouts, from the timer thread */
+void run_expired_timeouts(void)
 {
-	if (!list_empty(&timeout_list)) {
-		struct list_head expired_list, *ptr;
-		timeout_t now;
+	struct timeout_user *user;
+	struct list_head *ptr;
+	unsigned long flags;
 
-		local_irq_disable();
-		now = current_time;
+	spin_lock_irqsave(&timeout_lock, flags);
+	while ((ptr = list_head(&expired_list)) != NULL) {
+		user = LIST_ENTRY(ptr, struct timeout_user, entry);
+		list_del(&user->entry);
+		user->state = TIMEOUT_RUNNING;
+		spin_unlock_irqrestore(&timeout_lock, flags);
 
-		/* first remove all expired timers from the list */
+		user->callback(user->private);
+		kmem_cache_free(timeout_cache, user);
 
-		INIT_LIST_HEAD(&expired_list);
-		while ((ptr = list_head(&timeout_list)) != NULL) {
-			struct timeout_user *timeout = LIST_ENTRY(ptr, struct timeout_user, entry);
+		spin_lock_irqsave(&timeout_lock, flags);
+	}
+	spin_unlock_irqrestore(&timeout_lock, flags);
+}
 
-			if (timeout->when <= now) {
-				list_del(&timeout->entry);
-				list_add_before(&expired_list, &timeout->entry);
-			}
-			else break;
-		}
+/* sleep until a timeout expires or the timer thread is stopped */
+void wait_for_timeouts(void)
+{
+	wait_event_interruptible(timeout_wait, !list_empty(&expired_list) || kthread_should_stop());
+}
 
-		local_irq_enable();
+void init_timeouts(void)
+{
+	timeout_cache = kmem_cache_create("uk_timeout_user", sizeof(struct timeout_user), 0, 0, NULL);
+}
 
-		/* now call the callback for all the removed timers */
+/* drop the timeouts left after the timer thread is gone */
+void exit_timeouts(void)
+{
+	struct timeout_user *user;
+	struct list_head *ptr;
+	unsigned long flags;
 
-		while ((ptr = list_head(&expired_list)) != NULL) {
-			struct timeout_user *timeout = LIST_ENTRY(ptr, struct timeout_user, entry);
-			list_del(&timeout->entry);
-			timeout->callback(timeout->private);
-			free(timeout);
-		}
+	spin_lock_irqsave(&timeout_lock, flags);
+	while ((ptr = list_head(&timeout_list)) || (ptr = list_head(&expired_list))) {
+		user = LIST_ENTRY(ptr, struct timeout_user, entry);
+		list_del(&user->entry);
+		user->state = TIMEOUT_REMOVED;
+		spin_unlock_irqrestore(&timeout_lock, flags);
 
-		if ((ptr = list_head(&timeout_list)) != NULL) {
-			struct timeout_user *timeout = LIST_ENTRY(ptr, struct timeout_user, entry);
-			int diff;
-			timeout_t result = timeout->when - current_time + 9999;
-			do_div(result, 10000);
-			diff = result;
-			if (diff < 0)
-				diff = 0;
-			return diff;
-		}
+		hrtimer_cancel(&user->timer);
+		kmem_cache_free(timeout_cache, user);
+
+		spin_lock_irqsave(&timeout_lock, flags);
 	}
-	return -1;  /* no pending timeouts */
-}
+	spin_unlock_irqrestore(&timeout_lock, flags);
 
+	if (timeout_cache)
+		kmem_cache_destroy(timeout_cache);
+}
 
 /****************************************************************/
 /* device functions */
@@ -942,74 +1290,104 @@ void unlock_fd(struct fd *fd, file_pos_t start, file_pos_t count)
 }
 
 
-static inline void fd_poll_event( struct fd *fd, int event )
+
+/* the process whose event loop the fds created now go to, and a task of it */
+static struct eprocess *get_poll_process(struct task_struct **task)
 {
-    fd->fd_ops->poll_event( fd, event );
+	if (current->ethread) {
+		*task = current;
+		return current->ethread->threads_process;
+	}
+	if (current->parent && current->parent->ethread) {
+		*task = current->parent;
+		return current->parent->ethread->threads_process;
+	}
+	return NULL;
 }
 
 static int add_poll_user( struct fd *fd )
 {
+    struct task_struct *task;
+    struct eprocess *process = get_poll_process( &task );
+    struct poll_loop *loop;
     int ret;
 
-	if (current->ethread->threads_process->epoll_fd == -1) init_epoll();
+    if (!process) return -1;
+    mutex_lock( &poll_loop_create_lock );
+    if (!(loop = process->poll_loop)) loop = create_poll_loop( process, task );
+    if (loop) atomic_inc( &loop->refcount );  /* the user's, stop_poll_loop may drop the process's */
+    mutex_unlock( &poll_loop_create_lock );
+    if (!loop) return -1;
 
-    if (freelist)
+    mutex_lock( &loop->lock );
+    if (loop->freelist)
     {
-        ret = freelist - poll_users;
-        freelist = (struct fd **)poll_users[ret];
+        ret = loop->freelist - loop->poll_users;
+        loop->freelist = (struct fd **)loop->poll_users[ret];
     }
     else
     {
-        if (nb_users == allocated_users)
+        if (loop->nb_users == loop->allocated_users)
         {
             struct fd **newusers;
             struct pollfd *newpoll;
-            int new_count = allocated_users ? (allocated_users + allocated_users / 2) : 16;
-            if (!(newusers = realloc( poll_users, new_count * sizeof(*poll_users), allocated_users * sizeof(*poll_users) ))) return -1;
-            if (!(newpoll = realloc( pollfd, new_count * sizeof(*pollfd), allocated_users * sizeof(*pollfd) )))
-            {
-                if (allocated_users)
-                    poll_users = newusers;
-                else
-                    free( newusers );
-                return -1;
-            }
-            poll_users = newusers;
-            pollfd = newpoll;
-//            if (!allocated_users) init_epoll();
-            allocated_users = new_count;
+            struct epoll_reg *newreg;
+            int count = loop->allocated_users;
+            int new_count = count ? (count + count / 2) : 16;
+
+            if (!(newusers = realloc( loop->poll_users, new_count * sizeof(*newusers), count * sizeof(*newusers) )))
+                goto failed;
+            loop->poll_users = newusers;
+            if (!(newpoll = realloc( loop->pollfd, new_count * sizeof(*newpoll), count * sizeof(*newpoll) )))
+                goto failed;
+            loop->pollfd = newpoll;
+            if (!(newreg = realloc( loop->epoll_reg, new_count * sizeof(*newreg), count * sizeof(*newreg) )))
+                goto failed;
+            loop->epoll_reg = newreg;
+            loop->allocated_users = new_count;
         }
-        ret = nb_users++;
+        ret = loop->nb_users++;
     }
-    pollfd[ret].fd = -1;
-    pollfd[ret].events = 0;
-    pollfd[ret].revents = 0;
-    poll_users[ret] = fd;
-    active_users++;
+    loop->pollfd[ret].fd = -1;
+    loop->pollfd[ret].events = 0;
+    loop->pollfd[ret].revents = 0;
+    loop->epoll_reg[ret].fd = -1;
+    loop->epoll_reg[ret].events = 0;
+    loop->poll_users[ret] = fd;
+    loop->active_users++;
+    mutex_unlock( &loop->lock );
+
+    fd->poll_loop = loop;
     return ret;
+
+failed:
+    mutex_unlock( &loop->lock );
+    release_poll_loop( loop );
+    return -1;
 }
 
-static inline void remove_epoll_user( struct fd *fd, int user )
+/* remove a user from the poll list */
+static void remove_poll_user( struct fd *fd, int user )
 {
-    if (current->ethread->threads_process->epoll_fd == -1) return;
+    struct poll_loop *loop = fd->poll_loop;
 
-    if (pollfd[user].fd != -1)
+    mutex_lock( &loop->lock );
+    loop->pollfd[user].fd = -1;
+    loop->pollfd[user].events = 0;
+    loop->pollfd[user].revents = 0;
+    loop->poll_users[user] = NULL;
+    if (poll_loop_is_local( loop ) || loop->epoll_fd == -1) sync_epoll_user( loop, user );
+    if (loop->epoll_reg[user].fd == -1)
+        free_poll_user( loop, user );
+    else
     {
-        struct epoll_event dummy;
-        sys_epoll_ctl( current->ethread->threads_process->epoll_fd, EPOLL_CTL_DEL, fd->unix_fd, &dummy );
+        loop->pending = 1;  /* freed by the loop thread once epoll forgot it */
+        wake_poll_loop( loop );
     }
-}
+    mutex_unlock( &loop->lock );
 
-/* remove a user from the poll list */
-static void remove_poll_user( struct fd *fd, int user )
-{
-    remove_epoll_user( fd, user );
-    pollfd[user].fd = -1;
-    pollfd[user].events = 0;
-    pollfd[user].revents = 0;
-    poll_users[user] = (struct fd *)freelist;
-    freelist = &poll_users[user];
-    active_users--;
+    fd->poll_loop = NULL;
+    release_poll_loop( loop );
 }
 
 /****************************************************************/
@@ -1019,6 +1397,99 @@ static void fd_dump(struct object *obj, int verbose)
 {
 }
 
+/*
+ * wait queue hooks
+ * instead of polling its fds on every wait, a waiter hooks the fd once onto
+ * the unix file's wait queues, a wake up there makes the user's waiters
+ * check the object again
+ * Hooking and unhooking are serialized by fd_wait_lock. The user unhooks
+ * its fd when it is destroyed, so the tasklet never outlives fd->user.
+ */
+static DEFINE_MUTEX(fd_wait_lock);
+
+/* runs the dispatcher side of a wake up, outside of the unix wait queue lock */
+static void fd_wait_tasklet(unsigned long data)
+{
+	struct fd *fd = (struct fd *)data;
+	struct object *user = fd->user;
+	unsigned long flags;
+
+	if (!user)
+		return;
+
+	flags = lock_dispatcher_object(user);
+	wake_dispatcher_waiters(&user->header);
+	unlock_dispatcher_object(user, flags);
+}
+
+static int fd_wait_wakeup(wait_queue_t *wait, unsigned mode, int sync, void *key)
+{
+	struct fd *fd = wait->private;
+
+	if (key && !((unsigned long)key & (POLLIN | POLLERR | POLLHUP)))
+		return 0;
+
+	tasklet_schedule(&fd->wait_tasklet);
+	return 0;
+}
+
+struct fd_poll_table
+{
+	poll_table  pt;
+	struct fd  *fd;
+};
+
+static void fd_wait_queue_proc(struct file *file, wait_queue_head_t *whead, poll_table *pt)
+{
+	struct fd *fd = container_of(pt, struct fd_poll_table, pt)->fd;
+	wait_queue_t *wait;
+
+	if (fd->wait_heads >= FD_WAIT_HEADS)
+		return;
+
+	wait = &fd->wait[fd->wait_heads];
+	init_waitqueue_func_entry(wait, fd_wait_wakeup);
+	wait->private = fd;
+	add_wait_queue(whead, wait);
+	fd->wait_head[fd->wait_heads++] = whead;
+}
+
+/* hook the fd onto its unix file's wait queues, once for the fd's lifetime */
+void fd_hook_wait(struct fd *fd)
+{
+	struct fd_poll_table table;
+
+	if (ACCESS_ONCE(fd->wait_hooked))
+		return;
+
+	mutex_lock(&fd_wait_lock);
+	if (fd->wait_hooked)
+		goto out;
+	fd->wait_hooked = 1;
+
+	if (!fd->unix_file || !fd->unix_file->f_op || !fd->unix_file->f_op->poll)
+		goto out;
+
+	init_poll_funcptr(&table.pt, fd_wait_queue_proc);
+	table.fd = fd;
+	fd->unix_file->f_op->poll(fd->unix_file, &table.pt);
+out:
+	mutex_unlock(&fd_wait_lock);
+}
+
+/* take the fd off the unix file's wait queues, and wait for a running wake up */
+void fd_unhook_wait(struct fd *fd)
+{
+	mutex_lock(&fd_wait_lock);
+	while (fd->wait_heads) {
+		fd->wait_heads--;
+		remove_wait_queue(fd->wait_head[fd->wait_heads], &fd->wait[fd->wait_heads]);
+	}
+	tasklet_kill(&fd->wait_tasklet);
+	fd->wait_hooked = 0;
+	mutex_unlock(&fd_wait_lock);
+}
+
 static void fd_destroy(struct object *obj)
 {
 	struct fd *fd = (struct fd *)obj;
@@ -1033,6 +1504,7 @@ static void fd_destroy(struct object *obj)
 	list_del(&fd->inode_entry);
     if (fd->poll_index != -1) remove_poll_user( fd, fd->poll_index );
 
+	fd_unhook_wait(fd);
 	if (fd->unix_file) {
 		fput(fd->unix_file);
 		fd->unix_file = NULL;
@@ -1046,70 +1518,33 @@ static void fd_destroy(struct object *obj)
 	}
 }
 
-/* set the events that epoll waits for on this fd; helper for set_fd_events */
-static inline void set_fd_epoll_events( struct fd *fd, int user, int events )
+void set_fd_events(struct fd *fd, int events)
 {
-    struct epoll_event ev;
-    int ctl;
-	struct eprocess *process;
-
-	if (current->ethread)
-		process = current->ethread->threads_process;
-	else if (current->parent && current->parent->ethread)
-		process = current->parent->ethread->threads_process;
-	else
-		return;
+    struct poll_loop *loop = fd->poll_loop;
+    int user = fd->poll_index;
 
-    if (process->epoll_fd == -1) return;
+    if (!loop) return;
 
+    mutex_lock( &loop->lock );
     if (events == -1)  /* stop waiting on this fd completely */
     {
-        if (pollfd[user].fd == -1) return;  /* already removed */
-        ctl = EPOLL_CTL_DEL;
-    }
-    else if (pollfd[user].fd == -1)
-    {
-        if (pollfd[user].events) return;  /* stopped waiting on it, don't restart */
-        ctl = EPOLL_CTL_ADD;
-    }
-    else
-    {
-        if (pollfd[user].events == events) return;  /* nothing to do */
-        ctl = EPOLL_CTL_MOD;
+        loop->pollfd[user].fd = -1;
+        loop->pollfd[user].events = POLLERR;
+        loop->pollfd[user].revents = 0;
     }
-
-    ev.events = events;
-    memset(&ev.data, 0, sizeof(ev.data));
-    ev.data.u32 = user;
-
-    if (sys_epoll_ctl( process->epoll_fd, ctl, fd->unix_fd, &ev ) == -1)
+    else if (loop->pollfd[user].fd != -1 || !loop->pollfd[user].events)
     {
-        if (errno == ENOMEM)  /* not enough memory, give up on epoll */
-        {
-            close( process->epoll_fd );
-            process->epoll_fd = -1;
-        }
-        else perror( "epoll_ctl" );  /* should not happen */
+        loop->pollfd[user].fd = fd->unix_fd;
+        loop->pollfd[user].events = events;
     }
-}
 
-void set_fd_events(struct fd *fd, int events)
-{
-    int user = fd->poll_index;
-
-    set_fd_epoll_events( fd, user, events );
-
-    if (events == -1)  /* stop waiting on this fd completely */
+    if (poll_loop_is_local( loop )) sync_epoll_user( loop, user );
+    else if (!loop->pending)
     {
-        pollfd[user].fd = -1;
-        pollfd[user].events = POLLERR;
-        pollfd[user].revents = 0;
-    }
-    else if (pollfd[user].fd != -1 || !pollfd[user].events)
-    {
-        pollfd[user].fd = fd->unix_fd;
-        pollfd[user].events = events;
+        loop->pending = 1;
+        wake_poll_loop( loop );
     }
+    mutex_unlock( &loop->lock );
 }
 
 /* prepare an fd for unmounting its corresponding device */
@@ -1118,6 +1553,7 @@ static inline void unmount_fd(struct fd *fd)
 	async_wake_up(fd->read_q, STATUS_VOLUME_DISMOUNTED);
 	async_wake_up(fd->write_q, STATUS_VOLUME_DISMOUNTED);
 
+	fd_unhook_wait(fd);
 	if (fd->unix_file) {
 		fput(fd->unix_file);
 		fd->unix_file = NULL;
@@ -1164,6 +1600,10 @@ static struct fd *alloc_fd_object(void)
 	fd->write_q    = NULL;
 	fd->wait_q     = NULL;
 	fd->completion = NULL;
+	fd->wait_hooked = 0;
+	fd->wait_heads = 0;
+	fd->poll_loop  = NULL;
+	tasklet_init(&fd->wait_tasklet, fd_wait_tasklet, (unsigned long)fd);
 	INIT_LIST_HEAD(&fd->inode_entry);
 	INIT_LIST_HEAD(&fd->locks);
 
@@ -1199,6 +1639,11 @@ struct fd *alloc_pseudo_fd(const struct fd_ops *fd_user_ops, struct object *user
 	fd->write_q    = NULL;
 	fd->wait_q     = NULL;
 	fd->completion = NULL;
+	fd->wait_hooked = 0;
+	fd->wait_heads = 0;
+	fd->poll_index = -1;
+	fd->poll_loop  = NULL;
+	tasklet_init(&fd->wait_tasklet, fd_wait_tasklet, (unsigned long)fd);
 	fd->no_fd_status = STATUS_BAD_DEVICE_TYPE;
 	INIT_LIST_HEAD(&fd->inode_entry);
 	INIT_LIST_HEAD(&fd->locks);
@@ -1468,6 +1913,10 @@ int check_fd_events(struct fd *fd, int events)
 	if (fd->inode)
 		return events;  /* regular files are always signaled */
 
+	/* ask the file directly, its poll method may sleep, see check_fd_events_atomic */
+	if (fd->unix_file && fd->unix_file->f_op && fd->unix_file->f_op->poll)
+		return fd->unix_file->f_op->poll(fd->unix_file, NULL) & (events | POLLERR | POLLHUP);
+
 	pfd.fd     = fd->unix_fd;
 	pfd.events = events;
 	pfd.revents = 0;
@@ -1478,6 +1927,26 @@ int check_fd_events(struct fd *fd, int events)
 	return pfd.revents;
 }
 
+/*
+ * check_fd_events for signaled() routines, called under the dispatcher lock
+ * only files whose poll method is known not to sleep are asked, sockets and
+ * pipe ends; the others report the state the fd was last signaled with
+ */
+int check_fd_events_atomic(struct fd *fd, int events)
+{
+	struct file *file = fd->unix_file;
+
+	if (fd->unix_fd == -1)
+		return POLLERR;
+	if (fd->inode)
+		return events;  /* regular files are always signaled */
+
+	if (file && file->f_op && file->f_op->poll &&
+			(S_ISSOCK(file->f_path.dentry->d_inode->i_mode) || is_pipe_ring_file(file)))
+		return file->f_op->poll(file, NULL) & (events | POLLERR | POLLHUP);
+	return fd->signaled ? events : 0;
+}
+
 /* default signaled() routine for objects that poll() on an fd */
 int default_fd_signaled(struct object *obj, struct w32thread *thread)
 {
@@ -1839,49 +2308,4 @@ DECL_HANDLER(add_fd_completion)
 	}
 }
 
-extern int uk_epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout);
-void main_loop(void)
-{
-    int i, ret = 0;
-    struct epoll_event events[128];
-	unsigned int msecs,timeout;
-
-	msecs = 10;
-	timeout = msecs_to_jiffies(msecs)+1;
-
-	while (1)
-	{
-//		timeout = get_next_timeout();
-		if (active_users) break;
-		schedule_timeout_interruptible(timeout);
-	}
-
-    while (current->parent->pid != 1)//(active_users)
-    {
-//        timeout = get_next_timeout();
-
-//        if (!active_users) do_exit(0);  /* last user removed by a timeout */
-
-	if (current->parent->ethread && current->parent->ethread->threads_process && current->parent->ethread->threads_process->epoll_fd != -1) {
-        ret = uk_epoll_wait( current->parent->ethread->threads_process->epoll_fd, events, sizeof(events)/sizeof(events[0]), 1000 );
-	}
-//        set_current_time();
-
-        /* put the events into the pollfd array first, like poll does */
-        for (i = 0; i < ret; i++)
-        {
-            int user = events[i].data.u32;
-            pollfd[user].revents = events[i].events;
-        }
-
-        /* read events from the pollfd array, as set_fd_events may modify them */
-        for (i = 0; i < ret; i++)
-        {
-            int user = events[i].data.u32;
-            if (pollfd[user].revents) fd_poll_event( poll_users[user], pollfd[user].revents );
-        }
-
-		schedule_timeout_interruptible(timeout);
-    }
-}
 #endif /* CONFIG_UNIFIED_KERNEL */
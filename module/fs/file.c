@@ -194,7 +194,7 @@ static struct object *create_file(const char *nameptr, data_size_t len, unsigned
 	char *name;
 	mode_t mode;
 
-	ktrace("name=%s\n", nameptr);
+	ktrace("name=%.*s\n", (int)len, nameptr);
 	if (!(name = mem_alloc(len + 1)))
 		return NULL;
 	memcpy(name, nameptr, len);
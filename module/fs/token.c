@@ -31,7 +31,9 @@
 #ifdef CONFIG_UNIFIED_KERNEL
 
 #define MAX_SUBAUTH_COUNT 1
+#define ACCESS_CACHE_SIZE 16
 
+const LUID SeLockMemoryPrivilege           = {  4, 0 };
 const LUID SeIncreaseQuotaPrivilege        = {  5, 0 };
 const LUID SeSecurityPrivilege             = {  8, 0 };
 const LUID SeTakeOwnershipPrivilege        = {  9, 0 };
@@ -70,6 +72,20 @@ static luid_t prev_luid_value = { 1000, 0 };
 struct w32thread *get_thread_from_handle(obj_handle_t handle, unsigned int access);
 struct w32process *get_process_from_handle(obj_handle_t handle, unsigned int access);
 
+/* result of a successful token_access_check */
+struct access_cache_entry
+{
+	const struct security_descriptor *key; /* descriptor the check was made against */
+	struct security_descriptor *sd;      /* copy of it, NULL if unused */
+	data_size_t         sd_size;
+	unsigned int        desired_access;
+	GENERIC_MAPPING     mapping;
+	unsigned int        status;          /* access status */
+	unsigned int        granted_access;
+	unsigned int        priv_count;      /* 0 or 1 */
+	LUID_AND_ATTRIBUTES priv;
+};
+
 struct token
 {
 	struct object       obj;             /* object header */
@@ -83,6 +99,9 @@ struct token
 	ACL                *default_dacl;    /* the default DACL to assign to objects created by this user */
 	TOKEN_SOURCE        source;          /* source of the token */
 	int                 impersonation_level; /* impersonation level this token is capable of if non-primary token */
+	spinlock_t          access_cache_lock;   /* guards access_cache and access_cache_next */
+	struct access_cache_entry *access_cache; /* recent access checks, flushed when the token is modified */
+	unsigned int        access_cache_next;   /* entry to replace next */
 };
 
 struct privilege
@@ -352,6 +371,24 @@ static inline void privilege_remove(struct privilege *privilege)
 	free(privilege);
 }
 
+static void token_flush_access_cache(struct token *token)
+{
+	struct access_cache_entry *cache;
+	unsigned int i;
+
+	spin_lock(&token->access_cache_lock);
+	cache = token->access_cache;
+	token->access_cache = NULL;
+	token->access_cache_next = 0;
+	spin_unlock(&token->access_cache_lock);
+
+	if (!cache)
+		return;
+	for (i = 0; i < ACCESS_CACHE_SIZE; i++)
+		kfree(cache[i].sd);
+	kfree(cache);
+}
+
 static void token_destroy(struct object *obj)
 {
 	struct token* token;
@@ -373,6 +410,7 @@ static void token_destroy(struct object *obj)
 	}
 
 	free(token->default_dacl);
+	token_flush_access_cache(token);
 }
 
 /* creates a new token.
@@ -412,6 +450,9 @@ static struct token *create_token(unsigned primary, const SID *user,
 			token->impersonation_level = impersonation_level;
 		token->default_dacl = NULL;
 		token->primary_group = NULL;
+		spin_lock_init(&token->access_cache_lock);
+		token->access_cache = NULL;
+		token->access_cache_next = 0;
 
 		/* copy user */
 		token->user = memdup(user, FIELD_OFFSET(SID, SubAuthority[user->SubAuthorityCount]));
@@ -609,6 +650,7 @@ struct token *token_create_admin(void)
 			{ SeLoadDriverPrivilege          , SE_PRIVILEGE_ENABLED },
 			{ SeCreatePagefilePrivilege      , 0                    },
 			{ SeIncreaseQuotaPrivilege       , 0                    },
+			{ SeLockMemoryPrivilege          , 0                    },
 			{ SeUndockPrivilege              , 0                    },
 			{ SeManageVolumePrivilege        , 0                    },
 			{ SeImpersonatePrivilege         , SE_PRIVILEGE_ENABLED },
@@ -663,6 +705,7 @@ static unsigned int token_adjust_privileges(struct token *token, const LUID_AND_
 
 	/* mark as modified */
 	allocate_luid(&token->modified_id);
+	token_flush_access_cache(token);
 
 	for (i = 0; i < count; i++) {
 		struct privilege *privilege =
@@ -698,6 +741,7 @@ static void token_disable_privileges(struct token *token)
 
 	/* mark as modified */
 	allocate_luid(&token->modified_id);
+	token_flush_access_cache(token);
 
 	LIST_FOR_EACH_ENTRY(privilege, &token->privileges, struct privilege, entry)
 		privilege->enabled = FALSE;
@@ -900,6 +944,99 @@ done:
 	return STATUS_SUCCESS;
 }
 
+static inline data_size_t sd_size(const struct security_descriptor *sd)
+{
+	return sizeof(*sd) + sd->owner_len + sd->group_len + sd->sacl_len + sd->dacl_len;
+}
+
+/* token_access_check, remembering the results per token
+ * an entry is found by the address of the descriptor and confirmed by its
+ * content, so that a new one set at the same address never matches an older result */
+static unsigned int token_access_check_cached(struct token *token,
+				const struct security_descriptor *sd,
+				unsigned int desired_access,
+				LUID_AND_ATTRIBUTES *privs,
+				unsigned int *priv_count,
+				const GENERIC_MAPPING *mapping,
+				unsigned int *granted_access,
+				unsigned int *status)
+{
+	struct access_cache_entry *entry, *cache = NULL;
+	struct security_descriptor *copy, *old;
+	data_size_t size = sd_size(sd);
+	unsigned int i, ret;
+
+	/* the results depend on the room for privileges */
+	if (!priv_count || *priv_count < 1)
+		return token_access_check(token, sd, desired_access, privs, priv_count,
+				mapping, granted_access, status);
+
+	spin_lock(&token->access_cache_lock);
+	if (token->access_cache) {
+		for (i = 0; i < ACCESS_CACHE_SIZE; i++) {
+			entry = &token->access_cache[i];
+			if (entry->key == sd && entry->sd
+					&& entry->desired_access == desired_access
+					&& entry->sd_size == size
+					&& !memcmp(&entry->mapping, mapping, sizeof(*mapping))
+					&& !memcmp(entry->sd, sd, size)) {
+				*status = entry->status;
+				*granted_access = entry->granted_access;
+				*priv_count = entry->priv_count;
+				if (entry->priv_count)
+					*privs = entry->priv;
+				spin_unlock(&token->access_cache_lock);
+				return STATUS_SUCCESS;
+			}
+		}
+	}
+	spin_unlock(&token->access_cache_lock);
+
+	ret = token_access_check(token, sd, desired_access, privs, priv_count,
+			mapping, granted_access, status);
+	if (ret != STATUS_SUCCESS)
+		return ret;
+
+	/* allocate outside the lock, the cache may be installed meanwhile */
+	if (!(copy = kmalloc(size, GFP_KERNEL)))
+		return ret;
+	memcpy(copy, sd, size);
+	if (!ACCESS_ONCE(token->access_cache)
+			&& !(cache = kzalloc(ACCESS_CACHE_SIZE * sizeof(*entry), GFP_KERNEL))) {
+		kfree(copy);
+		return ret;
+	}
+
+	spin_lock(&token->access_cache_lock);
+	if (!token->access_cache) {
+		if (!cache) {  /* flushed meanwhile */
+			spin_unlock(&token->access_cache_lock);
+			kfree(copy);
+			return ret;
+		}
+		token->access_cache = cache;
+		cache = NULL;
+	}
+	entry = &token->access_cache[token->access_cache_next];
+	old = entry->sd;
+	entry->key = sd;
+	entry->sd = copy;
+	entry->sd_size = size;
+	entry->desired_access = desired_access;
+	entry->mapping = *mapping;
+	entry->status = *status;
+	entry->granted_access = *granted_access;
+	entry->priv_count = *priv_count;
+	if (*priv_count)
+		entry->priv = *privs;
+	token->access_cache_next = (token->access_cache_next + 1) % ACCESS_CACHE_SIZE;
+	spin_unlock(&token->access_cache_lock);
+
+	kfree(old);
+	kfree(cache);
+	return ret;
+}
+
 const ACL *token_get_default_dacl(struct token *token)
 {
 	return token->default_dacl;
@@ -936,7 +1073,7 @@ int check_object_access(struct object *obj, unsigned int *access)
 	mapping.GenericWrite = BODY_TO_HEADER(obj)->ops->map_access((void*)obj, GENERIC_WRITE);
 	mapping.GenericExecute = BODY_TO_HEADER(obj)->ops->map_access((void*)obj, GENERIC_EXECUTE);
 
-	res = token_access_check(token, obj->sd, *access, &priv, &priv_count,
+	res = token_access_check_cached(token, obj->sd, *access, &priv, &priv_count,
 			&mapping, access, &status) == STATUS_SUCCESS &&
 		status == STATUS_SUCCESS;
 
@@ -1128,7 +1265,7 @@ DECL_HANDLER(access_check)
 		mapping.GenericExecute = req->mapping_execute;
 		mapping.GenericAll = req->mapping_all;
 
-		status = token_access_check(
+		status = token_access_check_cached(
 				token, sd, req->desired_access, &priv, &priv_count, &mapping,
 				&reply->access_granted, &reply->access_status);
 
@@ -104,6 +104,8 @@ struct file_args {
 
 typedef struct win32_file_ctrl win32_file_ctrl;
 
+struct uk_completion;
+
 /*
  * process-access file object definition
  */
@@ -154,6 +156,8 @@ struct win32_file {
 	__u32			wf_access;	/* file access mode */
 	__u32			wf_sharing;	/* sharing mode */
 	__u32			wf_attrs;	/* file open attributes */
+	struct uk_completion	*wf_completion;	/* completion port of overlapped I/O */
+	unsigned long		wf_comp_key;	/* completion key to post with */
 };
 
 /*
@@ -182,6 +186,11 @@ struct win32_file_ctrl {
 #define FILE_NOTIFY_VALID_MASK		0x00000fff
 #define FILE_NOTIFY_ALL                 (FILE_NOTIFY_VALID_MASK)
 
+typedef struct _FILE_COMPLETION_INFORMATION {
+	HANDLE		CompletionPort;
+	ULONG_PTR	CompletionKey;
+} FILE_COMPLETION_INFORMATION, *PFILE_COMPLETION_INFORMATION;
+
 typedef struct _FILE_NOTIFY_INFORMATION {
 	DWORD NextEntryOffset;
 	DWORD Action;
@@ -38,14 +38,12 @@
 #define UNICODE_PATH_SEP L'\\'
 #define UNICODE_NO_PATH L"..."
 
-#define EX_HANDLE_ENTRY_LOCKED (1 << ((sizeof(PVOID) * 8) - 1))
 #define EX_HANDLE_ENTRY_PROTECTFROMCLOSE (1 << 0)
 #define EX_HANDLE_ENTRY_INHERITABLE (1 << 1)
 #define EX_HANDLE_ENTRY_AUDITONCLOSE (1 << 2)
 #define EX_HANDLE_TABLE_CLOSING 0x1
 #define EX_INVALID_HANDLE (~0)
-#define EX_HANDLE_ENTRY_FLAGSMASK (EX_HANDLE_ENTRY_LOCKED | \
-                                   EX_HANDLE_ENTRY_PROTECTFROMCLOSE | \
+#define EX_HANDLE_ENTRY_FLAGSMASK (EX_HANDLE_ENTRY_PROTECTFROMCLOSE | \
                                    EX_HANDLE_ENTRY_INHERITABLE | \
                                    EX_HANDLE_ENTRY_AUDITONCLOSE)
 
@@ -130,14 +128,6 @@ delete_resource(struct eresource *Resource);
 VOID
 init_handle_tables(VOID);
 
-BOOLEAN
-lock_handle_table_entry(IN struct handle_table *HandleTable,
-		IN struct handle_table_entry *Entry);
-
-VOID
-unlock_handle_table_entry(IN struct handle_table *HandleTable,
-		IN struct handle_table_entry *Entry);
-
 struct handle_table *
 __create_handle_table(IN struct eprocess *QuotaProcess  OPTIONAL);
 
@@ -0,0 +1,121 @@
+/*
+ * ktrace.h
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * ktrace.h: per-cpu binary trace buffer behind ktrace() and kdebug()
+ *
+ * A call site costs one load and a branch while its subsystem is masked
+ * off.  When it is on, the format arguments are stored in binary with
+ * vbin_printf() and only formatted when /proc/unifiedkernel/trace is read.
+ */
+
+#ifndef _KTRACE_H
+#define _KTRACE_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/proc_fs.h>
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+/* bits of uk_trace_mask */
+enum uk_trace_subsys
+{
+	UK_TRACE_KE,
+	UK_TRACE_IO,
+	UK_TRACE_OB,
+	UK_TRACE_PS,
+	UK_TRACE_MM,
+	UK_TRACE_PUB,
+	UK_TRACE_REG,
+	UK_TRACE_MSG,
+	UK_TRACE_FS,
+	UK_TRACE_SOCK,
+	UK_TRACE_DEVICE,
+	UK_TRACE_MISC,		/* headers and anything else */
+	UK_TRACE_SYSCALL,	/* every win32 syscall */
+	UK_TRACE_SERVICE,	/* every wine service request, with its status and time */
+	UK_TRACE_DEBUG,		/* kdebug() of every subsystem */
+	UK_TRACE_NR
+};
+
+/* one per ktrace()/kdebug() call site */
+struct uk_trace_site
+{
+	const char	*func;
+	const char	*file;
+	signed char	subsys;		/* -1 until first used */
+	unsigned char	debug;		/* a kdebug() */
+};
+
+extern unsigned int uk_trace_mask;
+
+extern void uk_trace_resolve(struct uk_trace_site *site);
+extern void uk_trace_printf(struct uk_trace_site *site, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+extern void __uk_trace_syscall(int call_id);
+extern void __uk_trace_service(int req, unsigned int status, ktime_t start);
+extern int uk_trace_init(struct proc_dir_entry *parent);
+extern void uk_trace_exit(struct proc_dir_entry *parent);
+
+static inline int uk_trace_on(int subsys)
+{
+	return unlikely(uk_trace_mask & (1 << subsys));
+}
+
+static inline int uk_trace_site_on(struct uk_trace_site *site)
+{
+	if (unlikely(site->subsys < 0))
+		uk_trace_resolve(site);
+	return (uk_trace_mask & (1 << site->subsys))
+		|| (site->debug && (uk_trace_mask & (1 << UK_TRACE_DEBUG)));
+}
+
+static inline void uk_trace_syscall(int call_id)
+{
+	if (uk_trace_on(UK_TRACE_SYSCALL))
+		__uk_trace_syscall(call_id);
+}
+
+static inline void uk_trace_service(int req, unsigned int status, ktime_t start)
+{
+	if (uk_trace_on(UK_TRACE_SERVICE))
+		__uk_trace_service(req, status, start);
+}
+
+#define __uk_trace(DEBUG, FMT...) \
+	do { \
+		static struct uk_trace_site __uk_site = { \
+			.func = __FUNCTION__, \
+			.file = __FILE__, \
+			.subsys = -1, \
+			.debug = DEBUG, \
+		}; \
+		if (unlikely(uk_trace_mask) && uk_trace_site_on(&__uk_site)) \
+			uk_trace_printf(&__uk_site, FMT); \
+	} while (0)
+
+#define kdebug(FMT...)	__uk_trace(1, FMT)
+#define ktrace(FMT...)	__uk_trace(0, FMT)
+
+#endif /* CONFIG_UNIFIED_KERNEL */
+#endif /* _KTRACE_H */
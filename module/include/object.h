@@ -27,6 +27,9 @@
 #ifndef _OBJECT_H
 #define _OBJECT_H
 
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 #include "ntstatus.h"
@@ -373,13 +376,16 @@ typedef struct _OBJECT_TYPE {
 
 /* Object Directory Structure */
 
-#define NUMBER_HASH_BUCKETS 37
+#define OBDIR_MIN_BITS		4	/* buckets allocated on the first insert */
+#define OBDIR_MAX_BITS		16
+#define OBDIR_LOCK_BITS		6
+#define OBDIR_LOCK_COUNT	(1 << OBDIR_LOCK_BITS)
 
 typedef struct _OBJECT_DIRECTORY {
 	struct object obj;
-	struct _OBJECT_DIRECTORY_ENTRY *HashBuckets[NUMBER_HASH_BUCKETS];
-	struct _OBJECT_DIRECTORY_ENTRY **LookupBucket;
-	BOOLEAN LookupFound;
+	struct _OBJECT_DIRECTORY_ENTRY **HashBuckets;	/* 1 << HashBits chains, NULL while empty */
+	ULONG HashBits;
+	ULONG EntryCount;	/* table doubles beyond 2 entries per bucket */
 	USHORT SymbolicLinkUsageCount;
 	struct _DEVICE_MAP *DeviceMap;
 } OBJECT_DIRECTORY, *POBJECT_DIRECTORY;
@@ -389,8 +395,20 @@ typedef struct _OBJECT_DIRECTORY {
 typedef struct _OBJECT_DIRECTORY_ENTRY {
 	struct _OBJECT_DIRECTORY_ENTRY *ChainLink;
 	PVOID Object;
+	ULONG HashValue;	/* of the upcased name */
 } OBJECT_DIRECTORY_ENTRY, *POBJECT_DIRECTORY_ENTRY;
 
+/*
+ * the buckets of a directory are protected by one of obdir_locks[], chosen
+ * by hashing the directory address, lookups only take it for reading
+ */
+extern rwlock_t obdir_locks[OBDIR_LOCK_COUNT];
+
+static inline rwlock_t *obdir_lock(POBJECT_DIRECTORY Directory)
+{
+	return &obdir_locks[hash_ptr(Directory, OBDIR_LOCK_BITS)];
+}
+
 /* Object Directory */
 
 typedef struct _OBJECT_DIRECTORY_INFORMATION {
@@ -468,6 +486,7 @@ typedef struct _OBJECT_HEADER {
 	};
 
 	PSECURITY_DESCRIPTOR SecurityDescriptor;
+	struct rcu_head Rcu;	/* handle lookups may still see the header, see delete_object */
 	QUAD Body;
 } OBJECT_HEADER, *POBJECT_HEADER;
 
@@ -761,7 +780,10 @@ int alloc_object(POBJECT_CREATE_INFORMATION ObjectCreateInfo,
                   POBJECT_HEADER *ObjectHeader);
 
 BOOLEAN
-delete_obdir_entry (IN POBJECT_DIRECTORY Directory);
+delete_obdir_entry (IN POBJECT_DIRECTORY Directory, IN PVOID Object);
+
+VOID
+free_obdir_table(IN PVOID Directory);
 
 NTSTATUS SERVICECALL
 NtCreateDirectoryObject(OUT PHANDLE DirectoryHandle,
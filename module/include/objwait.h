@@ -29,6 +29,8 @@
 #define _OBJWAIT_H
 
 #include <linux/module.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
 #include "object.h"
 #include "ke.h"
 #include "ntstatus.h"
@@ -37,6 +39,36 @@
 
 #define MAXIMUM_WAIT_OBJECTS	64
 
+/*
+ * dispatcher locks
+ * every dispatcher object is covered by one of these, hashed on its address,
+ * the object's signal state and wait list may only change with it held.
+ * A WaitAll holds the locks of all its objects at once, so there are few
+ * enough of them to stay below lockdep's MAX_LOCK_DEPTH (48)
+ */
+#define DISPATCHER_LOCK_BITS	5
+#define DISPATCHER_LOCK_COUNT	(1 << DISPATCHER_LOCK_BITS)
+
+extern spinlock_t dispatcher_locks[DISPATCHER_LOCK_COUNT];
+
+static inline spinlock_t *dispatcher_lock(void *object)
+{
+	return &dispatcher_locks[hash_ptr(object, DISPATCHER_LOCK_BITS)];
+}
+
+static inline unsigned long lock_dispatcher_object(void *object)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(dispatcher_lock(object), flags);
+	return flags;
+}
+
+static inline void unlock_dispatcher_object(void *object, unsigned long flags)
+{
+	spin_unlock_irqrestore(dispatcher_lock(object), flags);
+}
+
 #define WAIT_OBJECT_0		(STATUS_WAIT_0 + 0)
 #define WAIT_ABANDONED		(STATUS_ABANDONED_WAIT_0 + 0)
 #define WAIT_ABANDONED_0	(STATUS_ABANDONED_WAIT_0 + 0)
@@ -82,10 +114,15 @@ wait_for_multi_objs(ULONG Count,
 
 NTSTATUS SERVICECALL NtWaitForMultipleObjects(ULONG,PHANDLE,WAIT_TYPE,BOOLEAN,PLARGE_INTEGER);
 
+/* Must be called with the object's dispatcher lock held */
 VOID
 wait_test(struct dispatcher_header * Object,
 	KPRIORITY Increment);
 
+/* Must be called with the object's dispatcher lock held */
+VOID
+wake_dispatcher_waiters(struct dispatcher_header * Object);
+
 VOID
 abort_wait_thread(struct kthread *Thread,
 		NTSTATUS WaitStatus,
@@ -0,0 +1,67 @@
+/*
+ * pipe_ring.h
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * pipe_ring.h: the transport under a connected named pipe instance
+ */
+
+#ifndef _PIPE_RING_H
+#define _PIPE_RING_H
+
+#include <linux/fs.h>
+#include <linux/ioctl.h>
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+/* create_pipe_ring() flags */
+#define PIPE_RING_MESSAGE		0x0001	/* writes are kept as messages */
+#define PIPE_RING_SERVER_READ_MESSAGE	0x0002	/* server end reads a message at a time */
+#define PIPE_RING_CLIENT_READ_MESSAGE	0x0004	/* client end reads a message at a time */
+
+/*
+ * bytes left of the message the last read stopped in, 0 at a message boundary
+ * ntdll uses it to return STATUS_BUFFER_OVERFLOW, keep the value in sync
+ */
+#define PIPE_RING_MORE_DATA		_IOR('p', 0xd0, int)
+
+/* nothing left to read and the other end gone, tells an empty message from the end */
+#define PIPE_RING_BROKEN		_IOR('p', 0xd1, int)
+
+struct pipe_ring_info
+{
+	unsigned int	avail;		/* bytes that can be read */
+	unsigned int	messages;	/* messages that can be read */
+	unsigned int	message_left;	/* bytes left of the next message */
+	int		broken;		/* the other end is gone */
+};
+
+extern int create_pipe_ring(unsigned int flags, unsigned int insize,
+		unsigned int outsize, int fds[2]);
+extern int is_pipe_ring_file(struct file *filp);
+extern void pipe_ring_shutdown(struct file *filp);
+extern int pipe_ring_peek(struct file *filp, void *buf, unsigned int size,
+		struct pipe_ring_info *info);
+extern long pipe_ring_transact(struct file *filp, const void *in, unsigned int in_size,
+		void *out, unsigned int out_size, unsigned int *left);
+
+#endif /* CONFIG_UNIFIED_KERNEL */
+#endif /* _PIPE_RING_H */
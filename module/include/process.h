@@ -305,7 +305,7 @@ struct eprocess
 	spinlock_t                      watch_lock;
 	long				watch_fd;
 	pid_t				watch_thread;
-	int					epoll_fd;
+	struct poll_loop		*poll_loop;	/* fd event loop, see fs/fd.c */
 }; /* struc eprocess */
 
 typedef struct eprocess EPROCESS, *PEPROCESS;
@@ -465,7 +465,6 @@ struct w32process
 	struct token        *token;           /* security token associated with this process */
 	struct list_head     dlls;            /* list of loaded dlls */
 	unsigned int         trace_data;      /* opaque data used by the process tracing mechanism */
-	int                 dummyfd;
 };
 
 extern POBJECT_TYPE process_object_type;
@@ -44,6 +44,7 @@
 #define _SEC_RESERVE			0x04000000     
 #define _SEC_COMMIT			0x08000000     
 #define _SEC_NOCACHE			0x10000000     
+#define _SEC_LARGE_PAGES		0x80000000
 
 #define	SECTION_EXTEND_SIZE	0x10
 #define	SECTION_MAP_READ	0x04
@@ -62,6 +63,7 @@ struct win32_image_section
 	off_t                   wis_fpos;       /* file position */
 	size_t                  wis_size;       /* section size */
 	size_t                  wis_rawsize;    /* raw data size */
+	size_t                  wis_maplen;     /* raw data mapped straight from the page cache */
 	unsigned long           wis_padrva;     /* padding RVA */
 	unsigned long           wis_flags;      /* specific flags */
 	unsigned long           wis_protect;    /* specific protects */
@@ -129,9 +131,42 @@ typedef struct _SECTION_IMAGE_INFORMATION
     ULONG     Unknown4[3];
 } SECTION_IMAGE_INFORMATION, *PSECTION_IMAGE_INFORMATION;
 
+/*
+ * identifies one version of a file, for the caches of what was parsed from it
+ */
+struct file_stamp {
+	struct super_block	*fs_sb;
+	unsigned long		fs_ino;
+	__u32			fs_generation;
+	loff_t			fs_size;
+	struct timespec		fs_mtime;
+	struct timespec		fs_ctime;
+};
+
+static inline void get_file_stamp(struct file *file, struct file_stamp *stamp)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+
+	stamp->fs_sb = inode->i_sb;
+	stamp->fs_ino = inode->i_ino;
+	stamp->fs_generation = inode->i_generation;
+	stamp->fs_size = i_size_read(inode);
+	stamp->fs_mtime = inode->i_mtime;
+	stamp->fs_ctime = inode->i_ctime;
+}
+
+static inline int file_stamp_equal(struct file_stamp *a, struct file_stamp *b)
+{
+	return a->fs_sb == b->fs_sb && a->fs_ino == b->fs_ino
+		&& a->fs_generation == b->fs_generation && a->fs_size == b->fs_size
+		&& timespec_equal(&a->fs_mtime, &b->fs_mtime)
+		&& timespec_equal(&a->fs_ctime, &b->fs_ctime);
+}
+
 extern POBJECT_TYPE section_object_type;
 int data_section_setup(struct win32_section *ws);
 int image_section_setup(struct win32_section *ws);
+void exit_image_cache(void);
 
 NTSTATUS
 SERVICECALL
@@ -0,0 +1,61 @@
+/*
+ * stats.h
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * stats.h: per-cpu call counters and latency histograms
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/proc_fs.h>
+#include "w32syscall.h"
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+#define UK_STAT_BUCKETS	32	/* bucket n counts calls of [2^(n-1), 2^n) ns */
+
+struct uk_stat
+{
+	unsigned long		count;
+	unsigned long long	total_ns;
+	unsigned long		hist[UK_STAT_BUCKETS];
+};
+
+struct uk_stats
+{
+	struct uk_stat		syscall[NUMBER_OF_SYSCALLS];
+	struct uk_stat		request[REQ_NB_REQUESTS];
+};
+
+extern int uk_stats_enabled;
+
+extern int uk_stats_init(struct proc_dir_entry *parent);
+extern void uk_stats_exit(struct proc_dir_entry *parent);
+extern void uk_stats_syscall_enter(int call_id);
+extern void uk_stats_syscall_leave(void);
+extern void uk_stats_account_request(int req, ktime_t start);
+
+#endif /* CONFIG_UNIFIED_KERNEL */
+#endif /* _STATS_H */
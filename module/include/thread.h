@@ -83,7 +83,6 @@ typedef struct w32thread
 	int                    debug_break;   /* debug breakpoint pending? */
 	struct msg_queue      *queue;         /* message queue */
 	unsigned int           error;         /* current error code */
-	unsigned int           wake_up;
 	union generic_request  req;           /* current request */
 	void                  *req_data;      /* variable-size data for request */
 	unsigned int           req_toread;    /* amount of data still to read in request */
@@ -101,6 +100,10 @@ typedef struct w32thread
 	obj_handle_t           desktop;       /* desktop handle */
 	int                    desktop_users; /* number of objects using the thread desktop */
 	struct token          *token;         /* security token associated with this thread */
+	struct page           *req_ring_page; /* pinned user page of the shared request ring */
+	void                  *req_ring_data; /* kernel copy of the ring entry data */
+	int                    req_ring_busy; /* the ring is being flushed */
+	struct page           *queue_status_page; /* pinned user page of the published queue status */
 } TSB, *PTSB, W32THREAD;
 
 struct thread_snapshot
@@ -201,6 +204,7 @@ typedef void (STDCALL *PKSYSTEM_ROUTINE)(PKSTART_ROUTINE StartRoutine, PVOID Sta
 
 extern struct w32thread *get_thread_from_id(unsigned int id);
 extern void uk_wake_up(struct object *obj, int max);
+extern void uk_clear_signal(struct object *obj);
 extern int thread_queue_apc(struct w32thread *thread, struct object *owner, 
 		const apc_call_t *call_data);
 extern void thread_cancel_apc(struct w32thread *thread, struct object *owner, enum apc_type type);
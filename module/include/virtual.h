@@ -67,6 +67,7 @@ typedef const int CINT;
 #define MEM_MAPPED			0x00040000     
 #define MEM_RESET			0x00080000     
 #define MEM_TOP_DOWN			0x00100000
+#define MEM_LARGE_PAGES			0x20000000
 #define MEM_SYSTEM			0x80000000
 #define MEM_4MB_PAGES			0x80000000     
 #define	MEM_IMAGE			_SEC_IMAGE
@@ -150,5 +151,14 @@ NtFreeVirtualMemory(IN HANDLE ProcessHandle,
 		IN PULONG PRegionSize,
 		IN ULONG FreeType);
 
+/* large pages */
+unsigned long large_page_minimum(void);
+NTSTATUS check_large_pages(unsigned long addr, unsigned long size);
+struct file *open_large_page_file(void);
+int reserve_large_page_file(struct file *filp, unsigned long size);
+unsigned long map_large_pages(struct task_struct *tsk, unsigned long addr,
+		unsigned long size, unsigned long prot, unsigned long flags);
+void account_large_pages(unsigned long size, int large);
+
 #endif /* CONFIG_UNIFIED_KERNEL */
 #endif /* _VIRTUAL_H */
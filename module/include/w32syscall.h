@@ -33,6 +33,11 @@
 #include "wineserver/server.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
+
+#define MIN_SYSCALL_NUMBER    0
+#define MAX_SYSCALL_NUMBER    237
+#define NUMBER_OF_SYSCALLS    238
+
 /* 0 */
 NTSTATUS SERVICECALL
 NtAcceptConnectPort (PHANDLE		ServerPortHandle,
@@ -1497,5 +1502,22 @@ NtWineService(PSERVER_REQUEST_INFO ReqMsg);
 NTSTATUS SERVICECALL
 NtCatchApc(int param);
 
+NTSTATUS SERVICECALL
+NtRegisterWineServiceRing(IN PVOID Ring);
+
+NTSTATUS SERVICECALL
+NtSubmitWineServiceRing(VOID);
+
+NTSTATUS SERVICECALL
+NtRemoveIoCompletionEx(IN  HANDLE		  IoCompletionHandle,
+		OUT PFILE_IO_COMPLETION_INFORMATION IoCompletionInformation,
+		IN  ULONG 		  Count,
+		OUT PULONG 		  NumEntriesRemoved,
+		IN  PLARGE_INTEGER   Timeout OPTIONAL,
+		IN  BOOLEAN 		  Alertable);
+
+NTSTATUS SERVICECALL
+NtRegisterQueueStatus(IN PVOID Status);
+
 #endif /* CONFIG_UNIFIED_KERNEL */
 #endif /* _W32SYSCALL_H */
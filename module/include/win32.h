@@ -32,6 +32,7 @@
 #include <linux/module.h>
 #include <asm/byteorder.h>
 #include "winternl.h"
+#include "ktrace.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
@@ -55,31 +56,6 @@
 #define NULL 0
 #endif
 
-#if 0
-#define KDEBUG 1
-#define KTRACE 1
-#endif
-
-#ifdef KDEBUG
-#define kdebug(FMT...) \
-	do { \
-		printk("UK: pid %x tid %x %s ", current->tgid, current->pid, __FUNCTION__); \
-		printk(FMT); \
-	} while (0)
-#else
-#define kdebug(FMT...) do { } while (0)
-#endif
-
-#ifdef KTRACE
-#define ktrace(FMT...) \
-	do { \
-		printk("UK: pid %x tid %x %s ", current->tgid, current->pid, __FUNCTION__); \
-		printk(FMT); \
-	} while (0)
-#else
-#define ktrace(FMT...) do { } while (0)
-#endif
-
 #define _ANONYMOUS_UNION __extension__
 
 #define	NOREGPARM	__attribute__((regparm(0)))
@@ -935,6 +911,15 @@ typedef struct _IO_STATUS_BLOCK
 	NTSTATUS  async_status;
 } IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
 
+/* user mode layout, without the async_status of IO_STATUS_BLOCK */
+typedef struct _FILE_IO_COMPLETION_INFORMATION
+{
+	ULONG_PTR  CompletionKey;
+	ULONG_PTR  CompletionValue;
+	NTSTATUS   Status;
+	ULONG_PTR  Information;
+} FILE_IO_COMPLETION_INFORMATION, *PFILE_IO_COMPLETION_INFORMATION;
+
 
 
 typedef union _LARGE_INTEGER {
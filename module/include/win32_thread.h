@@ -72,10 +72,18 @@ struct task_ethread_operations {
                          unsigned long clone_flags);
 };
 
+/* kthread->wait_claimed */
+#define WAIT_PENDING	0
+#define WAIT_CLAIMED	1	/* being ended, wait_status not valid yet */
+#define WAIT_ENDED	2
+
 struct kthread
 {
 	struct dispatcher_header 	header;    
 	struct list_head        	mutant_list_head;      
+	spinlock_t			mutant_list_lock;	/* protects mutant_list_head */
+	atomic_t			wait_claimed;	/* WAIT_PENDING until someone ends the wait */
+	struct dispatcher_header	*signal_object;	/* signalled by the next wait, see NtSignalAndWaitForSingleObject */
 	void*				initial_stack;        
 	unsigned long         		stack_limit;          
 	void*			teb;                
@@ -274,6 +282,8 @@ struct ethread
 	struct task_struct*		et_task;	/* Linux task */
 	struct ethread_operations*	et_ops;
 	void*				tsb;
+	int				et_syscall;	/* syscall being timed, -1 if none */
+	ktime_t				et_syscall_start;
 #if 0
 	void*				et_extend;
 #endif
@@ -76,7 +76,10 @@ extern int is_same_file_fd(struct fd *fd1, struct fd *fd2);
 extern int is_fd_removable(struct fd *fd);
 extern int fd_close_handle(struct object *obj, struct w32process *process, obj_handle_t handle);
 extern int check_fd_events(struct fd *fd, int events);
+extern int check_fd_events_atomic(struct fd *fd, int events);
+extern void fd_hook_wait(struct fd *fd);
 extern void set_fd_events(struct fd *fd, int events);
+extern void fd_unhook_wait(struct fd *fd);
 extern obj_handle_t lock_fd(struct fd *fd, file_pos_t offset, file_pos_t count, int shared, int wait);
 extern void unlock_fd(struct fd *fd, file_pos_t offset, file_pos_t count);
 extern void set_fd_signaled(struct fd *fd, int signaled);
@@ -96,7 +99,6 @@ extern void default_fd_async_event(struct fd *fd, struct async_queue *queue, str
 extern int default_fd_async_terminated(struct fd *fd, struct async_queue *queue, struct async *async, int status);
 extern void default_fd_cancel_async(struct fd *fd, struct w32process *process, struct w32thread *thread, unsigned __int64 iosb);
 extern void no_flush(struct fd *fd, struct kevent **event);
-extern void main_loop(void);
 extern void remove_process_locks(struct w32process *process);
 
 static inline struct fd *get_obj_fd(struct object *obj)
@@ -116,10 +118,10 @@ typedef void (*timeout_callback)(void *private);
 extern struct timeout_user *add_timeout_user(timeout_t when, timeout_callback func, void *private);
 extern void remove_timeout_user(struct timeout_user *user);
 extern const char *get_timeout_str(timeout_t timeout);
-extern int get_next_timeout(void);
-
-extern struct timer_list *add_linux_timer(timeout_t when, timeout_callback func, void *private);
-extern void remove_linux_timer(struct timer_list *timer);
+extern void run_expired_timeouts(void);
+extern void wait_for_timeouts(void);
+extern void init_timeouts(void);
+extern void exit_timeouts(void);
 
 /* file functions */
 struct uk_file;
@@ -156,6 +156,7 @@ extern void *fgets(void *buf, int len, struct LIBC_FILE *fp);
 
 
 extern long fclose(struct LIBC_FILE* fp);
+extern long fflush(struct LIBC_FILE* fp);
 
 extern struct LIBC_FILE *libc_file_open(struct file *filp, char *readwrite) ;
 
@@ -900,6 +900,20 @@ struct console_renderer_event
 	} u;
 };
 
+/*
+ * header of the cells of a screen buffer as mapped by the renderer, through
+ * the screen buffer fd; the header page can only be mapped read only
+ */
+struct console_output_shm
+{
+	unsigned int size;           /* size of the mapping */
+	int          width;          /* size (w-h) of the screen buffer */
+	int          height;
+	unsigned int pending_offset; /* offset of an int set while an update event is queued */
+	unsigned int dirty_offset;   /* offset of the bitmap of rows changed since the renderer looked */
+	unsigned int data_offset;    /* offset of the width x height cells */
+};
+
 struct get_console_renderer_events_request
 {
 	struct request_header __header;
@@ -62,9 +62,10 @@
 #define KEY_VOLATILE 0x0001  /* key is volatile (not saved to disk) */
 #define KEY_DELETED  0x0002  /* key has been deleted */
 #define KEY_DIRTY    0x0004  /* key has been modified */
+#define KEY_LOADING  0x0008  /* branch is being loaded, changes are not journaled */
 
-#define MIN_SUBKEYS  8   /* min. number of allocated subkeys per key */
-#define MIN_VALUES   8   /* min. number of allocated values per key */
+#define REG_INDEX_BLOCK     64  /* entries per block of a name index */
+#define REG_INDEX_HASH_MIN  32  /* entries before a name index gets a hash table */
 
 #define MAX_NAME_LEN  MAX_PATH  /* max. length of a key name */
 #define MAX_VALUE_LEN MAX_PATH  /* max. length of a value name */
@@ -195,7 +196,79 @@ struct key_value
 	void             *data;    /* pointer to value data */
 };
 
-#define VALUES_PER_BLOCK 0x1000
+/*
+ * name index of the subkeys or values of a key: entries are sorted the way
+ * enum_key and enum_value number them, in blocks of REG_INDEX_BLOCK
+ */
+struct reg_index_block
+{
+	unsigned int  count;
+	void         *entries[REG_INDEX_BLOCK];
+};
+
+struct reg_index
+{
+	unsigned int             count;       /* number of entries */
+	unsigned int             nb_blocks;   /* blocks in use */
+	unsigned int             max_blocks;  /* size of the blocks array */
+	struct reg_index_block **blocks;
+	unsigned int             hash_bits;   /* log2 of the hash size, 0 if there is no hash */
+	void                   **hash;        /* entries by name, linear probing */
+	unsigned int             cur_block;   /* cursor for access by position */
+	unsigned int             cur_base;    /* position of the first entry of cur_block */
+	const WCHAR           *(*get_name)(const void *entry, data_size_t *len);
+};
+
+extern void reg_index_init(struct reg_index *index,
+		const WCHAR *(*get_name)(const void *entry, data_size_t *len));
+extern void reg_index_free(struct reg_index *index);
+extern void *reg_index_find(struct reg_index *index, const struct unicode_str *name);
+extern void *reg_index_get(struct reg_index *index, unsigned int pos);
+extern int reg_index_insert(struct reg_index *index, void *entry);
+extern void reg_index_remove(struct reg_index *index, const void *entry);
+
+/*
+ * binary hive: a header followed by 4-byte aligned records, children are
+ * written before their parent so every offset points backwards
+ *
+ * key record:   struct hive_key, name, class
+ * value record: struct hive_value, name, data
+ * subkey and value tables: arrays of record offsets, in the same order as
+ * the subkeys and values indexes of struct reg_key
+ */
+#define HIVE_MAGIC "UKHIVE01"
+
+struct hive_header
+{
+	char          magic[8];
+	unsigned int  root;        /* offset of the branch key record */
+	unsigned int  size;        /* file size */
+};
+
+struct hive_key
+{
+	unsigned int   modif;      /* last modification time */
+	unsigned short namelen;    /* length of key name */
+	unsigned short classlen;   /* length of class name */
+	unsigned int   nb_subkeys;
+	unsigned int   subkeys;    /* offset of the subkey table */
+	unsigned int   nb_values;
+	unsigned int   values;     /* offset of the value table */
+};
+
+struct hive_value
+{
+	unsigned short namelen;    /* length of value name */
+	unsigned short type;       /* value type */
+	unsigned int   len;        /* value data length in bytes */
+};
+
+/* an open hive file, referenced by every key that still has to be loaded from it */
+struct reg_hive
+{
+	atomic_t      refcount;
+	struct file  *filp;
+};
 
 struct reg_key
 {
@@ -204,24 +277,31 @@ struct reg_key
 	unsigned short    namelen;     /* length of key name */
 	unsigned short    classlen;    /* length of class name */
 	struct reg_key   *parent;      /* parent key */
-	int               last_subkey; /* last in use subkey */
-	int               nb_subkeys;  /* count of allocated subkeys */
-	struct reg_key  **subkeys;     /* subkeys array */
-	int               last_value;  /* last in use value */
-	int               nb_values;   /* count of allocated values in array */
-	struct key_value *values[4];   /* values array */
+	struct reg_index  subkeys;     /* subkeys, struct reg_key */
+	struct reg_index  values;      /* values, struct key_value */
 	unsigned int      flags;       /* flags */
 	time_t            modif;       /* last modification time */
 	struct list_head  notify_list; /* list of notifications */
+	struct reg_hive  *hive;        /* hive holding the subkeys and values, NULL once loaded */
+	unsigned int      hive_offset; /* offset of the key record in the hive */
 };
 
 #define MAX_SAVE_BRANCH_INFO 3
 
+#define JOURNAL_BATCH        64            /* records that wake up the save thread */
+#define JOURNAL_SYNC_MSECS   2000          /* max. age of a record before it is synced */
+#define JOURNAL_COMPACT_SIZE (256 * 1024)  /* journal size that triggers a full save */
+
 /* information about where to save a registry branch */
 struct save_branch_info
 {
-	struct reg_key  *key;
-	char        *path;
+	struct reg_key   *key;
+	char             *path;
+	char             *journal_path; /* append-only log of changes since the last save */
+	struct LIBC_FILE *journal;
+	int               pending;      /* records written since the last sync */
+	char             *hive_path;    /* binary image of the branch */
+	int               hive_stale;   /* hive is older than the text file it was loaded from */
 };
 
 /* ch [0-9A-Fa-f] */
@@ -32,6 +32,7 @@
 #include "io.h"
 #include "wineserver/token.h"
 
+extern const LUID SeLockMemoryPrivilege;
 extern const LUID SeIncreaseQuotaPrivilege;
 extern const LUID SeSecurityPrivilege;
 extern const LUID SeTakeOwnershipPrivilege;
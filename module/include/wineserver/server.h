@@ -49,5 +49,53 @@ typedef struct __server_request_info
 	void                 *reply_data; /* reply data pointer */
 	struct __server_iovec data[__SERVER_MAX_DATA];  /* request variable size data */
 } *PSERVER_REQUEST_INFO;
+
+/*
+ * per-thread request ring, one page shared between ntdll and the module
+ * ntdll fills entries and advances head, the module consumes them and advances tail
+ * the ring is drained on NtSubmitWineServiceRing and on entry to NtWineService and the waits
+ */
+#define UK_RING_ENTRIES		8
+#define UK_RING_DATA_SIZE	384
+
+#define UK_RING_NOREPLY		0x0001	/* fire and forget, reply is discarded */
+#define UK_RING_DONE		0x8000	/* set by the module once the reply is valid */
+
+struct uk_ring_entry
+{
+	union
+	{
+		union generic_request req;    /* request structure */
+		union generic_reply   reply;  /* reply structure */
+	} u;
+	unsigned int          flags;      /* UK_RING_* flags */
+	void                 *reply_data; /* reply data pointer, may be NULL */
+	char                  data[UK_RING_DATA_SIZE];  /* inline request data */
+};
+
+struct uk_request_ring
+{
+	volatile unsigned int head;       /* next entry to fill, written by ntdll */
+	volatile unsigned int tail;       /* next entry to consume, written by the module */
+	volatile unsigned int busy;       /* ntdll is using the ring, ignored by the module */
+	struct uk_ring_entry  entries[UK_RING_ENTRIES];
+};
+
+/*
+ * per-thread message queue status, one page registered with NtRegisterQueueStatus
+ * only the module writes it, seq is odd while an update is in progress
+ */
+struct uk_queue_status
+{
+	volatile unsigned int seq;           /* update sequence number */
+	unsigned int          queue;         /* the thread has a message queue */
+	unsigned int          wake_bits;     /* wakeup bits */
+	unsigned int          changed_bits;  /* changed wakeup bits */
+	unsigned int          wake_mask;     /* wakeup mask */
+	unsigned int          changed_mask;  /* changed wakeup mask */
+	int                   paint_count;   /* pending paint messages count */
+	int                   quit_message;  /* is there a pending quit message? */
+	unsigned char         keystate[256]; /* state of each key of the thread input */
+};
 #endif /* CONFIG_UNIFIED_KERNEL */
 #endif /* _WINESERVER_SERVER_H */
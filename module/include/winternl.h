@@ -442,7 +442,6 @@ struct handle_table
     long 			next_index_needing_pool;
     struct eresource 		handle_table_lock;
     struct list_head 		handle_table_list;
-    struct kevent 		handle_contention_event;
 
     struct w32process    *process;     /* process owning this table */
     int                  count;       /* number of allocated entries */
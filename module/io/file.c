@@ -27,9 +27,16 @@
 #include <linux/file.h>
 #include <linux/smp_lock.h>
 #include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/kthread.h>
+#include <linux/mmu_context.h>
+#include <linux/syscalls.h>
 #include "file.h"
+#include "handle.h"
 #include "process.h"
 #include "thread.h"
+#include "apc.h"
+#include "event.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
@@ -42,10 +49,25 @@ EXPORT_SYMBOL(file_ctrl_root);
 HANDLE	file_ctrl_root_handle = NULL;
 EXPORT_SYMBOL(file_ctrl_root_handle);
 
+#define FILE_SYNCHRONOUS_IO_ALERT	0x00000010
+#define FILE_SYNCHRONOUS_IO_NONALERT	0x00000020
+#define IO_COMPLETION_MODIFY_STATE	0x0002
+
+/* win32_file->Flags */
+#define FO_SYNCHRONOUS_IO		0x00000002
+#define FO_ALERTABLE_IO			0x00000004
+
+/* ByteOffset.LowPart, with HighPart -1 */
+#define FILE_WRITE_TO_END_OF_FILE	0xffffffff
+#define FILE_USE_FILE_POINTER_POSITION	0xfffffffe
+
 static int  file_check_sharing(struct win32_file *, struct win32_file_ctrl *);
 
 extern int unistr2charstr(PWSTR unistr, LPCSTR chstr);
 extern NTSTATUS translate_object_name(PUNICODE_STRING ObjectName);
+extern struct uk_completion *get_completion_obj(struct w32process *process, obj_handle_t handle, unsigned int access);
+extern void add_completion(struct uk_completion *completion, unsigned long ckey, unsigned long cvalue,
+		unsigned int status, unsigned long information);
 
 /*
  * open a file object, maybe creating if non-existent
@@ -175,6 +197,10 @@ NtCreateFile(
 	Object->wf_access	= DesiredAccess;
 	Object->wf_sharing	= ShareAccess;
 	Object->wf_attrs	= FileAttributes;
+	if (CreateOptions & FILE_SYNCHRONOUS_IO_ALERT)
+		Object->Flags	|= FO_SYNCHRONOUS_IO | FO_ALERTABLE_IO;
+	else if (CreateOptions & FILE_SYNCHRONOUS_IO_NONALERT)
+		Object->Flags	|= FO_SYNCHRONOUS_IO;
 	Object->wf_control	= ControlObject;
 	ref_object(ControlObject);
 
@@ -321,41 +347,271 @@ NtOpenFile(
 EXPORT_SYMBOL(NtOpenFile);
 
 /*
- * read from a file
+ * a read or write in progress
+ * - overlapped ones are queued on file_io_list and run by a file_io thread,
+ *   which holds the references below until the I/O is complete
  */
-NTSTATUS
-SERVICECALL
-NtReadFile(
-		IN HANDLE FileHandle,
-		IN HANDLE Event OPTIONAL,
-		IN PIO_APC_ROUTINE ApcRoutine OPTIONAL,
-		IN PVOID ApcContext OPTIONAL,
-		OUT PIO_STATUS_BLOCK IoStatusBlock,
-		OUT PVOID Buffer,
-		IN ULONG Length,
-		IN PLARGE_INTEGER ByteOffset OPTIONAL, /* NOT optional for asynch. operations! */
-		IN PULONG Key OPTIONAL
-	  )
+struct file_io {
+	struct list_head	entry;		/* on file_io_list */
+	struct win32_file	*wf;
+	struct mm_struct	*mm;		/* address space of the buffers */
+	struct ethread		*thread;	/* issuer, the APC goes to it */
+	struct task_struct	*task;		/* task of the issuer, signalled for the APC */
+	struct kevent		*event;		/* signalled on completion, or NULL */
+	PIO_APC_ROUTINE		apc_routine;
+	PVOID			apc_context;	/* also the completion port value */
+	PIO_STATUS_BLOCK	iosb;
+	loff_t			pos;
+	int			write;
+	ULONG			length;
+	unsigned long		nr_segs;
+	struct iovec		*iov;
+};
+
+#define FILE_IO_THREADS_PER_CPU	4
+
+static LIST_HEAD(file_io_list);
+static DEFINE_SPINLOCK(file_io_lock);
+static DECLARE_WAIT_QUEUE_HEAD(file_io_wait);
+static struct task_struct **file_io_threads;
+static int nr_file_io_threads;
+
+/*
+ * read or write at *pos, leaving f_pos alone
+ * - the buffers are user memory checked with access_ok()
+ * - segments are transferred one by one, up to the first short one
+ */
+static ssize_t file_rw(struct file *file, int write, struct iovec *iov,
+		unsigned long nr_segs, loff_t *pos)
 {
-	struct win32_file *wf;
-	struct file *file;
-	loff_t	pos;
-	struct ethread	*thread;
-	IO_STATUS_BLOCK		io_status;
-	NTSTATUS	status = STATUS_UNSUCCESSFUL;
+	ssize_t ret, total = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr_segs; i++) {
+		ret = write ? vfs_write(file, iov[i].iov_base, iov[i].iov_len, pos)
+			: vfs_read(file, iov[i].iov_base, iov[i].iov_len, pos);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		if (ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+} /* end file_rw() */
 
-	ktrace("NtReadFile(%p)\n", FileHandle);
+/*
+ * store the result in the IO_STATUS_BLOCK
+ * - the user one has no async_status, so the fields are written one by one
+ */
+static void set_io_status(PIO_STATUS_BLOCK iosb, NTSTATUS status, ULONG_PTR info)
+{
+	if (put_user(status, &iosb->Status) || put_user(info, &iosb->Information))
+		ktrace("bad IoStatusBlock %p\n", iosb);
+} /* end set_io_status() */
+
+/*
+ * finish a read or write: fill in the IO_STATUS_BLOCK, then signal the event
+ * and queue the APC, or post to the completion port of the file
+ * - a file_io thread has no ethread, so nothing here may go by the current
+ *   thread: the issuer is io->thread, and io->task its pinned task
+ */
+static NTSTATUS file_io_complete(struct file_io *io, ssize_t ret)
+{
+	struct ethread *thread = io->thread;
+	struct uk_completion *completion = io->wf->wf_completion;
+	struct kapc *apc;
+	ULONG_PTR info = ret > 0 ? ret : 0;
+	NTSTATUS status;
+
+	if (ret < 0)
+		status = errno2ntstatus(-ret);
+	else if (!ret && io->length && !io->write)
+		status = STATUS_END_OF_FILE;
+	else
+		status = STATUS_SUCCESS;
+	set_io_status(io->iosb, status, info);
+
+	if (io->event)
+		set_event(io->event, EVENT_INCREMENT, FALSE);
+
+	if (io->apc_routine) {
+		if (thread->terminated)
+			return status;
+		if (!(apc = kmalloc(sizeof(struct kapc), GFP_KERNEL)))
+			return status;
+
+		/* ApcRoutine(ApcContext, IoStatusBlock, 0) */
+		apc_init(apc,
+				&thread->tcb,
+				OriginalApcEnvironment,
+				free_apc_routine,
+				NULL,
+				(PKNORMAL_ROUTINE)io->apc_routine,
+				UserMode,
+				io->apc_context);
+		if (!insert_queue_apc(apc, io->iosb, NULL, IO_NO_INCREMENT)) {
+			kfree(apc);
+			return status;
+		}
+		set_tsk_thread_flag(io->task, TIF_APC);
+		if (thread->tcb.alertable)
+			abort_wait_thread(&thread->tcb, STATUS_USER_APC, IO_NO_INCREMENT);
+		send_sig(SIGUSR2, io->task, 1);
+	} else if (completion && io->apc_context)
+		add_completion(completion, io->wf->wf_comp_key,
+				(unsigned long)io->apc_context, status, info);
+
+	return status;
+} /* end file_io_complete() */
+
+/* drop what a queued read or write holds */
+static void free_file_io(struct file_io *io)
+{
+	if (io->mm)
+		mmput(io->mm);
+	if (io->event)
+		deref_object(io->event);
+	put_task_struct(io->task);
+	deref_object(io->thread);
+	deref_object(io->wf);
+	kfree(io);
+} /* end free_file_io() */
+
+static void run_file_io(struct file_io *io)
+{
+	ssize_t ret;
+
+	if (io->mm)
+		use_mm(io->mm);
+	ret = file_rw(io->wf->wf_file, io->write, io->iov, io->nr_segs, &io->pos);
+	file_io_complete(io, ret);
+	if (io->mm)
+		unuse_mm(io->mm);
+	free_file_io(io);
+} /* end run_file_io() */
+
+static int file_io_thread(void *data)
+{
+	struct file_io *io;
+
+	/* the buffers and IO_STATUS_BLOCKs are user memory */
+	set_fs(USER_DS);
+
+	for (;;) {
+		wait_event_interruptible_exclusive(file_io_wait,
+				!list_empty(&file_io_list) || kthread_should_stop());
+
+		spin_lock(&file_io_lock);
+		if (list_empty(&file_io_list)) {
+			spin_unlock(&file_io_lock);
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+		io = list_first_entry(&file_io_list, struct file_io, entry);
+		list_del(&io->entry);
+		spin_unlock(&file_io_lock);
+
+		run_file_io(io);
+	}
+	return 0;
+} /* end file_io_thread() */
+
+/*
+ * start the threads that run overlapped reads and writes
+ * - a blocked read holds up its thread only, so there are several per cpu
+ */
+void init_file_io(void)
+{
+	struct task_struct *task;
+	int i, n = FILE_IO_THREADS_PER_CPU * num_online_cpus();
+
+	file_io_threads = kmalloc(n * sizeof(struct task_struct *), GFP_KERNEL);
+	if (!file_io_threads)
+		return;
+
+	for (i = 0; i < n; i++) {
+		task = kthread_run(file_io_thread, NULL, "file_io/%d", i);
+		if (IS_ERR(task))
+			break;
+		file_io_threads[nr_file_io_threads++] = task;
+	}
+} /* end init_file_io() */
+
+void exit_file_io(void)
+{
+	struct file_io *io, *next;
+	int i;
+
+	for (i = 0; i < nr_file_io_threads; i++)
+		kthread_stop(file_io_threads[i]);
+
+	/* nobody runs what is left anymore */
+	list_for_each_entry_safe(io, next, &file_io_list, entry) {
+		list_del(&io->entry);
+		free_file_io(io);
+	}
+
+	kfree(file_io_threads);
+	file_io_threads = NULL;
+	nr_file_io_threads = 0;
+} /* end exit_file_io() */
+
+/*
+ * common part of NtReadFile, NtWriteFile, NtReadFileScatter and NtWriteFileGather
+ * - ByteOffset is honoured without going through f_pos, so positional
+ *   transfers on one file do not serialise on its position
+ * - on a file opened without FILE_SYNCHRONOUS_IO_*, the transfer is handed
+ *   to a file_io thread and STATUS_PENDING returned at once
+ * - Key is not used, there are no byte range locks
+ */
+static NTSTATUS file_read_write(HANDLE FileHandle,
+		HANDLE Event,
+		PIO_APC_ROUTINE ApcRoutine,
+		PVOID ApcContext,
+		PIO_STATUS_BLOCK IoStatusBlock,
+		struct iovec *iov,
+		unsigned long nr_segs,
+		ULONG Length,
+		PLARGE_INTEGER ByteOffset,
+		int write)
+{
+	struct win32_file	*wf;
+	struct file	*file;
+	struct ethread	*thread;
+	struct kevent	*event = NULL;
+	struct file_io	sync_io, *io;
+	LARGE_INTEGER	offset;
+	loff_t	pos;
+	ssize_t	ret;
+	unsigned long	i;
+	NTSTATUS	status;
 
 	thread = get_current_ethread();
 	if (!thread)
-		goto cleanup_nobj;
+		return STATUS_UNSUCCESSFUL;
 
 	if (!IoStatusBlock)
 		return STATUS_INVALID_PARAMETER;
 
+	if (!access_ok(VERIFY_WRITE, IoStatusBlock, offsetof(IO_STATUS_BLOCK, async_status)))
+		return STATUS_ACCESS_VIOLATION;
+
+	for (i = 0; i < nr_segs; i++)
+		if (!access_ok(write ? VERIFY_READ : VERIFY_WRITE, iov[i].iov_base, iov[i].iov_len))
+			return STATUS_ACCESS_VIOLATION;
+
+	if (ByteOffset) {
+		if (copy_from_user(&offset, ByteOffset, sizeof(offset)))
+			return STATUS_ACCESS_VIOLATION;
+
+		if (offset.HighPart == -1 && offset.LowPart == FILE_USE_FILE_POINTER_POSITION)
+			ByteOffset = NULL;
+	}
+
 	status = ref_object_by_handle(FileHandle,
-			STANDARD_RIGHTS_REQUIRED,
-			NULL,
+			write ? FILE_WRITE_DATA : FILE_READ_DATA,
+			file_object_type,
 			KernelMode,
 			(PVOID *)&wf,
 			NULL);
@@ -364,35 +620,162 @@ NtReadFile(
 
 	file = wf->wf_file;
 
-	/* check the file can actually be read */
-	if (!(wf->wf_access & GENERIC_READ))
+	/* check the file can actually be read or written */
+	status = STATUS_ACCESS_DENIED;
+	if (!(wf->wf_access & (write ? GENERIC_WRITE | FILE_WRITE_DATA : GENERIC_READ | FILE_READ_DATA)))
 		goto cleanup;
-
-	status = STATUS_ACCESS_VIOLATION;
-	if (!(file->f_mode & FMODE_READ))
+	if (!(file->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
 		goto cleanup;
 
-	/* read from file */
-	pos = file->f_pos;
-	if ((unsigned long)Buffer < TASK_SIZE) { /* FIXME */
-		status = vfs_read(file, Buffer, Length, &pos);
-		file->f_pos = pos;
-	}
+	status = STATUS_INVALID_PARAMETER;
+	if (!ByteOffset) {
+		/* an overlapped file has no current position to go by */
+		if (!(wf->Flags & FO_SYNCHRONOUS_IO))
+			goto cleanup;
+		pos = file->f_pos;
+	} else if (write && offset.HighPart == -1 && offset.LowPart == FILE_WRITE_TO_END_OF_FILE)
+		pos = i_size_read(file->f_dentry->d_inode);
+	else if (offset.QuadPart < 0)
+		goto cleanup;
 	else
-		status = kernel_read(file, pos, Buffer, Length);
-	if (status >= 0) {
-		/* write _ReadBytes_ to user space */
-		io_status.Information = (ULONG_PTR)status;
-		if ((unsigned long)Buffer < TASK_SIZE) /* FIXME */
-			status = copy_to_user(IoStatusBlock, &io_status, sizeof(io_status))
-				? STATUS_NO_MEMORY: STATUS_SUCCESS; 
+		pos = offset.QuadPart;
+
+	if (Event) {
+		status = ref_object_by_handle(Event,
+				EVENT_MODIFY_STATE,
+				event_object_type,
+				KernelMode,
+				(PVOID *)&event,
+				NULL);
+		if (!NT_SUCCESS(status))
+			goto cleanup;
+		reset_event(event);
 	}
 
+	if (wf->Flags & FO_SYNCHRONOUS_IO) {
+		ret = file_rw(file, write, iov, nr_segs, &pos);
+		/* a synchronous file keeps track of its position, ByteOffset or not */
+		if (ret >= 0)
+			file->f_pos = pos;
+
+		sync_io.wf = wf;
+		sync_io.thread = thread;
+		sync_io.task = current;
+		sync_io.event = event;
+		sync_io.apc_routine = ApcRoutine;
+		sync_io.apc_context = ApcContext;
+		sync_io.iosb = IoStatusBlock;
+		sync_io.write = write;
+		sync_io.length = Length;
+		status = file_io_complete(&sync_io, ret);
+		goto cleanup_event;
+	}
+
+	status = STATUS_NO_MEMORY;
+	io = kmalloc(sizeof(*io) + nr_segs * sizeof(struct iovec), GFP_KERNEL);
+	if (!io)
+		goto cleanup_event;
+
+	io->wf = wf;
+	io->mm = current->mm;
+	if (io->mm)
+		atomic_inc(&io->mm->mm_users);
+	io->thread = thread;
+	ref_object(thread);
+	io->task = current;
+	get_task_struct(current);
+	io->event = event;
+	io->apc_routine = ApcRoutine;
+	io->apc_context = ApcContext;
+	io->iosb = IoStatusBlock;
+	io->pos = pos;
+	io->write = write;
+	io->length = Length;
+	io->nr_segs = nr_segs;
+	io->iov = (struct iovec *)(io + 1);
+	memcpy(io->iov, iov, nr_segs * sizeof(struct iovec));
+
+	set_io_status(IoStatusBlock, STATUS_PENDING, 0);
+
+	/* the references to wf and event now belong to the file_io thread */
+	spin_lock(&file_io_lock);
+	list_add_tail(&io->entry, &file_io_list);
+	spin_unlock(&file_io_lock);
+	wake_up(&file_io_wait);
+	return STATUS_PENDING;
+
+cleanup_event:
+	if (event)
+		deref_object(event);
+
 cleanup:
 	deref_object((PVOID)wf);
+	return status;
+} /* end file_read_write() */
+
+/*
+ * turn the page sized FILE_SEGMENT_ELEMENTs of a scatter/gather request
+ * into an iovec array
+ */
+static NTSTATUS get_segments(FILE_SEGMENT_ELEMENT *Segments, ULONG Length,
+		struct iovec **iovp, unsigned long *nr_segs)
+{
+	FILE_SEGMENT_ELEMENT	segment;
+	struct iovec	*iov;
+	unsigned long	i, n;
+
+	n = (Length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (!n || n > UIO_MAXIOV || (unsigned long)Segments >= TASK_SIZE)
+		return STATUS_INVALID_PARAMETER;
+
+	if (!(iov = kmalloc(n * sizeof(struct iovec), GFP_KERNEL)))
+		return STATUS_NO_MEMORY;
+
+	for (i = 0; i < n; i++) {
+		if (copy_from_user(&segment, Segments + i, sizeof(segment))) {
+			kfree(iov);
+			return STATUS_ACCESS_VIOLATION;
+		}
+		iov[i].iov_base = (void __user *)(unsigned long)segment.Alignment;
+		iov[i].iov_len = min_t(unsigned long, Length - (i << PAGE_SHIFT), PAGE_SIZE);
+		if ((unsigned long)iov[i].iov_base & ~PAGE_MASK
+				|| segment.Alignment >= TASK_SIZE) {
+			kfree(iov);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
 
-cleanup_nobj:
-	ktrace("*** NtReadFile = %d\n", status);
+	*iovp = iov;
+	*nr_segs = n;
+	return STATUS_SUCCESS;
+} /* end get_segments() */
+
+/*
+ * read from a file
+ */
+NTSTATUS
+SERVICECALL
+NtReadFile(
+		IN HANDLE FileHandle,
+		IN HANDLE Event OPTIONAL,
+		IN PIO_APC_ROUTINE ApcRoutine OPTIONAL,
+		IN PVOID ApcContext OPTIONAL,
+		OUT PIO_STATUS_BLOCK IoStatusBlock,
+		OUT PVOID Buffer,
+		IN ULONG Length,
+		IN PLARGE_INTEGER ByteOffset OPTIONAL, /* NOT optional for asynch. operations! */
+		IN PULONG Key OPTIONAL
+	  )
+{
+	struct iovec	iov = { .iov_base = Buffer, .iov_len = Length };
+	NTSTATUS	status;
+
+	ktrace("NtReadFile(%p)\n", FileHandle);
+
+	status = file_read_write(FileHandle, Event, ApcRoutine, ApcContext,
+			IoStatusBlock, &iov, 1, Length, ByteOffset, 0);
+
+	ktrace("*** NtReadFile = %x\n", status);
 	return status;
 } /* end NtReadFile() */
 EXPORT_SYMBOL(NtReadFile);
@@ -414,62 +797,90 @@ NtWriteFile (
 		IN PULONG Key OPTIONAL
 	    )
 {
-	struct file	*file;
-	struct win32_file	*wf;
-	struct ethread	*thread;
-	loff_t	pos;
-	IO_STATUS_BLOCK	io_status;
-	NTSTATUS	status = STATUS_UNSUCCESSFUL;
+	struct iovec	iov = { .iov_base = Buffer, .iov_len = Length };
+	NTSTATUS	status;
 
 	ktrace("NtWriteFile(%p)\n", FileHandle);
 
-	thread = get_current_ethread();
-	if (!thread)
-		goto cleanup_nobj;
+	status = file_read_write(FileHandle, Event, ApcRoutine, ApcContext,
+			IoStatusBlock, &iov, 1, Length, ByteOffset, 1);
 
-	if (!IoStatusBlock)
-		return STATUS_INVALID_PARAMETER;
+	ktrace("*** NtWriteFile = %x\n", status);
+	return status;
+} /* end NtWriteFile() */
+EXPORT_SYMBOL(NtWriteFile);
 
-	status = ref_object_by_handle(FileHandle,
-			STANDARD_RIGHTS_REQUIRED,
-			NULL,
-			KernelMode,
-			(PVOID *)&wf,
-			NULL);
+/*
+ * read from a file into a list of pages
+ */
+NTSTATUS
+SERVICECALL
+NtReadFileScatter(
+		IN  HANDLE FileHandle,
+		IN  HANDLE Event OPTIONAL,
+		IN  PIO_APC_ROUTINE UserApcRoutine OPTIONAL,
+		IN  PVOID UserApcContext OPTIONAL,
+		OUT PIO_STATUS_BLOCK UserIoStatusBlock,
+		IN  FILE_SEGMENT_ELEMENT BufferDescription [],
+		IN  ULONG BufferLength,
+		IN  PLARGE_INTEGER ByteOffset,
+		IN  PULONG Key OPTIONAL
+		)
+{
+	struct iovec	*iov;
+	unsigned long	nr_segs;
+	NTSTATUS	status;
+
+	ktrace("NtReadFileScatter(%p)\n", FileHandle);
+
+	status = get_segments(BufferDescription, BufferLength, &iov, &nr_segs);
 	if (!NT_SUCCESS(status))
 		return status;
 
-	file = wf->wf_file;
+	status = file_read_write(FileHandle, Event, UserApcRoutine, UserApcContext,
+			UserIoStatusBlock, iov, nr_segs, BufferLength, ByteOffset, 0);
+	kfree(iov);
 
-	/* check the file can actually be written */
-	if (!(wf->wf_access & GENERIC_WRITE))
-		goto cleanup;
+	ktrace("*** NtReadFileScatter = %x\n", status);
+	return status;
+} /* end NtReadFileScatter() */
+EXPORT_SYMBOL(NtReadFileScatter);
 
-	status = STATUS_ACCESS_VIOLATION;
-	if (!(file->f_mode & FMODE_WRITE))
-		goto cleanup;
+/*
+ * write to a file from a list of pages
+ */
+NTSTATUS
+SERVICECALL
+NtWriteFileGather(
+		IN  HANDLE FileHandle,
+		IN  HANDLE Event OPTIONAL,
+		IN  PIO_APC_ROUTINE UserApcRoutine OPTIONAL,
+		IN  PVOID UserApcContext OPTIONAL,
+		OUT PIO_STATUS_BLOCK UserIoStatusBlock,
+		IN  FILE_SEGMENT_ELEMENT BufferDescription [],
+		IN  ULONG BufferLength,
+		IN  PLARGE_INTEGER ByteOffset,
+		IN  PULONG Key OPTIONAL
+		)
+{
+	struct iovec	*iov;
+	unsigned long	nr_segs;
+	NTSTATUS	status;
 
-	/* write to file */
-	pos = file->f_pos;
-	status = vfs_write(file, Buffer, Length, &pos);
-	file->f_pos = pos;
-	if (status >= 0) {
-		/* copy _WRITEDBYTES_ to user space */
-		io_status.Information = (ULONG_PTR)status;
-		if(copy_to_user(IoStatusBlock, &io_status, sizeof(io_status)))
-			status = STATUS_NO_MEMORY;
-		else
-			status = STATUS_SUCCESS; 
-	}
+	ktrace("NtWriteFileGather(%p)\n", FileHandle);
 
-cleanup:
-	deref_object((PVOID)wf);
+	status = get_segments(BufferDescription, BufferLength, &iov, &nr_segs);
+	if (!NT_SUCCESS(status))
+		return status;
 
-cleanup_nobj:
-	ktrace("*** NtWriteFile = %d\n", status);
+	status = file_read_write(FileHandle, Event, UserApcRoutine, UserApcContext,
+			UserIoStatusBlock, iov, nr_segs, BufferLength, ByteOffset, 1);
+	kfree(iov);
+
+	ktrace("*** NtWriteFileGather = %x\n", status);
 	return status;
-} /* end NtWriteFile() */
-EXPORT_SYMBOL(NtWriteFile);
+} /* end NtWriteFileGather() */
+EXPORT_SYMBOL(NtWriteFileGather);
 
 /*
  * set a file information
@@ -534,6 +945,31 @@ NtSetInformationFile(
 
 				status = STATUS_SUCCESS;
 
+				break;
+			}
+		case FileCompletionInformation:
+			{
+				FILE_COMPLETION_INFORMATION	CompInfo;
+
+				status = STATUS_INVALID_PARAMETER;
+				if (Length < sizeof(CompInfo))
+					goto cleanup;
+				/* only overlapped I/O completes to a port, and only to one */
+				if ((wf->Flags & FO_SYNCHRONOUS_IO) || wf->wf_completion)
+					goto cleanup;
+
+				status = STATUS_ACCESS_VIOLATION;
+				if (copy_from_user(&CompInfo, FileInformation, sizeof(CompInfo)))
+					goto cleanup;
+
+				wf->wf_completion = get_completion_obj(get_current_w32process(),
+						(obj_handle_t)CompInfo.CompletionPort, IO_COMPLETION_MODIFY_STATE);
+				if (!wf->wf_completion) {
+					status = get_error();
+					goto cleanup;
+				}
+				wf->wf_comp_key = CompInfo.CompletionKey;
+				status = STATUS_SUCCESS;
 				break;
 			}
 		default:
@@ -692,6 +1128,9 @@ io_delete_file(PVOID ObjectBody)
 	if (wf->wf_file)
 		fput(wf->wf_file);
 
+	if (wf->wf_completion)
+		release_object(wf->wf_completion);
+
 	if (wf->wf_control) {
 		/* unlink from the controlling object */
 		list_del(&wf->wf_ctllist);
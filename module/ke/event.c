@@ -220,11 +220,13 @@ set_event(struct kevent *Event,
 	KPRIORITY Increment,
 	BOOLEAN Wait)
 {
-	struct ethread *thread = get_current_ethread();
 	LONG prev;
 	struct kwait_block *block;
+	unsigned long flags = 0;
 
-	local_irq_disable();
+	/* with Wait the caller is signal_and_queue_wait, holding the lock already */
+	if (!Wait)
+		flags = lock_dispatcher_object(Event);
 
 	prev = Event->header.signal_state;
 
@@ -240,10 +242,8 @@ set_event(struct kevent *Event,
 		}
 	}
 
-	if (Wait == FALSE)
-		local_irq_enable();
-	else
-		thread->tcb.wait_next = TRUE;
+	if (!Wait)
+		unlock_dispatcher_object(Event, flags);
 
 	return prev;
 }
@@ -293,13 +293,14 @@ STDCALL
 reset_event(struct kevent *Event)
 {
 	LONG prev;
+	unsigned long flags;
 
-	local_irq_disable();
+	flags = lock_dispatcher_object(Event);
 
 	prev = Event->header.signal_state;
 	Event->header.signal_state = 0;
 
-	local_irq_enable();
+	unlock_dispatcher_object(Event, flags);
 
 	return prev;
 }
@@ -350,10 +351,10 @@ pulse_event(IN struct kevent *Event,
 	IN KPRIORITY Increment,
 	IN BOOLEAN Wait)
 {
-	struct ethread *thread = get_current_ethread();
 	LONG prev;
+	unsigned long flags;
 
-	local_irq_disable();
+	flags = lock_dispatcher_object(Event);
 
 	prev = Event->header.signal_state;
 
@@ -364,10 +365,7 @@ pulse_event(IN struct kevent *Event,
 
 	Event->header.signal_state = 0;
 
-	if (Wait == FALSE)
-		local_irq_enable();
-	else
-		thread->tcb.wait_next = TRUE;
+	unlock_dispatcher_object(Event, flags);
 
 	return prev;
 }
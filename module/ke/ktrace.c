@@ -0,0 +1,498 @@
+/*
+ * ktrace.c
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * ktrace.c: per-cpu trace rings
+ *
+ * Each cpu owns a ring of fixed size records.  A writer claims the next
+ * slot with local_inc_return() on its own cpu, so interrupts may nest but
+ * no lock is taken, and publishes the record by storing its sequence number
+ * last.  The reader copies every published record of every cpu, sorts them
+ * by time and formats them, naming syscalls and wine service requests
+ * through syscall[] and wine_service[].
+ *
+ * /proc/unifiedkernel/trace prints the rings, writing "clear" empties them.
+ * /proc/unifiedkernel/trace_mask lists the subsystems, writing a hex mask
+ * or names, "-name" to switch one off, "all" or "none" changes them.
+ * The mask can also be given at load time as the trace_mask parameter.
+ */
+#include <linux/moduleparam.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/sched.h>
+#include <asm/local.h>
+#include "ktrace.h"
+#include "w32syscall.h"
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+#define UK_TRACE_EVENTS	4096	/* per cpu, a power of 2 */
+#define UK_TRACE_WORDS	20	/* of vbin_printf() arguments */
+
+/* uk_trace_event->type */
+#define UK_TRACE_EV_PRINT	0
+#define UK_TRACE_EV_SYSCALL	1
+#define UK_TRACE_EV_SERVICE	2
+
+struct uk_trace_event
+{
+	unsigned long		seq;	/* slot position + 1, 0 while being written */
+	unsigned short		type;
+	unsigned short		truncated;	/* arguments did not fit */
+	pid_t			pid;
+	u64			time;	/* ns, cpu_clock() */
+	struct uk_trace_site	*site;
+	const char		*fmt;
+	int			id;	/* syscall or request number */
+	unsigned int		status;
+	u64			duration;	/* ns */
+	u32			args[UK_TRACE_WORDS];
+};
+
+struct uk_trace_ring
+{
+	local_t			head;	/* slots claimed so far */
+	unsigned long		clear;	/* head when last cleared */
+	struct uk_trace_event	events[UK_TRACE_EVENTS];
+};
+
+/* a record copied out for the reader */
+struct uk_trace_copy
+{
+	int			cpu;
+	struct uk_trace_event	event;
+};
+
+struct uk_trace_snapshot
+{
+	unsigned int		count;
+	struct uk_trace_copy	copies[0];
+};
+
+extern char *syscall[];
+extern const char *wine_service[];
+
+static const char *subsys_names[UK_TRACE_NR] =
+{
+	"ke", "io", "ob", "ps", "mm", "pub", "reg", "msg", "fs", "sock", "device",
+	"misc", "syscall", "service", "debug"
+};
+
+unsigned int uk_trace_mask;
+EXPORT_SYMBOL(uk_trace_mask);
+module_param_named(trace_mask, uk_trace_mask, uint, S_IRUGO | S_IWUSR);
+
+static struct uk_trace_ring *uk_trace_rings[NR_CPUS];
+static int uk_trace_ready;
+
+/* the subsystem of a call site is the directory of its source file */
+void uk_trace_resolve(struct uk_trace_site *site)
+{
+	const char *end = strrchr(site->file, '/'), *dir;
+	int i;
+
+	site->subsys = UK_TRACE_MISC;
+	if (!end)
+		return;
+	for (dir = end; dir > site->file && dir[-1] != '/'; dir--)
+		;
+
+	for (i = 0; i < UK_TRACE_MISC; i++)
+		if (strlen(subsys_names[i]) == end - dir
+				&& !strncmp(dir, subsys_names[i], end - dir)) {
+			site->subsys = i;
+			return;
+		}
+}
+EXPORT_SYMBOL(uk_trace_resolve);
+
+/* claim the next slot of this cpu, must be called with preemption disabled */
+static struct uk_trace_event *trace_reserve(int cpu, int type, unsigned long *pos)
+{
+	struct uk_trace_ring *ring = uk_trace_rings[cpu];
+	struct uk_trace_event *event;
+
+	*pos = local_inc_return(&ring->head) - 1;
+	event = &ring->events[*pos & (UK_TRACE_EVENTS - 1)];
+	event->seq = 0;
+	smp_wmb();
+
+	event->type = type;
+	event->truncated = 0;
+	event->pid = current->pid;
+	event->time = cpu_clock(cpu);
+	return event;
+}
+
+static inline void trace_commit(struct uk_trace_event *event, unsigned long pos)
+{
+	smp_wmb();
+	event->seq = pos + 1;
+}
+
+void uk_trace_printf(struct uk_trace_site *site, const char *fmt, ...)
+{
+	struct uk_trace_event *event;
+	unsigned long pos;
+	va_list args;
+	int cpu;
+
+	cpu = get_cpu();
+	if (!uk_trace_ready) {
+		put_cpu();
+		return;
+	}
+	event = trace_reserve(cpu, UK_TRACE_EV_PRINT, &pos);
+	event->site = site;
+	event->fmt = fmt;
+	va_start(args, fmt);
+	if (vbin_printf(event->args, UK_TRACE_WORDS, fmt, args) > UK_TRACE_WORDS)
+		event->truncated = 1;
+	va_end(args);
+	trace_commit(event, pos);
+	put_cpu();
+}
+EXPORT_SYMBOL(uk_trace_printf);
+
+void __uk_trace_syscall(int call_id)
+{
+	struct uk_trace_event *event;
+	unsigned long pos;
+	int cpu;
+
+	cpu = get_cpu();
+	if (!uk_trace_ready) {
+		put_cpu();
+		return;
+	}
+	event = trace_reserve(cpu, UK_TRACE_EV_SYSCALL, &pos);
+	event->id = call_id;
+	trace_commit(event, pos);
+	put_cpu();
+}
+EXPORT_SYMBOL(__uk_trace_syscall);
+
+void __uk_trace_service(int req, unsigned int status, ktime_t start)
+{
+	struct uk_trace_event *event;
+	unsigned long pos;
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int cpu;
+
+	cpu = get_cpu();
+	if (!uk_trace_ready) {
+		put_cpu();
+		return;
+	}
+	event = trace_reserve(cpu, UK_TRACE_EV_SERVICE, &pos);
+	event->id = req;
+	event->status = status;
+	event->duration = ns > 0 ? ns : 0;
+	trace_commit(event, pos);
+	put_cpu();
+}
+EXPORT_SYMBOL(__uk_trace_service);
+
+static int compare_copies(const void *a, const void *b)
+{
+	const struct uk_trace_copy *x = a, *y = b;
+
+	if (x->event.time != y->event.time)
+		return x->event.time < y->event.time ? -1 : 1;
+	return x->event.seq < y->event.seq ? -1 : x->event.seq > y->event.seq;
+}
+
+/* copy the published records of every cpu, oldest first */
+static struct uk_trace_snapshot *take_snapshot(void)
+{
+	struct uk_trace_snapshot *snap;
+	struct uk_trace_ring *ring;
+	struct uk_trace_copy *copy;
+	unsigned long head, pos, seq;
+	int cpu, ncpus = 0;
+
+	for_each_possible_cpu(cpu)
+		ncpus++;
+	snap = vmalloc(sizeof(*snap) + ncpus * UK_TRACE_EVENTS * sizeof(struct uk_trace_copy));
+	if (!snap)
+		return NULL;
+	snap->count = 0;
+
+	for_each_possible_cpu(cpu) {
+		ring = uk_trace_rings[cpu];
+		head = local_read(&ring->head);
+		pos = head > UK_TRACE_EVENTS ? head - UK_TRACE_EVENTS : 0;
+		if (pos < ring->clear)
+			pos = ring->clear;
+
+		for (; pos != head; pos++) {
+			copy = &snap->copies[snap->count];
+			seq = ring->events[pos & (UK_TRACE_EVENTS - 1)].seq;
+			smp_rmb();
+			copy->event = ring->events[pos & (UK_TRACE_EVENTS - 1)];
+			smp_rmb();
+			/* skip slots being written or already reused */
+			if (seq != pos + 1 || ring->events[pos & (UK_TRACE_EVENTS - 1)].seq != seq)
+				continue;
+			copy->cpu = cpu;
+			snap->count++;
+		}
+	}
+
+	sort(snap->copies, snap->count, sizeof(struct uk_trace_copy), compare_copies, NULL);
+	return snap;
+}
+
+static void *trace_start(struct seq_file *m, loff_t *pos)
+{
+	struct uk_trace_snapshot *snap = m->private;
+
+	return *pos < snap->count ? &snap->copies[*pos] : NULL;
+}
+
+static void *trace_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return trace_start(m, pos);
+}
+
+static void trace_stop(struct seq_file *m, void *v)
+{
+}
+
+static int trace_show(struct seq_file *m, void *v)
+{
+	struct uk_trace_copy *copy = v;
+	struct uk_trace_event *event = &copy->event;
+	unsigned long long sec = event->time;
+	unsigned long nsec = do_div(sec, NSEC_PER_SEC);
+	char buf[256];
+	int len;
+
+	seq_printf(m, "%5llu.%06lu %3d %5d ", sec, nsec / 1000, copy->cpu, event->pid);
+
+	switch (event->type) {
+		case UK_TRACE_EV_SYSCALL:
+			seq_printf(m, "%-7s %s\n", subsys_names[UK_TRACE_SYSCALL],
+					event->id >= 0 && event->id < NUMBER_OF_SYSCALLS
+					? syscall[event->id] : "?");
+			break;
+		case UK_TRACE_EV_SERVICE:
+			seq_printf(m, "%-7s %s status %08x %llu ns\n", subsys_names[UK_TRACE_SERVICE],
+					event->id >= 0 && event->id < REQ_NB_REQUESTS && wine_service[event->id]
+					? wine_service[event->id] : "req_unknown",
+					event->status, event->duration);
+			break;
+		default:
+			if (event->truncated)
+				len = snprintf(buf, sizeof(buf), "(arguments lost) %s", event->fmt);
+			else
+				len = bstr_printf(buf, sizeof(buf), event->fmt, event->args);
+			if (len >= sizeof(buf))
+				len = sizeof(buf) - 1;
+			while (len && buf[len - 1] == '\n')
+				buf[--len] = 0;
+			seq_printf(m, "%-7s %s: %s\n", event->site->debug
+					? subsys_names[UK_TRACE_DEBUG] : subsys_names[event->site->subsys],
+					event->site->func, buf);
+			break;
+	}
+	return 0;
+}
+
+static const struct seq_operations trace_seq_ops = {
+	.start	= trace_start,
+	.next	= trace_next,
+	.stop	= trace_stop,
+	.show	= trace_show,
+};
+
+static int trace_open(struct inode *inode, struct file *file)
+{
+	struct uk_trace_snapshot *snap;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return 0;
+
+	if (!(snap = take_snapshot()))
+		return -ENOMEM;
+	if ((ret = seq_open(file, &trace_seq_ops))) {
+		vfree(snap);
+		return ret;
+	}
+	((struct seq_file *)file->private_data)->private = snap;
+	return 0;
+}
+
+static int trace_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	if (!m)
+		return 0;
+	vfree(m->private);
+	return seq_release(inode, file);
+}
+
+static ssize_t trace_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	char cmd[8];
+	int cpu;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = 0;
+
+	if (strncmp(cmd, "clear", 5))
+		return -EINVAL;
+	for_each_possible_cpu(cpu)
+		uk_trace_rings[cpu]->clear = local_read(&uk_trace_rings[cpu]->head);
+	return count;
+}
+
+static const struct file_operations trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= trace_open,
+	.read		= seq_read,
+	.write		= trace_write,
+	.llseek		= seq_lseek,
+	.release	= trace_release,
+};
+
+static int trace_mask_show(struct seq_file *m, void *v)
+{
+	int i;
+
+	seq_printf(m, "mask %04x\n", uk_trace_mask);
+	for (i = 0; i < UK_TRACE_NR; i++)
+		seq_printf(m, "%-8s %s\n", subsys_names[i], uk_trace_mask & (1 << i) ? "on" : "off");
+	return 0;
+}
+
+static int trace_mask_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, trace_mask_show, NULL);
+}
+
+static ssize_t trace_mask_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	char cmd[128], *p, *word;
+	unsigned int mask = uk_trace_mask;
+	int i, off;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = 0;
+
+	p = cmd;
+	while ((word = strsep(&p, " \t\n,"))) {
+		if (!*word)
+			continue;
+		if (!strcmp(word, "all"))
+			mask = (1 << UK_TRACE_NR) - 1;
+		else if (!strcmp(word, "none"))
+			mask = 0;
+		else if (word[0] >= '0' && word[0] <= '9')
+			mask = simple_strtoul(word, NULL, 16);
+		else {
+			off = word[0] == '-';
+			for (i = 0; i < UK_TRACE_NR; i++)
+				if (!strcmp(word + off, subsys_names[i]))
+					break;
+			if (i == UK_TRACE_NR)
+				return -EINVAL;
+			if (off)
+				mask &= ~(1 << i);
+			else
+				mask |= 1 << i;
+		}
+	}
+
+	uk_trace_mask = mask;
+	return count;
+}
+
+static const struct file_operations trace_mask_fops = {
+	.owner		= THIS_MODULE,
+	.open		= trace_mask_open,
+	.read		= seq_read,
+	.write		= trace_mask_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void free_rings(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (uk_trace_rings[cpu])
+			vfree(uk_trace_rings[cpu]);
+		uk_trace_rings[cpu] = NULL;
+	}
+}
+
+int uk_trace_init(struct proc_dir_entry *parent)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!(uk_trace_rings[cpu] = vmalloc(sizeof(struct uk_trace_ring))))
+			goto out_free_rings;
+		memset(uk_trace_rings[cpu], 0, sizeof(struct uk_trace_ring));
+	}
+
+	if (!proc_create("trace", S_IRUSR | S_IWUSR, parent, &trace_fops))
+		goto out_free_rings;
+	if (!proc_create("trace_mask", S_IRUSR | S_IWUSR, parent, &trace_mask_fops))
+		goto out_remove_trace;
+
+	uk_trace_ready = 1;
+	return 0;
+
+out_remove_trace:
+	remove_proc_entry("trace", parent);
+out_free_rings:
+	free_rings();
+	return -ENOMEM;
+}
+
+void uk_trace_exit(struct proc_dir_entry *parent)
+{
+	if (!uk_trace_ready)
+		return;
+
+	uk_trace_ready = 0;
+	/* let writers that saw uk_trace_ready leave their rings */
+	synchronize_sched();
+
+	remove_proc_entry("trace_mask", parent);
+	remove_proc_entry("trace", parent);
+	free_rings();
+}
+#endif /* CONFIG_UNIFIED_KERNEL */
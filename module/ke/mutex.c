@@ -77,9 +77,9 @@ mutant_init(IN struct kmutant* Mutant,
 
 		thread = get_current_ethread(); 
 
-		local_irq_disable();
+		spin_lock_irq(&thread->tcb.mutant_list_lock);
 		list_add_tail(&Mutant->mutant_list_entry, &thread->tcb.mutant_list_head);
-		local_irq_enable();
+		spin_unlock_irq(&thread->tcb.mutant_list_lock);
 	}
 
 	INIT_DISP_HEADER(&Mutant->header,
@@ -236,9 +236,13 @@ release_mutant(IN struct kmutant *Mutant,
 	IN BOOLEAN Wait)
 {
 	struct ethread *thread = get_current_ethread();
+	struct kthread *owner;
 	LONG prev;
+	unsigned long flags = 0;
 
-	local_irq_disable();
+	/* with Wait the caller is signal_and_queue_wait, holding the lock already */
+	if (!Wait)
+		flags = lock_dispatcher_object(Mutant);
 	prev = Mutant->header.signal_state;
 
 	if (Abandon == FALSE)
@@ -250,7 +254,10 @@ release_mutant(IN struct kmutant *Mutant,
 
 	if (Mutant->header.signal_state == 1) {
 		if (prev <= 0) {
+			owner = Mutant->owner_thread ? Mutant->owner_thread : &thread->tcb;
+			spin_lock(&owner->mutant_list_lock);
 			list_del(&Mutant->mutant_list_entry);
+			spin_unlock(&owner->mutant_list_lock);
 
 			thread->tcb.kernel_apc_disable += Mutant->apc_disable;
 		}
@@ -261,10 +268,8 @@ release_mutant(IN struct kmutant *Mutant,
 			wait_test(&Mutant->header, Increment);
 	}
 
-	if (Wait == FALSE)
-		local_irq_enable();
-	else
-		thread->tcb.wait_next = TRUE;
+	if (!Wait)
+		unlock_dispatcher_object(Mutant, flags);
 
 	return prev;
 }
@@ -26,6 +26,8 @@
  */
 #include <linux/proc_fs.h>
 #include "process.h"
+#include "stats.h"
+#include "ktrace.h"
 
 #if defined(CONFIG_EXPRESS_IPC) || defined(CONFIG_UNIFIED_KERNEL)
 
@@ -165,6 +167,8 @@ extern char builtin_dll_path[MAX_PATH];
 /* built-in so path */
 
 extern size_t print_dosdriver(char *buf);
+extern int large_page_proc_init(struct proc_dir_entry *parent);
+extern void large_page_proc_exit(struct proc_dir_entry *parent);
 extern int parse_dosdriver(char *buf, size_t count, int append);
 
 static int dosdriver_read_proc(char *page, char **start,
@@ -238,11 +242,8 @@ out:
 }
 /* built-in so path */
 
-extern const struct file_operations dummy_fops;
-
 int proc_uk_init(void)
 {
-	struct proc_dir_entry	*dummyfile_entry;
 	struct proc_dir_entry	*dosdriver_entry;
 	/* built-in so path */
 	struct proc_dir_entry	*builtin_dll_entry;
@@ -274,12 +275,12 @@ int proc_uk_init(void)
 	builtin_dll_entry->write_proc = builtin_dll_write_proc;
 	/* built-in so path */
 
-	dummyfile_entry = create_proc_entry("dummy", S_IRUSR | S_IWUSR, proc_uk_io);
-	if (!dummyfile_entry) {
-		remove_proc_entry("dummy", proc_uk_io);
-		goto out_free_dosdriver;
-	}
-	dummyfile_entry->proc_fops = &dummy_fops;
+	/* statistics and tracing are optional, the module works without them */
+	if (uk_stats_init(proc_uk))
+		printk(KERN_WARNING "unifiedkernel: no memory for syscall statistics\n");
+	if (uk_trace_init(proc_uk))
+		printk(KERN_WARNING "unifiedkernel: no memory for tracing\n");
+	large_page_proc_init(proc_uk_mm);
 	return 0;
 
 out_free_dosdriver:
@@ -298,14 +299,17 @@ void proc_uk_exit(void)
 {
 	if (proc_uk_io) {
 		remove_proc_entry("dosdriver", proc_uk_io);
-		remove_proc_entry("dummy", proc_uk_io);
 		remove_proc_entry("unifiedkernel/io", NULL);
 	}
 
-	if (proc_uk_mm)
+	if (proc_uk_mm) {
+		large_page_proc_exit(proc_uk_mm);
 		remove_proc_entry("unifiedkernel/mm", NULL);
+	}
 
 	if (proc_uk) {
+		uk_stats_exit(proc_uk);
+		uk_trace_exit(proc_uk);
 		/* built-in so path */
 		remove_proc_entry("builtin_dll", proc_uk);
 		/* built-in so path */
@@ -0,0 +1,199 @@
+/*
+ * reqring.c
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * reqring.c: per-thread shared request ring for wine service
+ *
+ * ntdll registers one page of its own memory, the page is pinned so that
+ * requests can be read and replies written without copy_from_user/copy_to_user
+ * of the request structures. It is only mapped with kmap_atomic around each
+ * access, as handlers may sleep and a mapping per thread would use up the
+ * pkmap slots.
+ * Entries flagged UK_RING_NOREPLY are never waited for by ntdll, they are
+ * drained the next time the thread enters the module for a wine service
+ * or a wait, so requests keep their submission order.
+ */
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include "w32syscall.h"
+#include "wineserver/lib.h"
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+extern NTSTATUS call_req_handler(struct w32thread *thread);
+
+/* unpin the ring, also called from cleanup_thread */
+void free_request_ring(struct w32thread *thread)
+{
+	if (!thread->req_ring_page)
+		return;
+
+	set_page_dirty_lock(thread->req_ring_page);
+	put_page(thread->req_ring_page);
+	kfree(thread->req_ring_data);
+
+	thread->req_ring_page = NULL;
+	thread->req_ring_data = NULL;
+}
+
+static inline struct uk_request_ring *map_request_ring(struct w32thread *thread)
+{
+	return (struct uk_request_ring *)kmap_atomic(thread->req_ring_page, KM_USER0);
+}
+
+static inline void unmap_request_ring(struct uk_request_ring *ring)
+{
+	kunmap_atomic(ring, KM_USER0);
+}
+
+static void process_ring_entry(struct w32thread *thread, unsigned int index)
+{
+	struct uk_request_ring *ring;
+	struct uk_ring_entry *entry;
+	unsigned int flags;
+	void __user *reply_data;
+	data_size_t size;
+
+	ring = map_request_ring(thread);
+	entry = &ring->entries[index];
+	flags = entry->flags;
+	reply_data = entry->reply_data;
+	memcpy(&thread->req, &entry->u.req, sizeof(thread->req));
+	size = thread->req.request_header.request_size;
+	/* take a private copy, other threads of the process can write the page */
+	if (size && size <= UK_RING_DATA_SIZE)
+		memcpy(thread->req_ring_data, entry->data, size);
+	unmap_request_ring(ring);
+
+	if (size > UK_RING_DATA_SIZE) {
+		memset(&thread->reply, 0, sizeof(thread->reply));
+		thread->reply.reply_header.error = STATUS_INVALID_PARAMETER;
+		thread->reply_size = 0;
+	} else {
+		thread->req_data = size ? thread->req_ring_data : NULL;
+		call_req_handler(thread);
+		thread->req_data = NULL;
+	}
+
+	if (!(flags & UK_RING_NOREPLY) && thread->reply_size) {
+		if (!reply_data || copy_to_user(reply_data, thread->reply_data, thread->reply_size))
+			thread->reply.reply_header.error = STATUS_ACCESS_VIOLATION;
+	}
+
+	ring = map_request_ring(thread);
+	entry = &ring->entries[index];
+	if (!(flags & UK_RING_NOREPLY))
+		memcpy(&entry->u.reply, &thread->reply, sizeof(thread->reply));
+	smp_wmb();
+	entry->flags = flags | UK_RING_DONE;
+	unmap_request_ring(ring);
+}
+
+/*
+ * consume every entry submitted so far, at most one ring worth
+ * a flush started from within a handler leaves the ring to the outer one
+ */
+void flush_request_ring(struct w32thread *thread)
+{
+	struct uk_request_ring *ring;
+	unsigned int head, tail, n;
+
+	if (!thread->req_ring_page || thread->req_ring_busy)
+		return;
+	thread->req_ring_busy = 1;
+
+	ring = map_request_ring(thread);
+	head = ring->head;
+	tail = ring->tail;
+	unmap_request_ring(ring);
+	smp_rmb();
+
+	for (n = 0; tail != head && n < UK_RING_ENTRIES; n++, tail++)
+		process_ring_entry(thread, tail % UK_RING_ENTRIES);
+
+	ring = map_request_ring(thread);
+	smp_wmb();
+	ring->tail = tail;
+	unmap_request_ring(ring);
+
+	thread->req_ring_busy = 0;
+}
+
+/* 234 */
+NTSTATUS SERVICECALL
+NtRegisterWineServiceRing(IN PVOID Ring)
+{
+	struct w32thread *thread = (PTSB)get_current_w32thread();
+	unsigned long addr = (unsigned long)Ring;
+	struct uk_request_ring *ring;
+	struct page *page;
+	void *data;
+	int ret;
+
+	ktrace("Ring %p\n", Ring);
+	if (!thread)
+		return STATUS_UNSUCCESSFUL;
+
+	/* drain whatever the old ring still holds before switching */
+	flush_request_ring(thread);
+	free_request_ring(thread);
+
+	if (!Ring)
+		return STATUS_SUCCESS;
+
+	if ((addr & ~PAGE_MASK) || addr >= TASK_SIZE)
+		return STATUS_INVALID_PARAMETER;
+
+	if (!(data = kmalloc(UK_RING_DATA_SIZE, GFP_KERNEL)))
+		return STATUS_NO_MEMORY;
+
+	down_read(&current->mm->mmap_sem);
+	ret = get_user_pages(current, current->mm, addr, 1, 1, 0, &page, NULL);
+	up_read(&current->mm->mmap_sem);
+	if (ret != 1) {
+		kfree(data);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	thread->req_ring_page = page;
+	thread->req_ring_data = data;
+	ring = map_request_ring(thread);
+	ring->tail = ring->head;
+	unmap_request_ring(ring);
+
+	return STATUS_SUCCESS;
+}
+EXPORT_SYMBOL(NtRegisterWineServiceRing);
+
+NTSTATUS SERVICECALL
+NtSubmitWineServiceRing(VOID)
+{
+	struct w32thread *thread = (PTSB)get_current_w32thread();
+
+	if (!thread || !thread->req_ring_page)
+		return STATUS_INVALID_PARAMETER;
+
+	flush_request_ring(thread);
+	return STATUS_SUCCESS;
+}
+EXPORT_SYMBOL(NtSubmitWineServiceRing);
+#endif /* CONFIG_UNIFIED_KERNEL */
@@ -225,10 +225,12 @@ release_semaphore(struct ksemaphore *Semaphore,
 		LONG Adjustment,
 		BOOLEAN Wait)
 {
-	struct ethread *thread = get_current_ethread();
 	LONG old;
+	unsigned long flags = 0;
 
-	local_irq_disable();
+	/* with Wait the caller is signal_and_queue_wait, holding the lock already */
+	if (!Wait)
+		flags = lock_dispatcher_object(Semaphore);
 
 	old = Semaphore->header.signal_state;
 	Semaphore->header.signal_state = old + Adjustment;
@@ -240,10 +242,8 @@ release_semaphore(struct ksemaphore *Semaphore,
 	if (old == 0 && !list_empty(&Semaphore->header.wait_list_head))
 		wait_test(&Semaphore->header, Increment);
 
-	if (Wait == FALSE)
-		local_irq_enable();
-	else
-		thread->tcb.wait_next = TRUE;
+	if (!Wait)
+		unlock_dispatcher_object(Semaphore, flags);
 	
 	/* FIXME: shouldn't return a NTSTATUS here */
 	if (old + Adjustment > Semaphore->limit || Adjustment <= 0) return STATUS_SEMAPHORE_LIMIT_EXCEEDED;
@@ -0,0 +1,243 @@
+/*
+ * stats.c
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * stats.c: per-cpu call counters and log2 latency histograms for every
+ * win32 syscall and every wine service request
+ *
+ * /proc/unifiedkernel/stats prints the counters summed over all cpus,
+ * writing "reset" clears them, "on" and "off" switch the accounting,
+ * which is off by default.
+ * The counters of a cpu are too big for alloc_percpu, so like the trace
+ * rings they are vmalloc'ed per possible cpu.
+ */
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+#include "stats.h"
+#include "thread.h"
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+extern char *syscall[];
+extern const char *wine_service[];
+
+int uk_stats_enabled = 0;
+
+static struct uk_stats *uk_stats[NR_CPUS];
+static int uk_stats_ready;
+
+static inline void account(struct uk_stat *stat, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int bucket;
+
+	if (ns < 0)
+		ns = 0;
+	bucket = fls64(ns);
+	if (bucket >= UK_STAT_BUCKETS)
+		bucket = UK_STAT_BUCKETS - 1;
+
+	stat->count++;
+	stat->total_ns += ns;
+	stat->hist[bucket]++;
+}
+
+void uk_stats_syscall_enter(int call_id)
+{
+	struct ethread *thread = get_current_ethread();
+
+	if (!thread)
+		return;
+	if (!uk_stats_ready || !uk_stats_enabled || call_id < 0 || call_id >= NUMBER_OF_SYSCALLS) {
+		thread->et_syscall = -1;
+		return;
+	}
+
+	thread->et_syscall = call_id;
+	thread->et_syscall_start = ktime_get();
+}
+
+void uk_stats_syscall_leave(void)
+{
+	struct ethread *thread = get_current_ethread();
+	int cpu;
+
+	if (!thread || thread->et_syscall < 0)
+		return;
+
+	/* uk_stats_exit waits for us with synchronize_sched */
+	cpu = get_cpu();
+	if (uk_stats_ready)
+		account(&uk_stats[cpu]->syscall[thread->et_syscall], thread->et_syscall_start);
+	put_cpu();
+	thread->et_syscall = -1;
+}
+
+void uk_stats_account_request(int req, ktime_t start)
+{
+	int cpu;
+
+	if (req < 0 || req >= REQ_NB_REQUESTS)
+		return;
+
+	cpu = get_cpu();
+	if (uk_stats_ready)
+		account(&uk_stats[cpu]->request[req], start);
+	put_cpu();
+}
+
+static void sum_stat(struct uk_stat *sum, int is_syscall, int index)
+{
+	struct uk_stat *stat;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct uk_stats *stats = uk_stats[cpu];
+
+		stat = is_syscall ? &stats->syscall[index] : &stats->request[index];
+		sum->count += stat->count;
+		sum->total_ns += stat->total_ns;
+		for (i = 0; i < UK_STAT_BUCKETS; i++)
+			sum->hist[i] += stat->hist[i];
+	}
+}
+
+static void show_stat(struct seq_file *m, const char *name, struct uk_stat *sum)
+{
+	int i;
+
+	seq_printf(m, "%-40s %10lu %14llu %10llu ", name, sum->count,
+			div_u64(sum->total_ns, 1000), div_u64(sum->total_ns, sum->count));
+	for (i = 0; i < UK_STAT_BUCKETS; i++)
+		if (sum->hist[i])
+			seq_printf(m, " %d:%lu", i, sum->hist[i]);
+	seq_putc(m, '\n');
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct uk_stat sum;
+	int i;
+
+	seq_printf(m, "accounting %s\n", uk_stats_enabled ? "on" : "off");
+	seq_printf(m, "%-40s %10s %14s %10s  log2(ns):calls\n", "name", "calls", "total_us", "avg_ns");
+
+	for (i = 0; i < NUMBER_OF_SYSCALLS; i++) {
+		sum_stat(&sum, 1, i);
+		if (sum.count)
+			show_stat(m, syscall[i], &sum);
+	}
+
+	for (i = 0; i < REQ_NB_REQUESTS; i++) {
+		sum_stat(&sum, 0, i);
+		if (sum.count)
+			show_stat(m, wine_service[i] ? wine_service[i] : "req_unknown", &sum);
+	}
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, NULL);
+}
+
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	char cmd[8];
+	int cpu;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = 0;
+
+	if (!strncmp(cmd, "reset", 5)) {
+		for_each_possible_cpu(cpu)
+			memset(uk_stats[cpu], 0, sizeof(struct uk_stats));
+	} else if (!strncmp(cmd, "on", 2))
+		uk_stats_enabled = 1;
+	else if (!strncmp(cmd, "off", 3))
+		uk_stats_enabled = 0;
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+static const struct file_operations stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= stats_open,
+	.read		= seq_read,
+	.write		= stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void free_stats(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (uk_stats[cpu])
+			vfree(uk_stats[cpu]);
+		uk_stats[cpu] = NULL;
+	}
+}
+
+int uk_stats_init(struct proc_dir_entry *parent)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!(uk_stats[cpu] = vmalloc(sizeof(struct uk_stats))))
+			goto out_free_stats;
+		memset(uk_stats[cpu], 0, sizeof(struct uk_stats));
+	}
+
+	if (!proc_create("stats", S_IRUSR | S_IWUSR, parent, &stats_fops))
+		goto out_free_stats;
+
+	uk_stats_ready = 1;
+	return 0;
+
+out_free_stats:
+	free_stats();
+	return -ENOMEM;
+}
+
+void uk_stats_exit(struct proc_dir_entry *parent)
+{
+	if (!uk_stats_ready)
+		return;
+
+	uk_stats_ready = 0;
+	/* let callers that saw uk_stats_ready leave their counters */
+	synchronize_sched();
+
+	remove_proc_entry("stats", parent);
+	free_stats();
+}
+#endif /* CONFIG_UNIFIED_KERNEL */
@@ -27,9 +27,12 @@
 #include <linux/mm.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/dcache.h>
+#include <linux/mutex.h>
 #include <asm/mman.h>
 #include "attach.h"
 #include "virtual.h"
+#include "section.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
@@ -81,6 +84,36 @@ static unsigned long ntdll_start_thunk;
 static unsigned long exeso_start_thunk;
 #endif
 
+/*
+ * the entry points looked up in ntdll.dll.so, resolved in one pass over its
+ * dynamic symbols and only again when another version of it is mapped
+ */
+static struct ntdll_symbol {
+	const char	*name;
+	unsigned long	*addr;
+	unsigned int	hash;
+} ntdll_symbols[] = {
+	/* LdrInitializeThunk is used to load dll for PE exe file */
+	{ "LdrInitializeThunk", &ntdll_entry },
+	/* when interpreter done, jump to StartThunk */
+	{ "StartThunk", &start_thunk },
+	/* KiUserApcDispatcher is APC Dispatcher */
+	{ "KiUserApcDispatcher", &apc_dispatcher },
+	/* a forward function , will call BaseProcessStart in kernel32.dll.so */
+	{ "ProcessStartForward", &pe_entry },
+	{ "start_thread", &thread_entry },
+#ifdef EXE_SO
+	{ "ntdll_start_thunk", &ntdll_start_thunk },
+	{ "exeso_start_thunk", &exeso_start_thunk },
+#endif
+};
+
+#define NTDLL_SYMBOLS	(sizeof(ntdll_symbols) / sizeof(ntdll_symbols[0]))
+
+static struct file_stamp ntdll_stamp;
+static int ntdll_resolved;
+static DEFINE_MUTEX(ntdll_mutex);
+
 static int padzero(struct task_struct *tsk, unsigned long bss)
 {
 	int ret = 0;
@@ -267,18 +300,18 @@ out:
 	return error;
 } /* end load_elf_interp */
 
-unsigned long uk_find_symbol(struct elf_shdr *elf_shdata, int shnum, char *sym)
+/* find the dynamic symbol table and its string table */
+static int get_dynsym(struct elf_shdr *elf_shdata, int shnum, struct elf_sym **sym_tab,
+		char **str_tab, int *str_tab_size)
 {
 	int		link = -1;
-	int		str_tab_size = 0;
-	char	*str_tab = NULL;
 	struct elf_shdr	*elf_spnt;
-	struct elf_sym	*sympnt, *sym_tab = NULL;
-	unsigned long	sym_addr = -EINVAL;
 
+	*sym_tab = NULL;
+	*str_tab = NULL;
 	for (elf_spnt = elf_shdata; elf_spnt < elf_shdata + shnum; elf_spnt++) {
 		if (elf_spnt->sh_type == SHT_DYNSYM) {
-			sym_tab = (struct elf_sym *)(elf_spnt->sh_addr);
+			*sym_tab = (struct elf_sym *)(elf_spnt->sh_addr);
 			link = elf_spnt->sh_link;
 			sym_count = elf_spnt->sh_size / sizeof(struct elf_sym);
 		}
@@ -289,9 +322,21 @@ unsigned long uk_find_symbol(struct elf_shdr *elf_shdata, int shnum, char *sym)
 		if (elf_spnt->sh_type != SHT_STRTAB)
 			return -ENOEXEC;
 
-		str_tab = (char *)(elf_spnt->sh_addr);
-		str_tab_size = elf_spnt->sh_size;
+		*str_tab = (char *)(elf_spnt->sh_addr);
+		*str_tab_size = elf_spnt->sh_size;
 	}
+	return 0;
+} /* end get_dynsym */
+
+unsigned long uk_find_symbol(struct elf_shdr *elf_shdata, int shnum, char *sym)
+{
+	int		str_tab_size = 0;
+	char	*str_tab;
+	struct elf_sym	*sympnt, *sym_tab;
+	unsigned long	sym_addr = -EINVAL;
+
+	if (get_dynsym(elf_shdata, shnum, &sym_tab, &str_tab, &str_tab_size))
+		return -ENOEXEC;
 
 	if (sym_tab && str_tab) {
 		for (sympnt = sym_tab; sympnt < sym_tab + sym_count; sympnt++) {
@@ -308,6 +353,72 @@ unsigned long uk_find_symbol(struct elf_shdr *elf_shdata, int shnum, char *sym)
 } /* end uk_find_symbol */
 EXPORT_SYMBOL(uk_find_symbol);
 
+/* look up all of ntdll_symbols, comparing the names only when the hashes match */
+static void resolve_ntdll_symbols(struct elf_shdr *elf_shdata, int shnum)
+{
+	int		i, left, str_tab_size = 0;
+	char	*str_tab, *name;
+	struct elf_sym	*sympnt, *sym_tab;
+	unsigned int	hash;
+
+	for (i = 0; i < NTDLL_SYMBOLS; i++) {
+		*ntdll_symbols[i].addr = -EINVAL;
+		if (!ntdll_symbols[i].hash)
+			ntdll_symbols[i].hash = full_name_hash(ntdll_symbols[i].name,
+					strlen(ntdll_symbols[i].name));
+	}
+
+	if (get_dynsym(elf_shdata, shnum, &sym_tab, &str_tab, &str_tab_size)) {
+		for (i = 0; i < NTDLL_SYMBOLS; i++)
+			*ntdll_symbols[i].addr = -ENOEXEC;
+		return;
+	}
+	if (!sym_tab || !str_tab)
+		return;
+
+	left = NTDLL_SYMBOLS;
+	for (sympnt = sym_tab; sympnt < sym_tab + sym_count && left; sympnt++) {
+		if (sympnt->st_name > str_tab_size)
+			break;
+		name = sympnt->st_name + str_tab;
+		hash = full_name_hash(name, strlen(name));
+		for (i = 0; i < NTDLL_SYMBOLS; i++) {
+			if (ntdll_symbols[i].hash == hash && *ntdll_symbols[i].addr == -EINVAL
+					&& !strcmp(name, ntdll_symbols[i].name)) {
+				*ntdll_symbols[i].addr = sympnt->st_value;
+				left--;
+				break;
+			}
+		}
+	}
+} /* end resolve_ntdll_symbols */
+
+static int read_ntdll_symbols(struct file *ntdll, struct elfhdr *ntdll_elf_ex)
+{
+	int elf_shnum;
+	int elf_shsize;
+	int retval;
+	struct elf_shdr *elf_shdata = NULL;
+
+	/* section header is not mapped to memory, need read it */
+	/* load section header list for ntdll */
+	elf_shnum = ntdll_elf_ex->e_shnum;
+	elf_shsize = elf_shnum * ntdll_elf_ex->e_shentsize;
+	elf_shdata = (struct elf_shdr *)kmalloc(elf_shsize, GFP_KERNEL);
+	if (!elf_shdata)
+		return -ENOMEM;
+
+	retval = kernel_read(ntdll, ntdll_elf_ex->e_shoff, (void *)elf_shdata, elf_shsize);
+	if (retval != elf_shsize) {
+		kfree(elf_shdata);
+		return retval >= 0 ? -EIO : retval;
+	}
+
+	resolve_ntdll_symbols(elf_shdata, elf_shnum);
+	kfree(elf_shdata);
+	return 0;
+} /* end read_ntdll_symbols */
+
 unsigned long get_ntdll_entry(void)
 {
 	return ntdll_entry;
@@ -386,43 +497,19 @@ LONG STDCALL map_system_dll(struct task_struct *tsk, char *name,
 	load_elf_interp(tsk, &ntdll_elf_ex, ntdll, ntdll_load_addr, ld_name);
 
 	if (tsk == current) {
-		int elf_shnum;
-		int elf_shsize;
-		struct elf_shdr *elf_shdata = NULL;
-
-		/* section header is not mapped to memory, need read it */
-		/* load section header list for ntdll */
-		elf_shnum = ntdll_elf_ex.e_shnum;
-		elf_shsize = elf_shnum * ntdll_elf_ex.e_shentsize;
-		elf_shdata = (struct elf_shdr *)kmalloc(elf_shsize, GFP_KERNEL);
-		if (!elf_shdata) {
-			retval = -ENOMEM;
-			goto out_free_ntdll;
+		struct file_stamp stamp;
+
+		get_file_stamp(ntdll, &stamp);
+		retval = 0;
+		mutex_lock(&ntdll_mutex);
+		if (!ntdll_resolved || !file_stamp_equal(&stamp, &ntdll_stamp)) {
+			retval = read_ntdll_symbols(ntdll, &ntdll_elf_ex);
+			ntdll_stamp = stamp;
+			ntdll_resolved = !retval;
 		}
-
-		retval = kernel_read(ntdll, ntdll_elf_ex.e_shoff, (void *)elf_shdata, elf_shsize);
-		if (retval != elf_shsize) {
-			if (retval >= 0)
-				retval = -EIO;
-			kfree(elf_shdata);
+		mutex_unlock(&ntdll_mutex);
+		if (retval)
 			goto out_free_ntdll;
-		}
-
-		/* LdrInitializeThunk is used to load dll for PE exe file */
-		ntdll_entry = uk_find_symbol(elf_shdata, elf_shnum, "LdrInitializeThunk");
-		/* when interpreter done, jump to StartThunk */
-		start_thunk = uk_find_symbol(elf_shdata, elf_shnum, "StartThunk");
-		/* KiUserApcDispatcher is APC Dispatcher */
-		apc_dispatcher = uk_find_symbol(elf_shdata, elf_shnum, "KiUserApcDispatcher");
-		/* a forward function , will call BaseProcessStart in kernel32.dll.so */
-		pe_entry = uk_find_symbol(elf_shdata, elf_shnum, "ProcessStartForward");
-		thread_entry = uk_find_symbol(elf_shdata, elf_shnum, "start_thread");
-#ifdef EXE_SO
-		ntdll_start_thunk = uk_find_symbol(elf_shdata, elf_shnum, "ntdll_start_thunk");
-		exeso_start_thunk = uk_find_symbol(elf_shdata, elf_shnum, "exeso_start_thunk");
-#endif
-
-		kfree(elf_shdata);
 	}
 
 	allow_write_access(ntdll);
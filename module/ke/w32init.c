@@ -30,9 +30,6 @@
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
-void open_dummy_file(void);
-void close_dummy_file(void);
-
 char *rootdir;
 
 extern timeout_t start_time;
@@ -44,6 +41,7 @@ int restore_idt_entry(unsigned int n, unsigned long a, unsigned long b);
 unsigned long orig_idt_2e_a, orig_idt_2e_b;
 int init_pe_binfmt(void);
 void exit_pe_binfmt(void);
+void exit_image_cache(void);
 #ifdef EXE_SO
 int init_exeso_binfmt(void);
 void exit_exeso_binfmt(void);
@@ -91,7 +89,10 @@ extern void init_hook_table_implement(void);
 extern void init_atom_table_implement(void);
 extern void init_async_implement(void);
 extern void init_async_queue_implement(void);
-extern void init_completion_implement(void);
+extern int init_completion_implement(void);
+extern void exit_completion_implement(void);
+extern void init_file_io(void);
+extern void exit_file_io(void);
 extern void init_w32thread_implement(void);
 extern void init_w32process_implement(void);
 extern void init_startup_info_implement(void);
@@ -119,34 +120,24 @@ extern void init_serial_implement(void);
 extern void init_snapshot_implement(void);
 extern void init_timer_implement(void);
 
+extern void init_timeouts(void);
+extern void exit_timeouts(void);
+extern void run_expired_timeouts(void);
+extern void wait_for_timeouts(void);
+
 extern int kthread_should_stop(void);
 extern struct task_struct* kthread_create(int (*fn)(void* data),void* data,
 		const char namefmt[],...);
 
 void timer_loop(void)
 {
-	unsigned int msecs, timeout, next;
-	msecs = 10000;
-	timeout = msecs_to_jiffies(msecs) + 1;
-	while (1) {
-		next = get_next_timeout();
-		if (kthread_should_stop()) {
-			return;
-		}
-
-		local_irq_enable();
-		set_current_state(TASK_INTERRUPTIBLE);
-		if (next == -1)
-			schedule_timeout(timeout);
-		else {
-			next = msecs_to_jiffies(next) + 1;
-			schedule_timeout(next);
-		}
-		local_irq_disable();
+	while (!kthread_should_stop()) {
+		run_expired_timeouts();
+		wait_for_timeouts();
 	}
 }
 
-void init_wineobj_implement(void)
+int init_wineobj_implement(void)
 {
 	ktrace("\n");
 
@@ -159,7 +150,8 @@ void init_wineobj_implement(void)
 	init_atom_table_implement();
 	init_async_implement();
 	init_async_queue_implement();
-	init_completion_implement();
+	if (init_completion_implement())
+		return -ENOMEM;
 	init_w32thread_implement();
 	init_w32process_implement();
 	init_startup_info_implement();
@@ -190,8 +182,11 @@ void init_wineobj_implement(void)
 	init_snapshot_implement();
 
 	init_timer_implement();
+	return 0;
 }
 
+static void w32_cleanup(void);
+
 /* w32_init */
 static int w32_init(void)
 {
@@ -213,6 +208,7 @@ static int w32_init(void)
 
 	/* initialise the internal bits */
 	INIT_LIST_HEAD(&object_class_list);
+	init_timeouts();
 	init_pe_binfmt();
 #ifdef EXE_SO
 	init_exeso_binfmt();
@@ -221,6 +217,7 @@ static int w32_init(void)
 	init_object();
 	init_symbol_link();
 	init_io();
+	init_file_io();
 	init_directories();
 	init_named_pipe();
 	init_cid_table();
@@ -232,9 +229,11 @@ static int w32_init(void)
 	kernel_init_registry();
 	init_tet_ops(&tet_ops);
 
-	open_dummy_file();
-
-	init_wineobj_implement();
+	if (init_wineobj_implement() < 0) {
+		kdebug("Module not loaded. init_wineobj_implement error: out of memory\n");
+		w32_cleanup();
+		return -ENOMEM;
+	}
 	display_object_dir(name_space_root, 1);
 
 	register_binfmt(NULL);
@@ -247,30 +246,42 @@ static int w32_init(void)
 	ktrace("done\n");
 	return 0;
 } /* end w32_exit */
-/* w32_exit */
-static void w32_exit(void)
+/* undo w32_init, everything but the timer thread */
+static void w32_cleanup(void)
 {
-	int ret;
-
-	close_dummy_file();
-
+	exit_file_io();
 	destroy_cid_table();
 	exit_object();
 #ifdef EXE_SO
 	exit_exeso_binfmt();
 #endif
 	exit_pe_binfmt();
+	exit_image_cache();
 	proc_uk_exit();
 	free_rootdir();
-	ret = wake_up_process(save_kernel_task);
-	kthread_stop(save_kernel_task);
-
-	ret = wake_up_process(timer_kernel_task);
-	kthread_stop(timer_kernel_task);
+	if (!IS_ERR_OR_NULL(save_kernel_task)) {
+		wake_up_process(save_kernel_task);
+		kthread_stop(save_kernel_task);
+	}
+	exit_timeouts();
 
 	/* restore 0x2E */
 	restore_idt_entry(0x2E, orig_idt_2e_a, orig_idt_2e_b);
 
+	/* objects are freed from rcu callbacks, which live in this module */
+	rcu_barrier();
+	exit_completion_implement();
+}
+
+/* w32_exit */
+static void w32_exit(void)
+{
+	if (!IS_ERR_OR_NULL(timer_kernel_task)) {
+		wake_up_process(timer_kernel_task);
+		kthread_stop(timer_kernel_task);
+	}
+	w32_cleanup();
+
 	ktrace("Module w32 Off!\n");
 } /*end w32_exit */
 
@@ -33,6 +33,7 @@
 #include "section.h"
 #include "semaphore.h"
 #include "wineserver/lib.h"
+#include "stats.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
@@ -1669,21 +1670,6 @@ NtReadFile(IN  HANDLE		 FileHandle,
 }
 #endif
 
-NTSTATUS SERVICECALL
-NtReadFileScatter(IN  HANDLE			FileHandle,
-		IN  HANDLE			Event OPTIONAL,
-		IN  PIO_APC_ROUTINE 		UserApcRoutine OPTIONAL,
-		IN  PVOID			UserApcContext OPTIONAL,
-		OUT PIO_STATUS_BLOCK 		UserIoStatusBlock,
-		IN  FILE_SEGMENT_ELEMENT 	BufferDescription [],
-		IN  ULONG 			BufferLength,
-		IN  PLARGE_INTEGER  		ByteOffset,
-		IN  PULONG 			Key OPTIONAL)
-{
-	return -ENOSYS;
-}
-EXPORT_SYMBOL(NtReadFileScatter);
-
 NTSTATUS SERVICECALL
 NtReadRequestData (HANDLE		PortHandle,
 		PPORT_MESSAGE	Message,
@@ -1733,17 +1719,6 @@ NtReleaseSemaphore(IN  HANDLE SemaphoreHandle,
 }
 #endif
 
-NTSTATUS SERVICECALL
-NtRemoveIoCompletion(IN  HANDLE		  IoCompletionHandle,
-		OUT PVOID 		  *CompletionKey,
-		OUT PVOID 		  *CompletionContext,
-		OUT PIO_STATUS_BLOCK IoStatusBlock,
-		IN  PLARGE_INTEGER   Timeout OPTIONAL)
-{
-	return -ENOSYS;
-}
-EXPORT_SYMBOL(NtRemoveIoCompletion);
-
 /* 160  */
 NTSTATUS SERVICECALL
 NtReplaceKey (IN POBJECT_ATTRIBUTES ObjectAttributes,
@@ -2360,21 +2335,6 @@ NtWriteFile (IN  HANDLE 	  FileHandle,
 }
 #endif
 
-NTSTATUS SERVICECALL
-NtWriteFileGather(IN  HANDLE		   FileHandle,
-		IN  HANDLE		   Event OPTIONAL,
-		IN  PIO_APC_ROUTINE	   UserApcRoutine OPTIONAL,
-		IN  PVOID		   UserApcContext OPTIONAL,
-		OUT PIO_STATUS_BLOCK	   UserIoStatusBlock,
-		IN  FILE_SEGMENT_ELEMENT BufferDescription [],
-		IN  ULONG		   BufferLength,
-		IN  PLARGE_INTEGER	   ByteOffset,
-		IN  PULONG 		   Key OPTIONAL)
-{
-	return -ENOSYS;
-}
-EXPORT_SYMBOL(NtWriteFileGather);
-
 NTSTATUS SERVICECALL 
 NtWriteRequestData (HANDLE		PortHandle,
 		PPORT_MESSAGE	Message,
@@ -2419,6 +2379,7 @@ NtYieldExecution(VOID)
 EXPORT_SYMBOL(NtYieldExecution);
 
 const char* wine_service[];
+extern void flush_request_ring(struct w32thread *thread);
 
 /* not win32 syscall, just for wine service use */
 NTSTATUS call_req_handler(struct w32thread * thread) 
@@ -2433,8 +2394,15 @@ NTSTATUS call_req_handler(struct w32thread * thread)
 	if (req < REQ_NB_REQUESTS) {
 		handler = req_handlers[req];
 		if (handler) {
-			ktrace("NtWineService %d:%s\n", req, wine_service[req]);
-			handler(&thread->req, &thread->reply);
+			if (uk_stats_enabled || uk_trace_on(UK_TRACE_SERVICE)) {
+				ktime_t start = ktime_get();
+
+				handler(&thread->req, &thread->reply);
+				if (uk_stats_enabled)
+					uk_stats_account_request(req, start);
+				uk_trace_service(req, thread->error, start);
+			} else
+				handler(&thread->req, &thread->reply);
 		}
 		else {
 			ktrace("invalid call %d:(%s)\n", req, wine_service[req]);
@@ -2464,6 +2432,9 @@ NtWineService(PSERVER_REQUEST_INFO ReqMsg)
 	if(!ReqMsg || !thread)
 		return STATUS_UNSUCCESSFUL;
 
+	/* requests queued in the ring go first, they were issued earlier */
+	flush_request_ring(thread);
+
 	if (copy_from_user(&req_msg, ReqMsg, sizeof(req_msg)))
 		return STATUS_UNSUCCESSFUL;
 
@@ -2749,6 +2720,10 @@ SSDT MainSSDT[] = {
 	(SSDT)NtYieldExecution,
 	(SSDT)NtWineService,
 	(SSDT)NtCatchApc,
+	(SSDT)NtRegisterWineServiceRing,
+	(SSDT)NtSubmitWineServiceRing,		/* 235 */
+	(SSDT)NtRemoveIoCompletionEx,
+	(SSDT)NtRegisterQueueStatus,
 };
 EXPORT_SYMBOL(MainSSDT);
 
@@ -2801,15 +2776,12 @@ SSPT MainSSPT[] = {
 	3,  1,  1,  5,  4,
 	2,  2,  5,  3,  1, /* 220 */
 	1,  9,  9,  6,  5,
-	5,  0,  1,  1      /* 230 */
+	5,  0,  1,  1,  1, /* 230 */
+	0,  6,  1
 };
 EXPORT_SYMBOL(MainSSPT);
 
 
-#define MIN_SYSCALL_NUMBER    0
-#define MAX_SYSCALL_NUMBER    233
-#define NUMBER_OF_SYSCALLS    234
-
 /* From ReactOS, don't touch. */
 
 SSDT_ENTRY
@@ -2828,6 +2800,7 @@ void enter_win_syscall(void)
 
 void leave_win_syscall(void)
 {
+	uk_stats_syscall_leave();
 	ktrace("leave ==================>\n");
 }
 
@@ -3069,7 +3042,11 @@ char* syscall[] = {
 	"NtW32Call",			/* 230 */
 	"NtYieldExecution",
 	"NtWineService",
-	"NtCatchApc"
+	"NtCatchApc",
+	"NtRegisterWineServiceRing",
+	"NtSubmitWineServiceRing",		/* 235 */
+	"NtRemoveIoCompletionEx",
+	"NtRegisterQueueStatus"
 };
 
 const char* wine_service[REQ_NB_REQUESTS] =
@@ -3315,7 +3292,8 @@ const char* wine_service[REQ_NB_REQUESTS] =
 
 void log_call_id(int call_id)
 {
-	ktrace(" --Syscall: %s\n", syscall[call_id]);
+	uk_stats_syscall_enter(call_id);
+	uk_trace_syscall(call_id);
 }
 
 EXPORT_SYMBOL(log_call_id);
@@ -23,8 +23,28 @@
 /*
  * wait.c: thread wait on object 
  * Refered to Kernel-win32 code
+ *
+ * Locking:
+ * an object's signal state and wait list are protected by its dispatcher
+ * lock, one of dispatcher_locks[] chosen by hashing the object address, so
+ * signalling different objects does not contend.
+ * A wait is ended exactly once: whoever moves kthread->wait_claimed from
+ * WAIT_PENDING to WAIT_CLAIMED (a signaller, an alert, a timeout or the
+ * waiter itself) owns the thread's wait_status. It keeps interrupts off
+ * until the wait is WAIT_ENDED, as others may spin on WAIT_CLAIMED with a
+ * dispatcher lock held. Wait blocks of an ended wait are unlinked lazily,
+ * by the waiter or by the next signaller.
+ * A WaitAll is only ever satisfied by the waiter, holding the locks of all
+ * its objects; signallers just wake it up to retry.
+ * NtSignalAndWaitForSingleObject signals its object from within the wait,
+ * holding the locks of both objects until the waiter is queued.
+ * Fd-backed objects (msg queues, sockets) are waited on like any other
+ * object: their fd is hooked onto the unix file's wait queues, and a wake
+ * up there makes their waiters check them again.
  */
-#include <linux/poll.h>
+#include <linux/bitmap.h>
+#include "event.h"
+#include "mutex.h"
 #include "semaphore.h"
 #include "wineserver/lib.h"
 
@@ -39,6 +59,14 @@
 #define SynchronizationObject 2
 #define NotificationObject 3
 
+spinlock_t dispatcher_locks[DISPATCHER_LOCK_COUNT] = {
+	[0 ... DISPATCHER_LOCK_COUNT - 1] = __SPIN_LOCK_UNLOCKED(dispatcher_locks)
+};
+EXPORT_SYMBOL(dispatcher_locks);
+
+/* taken before the dispatcher locks of a WaitAll, so they nest in one order */
+static DEFINE_SPINLOCK(wait_all_lock);
+
 void call_kapc(void){
 	/* FIXME */
 }
@@ -56,132 +84,115 @@ void proc_msg_queue(struct object *obj, struct kthread *Thread)
 	}
 }
 
-struct poll_param {
-	int		poll_count;
-	int		*indexs;
-	int		timeout;	/* msec */
-	struct pollfd	*pfds;
-};
+extern void completion_thread_block(struct kthread *thread);
+extern void completion_thread_unblock(struct kthread *thread);
 
-VOID
-STDCALL
-block_thread(PNTSTATUS Status,
+static inline int claim_wait(struct kthread *Thread)
+{
+	return atomic_cmpxchg(&Thread->wait_claimed, WAIT_PENDING, WAIT_CLAIMED) == WAIT_PENDING;
+}
+
+static inline int wait_ended(struct kthread *Thread)
+{
+	return atomic_read(&Thread->wait_claimed) != WAIT_PENDING;
+}
+
+/* publish the status of a claimed wait and wake the waiter */
+static void end_wait(struct kthread *Thread, NTSTATUS WaitStatus)
+{
+	if(STATUS_ABANDONED == Thread->wait_status) Thread->wait_status += WaitStatus - STATUS_WAIT_0;
+	else Thread->wait_status = WaitStatus;
+
+	smp_wmb();
+	atomic_set(&Thread->wait_claimed, WAIT_ENDED);
+	wake_up_process(((struct ethread *)Thread)->et_task);
+}
+
+/*
+ * status of a wait ended by someone else
+ * the claimer has interrupts off until it ends the wait, so this spins briefly
+ */
+static NTSTATUS ended_wait_status(struct kthread *Thread)
+{
+	while (atomic_read(&Thread->wait_claimed) == WAIT_CLAIMED)
+		cpu_relax();
+	smp_rmb();
+	return Thread->wait_status;
+}
+
+/* the waiter ends its own wait */
+static inline void end_own_wait(struct kthread *Thread, NTSTATUS WaitStatus)
+{
+	Thread->wait_status = WaitStatus;
+	atomic_set(&Thread->wait_claimed, WAIT_ENDED);
+}
+
+/*
+ * sleep until the wait is ended, times out or is interrupted
+ * returns STATUS_KERNEL_APC when the caller has to check its objects again
+ */
+static NTSTATUS
+block_thread(struct kthread *thread,
 		UCHAR Alertable,
 		ULONG WaitMode,
 		UCHAR WaitReason,
-		PULONG_PTR Timeout,
-		struct poll_param *poll_param)
+		long *Timeout)
 {
-	struct kthread * thread = (struct kthread *)get_current_ethread();
-	struct kwait_block * wait_block;
+	NTSTATUS status;
+	unsigned long flags;
 
 	ktrace("\n");
 	if (thread->apc_state.kapc_pending) {
-		/* Remove Waits */
-		wait_block = thread->wait_block_list;
-		do {
-			proc_msg_queue(wait_block->object, thread); /* TBD, D.M. */
-			list_del(&wait_block->wait_list_entry);
-			wait_block = wait_block->next_wait_block;
-		} while (wait_block!= thread->wait_block_list);
-		thread->wait_block_list = NULL;
-
 		/* Ready Dispatch it and return status */
 		call_kapc();
 
-		if (Status != NULL) *Status = STATUS_KERNEL_APC;
-
-		if (poll_param->poll_count) {
-			kfree(poll_param->pfds);
-			kfree(poll_param->indexs);
-			poll_param->poll_count = 0;
-		}
-	} else {
-		/* Set the Thread Data as Requested */
-		thread->alertable = Alertable;
-		thread->wait_mode = (UCHAR)WaitMode;
-		thread->wait_reason = WaitReason;
-
-		if (poll_param->poll_count) {
-			int i, n, index;
-			unsigned long long tt;
-			asm volatile ("rdtsc\n" : "=A"(tt));
-
-			kdebug("%08llx: poll, n=%d\n", tt, poll_param->poll_count);
-			n = poll(poll_param->pfds, poll_param->poll_count, poll_param->timeout);
-			if (n < 0) {
-				/* TODO */
-			} else if (!n)	{ /* timeout */
-				kdebug("poll timeout, %d\n", poll_param->timeout);
-				*Timeout = 0;
-			} else {
-				if (poll_param->pfds[0].revents)
-					index = ((struct kthread *)current->ethread)->wait_status;
-				else
-					index = 0x7fffffff;
-				for (i = 1; i < poll_param->poll_count; i++) { /* dummy fd not checked */
-					kdebug("n %d revents %x\n", n, poll_param->pfds[i].revents);
-					if (poll_param->pfds[i].revents && index > poll_param->indexs[i])
-						index = poll_param->indexs[i];
-					((struct kthread *)current->ethread)->wait_status = index;
-					kdebug("fd %d, status %ld\n", poll_param->pfds[i].fd, ((struct kthread*)current->ethread)->wait_status);
-				}
-			}
-			kfree(poll_param->pfds);
-			kfree(poll_param->indexs);
-			poll_param->poll_count = 0;
-		} else {
-			BOOL timeout = *Timeout ? TRUE : FALSE;
-
-			local_irq_enable();
-			set_current_state(TASK_INTERRUPTIBLE);
-			*Timeout = schedule_timeout(*Timeout);
-			local_irq_disable();
-
-			if (((struct kthread *)current->ethread)->wait_status == STATUS_USER_APC) {
-				set_tsk_thread_flag(current, TIF_APC);
-				if (Status)
-					*Status = STATUS_USER_APC;
-				return;
-			}
-			if (!timeout) {
-				*Status = STATUS_TIMEOUT;
-				return;
-			}
+		local_irq_save(flags);
+		if (claim_wait(thread)) {
+			end_own_wait(thread, STATUS_KERNEL_APC);
+			local_irq_restore(flags);
+			return STATUS_KERNEL_APC;
 		}
+		local_irq_restore(flags);
+		return ended_wait_status(thread);
+	}
 
-		/* Dispatch it and return status */
-		if (signal_pending(current)) {
-			/* thread is signaled
-			 * Remove Waits */
-			wait_block = thread->wait_block_list;
-			do {
-				proc_msg_queue(wait_block->object, thread); /* TBD */
-				list_del(&wait_block->wait_list_entry);
-				wait_block = wait_block->next_wait_block;
-			} while (wait_block!= thread->wait_block_list);
-			thread->wait_block_list = NULL;
-			*Status = -EINTR; /* Linux error code for special check */
-			return;
-		}
+	/* Set the Thread Data as Requested */
+	thread->alertable = Alertable;
+	thread->wait_mode = (UCHAR)WaitMode;
+	thread->wait_reason = WaitReason;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (!wait_ended(thread)) {
+		/* a completion port lets another of its threads run meanwhile */
+		if (thread->queue)
+			completion_thread_block(thread);
+		*Timeout = schedule_timeout(*Timeout);
+		if (thread->queue)
+			completion_thread_unblock(thread);
+	}
+	__set_current_state(TASK_RUNNING);
 
-		if(Status) {
-			if (!(*Timeout)){ 
-				/* thread is signaled
-				 * Remove Waits */
-				wait_block = thread->wait_block_list;
-				do {
-					proc_msg_queue(wait_block->object, thread);  /* TBD */
-					list_del(&wait_block->wait_list_entry);
-					wait_block = wait_block->next_wait_block;
-				} while (wait_block!= thread->wait_block_list);
-				thread->wait_block_list = NULL;
-				*Status = STATUS_TIMEOUT;
-			} else *Status = ((struct kthread * )current->ethread)->wait_status;
-		}
+	if (signal_pending(current))
+		status = -EINTR; /* Linux error code for special check */
+	else if (!*Timeout)
+		status = STATUS_TIMEOUT;
+	else
+		status = STATUS_KERNEL_APC;	/* woken up to retry */
+
+	local_irq_save(flags);
+	if (claim_wait(thread)) {
+		end_own_wait(thread, status);
+		local_irq_restore(flags);
+		return status;
 	}
+	local_irq_restore(flags);
+
+	/* ended by a signaller, an alert or an apc */
+	status = ended_wait_status(thread);
+	if (status == STATUS_USER_APC)
+		set_tsk_thread_flag(current, TIF_APC);
+	return status;
 }
-EXPORT_SYMBOL(block_thread);
 
 VOID
 inline
@@ -214,6 +225,7 @@ check_alert(BOOLEAN Alertable,
 }
 EXPORT_SYMBOL(check_alert);
 
+/* Must be called with the object's dispatcher lock held */
 VOID
 satisfy_object_wait(struct dispatcher_header * Object,
 		struct kthread *Thread)
@@ -241,7 +253,9 @@ satisfy_object_wait(struct dispatcher_header * Object,
 				Thread->wait_status = STATUS_ABANDONED; 
 			} 
 
+			spin_lock(&Thread->mutant_list_lock);
 			list_add(&((struct kmutant *)Object)->mutant_list_entry, &Thread->mutant_list_head); 
+			spin_unlock(&Thread->mutant_list_lock);
 		} 
 	} else if ((Object->type & TIMER_OR_EVENT_TYPE) == SynchronizationObject) { 
 		Object->signal_state= 0; 
@@ -251,6 +265,7 @@ satisfy_object_wait(struct dispatcher_header * Object,
 	ktrace("done\n");
 }
 
+/* Must be called with the dispatcher locks of all the objects held */
 void
 satisfy_multi_obj_waits(struct kwait_block * WaitBlock)
 { 
@@ -296,68 +311,64 @@ is_object_waitable(PVOID Object)
 }
 
 
+/* Must be called with the object's dispatcher lock held */
 VOID
 wait_test(struct dispatcher_header * Object,
 		KPRIORITY Increment)
 {
-	struct list_head * wait_entry; 
-	struct list_head * wait_list; 
 	struct kwait_block * cur_wait_block; 
-	struct kwait_block * next_wait_block; 
+	struct kwait_block * next; 
 	struct kthread * wait_thread; 
-	int is_wine_obj = is_wine_object(Object->type);
 
-	wait_list = &Object->wait_list_head; /* TODO kernel */
-	wait_entry = wait_list->next; 
+	list_for_each_entry_safe(cur_wait_block, next, &Object->wait_list_head, wait_list_entry) {
+		if (Object->signal_state <= 0)
+			break;
 
-	while ((wait_entry != wait_list) && (Object->signal_state > 0)) {
-		/* Get the current wait block */ 
-		cur_wait_block = list_entry(wait_entry, struct kwait_block, wait_list_entry);
 		wait_thread = cur_wait_block->thread;
 
-		if (cur_wait_block->wait_type == WaitAny) {
-			wait_entry = wait_entry->prev;   
-			/* because this entry will be removed from the queue */
-			satisfy_object_wait(Object, wait_thread); 
-		} else {
-			next_wait_block = cur_wait_block->next_wait_block; 
-
-			/* Loop first to make sure they are valid */ 
-			while (next_wait_block != cur_wait_block) {
-				if (!is_object_signaled(next_wait_block->object, wait_thread)) { 
-					/* It's not, move to the next one */ 
-					goto SkipUnwait; 
-				} 
-
-				next_wait_block = next_wait_block->next_wait_block;
-			} 
-
-			/* All the objects are signaled, we can satisfy */ 
-			wait_entry = wait_entry->prev;  
-			/* because this entry will be removed from the queue */
-			satisfy_multi_obj_waits(cur_wait_block); 
-		} /* end Wait_All */
+		if (cur_wait_block->wait_type != WaitAny) {
+			/* the waiter satisfies a WaitAll itself, under all its objects' locks */
+			if (claim_wait(wait_thread)) {
+				list_del_init(&cur_wait_block->wait_list_entry);
+				end_wait(wait_thread, STATUS_KERNEL_APC);
+			}
+			continue;
+		}
 
-		if (!is_wine_obj) {
-			struct w32thread *w32thread = wait_thread->win32thread;
+		/* the wait has already been ended, the block is stale */
+		if (!claim_wait(wait_thread)) {
+			list_del_init(&cur_wait_block->wait_list_entry);
+			continue;
+		}
 
-			if (w32thread) w32thread->wake_up = 1;
-		} 
-		if (Object->type == CONSOLE_INPUT_EVENTS) {
-			struct w32thread *w32thread = wait_thread->win32thread;
+		list_del_init(&cur_wait_block->wait_list_entry);
+		satisfy_object_wait(Object, wait_thread); 
 
-			if (w32thread) w32thread->wake_up = 1;
-		}
 		/* All waits satisfied, unwait the thread */
-		abort_wait_thread(wait_thread, cur_wait_block->wait_key, Increment); 
-
-SkipUnwait: 
-		wait_entry = wait_entry->next; 
+		end_wait(wait_thread, cur_wait_block->wait_key);
 	} 
-
 }
 EXPORT_SYMBOL(wait_test);
 
+/*
+ * something the object's signaled op looks at has changed,
+ * make every thread waiting on it check its objects again
+ * Must be called with the object's dispatcher lock held
+ */
+VOID
+wake_dispatcher_waiters(struct dispatcher_header * Object)
+{
+	struct kwait_block * cur_wait_block; 
+	struct kwait_block * next; 
+
+	list_for_each_entry_safe(cur_wait_block, next, &Object->wait_list_head, wait_list_entry) {
+		list_del_init(&cur_wait_block->wait_list_entry);
+		if (claim_wait(cur_wait_block->thread))
+			end_wait(cur_wait_block->thread, STATUS_KERNEL_APC);
+	}
+}
+EXPORT_SYMBOL(wake_dispatcher_waiters);
+
 int msg_queue_add_queue(struct object *obj, struct w32thread* thread);
 
 int is_waitible_object(KOBJECTS type)
@@ -372,24 +383,199 @@ int is_waitible_object(KOBJECTS type)
 	}
 }
 
-extern int extract_unix_fd(struct fd *fdp);
+extern void fd_hook_wait(struct fd *fd);
 
-void free_wait_block(struct kwait_block *WaitBlockArray)
+/*
+ * take the dispatcher locks of all the objects of a WaitAll,
+ * and of the object to signal if any, in index order
+ */
+static unsigned long lock_wait_all(struct kwait_block *WaitBlockArray,
+		struct dispatcher_header *SignalObject, unsigned long *buckets)
 {
-	struct kwait_block * wait_block = WaitBlockArray;
-	struct list_head *entry;
-	void *prev, *next;
-	do
-	{
-        entry = &wait_block->wait_list_entry;
-		prev = entry->prev;
-		next = entry->next;
-		if((next!= entry) && (next != LIST_POISON1))
-		{
-			list_del(entry);
+	struct kwait_block *wait_block = WaitBlockArray;
+	unsigned long flags;
+	int bucket;
+
+	bitmap_zero(buckets, DISPATCHER_LOCK_COUNT);
+	do {
+		__set_bit(hash_ptr(wait_block->object, DISPATCHER_LOCK_BITS), buckets);
+		wait_block = wait_block->next_wait_block;
+	} while (wait_block != WaitBlockArray);
+	if (SignalObject)
+		__set_bit(hash_ptr(SignalObject, DISPATCHER_LOCK_BITS), buckets);
+
+	spin_lock_irqsave(&wait_all_lock, flags);
+	for_each_set_bit(bucket, buckets, DISPATCHER_LOCK_COUNT)
+		spin_lock_nest_lock(&dispatcher_locks[bucket], &wait_all_lock);
+	return flags;
+}
+
+static void unlock_wait_all(unsigned long *buckets, unsigned long flags)
+{
+	int bucket;
+
+	for_each_set_bit(bucket, buckets, DISPATCHER_LOCK_COUNT)
+		spin_unlock(&dispatcher_locks[bucket]);
+	spin_unlock_irqrestore(&wait_all_lock, flags);
+}
+
+/*
+ * WaitAny: satisfy the wait from the first signaled object,
+ * or queue on each object in turn
+ */
+static NTSTATUS
+queue_wait_any(struct kthread *Thread, struct kwait_block *WaitBlockArray)
+{
+	struct kwait_block *wait_block = WaitBlockArray;
+	struct dispatcher_header *cur_obj;
+	unsigned long flags;
+	NTSTATUS status;
+
+	do {
+		cur_obj = wait_block->object;
+		flags = lock_dispatcher_object(cur_obj);
+		if (is_object_signaled(cur_obj, Thread)) {
+			if (cur_obj->signal_state != (LONG)MINLONG) {
+				/* It has a normal signal state, so unwait it and return */
+				if (claim_wait(Thread)) {
+					satisfy_object_wait(cur_obj, Thread);
+					if(STATUS_ABANDONED == Thread->wait_status)
+						status = STATUS_ABANDONED | wait_block->wait_key;
+					else
+						status = STATUS_WAIT_0 | wait_block->wait_key;
+					end_own_wait(Thread, status);
+				} else
+					status = ended_wait_status(Thread);
+				unlock_dispatcher_object(cur_obj, flags);
+				return status;
+			} else {
+				/* Is this a Mutant? */
+				if (cur_obj->type == MutantObject) {
+					/* FIXME exception*/
+				}
+			}
 		}
+		list_add_tail(&wait_block->wait_list_entry, &cur_obj->wait_list_head);
+		unlock_dispatcher_object(cur_obj, flags);
+
+		/* a signaller may already have picked one of the queued blocks */
+		if (wait_ended(Thread))
+			return ended_wait_status(Thread);
+
 		wait_block = wait_block->next_wait_block;
 	} while (wait_block != WaitBlockArray);
+
+	return STATUS_PENDING;
+}
+
+/*
+ * WaitAll: satisfy the wait if every object is signaled, or queue on all of them
+ * Must be called with the dispatcher locks of all the objects held
+ */
+static NTSTATUS
+__queue_wait_all(struct kthread *Thread, struct kwait_block *WaitBlockArray)
+{
+	struct kwait_block *wait_block = WaitBlockArray;
+	unsigned long all_objects_signaled = true;
+	NTSTATUS status = STATUS_PENDING;
+
+	do {
+		if (!is_object_signaled(wait_block->object, Thread)) {
+			/* One of the objects isn't signaled */
+			all_objects_signaled = false;
+			break;
+		}
+		wait_block = wait_block->next_wait_block;
+	} while (wait_block != WaitBlockArray);
+
+	if (all_objects_signaled) {
+		if (claim_wait(Thread)) {
+			satisfy_multi_obj_waits(WaitBlockArray);
+			if(STATUS_ABANDONED == Thread->wait_status)
+				status = STATUS_ABANDONED_WAIT_0;
+			else status = STATUS_WAIT_0;
+			end_own_wait(Thread, status);
+		} else
+			status = ended_wait_status(Thread);
+	} else {
+		wait_block = WaitBlockArray;
+		do {
+			list_add_tail(&wait_block->wait_list_entry, &wait_block->object->wait_list_head);
+			wait_block = wait_block->next_wait_block;
+		} while (wait_block != WaitBlockArray);
+	}
+
+	return status;
+}
+
+static NTSTATUS
+queue_wait_all(struct kthread *Thread, struct kwait_block *WaitBlockArray)
+{
+	DECLARE_BITMAP(buckets, DISPATCHER_LOCK_COUNT);
+	unsigned long flags;
+	NTSTATUS status;
+
+	flags = lock_wait_all(WaitBlockArray, NULL, buckets);
+	status = __queue_wait_all(Thread, WaitBlockArray);
+	unlock_wait_all(buckets, flags);
+	return status;
+}
+
+/*
+ * signal an object and queue on the one to wait for, under the locks of both,
+ * so the waited object can not change in between
+ * Only used for a single wait object, where WaitAll and WaitAny are the same
+ */
+static NTSTATUS
+signal_and_queue_wait(struct kthread *Thread, struct dispatcher_header *SignalObject,
+		struct kwait_block *WaitBlockArray)
+{
+	DECLARE_BITMAP(buckets, DISPATCHER_LOCK_COUNT);
+	unsigned long flags;
+	NTSTATUS status;
+
+	flags = lock_wait_all(WaitBlockArray, SignalObject, buckets);
+
+	/* with Wait set, these find the lock already held */
+	switch (SignalObject->type) {
+		case EventNotificationObject:
+		case EventSynchronizationObject:
+			set_event((struct kevent *)SignalObject, EVENT_INCREMENT, TRUE);
+			break;
+
+		case MutantObject:
+			release_mutant((struct kmutant *)SignalObject, IO_NO_INCREMENT, FALSE, TRUE);
+			break;
+
+		case SemaphoreObject:
+			release_semaphore((struct ksemaphore *)SignalObject, SEMAPHORE_INCREMENT, 1, TRUE);
+			break;
+	}
+
+	status = __queue_wait_all(Thread, WaitBlockArray);
+	unlock_wait_all(buckets, flags);
+	return status;
+}
+
+/* unlink whatever wait blocks are still queued */
+static void dequeue_wait_blocks(struct kthread *Thread, struct kwait_block *WaitBlockArray, int slept)
+{
+	struct kwait_block *wait_block = WaitBlockArray;
+	unsigned long flags;
+
+	do {
+		flags = lock_dispatcher_object(wait_block->object);
+		if (!list_empty(&wait_block->wait_list_entry))
+			list_del_init(&wait_block->wait_list_entry);
+		unlock_dispatcher_object(wait_block->object, flags);
+
+		/* may signal other objects, so outside the lock */
+		if (slept)
+			proc_msg_queue((struct object *)wait_block->object, Thread); /* TBD */
+		wait_block = wait_block->next_wait_block;
+	} while (wait_block != WaitBlockArray);
+
+	Thread->wait_block_list = NULL;
 }
 
 NTSTATUS 
@@ -406,14 +592,12 @@ wait_for_multi_objs(ULONG Count,
 	struct dispatcher_header * cur_obj;
 	struct kwait_block * wait_block;
 	struct kthread * cur_thread = (struct kthread *)get_current_ethread();
-	unsigned long all_objects_signaled;
+	struct dispatcher_header *signal_object = cur_thread->signal_object;
 	unsigned long wait_index;
-	NTSTATUS status, wait_status;
+	NTSTATUS status;
 	struct timespec ts;
 	long timeout;
-	int poll_index = 0;
 	struct fd *fdp;
-	struct poll_param poll_param = { .poll_count = 0 };
 
 	if (Timeout) {
 		s32 rem;
@@ -424,18 +608,16 @@ wait_for_multi_objs(ULONG Count,
 	else
 		timeout = MAX_SCHEDULE_TIMEOUT;
 
-	/* Check if the lock is already held */
-	if (cur_thread->wait_next)  {
-		/* Lock is held, disable Wait Next */
-		cur_thread->wait_next = false;
-	} else {
-		local_irq_disable();
-		/* FIXME Lock not held, acquire it */
-	}
+	/* set by NtSignalAndWaitForSingleObject, signalled on the first pass only */
+	cur_thread->signal_object = NULL;
 
 	if (Count == 0) {
-		block_thread(&status, Alertable, WaitMode, WaitReason, &timeout, &poll_param);
-		local_irq_enable();
+		cur_thread->wait_block_list = NULL;
+		do {
+			cur_thread->wait_status = STATUS_WAIT_0;
+			atomic_set(&cur_thread->wait_claimed, WAIT_PENDING);
+			status = block_thread(cur_thread, Alertable, WaitMode, WaitReason, &timeout);
+		} while (status == STATUS_KERNEL_APC && !cur_thread->apc_state.kapc_pending);
 		return status;
 	}
 
@@ -449,137 +631,78 @@ wait_for_multi_objs(ULONG Count,
 		/* FIXME Using our own Block Array. Check in regards to System Object Limit */
 	}
 
-	/* Start the actual Loop */
-	do {
-		wait_status = cur_thread->wait_status;
-		cur_thread->wait_block_list = wait_block = WaitBlockArray;
-		all_objects_signaled = true;
-
-		/* First, we'll try to satisfy the wait directly */
-		for (wait_index = 0; wait_index < Count; wait_index++) {
-			cur_obj = (struct dispatcher_header * )Object[wait_index];
-			if (is_waitible_object(cur_obj->type)
-					&& BODY_TO_HEADER(cur_obj)->ops->get_fd
-					&& (fdp = BODY_TO_HEADER(cur_obj)->ops->get_fd((struct object *)cur_obj))) {
-				release_object(fdp);
-				poll_param.poll_count++;
-			}
+	/* Set up a Wait Block for each Object */
+	wait_block = WaitBlockArray;
+	for (wait_index = 0; wait_index < Count; wait_index++) {
+		cur_obj = (struct dispatcher_header * )Object[wait_index];
+		if (is_waitible_object(cur_obj->type)
+				&& BODY_TO_HEADER(cur_obj)->ops->get_fd
+				&& (fdp = BODY_TO_HEADER(cur_obj)->ops->get_fd((struct object *)cur_obj))) {
+			/* like msg_queue, sock, ... */
+			fd_hook_wait(fdp);
+			release_object(fdp);
+		}
 
-			if (cur_obj->type == IO_TYPE_FILE) {
-				cur_obj = (struct dispatcher_header *)(&((PFILE_OBJECT)cur_obj)->Event);
-			}
+		if (cur_obj->type == IO_TYPE_FILE) {
+			cur_obj = (struct dispatcher_header *)(&((PFILE_OBJECT)cur_obj)->Event);
+		}
 
-			if (is_object_signaled(cur_obj, cur_thread)) {
-				if (WaitType == WaitAny) {
-					if (cur_obj->signal_state!= (LONG)MINLONG) {
-						/* It has a normal signal state, so unwait it and return */
-						satisfy_object_wait(cur_obj, cur_thread);
-						if(STATUS_ABANDONED == cur_thread->wait_status)
-							status = cur_thread->wait_status = (STATUS_ABANDONED | wait_index);
-						else
-							status = STATUS_WAIT_0 | wait_index;
-						goto WaitDone;
-
-					} else {
-						/* Is this a Mutant? */
-						if (cur_obj->type == MutantObject) {
-							/* FIXME exception*/
-						}
-					}
-				}
+		wait_block->object = cur_obj;
+		wait_block->thread = cur_thread;
+		if(WaitAny == WaitType)
+			wait_block->wait_key = (USHORT)(STATUS_WAIT_0 + wait_index);
+		else  
+			wait_block->wait_key = (USHORT)(STATUS_WAIT_0);
+		/* a single object needs none of the WaitAll locking */
+		wait_block->wait_type = (USHORT)(Count == 1 ? WaitAny : WaitType);
+		wait_block->next_wait_block = wait_block + 1;
+		INIT_LIST_HEAD(&wait_block->wait_list_entry);
 
-			} else {
-				/* One of the objects isn't signaled... if this is a WaitAll, we will fail later */
-				all_objects_signaled = false;
-			}
+		wait_block = wait_block->next_wait_block;
+	}
 
-			/* Set up a Wait Block for this Object */
-			wait_block->object = cur_obj;
-			wait_block->thread = cur_thread;
-			if(WaitAny == WaitType)
-				wait_block->wait_key = (USHORT)(STATUS_WAIT_0 + wait_index);
-			else  
-				wait_block->wait_key = (USHORT)(STATUS_WAIT_0);
-			wait_block->wait_type = (USHORT)WaitType;
-			wait_block->next_wait_block = wait_block + 1;
+	/* Return to the Root Wait Block */
+	wait_block--;
+	wait_block->next_wait_block = WaitBlockArray;
 
-			wait_block = wait_block->next_wait_block;
-		}
+	/* Start the actual Loop */
+	do {
+		cur_thread->wait_block_list = WaitBlockArray;
 
-		/* Return to the Root Wait Block */
-		wait_block--;
-		wait_block->next_wait_block = WaitBlockArray;
+		/* Make sure we can satisfy the Alertable request */
+		check_alert(Alertable, cur_thread, WaitMode, &status);
+		cur_thread->wait_status = status;
 
-		if ((WaitType == WaitAll) && (all_objects_signaled)) {
-			wait_block = cur_thread->wait_block_list;
+		atomic_set(&cur_thread->wait_claimed, WAIT_PENDING);
 
-			satisfy_multi_obj_waits(wait_block);
-			if(STATUS_ABANDONED == cur_thread->wait_status)
-				status = STATUS_ABANDONED_WAIT_0;
-			else status = STATUS_WAIT_0;
+		/* First, we'll try to satisfy the wait directly, otherwise queue on the objects */
+		if (signal_object) {
+			status = signal_and_queue_wait(cur_thread, signal_object, WaitBlockArray);
+			signal_object = NULL;
+		} else if (WaitBlockArray->wait_type == WaitAny)
+			status = queue_wait_any(cur_thread, WaitBlockArray);
+		else
+			status = queue_wait_all(cur_thread, WaitBlockArray);
+
+		if (status != STATUS_PENDING) {
+			dequeue_wait_blocks(cur_thread, WaitBlockArray, 0);
 			goto WaitDone;
 		}
 
 		/* Now we have to wait, otherwise we will not be here. */
-		current_thread->wake_up = 0;
-		if (poll_param.poll_count) {
-			poll_param.poll_count++;  /* for dummyfile */
-			if (timeout == MAX_SCHEDULE_TIMEOUT)
-				poll_param.timeout = -1;
-			else
-				poll_param.timeout = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
-			poll_param.pfds = kmalloc(poll_param.poll_count * sizeof(struct pollfd), GFP_KERNEL);
-			poll_param.pfds[0].fd = current_thread->process->dummyfd;
-			poll_param.pfds[0].events = POLLIN | POLLHUP | POLLERR;
-			poll_param.pfds[0].revents = 0;
-			poll_param.indexs = kmalloc(poll_param.poll_count * sizeof(int), GFP_KERNEL);
-		}
-		poll_index = 1;
-		/* Make sure we can satisfy the Alertable request */
-		check_alert(Alertable, cur_thread, WaitMode, &status);
-
-		cur_thread->wait_status = status;
-		wait_block = cur_thread->wait_block_list;
-
-		do {
-			cur_obj = wait_block->object;
-			if (is_wine_object(cur_obj->type)) {
-				struct object *obj = (struct object*)cur_obj;
-				if (is_waitible_object(cur_obj->type)
-						&& BODY_TO_HEADER(obj)->ops->get_fd
-						&& (fdp = BODY_TO_HEADER(obj)->ops->get_fd(obj))) { /* like msg_queue, sock, ... */
-					poll_param.pfds[poll_index].fd = extract_unix_fd(fdp);
-					poll_param.pfds[poll_index].events = POLLIN | POLLHUP | POLLERR;
-					poll_param.pfds[poll_index].revents = 0;
-					poll_param.indexs[poll_index] = wait_block->wait_key;
-					poll_index++;
-					release_object(fdp);
-				}
-				if(cur_obj->type == MSG_QUEUE) {
-				}
-			}
-			INIT_LIST_HEAD(&wait_block->wait_list_entry);
-			list_add(&wait_block->wait_list_entry, &cur_obj->wait_list_head);
-			wait_block = wait_block->next_wait_block;
-		} while (wait_block != WaitBlockArray);
+		status = block_thread(cur_thread, Alertable, WaitMode,
+				(UCHAR)WaitReason, &timeout);
 
-		/* block current thread */
-		block_thread(&status, Alertable, WaitMode,
-				(UCHAR)WaitReason, &timeout, &poll_param);
+		dequeue_wait_blocks(cur_thread, WaitBlockArray, 1);
 
-		free_wait_block(WaitBlockArray);
-		poll_index = 0;
+		/* Check if we were executing an APC, or have to look at the objects again */
+	} while (status == STATUS_KERNEL_APC);
 
-		/* Check if we were executing an APC */
-		if (status != STATUS_KERNEL_APC) {
-			local_irq_enable();
-			return status;
-		}
-	} while (true);
+	return status;
 
 WaitDone:
-	local_irq_enable();
-	/* Release the Lock, we are done */
+	if (status == STATUS_USER_APC)
+		set_tsk_thread_flag(current, TIF_APC);
 	if (Timeout) {
 		jiffies_to_timespec(timeout, &ts);
 		Timeout->QuadPart = -(ts.tv_sec * 10000000L + ts.tv_nsec / 100);
@@ -589,35 +712,22 @@ WaitDone:
 }
 EXPORT_SYMBOL(wait_for_multi_objs);
 
-/* Must be called with the dispatcher lock held */
+/* ends the thread's wait if it is waiting, no lock needs to be held */
 VOID
 abort_wait_thread(struct kthread *Thread,
 		NTSTATUS WaitStatus,
 		KPRIORITY Increment)
 {
-	struct kwait_block *  wait_block; 
-
-	/* If we are blocked, we must be waiting on something also */ 
-	if(!((((struct ethread *) Thread)->et_task->state & 
-					(TASK_STOPPED | TASK_TRACED | TASK_INTERRUPTIBLE | TASK_UNINTERRUPTIBLE)) 
-				&& Thread->wait_block_list != NULL))
-		return;
-
-	wait_block = Thread->wait_block_list; 
-	do {
-		proc_msg_queue(wait_block->object, Thread); /* TBD */
-		list_del(&wait_block->wait_list_entry); 
-		wait_block = wait_block->next_wait_block; 
-	} while (wait_block != Thread->wait_block_list); 
-
-	if(STATUS_ABANDONED == Thread->wait_status) Thread->wait_status += WaitStatus - STATUS_WAIT_0;
-	else Thread->wait_status = WaitStatus;
+	unsigned long flags;
 
-	/* FIXME : Check if there's a Thread Timer */ 
+	local_irq_save(flags);
+	if (claim_wait(Thread)) {
+		/* FIXME : Check if there's a Thread Timer */ 
 
-	/* Reschedule the Thread */ 
-	set_tsk_need_resched(current);
-	wake_up_process(((struct ethread *)Thread)->et_task);
+		/* Reschedule the Thread, its wait blocks are unlinked when it wakes up */ 
+		end_wait(Thread, WaitStatus);
+	}
+	local_irq_restore(flags);
 }
 EXPORT_SYMBOL(abort_wait_thread);
 
@@ -61,8 +61,21 @@ int data_section_setup(struct win32_section *ws)
 		memcpy(name, prefix, prefix_len - 1);
 		unistr2charstr((PWSTR)obj_name->Buffer, name + prefix_len - 1);
 
-		/* create a SHMEM file */
-		ws->ws_file = shmem_file_setup(name, ws->ws_len, 0);
+		/*
+		 * create a hugetlbfs file for large pages, a SHMEM file otherwise
+		 * the huge pages are reserved now, views mapped later can't run short
+		 */
+		ws->ws_file = NULL;
+		if (ws->ws_alloctype & _SEC_LARGE_PAGES) {
+			ws->ws_file = open_large_page_file();
+			if (ws->ws_file && reserve_large_page_file(ws->ws_file, ws->ws_len)) {
+				fput(ws->ws_file);
+				ws->ws_file = NULL;
+			}
+			account_large_pages(ws->ws_len, ws->ws_file != NULL);
+		}
+		if (!ws->ws_file)
+			ws->ws_file = shmem_file_setup(name, ws->ws_len, 0);
 		if (IS_ERR(ws->ws_file)) {
 			kfree(name);
 			return PTR_ERR(ws->ws_file);
@@ -27,6 +27,8 @@
 
 #include <linux/mman.h>
 #include <linux/syscalls.h>
+#include <linux/pagemap.h>
+#include <linux/mutex.h>
 #include <asm/pgalloc.h>
 #include "virtual.h"
 #include "section.h"
@@ -51,18 +53,14 @@ static unsigned long character2prot[] = {
 	PROT_WRITE | PROT_READ | PROT_WRITE
 };
 
-#ifdef UNALIGNED_MMAP
-static struct page *filemap_pe_nopage(struct vm_area_struct *area,
-				unsigned long address, int *type);
+static int image_section_fault(struct vm_area_struct *vma, struct vm_fault *vmf);
 
-static struct vm_operations_struct file_pe_shared_mmap = {
-	.nopage = filemap_pe_nopage,
+static const struct vm_operations_struct image_section_vm_ops = {
+	.fault = image_section_fault,
 };
 
-static struct vm_operations_struct file_pe_private_mmap = {
-	.nopage = filemap_pe_nopage,
-};
-#endif
+/* vm_private_data of a page cache mapped section until its first fault */
+#define READAHEAD_PENDING	((void *)1)
 
 /* origin in kernel-win32 */
 static inline int is_power_of2(unsigned long addr)
@@ -73,6 +71,107 @@ static inline int is_power_of2(unsigned long addr)
 	return !(addr & (addr - 1));
 } /* end is_power_of2 */
 
+/*
+ * the parsed headers of the last images set up, so that running the same
+ * executable or loading the same dll again does not read them again
+ * an entry is only used while the file still has the stamp it was parsed with
+ */
+#define IMAGE_CACHE_SIZE	64
+
+struct image_cache_entry {
+	struct list_head	ic_entry;	/* in image_cache, most recent first */
+	struct file_stamp	ic_stamp;
+	struct win32_section	ic_ws;		/* only the image fields are set */
+	struct win32_image_section	ic_sections[0];
+};
+
+static LIST_HEAD(image_cache);
+static int image_cache_count;
+static DEFINE_MUTEX(image_cache_mutex);
+
+static void copy_image_info(struct win32_section *dst, struct win32_section *src)
+{
+	dst->ws_imagebase = src->ws_imagebase;
+	dst->ws_nsecs = src->ws_nsecs;
+	dst->ws_stackresv = src->ws_stackresv;
+	dst->ws_stackcommit = src->ws_stackcommit;
+	dst->ws_subsystem = src->ws_subsystem;
+	dst->ws_majorver = src->ws_majorver;
+	dst->ws_minorver = src->ws_minorver;
+	dst->ws_entrypoint = src->ws_entrypoint;
+	dst->ws_executable = src->ws_executable;
+	dst->ws_imagecharacter = src->ws_imagecharacter;
+	dst->ws_machine = src->ws_machine;
+	dst->ws_secoff = src->ws_secoff;
+	dst->ws_len = src->ws_len;
+	dst->ws_pagelen = src->ws_pagelen;
+}
+
+/* fill ws from the cache, return 1 if found */
+static int image_cache_lookup(struct win32_section *ws, struct file_stamp *stamp)
+{
+	struct image_cache_entry *ic;
+	size_t size;
+
+	mutex_lock(&image_cache_mutex);
+	list_for_each_entry(ic, &image_cache, ic_entry) {
+		if (!file_stamp_equal(&ic->ic_stamp, stamp))
+			continue;
+
+		size = sizeof(struct win32_image_section) * ic->ic_ws.ws_nsecs;
+		if (!(ws->ws_sections = kmalloc(size, GFP_KERNEL)))
+			break;
+		memcpy(ws->ws_sections, ic->ic_sections, size);
+		copy_image_info(ws, &ic->ic_ws);
+		list_move(&ic->ic_entry, &image_cache);
+		mutex_unlock(&image_cache_mutex);
+		return 1;
+	}
+	mutex_unlock(&image_cache_mutex);
+	return 0;
+}
+
+static void image_cache_add(struct win32_section *ws, struct file_stamp *stamp)
+{
+	struct image_cache_entry *ic, *old, *next;
+	size_t size = sizeof(struct win32_image_section) * ws->ws_nsecs;
+
+	if (!(ic = kmalloc(sizeof(*ic) + size, GFP_KERNEL)))
+		return;
+	ic->ic_stamp = *stamp;
+	copy_image_info(&ic->ic_ws, ws);
+	memcpy(ic->ic_sections, ws->ws_sections, size);
+
+	mutex_lock(&image_cache_mutex);
+	/* an older version of the same file will not be asked for again */
+	list_for_each_entry_safe(old, next, &image_cache, ic_entry) {
+		if (old->ic_stamp.fs_sb == stamp->fs_sb && old->ic_stamp.fs_ino == stamp->fs_ino) {
+			list_del(&old->ic_entry);
+			kfree(old);
+			image_cache_count--;
+		}
+	}
+	if (image_cache_count == IMAGE_CACHE_SIZE) {
+		old = list_entry(image_cache.prev, struct image_cache_entry, ic_entry);
+		list_del(&old->ic_entry);
+		kfree(old);
+		image_cache_count--;
+	}
+	list_add(&ic->ic_entry, &image_cache);
+	image_cache_count++;
+	mutex_unlock(&image_cache_mutex);
+}
+
+void exit_image_cache(void)
+{
+	struct image_cache_entry *ic, *next;
+
+	list_for_each_entry_safe(ic, next, &image_cache, ic_entry)
+		kfree(ic);
+	INIT_LIST_HEAD(&image_cache);
+	image_cache_count = 0;
+}
+
 /*
  * parse a PE image and build a set of VM areas and a relocation table index
  * - performs a cursory check of the image's validity
@@ -87,9 +186,11 @@ int image_section_setup(struct win32_section *ws)
 	IMAGE_SECTION_HEADER	*sec_hdr, *ps;
 	struct win32_image_section	*wis;
 	struct file	*file;
+	struct file_stamp	stamp;
 	size_t	hdr_len, nt_hdr_size, sec_hdr_size, total_hdr_size;
 	void	*hdr_buf;
 	DWORD	rva;
+	loff_t	i_size;
 	int	sec_align, file_align, sec_mask, file_mask;
 	int	tmp, err;
 
@@ -107,6 +208,11 @@ int image_section_setup(struct win32_section *ws)
 	if (!(file->f_mode & FMODE_READ))
 		return STATUS_ACCESS_DENIED;
 
+	/* taken before reading, a change made meanwhile makes the entry stale */
+	get_file_stamp(file, &stamp);
+	if (image_cache_lookup(ws, &stamp))
+		return 0;
+
 	/* get the image header and find the offset of the extended header */
 	/* alloc 2 pages to store file header */
 	hdr_buf = (void *)__get_free_pages(GFP_KERNEL, 1);
@@ -173,6 +279,7 @@ int image_section_setup(struct win32_section *ws)
 		goto free_hdr;
 
 	ws->ws_secoff = (char *)sec_hdr - (char *)hdr_buf;
+	i_size = stamp.fs_size;
 
 	/* allocate my section table (with a dummy section on the end) */
 	err = STATUS_NO_MEMORY;
@@ -189,6 +296,7 @@ int image_section_setup(struct win32_section *ws)
 	wis->wis_fpos	= 0;
 	wis->wis_size	= ALIGN_UP(total_hdr_size, sec_align);
 	wis->wis_rawsize = ALIGN_UP(total_hdr_size, file_align);
+	wis->wis_maplen = 0;
 	wis->wis_flags = MAP_DENYWRITE | MAP_PRIVATE;
 	wis->wis_protect = PROT_READ;
 	wis->wis_character = 0;
@@ -256,11 +364,24 @@ int image_section_setup(struct win32_section *ws)
 		if ((wis->wis_flags & MAP_SHARED)
 				&& (wis->wis_protect & (PROT_WRITE | PROT_EXEC)))
 			goto free_section;
+
+		/*
+		 * whole pages of raw data at a page aligned file position can be
+		 * mapped private from the file, and so shared with every other
+		 * process until one of them writes (relocates) a page
+		 */
+		wis->wis_maplen = 0;
+		if (!(wis->wis_flags & MAP_SHARED) && !(wis->wis_fpos & ~PAGE_MASK)
+				&& wis->wis_fpos < i_size) {
+			wis->wis_maplen = min((loff_t)wis->wis_rawsize, i_size - wis->wis_fpos);
+			wis->wis_maplen &= PAGE_MASK;
+		}
 	}
 
 	/* total segements len */
 	ws->ws_len = rva;
 	ws->ws_pagelen = PAGE_ALIGN(rva);
+	image_cache_add(ws, &stamp);
 	err = 0;
 	goto free_hdr;
 
@@ -275,6 +396,39 @@ free_hdr:
 } /* end image_section_setup */
 EXPORT_SYMBOL(image_section_setup);
 
+/*
+ * map the raw data of a section from the page cache, over the anonymous
+ * mapping at addr; the pages are read ahead on the first fault
+ * return 1 if mapped, 0 to fall back to reading the data in
+ */
+static int map_image_pages(struct task_struct *tsk, struct file *file,
+		struct win32_image_section *wis, unsigned long addr)
+{
+	unsigned long	ret;
+	struct vm_area_struct	*vma;
+
+	if (!wis->wis_maplen)
+		return 0;
+
+	ret = win32_do_mmap_pgoff(tsk, file, addr, wis->wis_maplen, PROT_READ | PROT_WRITE,
+			wis->wis_flags | MAP_FIXED, wis->wis_fpos >> PAGE_SHIFT);
+	if (IS_ERR((void *)ret)) {
+		/* e.g. the file is open for writing, leave the anonymous pages */
+		win32_do_mmap_pgoff(tsk, NULL, addr, wis->wis_maplen, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, 0);
+		return 0;
+	}
+
+	down_read(&tsk->mm->mmap_sem);
+	vma = find_vma(tsk->mm, ret);
+	if (vma && vma->vm_file == file && vma->vm_ops && vma->vm_ops->fault == filemap_fault) {
+		vma->vm_ops = &image_section_vm_ops;
+		vma->vm_private_data = READAHEAD_PENDING;
+	}
+	up_read(&tsk->mm->mmap_sem);
+	return 1;
+}
+
 /*
  * map the PE image into the process's VM space
  */
@@ -285,14 +439,10 @@ static int image_section_map(struct task_struct *tsk, struct win32_section *ws,
 	unsigned long		ret, base;
 	struct file		*file = ws->ws_file;
 	struct win32_image_section	*wis;
-#ifndef UNALIGNED_MMAP
 	loff_t pos;
 	ssize_t readed;
+	size_t mapped;
 	struct mm_struct *current_mm = current->mm;
-#else
-	struct vm_area_struct	*vma;
-	struct vm_operations_struct	*vmops;
-#endif
 
 	base = *addr;
 	if (!base)
@@ -303,46 +453,29 @@ static int image_section_map(struct task_struct *tsk, struct win32_section *ws,
 		if (wis->wis_character & IMAGE_SCN_TYPE_NOLOAD)
 			continue;
 
-		/* set vmops */
+		/* map fixed once the base is known */
 		flags = 0;
 		if (ws->ws_imagecharacter & IMAGE_FILE_EXECUTABLE_IMAGE || load_addr_set)
 			flags = MAP_FIXED;
 
-#ifndef UNALIGNED_MMAP
 		ret = win32_do_mmap_pgoff(tsk, NULL, base + wis->wis_rva, wis->wis_size,
 				PROT_READ | PROT_WRITE, wis->wis_flags | flags, 0);
-#else
-		if ((wis->wis_flags & MAP_SHARED) && (wis->wis_protect & PROT_WRITE))
-			vmops = &file_pe_shared_mmap;
-		else
-			vmops = &file_pe_private_mmap;
-
-		/* map a section */
-		ret = win32_do_mmap_pgoff(tsk, file, base + wis->wis_rva, wis->wis_size,
-				wis->wis_protect, wis->wis_flags | flags, wis->wis_rva >> PAGE_SHIFT);
-
-		/* fixup vma */
-		vma = find_vma(tsk->mm, ret);
-		if (vma) {
-			vma->vm_private_data = (void *)ws;
-			vma->vm_ops = vmops;
-		}
-#endif
-
 		if (IS_ERR((void *)ret))
 			goto failed;
 
-#ifndef UNALIGNED_MMAP
+		mapped = map_image_pages(tsk, file, wis, ret) ? wis->wis_maplen : 0;
+
         if (tsk != current)
             current_mm = attach_process((struct kprocess *)tsk->ethread->threads_process);
 
-        pos = (loff_t)wis->wis_fpos;
-        readed = vfs_read(file, (char *)ret, wis->wis_rawsize, &pos);
+        if (mapped < wis->wis_rawsize) {
+            pos = (loff_t)wis->wis_fpos + mapped;
+            readed = vfs_read(file, (char *)ret + mapped, wis->wis_rawsize - mapped, &pos);
+        }
         sys_mprotect(ret, wis->wis_size, wis->wis_protect);
 
         if (tsk != current)
             detach_process(current_mm);
-#endif
 
 		if (!load_addr_set) {
 			load_addr_set = 1;
@@ -392,65 +525,31 @@ static int image_section_munmap(struct win32_section *ws)
 	return ret;
 } /* image_section_munmap */
 
-#ifdef UNALIGNED_MMAP
-static struct page *filemap_pe_nopage(struct vm_area_struct *area,
-				unsigned long address, int *type)
+/*
+ * fault on a section mapped from the page cache
+ * the first fault reads the whole section ahead, so that starting a program
+ * costs a few large reads instead of one small read per page touched
+ */
+static int image_section_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	int	error;
-	void	*pgbuf;
-	unsigned long	pgoff, floff, voff, size;
-	struct page	*page;
-	struct file	*file = area->vm_file;
-	struct win32_section	*ws;
-	struct win32_image_section	*wis;
-
-	if (!(ws = (struct win32_section *)area->vm_private_data))
-		return NULL;
-	for (wis = ws->ws_sections; wis < ws->ws_sections + ws->ws_nsecs; wis++)
-		if ((address < ws->ws_realbase + wis->wis_rva + wis->wis_size)
-				&& (address >= ws->ws_realbase + wis->wis_rva))
-			break;
-
-	/* get page offset and virtual offset */
-	voff = address - area->vm_start;
-	pgoff = (voff >> PAGE_CACHE_SHIFT) + area->vm_pgoff;
-	voff += area->vm_start - ws->ws_realbase - wis->wis_rva;
-
-	if (pgoff >= ((wis->wis_rva + wis->wis_size) >> PAGE_CACHE_SHIFT))
-		if (area->vm_mm == current->mm)
-			return NULL;
-
-	page = alloc_pages(GFP_ATOMIC, 0);
-	if (!page)
-		return NOPAGE_OOM;
-
-	pgbuf = kmap(page);
-	if (pgbuf) {
-		if (voff > wis->wis_rawsize)
-			memset(pgbuf, 0, PAGE_SIZE);
-		else {
-			floff = voff + wis->wis_fpos;
-			size = wis->wis_rawsize - voff;
-			size = size < PAGE_SIZE ? size : PAGE_SIZE;
-			error = kernel_read(file, floff, pgbuf, size);
-			if (size < PAGE_SIZE)
-				memset(pgbuf + size, 0, PAGE_SIZE - size);
-
-			if (error < 0)
-				goto cleanup;
-
-			grab_swap_token();
-		}
-
-		kunmap(page);
-		return page;
+	struct file	*file = vma->vm_file;
+	struct file_ra_state	ra;
+	pgoff_t	index, end;
+	unsigned long	chunk;
+
+	if (vma->vm_private_data == READAHEAD_PENDING) {
+		vma->vm_private_data = NULL;
+
+		/* a private state, chunks of ra_pages are each read as requested */
+		file_ra_state_init(&ra, file->f_mapping);
+		chunk = ra.ra_pages;
+		end = chunk ? vma->vm_pgoff + vma_pages(vma) : 0;
+		for (index = vma->vm_pgoff; index < end; index += chunk)
+			page_cache_sync_readahead(file->f_mapping, &ra, file, index,
+					min(chunk, (unsigned long)(end - index)));
 	}
 
-cleanup:
-	kunmap(page);
-	__free_pages(page, 0);
-	return NULL;
-} /* end filemap_pe_nopage */
-#endif /* UNALIGNED_MMAP */
+	return filemap_fault(vma, vmf);
+} /* end image_section_fault */
 
 #endif /* CONFIG_UNIFIED_KERNEL */
@@ -0,0 +1,199 @@
+/*
+ * largepage.c
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * largepage.c: MEM_LARGE_PAGES and SEC_LARGE_PAGES memory
+ *
+ * Large pages are the pages of an unlinked file on the hugetlbfs mounted
+ * at the hugetlbfs module parameter.  Without such a mount, or when it is
+ * short of free huge pages, the memory is made of normal pages instead.
+ * /proc/unifiedkernel/mm/largepages counts both.
+ */
+#include <linux/hugetlb.h>
+#include <linux/magic.h>
+#include <linux/mman.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include "virtual.h"
+#include "thread.h"
+#include "wineserver/security.h"
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+extern void unlink(const char *filename);
+
+static char *hugetlbfs_path = "/dev/hugepages";
+module_param_named(hugetlbfs, hugetlbfs_path, charp, S_IRUGO);
+
+static atomic_t large_file_serial = ATOMIC_INIT(0);
+static atomic_long_t large_count = ATOMIC_LONG_INIT(0);
+static atomic_long_t large_bytes = ATOMIC_LONG_INIT(0);
+static atomic_long_t fallback_count = ATOMIC_LONG_INIT(0);
+static atomic_long_t fallback_bytes = ATOMIC_LONG_INIT(0);
+
+/* what GetLargePageMinimum returns, 0 if large pages are not supported */
+unsigned long large_page_minimum(void)
+{
+#ifdef CONFIG_HUGETLB_PAGE
+	return HPAGE_SIZE;
+#else
+	return 0;
+#endif
+}
+
+/* check a large page request of the current thread */
+NTSTATUS check_large_pages(unsigned long addr, unsigned long size)
+{
+	struct w32thread *thread = get_current_w32thread();
+	unsigned long minimum = large_page_minimum();
+
+	if (!minimum)
+		return STATUS_NOT_SUPPORTED;
+	if ((addr | size) & (minimum - 1))
+		return STATUS_INVALID_PARAMETER;
+	if (!thread || !thread_single_check_privilege(thread, &SeLockMemoryPrivilege))
+		return STATUS_PRIVILEGE_NOT_HELD;
+	return STATUS_SUCCESS;
+}
+
+/* create an unlinked file on hugetlbfs, NULL if there is none */
+struct file *open_large_page_file(void)
+{
+	struct file	*filp;
+	char	*name;
+
+	name = kasprintf(GFP_KERNEL, "%s/uk-%d-%u", hugetlbfs_path, current->tgid,
+			atomic_inc_return(&large_file_serial));
+	if (!name)
+		return NULL;
+
+	filp = filp_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (!IS_ERR(filp))
+		unlink(name);
+	kfree(name);
+	if (IS_ERR(filp))
+		return NULL;
+
+	/* is_file_hugepages() needs symbols the kernel does not export */
+	if (filp->f_path.dentry->d_sb->s_magic != HUGETLBFS_MAGIC) {
+		fput(filp);
+		return NULL;
+	}
+	return filp;
+} /* end open_large_page_file */
+
+/*
+ * reserve the huge pages of a whole large page file up front
+ * hugetlbfs only reserves them when a shared mapping is made, for the inode,
+ * and they stay reserved once it is unmapped, so probe with such a mapping
+ */
+int reserve_large_page_file(struct file *filp, unsigned long size)
+{
+	struct mm_struct	*mm = current->mm;
+	unsigned long	addr;
+
+	if (!mm)
+		return -EINVAL;
+
+	down_write(&mm->mmap_sem);
+	addr = do_mmap_pgoff(filp, 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+	if (!IS_ERR_VALUE(addr))
+		do_munmap(mm, addr, size);
+	up_write(&mm->mmap_sem);
+
+	return IS_ERR_VALUE(addr) ? (int)addr : 0;
+} /* end reserve_large_page_file */
+
+/*
+ * map anonymous memory made of large pages if possible, of normal pages if not
+ * return the address or an error as win32_do_mmap_pgoff
+ */
+unsigned long map_large_pages(struct task_struct *tsk, unsigned long addr,
+		unsigned long size, unsigned long prot, unsigned long flags)
+{
+	struct file	*file = open_large_page_file();
+	unsigned long	ret;
+
+	if (file) {
+		/* the mapping holds its own reference */
+		ret = win32_do_mmap_pgoff(tsk, file, addr, size, prot, flags, 0);
+		fput(file);
+		if (!IS_ERR((void *)ret)) {
+			account_large_pages(size, 1);
+			return ret;
+		}
+	}
+
+	ret = win32_do_mmap_pgoff(tsk, NULL, addr, size, prot, flags, 0);
+	if (!IS_ERR((void *)ret))
+		account_large_pages(size, 0);
+	return ret;
+} /* end map_large_pages */
+
+void account_large_pages(unsigned long size, int large)
+{
+	if (large) {
+		atomic_long_inc(&large_count);
+		atomic_long_add(size, &large_bytes);
+	}
+	else {
+		atomic_long_inc(&fallback_count);
+		atomic_long_add(size, &fallback_bytes);
+	}
+}
+
+static int largepages_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "minimum %lu\n", large_page_minimum());
+	seq_printf(m, "hugetlbfs %s\n", hugetlbfs_path);
+	seq_printf(m, "large %ld allocations %ld bytes\n",
+			atomic_long_read(&large_count), atomic_long_read(&large_bytes));
+	seq_printf(m, "fallback %ld allocations %ld bytes\n",
+			atomic_long_read(&fallback_count), atomic_long_read(&fallback_bytes));
+	return 0;
+}
+
+static int largepages_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, largepages_show, NULL);
+}
+
+static const struct file_operations largepages_fops = {
+	.owner		= THIS_MODULE,
+	.open		= largepages_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+int large_page_proc_init(struct proc_dir_entry *parent)
+{
+	if (!proc_create("largepages", S_IRUGO, parent, &largepages_fops))
+		return -ENOMEM;
+	return 0;
+}
+
+void large_page_proc_exit(struct proc_dir_entry *parent)
+{
+	remove_proc_entry("largepages", parent);
+}
+#endif /* CONFIG_UNIFIED_KERNEL */
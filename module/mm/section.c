@@ -210,6 +210,16 @@ NtCreateSection(
 		if (!wfile && (AllocationAttributes & _SEC_RESERVE))
 			section->ws_flags |= MAP_RESERVE;
 
+		if (AllocationAttributes & _SEC_LARGE_PAGES) {
+			/* only pagefile backed sections, committed as a whole */
+			Status = STATUS_INVALID_PARAMETER;
+			if (wfile || (AllocationAttributes & _SEC_RESERVE))
+				goto cleanup_handle;
+			Status = check_large_pages(0, section->ws_len);
+			if (!NT_SUCCESS(Status))
+				goto cleanup_handle;
+		}
+
 		if ((Protect & _PAGE_WRITECOPY) || (Protect & _PAGE_EXECUTE_WRITECOPY))
 			/* copy on write */
 			section->ws_flags |= MAP_PRIVATE;
@@ -673,6 +683,12 @@ map_section_view(
 	if (!(thread = get_first_thread(Process)))
 		return STATUS_THREAD_NOT_IN_PROCESS;
 
+	/* views of a large page section are made of whole large pages */
+	if ((section->ws_alloctype & _SEC_LARGE_PAGES)
+			&& (((SectionOffset ? SectionOffset->u.LowPart : 0) | *ViewSize
+				| (unsigned long)*BaseAddress) & (large_page_minimum() - 1)))
+		return STATUS_MAPPED_ALIGNMENT;
+
 	/* map offset, aligned to PAGE_SIZE */
 	if ((offset = SectionOffset ? SectionOffset->u.LowPart : 0))
 		offset &= PAGE_MASK;
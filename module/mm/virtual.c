@@ -26,6 +26,7 @@
  */
 #include <linux/mman.h>
 #include <linux/syscalls.h>
+#include <linux/highmem.h>
 #include "virtual.h"
 #include "attach.h"
 #include "section.h"
@@ -353,12 +354,21 @@ NtAllocateVirtualMemory(IN HANDLE ProcessHandle,
 			uk_mprotect(first_thread->et_task->mm, address, size, prot);
 			goto allocated;
 		case MEM_RESERVE:
+			/* large pages are committed when reserved */
+			status = STATUS_INVALID_PARAMETER;
+			if (AllocationType & MEM_LARGE_PAGES)
+				goto out;
 			address &= RESERVE_PAGE_MASK;
 			prot = PROT_NONE;
 			flags = MAP_PRIVATE | MAP_RESERVE;
 			break;
 		case MEM_RESERVE | MEM_COMMIT:
 		default:
+			if (AllocationType & MEM_LARGE_PAGES) {
+				status = check_large_pages(address, size);
+				if (!NT_SUCCESS(status))
+					goto out;
+			}
 			address &= RESERVE_PAGE_MASK;
 			prot = prot_table_wtol[ffs(Protect & 0xff) - 1];
 			flags = MAP_PRIVATE | MAP_RESERVE;
@@ -374,8 +384,11 @@ NtAllocateVirtualMemory(IN HANDLE ProcessHandle,
 		flags |= MAP_FIXED;
 	}
 
-	address = win32_do_mmap_pgoff(first_thread->et_task, NULL,
-			address, size, prot, flags, 0);
+	if (AllocationType & MEM_LARGE_PAGES)
+		address = map_large_pages(first_thread->et_task, address, size, prot, flags);
+	else
+		address = win32_do_mmap_pgoff(first_thread->et_task, NULL,
+				address, size, prot, flags, 0);
 	if (IS_ERR((void *)address)) {
 		status = (NTSTATUS)address;
 		goto out;
@@ -404,6 +417,48 @@ out:
 } /* end NtAllocateVirtualMemory */
 EXPORT_SYMBOL(NtAllocateVirtualMemory);
 
+/*
+ * copy between a buffer of the current process and the memory of a process,
+ * a page at a time from the pinned page itself, without a bounce buffer
+ * return the number of bytes copied
+ */
+static unsigned long copy_process_vm(struct task_struct *tsk, struct mm_struct *mm,
+		unsigned long addr, void __user *buf, unsigned long len, int write)
+{
+	struct page	*page;
+	unsigned long	done = 0, offset, bytes, left;
+	void	*maddr;
+	int	ret;
+
+	while (done < len) {
+		down_read(&mm->mmap_sem);
+		ret = get_user_pages(tsk, mm, addr, 1, write, 0, &page, NULL);
+		up_read(&mm->mmap_sem);
+		if (ret != 1)
+			break;
+
+		/* mmap_sem is dropped, the buffer may fault, even into the same mm */
+		offset = addr & ~PAGE_MASK;
+		bytes = min(len - done, PAGE_SIZE - offset);
+		maddr = kmap(page);
+		if (write) {
+			left = copy_from_user(maddr + offset, buf, bytes);
+			set_page_dirty_lock(page);
+		}
+		else
+			left = copy_to_user(buf, maddr + offset, bytes);
+		kunmap(page);
+		page_cache_release(page);
+
+		done += bytes - left;
+		if (left)
+			break;
+		addr += bytes;
+		buf += bytes;
+	}
+	return done;
+} /* end copy_process_vm */
+
 /*
  * NtWriteVirtualMemory
  * Write to  memory
@@ -418,9 +473,7 @@ NtWriteVirtualMemory(IN HANDLE ProcessHandle,
 	struct ethread 	*first_thread;
 	struct eprocess	*process;
 	struct mm_struct	*mm = NULL;
-	struct mm_struct	*cur_mm = NULL;
 	struct vm_area_struct	*vma;
-	PVOID		kbuf;
 	MODE		previous_mode;
 	NTSTATUS 	status;
 
@@ -462,42 +515,21 @@ NtWriteVirtualMemory(IN HANDLE ProcessHandle,
 		goto out;
 	}
 
-	kbuf = kmalloc(NumberOfBytesToWrite, GFP_KERNEL);
-	if (!kbuf) {
-		status = STATUS_NO_MEMORY;
-		goto out;
-	}
-
-	status = STATUS_INVALID_ADDRESS;
-	if (copy_from_user(kbuf, Buffer, NumberOfBytesToWrite))
-		goto out_free_kbuf;
-
 	/* Write memory */
-	if (process == get_current_eprocess()) {
-		if (copy_to_user(BaseAddress, kbuf, NumberOfBytesToWrite))
-			goto out_free_kbuf;
-	}
-	else {
-		cur_mm = attach_process(&process->pcb);
-		if (copy_to_user(BaseAddress, kbuf, NumberOfBytesToWrite)) {
-			detach_process(cur_mm);
-			goto out_free_kbuf;
-		}
-		detach_process(cur_mm);
-	}
+	status = STATUS_INVALID_ADDRESS;
+	if (copy_process_vm(first_thread->et_task, mm, (ULONG)BaseAddress, Buffer,
+				NumberOfBytesToWrite, 1) != NumberOfBytesToWrite)
+		goto out;
 
 	if (previous_mode == UserMode && NumberOfBytesWritten) {
 		if (copy_to_user(NumberOfBytesWritten, &NumberOfBytesToWrite, sizeof(ULONG)))
-			goto out_free_kbuf;
+			goto out;
 	}
 	/* TODO
 	   else *NumberOfBytesWritten = NumberOfBytesToWrite;
 	   */
 	status = STATUS_SUCCESS;
 
-out_free_kbuf:
-	kfree(kbuf);
-
 out:
 	deref_object(process);
 	return status;
@@ -518,8 +550,7 @@ NtReadVirtualMemory(IN HANDLE ProcessHandle,
 {
 	struct eprocess	*process;
 	struct ethread	*first_thread;
-	PVOID	kbuf;
-	struct mm_struct	*mm, *cur_mm;
+	struct mm_struct	*mm;
 	struct vm_area_struct	*vma;
 	MODE	previous_mode;
 	NTSTATUS status = STATUS_SUCCESS;
@@ -562,34 +593,15 @@ NtReadVirtualMemory(IN HANDLE ProcessHandle,
 		goto out;
 	}
 
-	kbuf = kmalloc(NumberOfBytesToRead, GFP_KERNEL);
-	if (!kbuf) {
-		status = STATUS_NO_MEMORY;
-		goto out;
-	}
-
-	status = STATUS_INVALID_ADDRESS;
-
 	/* Read memory */
-	if (process == get_current_eprocess()) {
-		if (copy_from_user(kbuf, BaseAddress, NumberOfBytesToRead))
-			goto out_free_kbuf;
-	}
-	else {
-		cur_mm = attach_process(&process->pcb);
-		if(copy_from_user(kbuf, BaseAddress, NumberOfBytesToRead)) {
-			detach_process(cur_mm);
-			goto out_free_kbuf;
-		}
-		detach_process(cur_mm);
-	}
-
-	if (copy_to_user(Buffer, kbuf, NumberOfBytesToRead))
-		goto out_free_kbuf;
+	status = STATUS_INVALID_ADDRESS;
+	if (copy_process_vm(first_thread->et_task, mm, (ULONG)BaseAddress, Buffer,
+				NumberOfBytesToRead, 0) != NumberOfBytesToRead)
+		goto out;
 
 	if (previous_mode == UserMode && NumberOfBytesRead) {
 		if (copy_to_user(NumberOfBytesRead, &NumberOfBytesToRead, sizeof(ULONG))) {
-			goto out_free_kbuf;
+			goto out;
 		}
 	}
 	/* TODO
@@ -597,9 +609,6 @@ NtReadVirtualMemory(IN HANDLE ProcessHandle,
 	   */
 	status = STATUS_SUCCESS;
 
-out_free_kbuf:
-	kfree(kbuf);
-
 out:
 	deref_object(process);
 	return status;
@@ -24,13 +24,14 @@
  * atom.c:
  * Refered to Wine code
  */
+#include <linux/log2.h>
 #include "unistr.h"
 #include "handle.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 #define HASH_SIZE     37
 #define MIN_HASH_SIZE 4
-#define MAX_HASH_SIZE 0x200
+#define MAX_HASH_SIZE 0x200        /* largest size a table can be created with */
 
 #define MAX_ATOM_LEN  255
 #define MIN_STR_ATOM  0xc000
@@ -39,22 +40,29 @@
 struct atom_entry
 {
 	struct atom_entry *next;   /* hash table list */
-	struct atom_entry *prev;   /* hash table list */
 	int                count;  /* reference count */
 	short              pinned; /* whether the atom is pinned or not */
 	atom_t             atom;   /* atom handle */
-	unsigned short     hash;   /* string hash */
 	unsigned short     len;    /* string len */
+	unsigned int       hash;   /* string hash, the low bits select the bucket */
 	WCHAR              str[1]; /* atom string */
 };
 
+/*
+ * The hash table has a power of 2 number of buckets and doubles whenever
+ * it holds more atoms than buckets, so chains stay about one entry long.
+ * The handles freed by deleted atoms are kept on a stack for reuse.
+ */
 struct atom_table
 {
 	struct object       obj;                 /* object header */
 	int                 count;               /* count of atom handles */
 	int                 last;                /* last handle in-use */
 	struct atom_entry **handles;             /* atom handles */
-	int                 entries_count;       /* number of hash entries */
+	unsigned short     *free_handles;        /* unused handles up to last */
+	int                 free_count;          /* number of unused handles */
+	int                 atoms_count;         /* number of atoms */
+	int                 entries_count;       /* number of hash entries, a power of 2 */
 	struct atom_entry **entries;             /* hash table entries */
 };
 
@@ -135,7 +143,11 @@ static struct atom_table *create_table(int entries_count)
 
 		if ((entries_count < MIN_HASH_SIZE) ||
 				(entries_count > MAX_HASH_SIZE)) entries_count = HASH_SIZE;
-		table->entries_count = entries_count;
+		table->entries_count = roundup_pow_of_two(entries_count);
+		table->handles = NULL;
+		table->free_handles = NULL;
+		table->free_count = 0;
+		table->atoms_count = 0;
 		if (!(table->entries = malloc(sizeof(*table->entries) * table->entries_count))) {
 			set_error(STATUS_NO_MEMORY);
 			goto fail;
@@ -143,7 +155,8 @@ static struct atom_table *create_table(int entries_count)
 		memset(table->entries, 0, sizeof(*table->entries) * table->entries_count);
 		table->count = 64;
 		table->last  = -1;
-		if ((table->handles = mem_alloc(sizeof(*table->handles) * table->count)))
+		if ((table->handles = mem_alloc(sizeof(*table->handles) * table->count)) &&
+				(table->free_handles = mem_alloc(sizeof(*table->free_handles) * table->count)))
 			return table;
 fail:
 		release_object(table);
@@ -167,21 +180,31 @@ static struct atom_entry *get_atom_entry(struct atom_table *table, atom_t atom)
 static atom_t add_atom_entry(struct atom_table *table, struct atom_entry *entry)
 {
 	int i;
-	for (i = 0; i <= table->last; i++)
-		if (!table->handles[i])
-			goto found;
+
+	if (table->free_count) {
+		i = table->free_handles[--table->free_count];
+		goto found;
+	}
+	i = table->last + 1;
 	if (i == table->count) {
 		struct atom_entry **new_table = NULL;
+		unsigned short *new_free = NULL;
 		int new_size = table->count + table->count / 2;
 		if (new_size > MAX_ATOMS) new_size = MAX_ATOMS;
-		if (new_size > table->count)
+		if (new_size > table->count) {
 			new_table = realloc(table->handles, sizeof(*table->handles) * new_size, sizeof(*table->handles) * table->count);
-		if (!new_table) {
+			if (new_table) {
+				table->handles = new_table;
+				new_free = realloc(table->free_handles, sizeof(*table->free_handles) * new_size,
+						sizeof(*table->free_handles) * table->count);
+			}
+		}
+		if (!new_free) {
 			set_error(STATUS_NO_MEMORY);
 			return 0;
 		}
 		table->count = new_size;
-		table->handles = new_table;
+		table->free_handles = new_free;
 	}
 	table->last = i;
 found:
@@ -190,14 +213,63 @@ found:
 	return entry->atom;
 }
 
-/* compute the hash code for a string */
-static unsigned short atom_hash(struct atom_table *table, const WCHAR *str, data_size_t len)
+/* release the handle of an atom entry */
+static void free_atom_entry(struct atom_table *table, struct atom_entry *entry)
 {
-	unsigned int i;
-	unsigned short hash = 0;
+	int i = entry->atom - MIN_STR_ATOM;
+
+	table->handles[i] = NULL;
+	table->free_handles[table->free_count++] = i;
+}
+
+/* compute the hash code for a string, FNV-1a of the upper-cased characters */
+static unsigned int atom_hash(const WCHAR *str, data_size_t len)
+{
+	unsigned int i, hash = 2166136261u;
 	for (i = 0; i < len; i++)
-		hash ^= toupperW(str[i]) + i;
-	return hash % table->entries_count;
+		hash = (hash ^ toupperW(str[i])) * 16777619;
+	return hash ^ (hash >> 16);  /* fold the high bits into the bucket bits */
+}
+
+static inline struct atom_entry **get_bucket(struct atom_table *table, unsigned int hash)
+{
+	return &table->entries[hash & (table->entries_count - 1)];
+}
+
+/* double the number of hash entries; the table is left as it is if there is no memory */
+static void grow_hash(struct atom_table *table)
+{
+	struct atom_entry **old_entries = table->entries, *entry, *next;
+	int i, old_count = table->entries_count;
+
+	if (!(table->entries = malloc(sizeof(*table->entries) * old_count * 2))) {
+		table->entries = old_entries;
+		clear_error();
+		return;
+	}
+	memset(table->entries, 0, sizeof(*table->entries) * old_count * 2);
+	table->entries_count = old_count * 2;
+
+	for (i = 0; i < old_count; i++) {
+		for (entry = old_entries[i]; entry; entry = next) {
+			struct atom_entry **bucket = get_bucket(table, entry->hash);
+			next = entry->next;
+			entry->next = *bucket;
+			*bucket = entry;
+		}
+	}
+	free(old_entries);
+}
+
+/* remove an entry from its hash list */
+static void unlink_atom_entry(struct atom_table *table, struct atom_entry *entry)
+{
+	struct atom_entry **ptr = get_bucket(table, entry->hash);
+
+	while (*ptr != entry)
+		ptr = &(*ptr)->next;
+	*ptr = entry->next;
+	table->atoms_count--;
 }
 
 /* dump an atom table */
@@ -206,15 +278,15 @@ static void atom_table_dump(struct object *obj, int verbose)
 	int i;
 	struct atom_table *table = (struct atom_table *)obj;
 
-	ktrace("Atom table size=%d entries=%d\n",
-			table->last + 1, table->entries_count);
+	ktrace("Atom table size=%d atoms=%d entries=%d\n",
+			table->last + 1, table->atoms_count, table->entries_count);
 	if (!verbose)
 		return;
 	for (i = 0; i <= table->last; i++) {
 		struct atom_entry *entry = table->handles[i];
 		if (!entry)
 			continue;
-		ktrace("%04x: ref=%d pinned=%c hash=%d\n",
+		ktrace("%04x: ref=%d pinned=%c hash=%08x\n",
 				entry->atom, entry->count, entry->pinned ? 'Y' : 'N', entry->hash);
 	}
 }
@@ -230,16 +302,17 @@ static void atom_table_destroy(struct object *obj)
 			free(table->handles[i]);
 		free(table->handles);
 	}
+	free(table->free_handles);
 	free(table->entries);
 }
 
 /* find an atom entry in its hash list */
 static struct atom_entry *find_atom_entry(struct atom_table *table, const WCHAR *str,
-					data_size_t len, unsigned short hash)
+					data_size_t len, unsigned int hash)
 {
-	struct atom_entry *entry = table->entries[hash];
+	struct atom_entry *entry = *get_bucket(table, hash);
 	while (entry) {
-		if (entry->len == len && !memicmpW(entry->str, str, len))
+		if (entry->hash == hash && entry->len == len && !memicmpW(entry->str, str, len))
 			break;
 		entry = entry->next;
 	}
@@ -250,7 +323,7 @@ static struct atom_entry *find_atom_entry(struct atom_table *table, const WCHAR
 static atom_t add_atom(struct atom_table *table, const WCHAR *str, data_size_t len)
 {
 	struct atom_entry *entry;
-	unsigned short hash = atom_hash(table, str, len);
+	unsigned int hash = atom_hash(str, len);
 	atom_t atom = 0;
 
 	if (!len) {
@@ -268,10 +341,14 @@ static atom_t add_atom(struct atom_table *table, const WCHAR *str, data_size_t l
 
 	if ((entry = mem_alloc(sizeof(*entry) + (len - 1) * sizeof(WCHAR)))) {
 		if ((atom = add_atom_entry(table, entry))) {
-			entry->prev  = NULL;
-			if ((entry->next = table->entries[hash]))
-				entry->next->prev = entry;
-			table->entries[hash] = entry;
+			struct atom_entry **bucket;
+
+			if (++table->atoms_count > table->entries_count &&
+					table->entries_count < MAX_ATOMS)
+				grow_hash(table);
+			bucket = get_bucket(table, hash);
+			entry->next = *bucket;
+			*bucket = entry;
 			entry->count  = 1;
 			entry->pinned = 0;
 			entry->hash   = hash;
@@ -293,12 +370,8 @@ static void delete_atom(struct atom_table *table, atom_t atom, int if_pinned)
 	if (entry->pinned && !if_pinned)
 		set_error(STATUS_WAS_LOCKED);
 	else if (!--entry->count) {
-		if (entry->next)
-			entry->next->prev = entry->prev;
-		if (entry->prev)
-			entry->prev->next = entry->next;
-		else table->entries[entry->hash] = entry->next;
-		table->handles[atom - MIN_STR_ATOM] = NULL;
+		unlink_atom_entry(table, entry);
+		free_atom_entry(table, entry);
 		free(entry);
 	}
 }
@@ -316,7 +389,7 @@ static atom_t find_atom(struct atom_table *table, const WCHAR *str, data_size_t
 		set_error(STATUS_INVALID_PARAMETER);
 		return 0;
 	}
-	if (table && (entry = find_atom_entry(table, str, len, atom_hash(table, str, len))))
+	if (table && (entry = find_atom_entry(table, str, len, atom_hash(str, len))))
 		return entry->atom;
 	set_error(STATUS_OBJECT_NAME_NOT_FOUND);
 	return 0;
@@ -372,7 +445,7 @@ atom_t find_global_atom(struct winstation *winstation, const WCHAR *str, data_si
 
 	if (!len || len > MAX_ATOM_LEN || !global_table)
 		return 0;
-	if ((entry = find_atom_entry(global_table, str, len, atom_hash(global_table, str, len))))
+	if ((entry = find_atom_entry(global_table, str, len, atom_hash(str, len))))
 		return entry->atom;
 	return 0;
 }
@@ -510,12 +583,8 @@ DECL_HANDLER(empty_atom_table)
 		for (i = 0; i <= table->last; i++) {
 			entry = table->handles[i];
 			if (entry && (!entry->pinned || req->if_pinned)) {
-				if (entry->next)
-					entry->next->prev = entry->prev;
-				if (entry->prev)
-					entry->prev->next = entry->next;
-				else table->entries[entry->hash] = entry->next;
-				table->handles[i] = NULL;
+				unlink_atom_entry(table, entry);
+				free_atom_entry(table, entry);
 				free(entry);
 			}
 		}
@@ -25,6 +25,8 @@
  * Refered to Wine code
  */
 #include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
 #include "unistr.h"
 #include "handle.h"
 #include "winuser.h"
@@ -107,6 +109,7 @@ struct thread_input
 	int                    caret_hide;    /* caret hide count */
 	int                    caret_state;   /* caret on/off state */
 	struct list_head       msg_list;      /* list of hardware messages */
+	struct list_head       queues;        /* queues using this input */
 	unsigned char          keystate[256]; /* state of each key */
 };
 
@@ -133,6 +136,10 @@ struct msg_queue
 	struct hook_table     *hooks;           /* hook table */
 	timeout_t              last_get_msg;    /* time of last get message call */
 	struct w32thread      *w32thread;
+	struct list_head       input_entry;     /* entry in the input queues list */
+	struct page           *status_page;     /* status page of the thread, see publish_queue_status */
+	spinlock_t             status_lock;     /* serializes updates of the status page */
+	unsigned int           status_seq;      /* last seq written to the status page */
 };
 
 static int msg_queue_signaled(struct object *obj, struct w32thread *thread);
@@ -262,6 +269,85 @@ static unsigned int last_input_time;
 
 static void free_message(struct message *msg);
 
+/*
+ * The status of a queue is copied into the page its thread registered with
+ * NtRegisterQueueStatus, so that user32 can see an empty queue and read key
+ * states without a request.  seq is odd while the copy is being updated.
+ * Updates are serialized by status_lock, and seq is counted in the queue,
+ * so that neither a concurrent update nor the process can leave it odd.
+ * The page is only mapped for the time of an update.
+ */
+static struct uk_queue_status *lock_queue_status(struct msg_queue *queue, unsigned long *flags)
+{
+	struct uk_queue_status *status;
+
+	spin_lock_irqsave(&queue->status_lock, *flags);
+	if (!queue->status_page) {
+		spin_unlock_irqrestore(&queue->status_lock, *flags);
+		return NULL;
+	}
+	status = kmap_atomic(queue->status_page, KM_USER0);
+	status->seq = ++queue->status_seq;
+	smp_wmb();
+	return status;
+}
+
+static void unlock_queue_status(struct msg_queue *queue, struct uk_queue_status *status,
+		unsigned long flags)
+{
+	smp_wmb();
+	status->seq = ++queue->status_seq;
+	kunmap_atomic(status, KM_USER0);
+	spin_unlock_irqrestore(&queue->status_lock, flags);
+}
+
+static void publish_queue_status(struct msg_queue *queue)
+{
+	struct uk_queue_status *status;
+	unsigned long flags;
+
+	if (!(status = lock_queue_status(queue, &flags)))
+		return;
+	status->queue        = 1;
+	status->wake_bits    = queue->wake_bits;
+	status->changed_bits = queue->changed_bits;
+	status->wake_mask    = queue->wake_mask;
+	status->changed_mask = queue->changed_mask;
+	status->paint_count  = queue->paint_count;
+	status->quit_message = queue->quit_message;
+	unlock_queue_status(queue, status, flags);
+}
+
+/* copy the key state of an input to every queue using it */
+static void publish_keystate(struct thread_input *input)
+{
+	struct msg_queue *queue;
+
+	LIST_FOR_EACH_ENTRY(queue, &input->queues, struct msg_queue, input_entry) {
+		struct uk_queue_status *status;
+		unsigned long flags;
+
+		if (!(status = lock_queue_status(queue, &flags)))
+			continue;
+		memcpy(status->keystate, input->keystate, sizeof(status->keystate));
+		unlock_queue_status(queue, status, flags);
+	}
+}
+
+/* switch the thread input of a queue, the queue takes over the reference */
+static void set_queue_input(struct msg_queue *queue, struct thread_input *input)
+{
+	if (queue->input) {
+		list_remove(&queue->input_entry);
+		release_object(queue->input);
+	}
+	queue->input = input;
+	if (input) {
+		list_add_before(&input->queues, &queue->input_entry);
+		publish_keystate(input);
+	}
+}
+
 /* set the caret window in a given thread input */
 static void set_caret_window(struct thread_input *input, user_handle_t win)
 {
@@ -302,6 +388,7 @@ static struct thread_input *create_thread_input(struct w32thread *thread)
 		input->menu_owner  = 0;
 		input->move_size   = 0;
 		INIT_LIST_HEAD(&input->msg_list);
+		INIT_LIST_HEAD(&input->queues);
 		set_caret_window(input, 0);
 		memset(input->keystate, 0, sizeof(input->keystate));
 
@@ -320,8 +407,7 @@ static inline void release_thread_input(struct w32thread *thread)
 
 	if (!input)
 		return;
-	release_object(input);
-	thread->queue->input = NULL;
+	set_queue_input(thread->queue, NULL);
 }
 
 /* create a message queue object */
@@ -358,9 +444,12 @@ static struct msg_queue *create_msg_queue(struct w32thread *thread, struct threa
 		queue->recv_result     = NULL;
 		queue->next_timer_id   = 0x7fff;
 		queue->timeout         = NULL;
-		queue->input           = (struct thread_input *)grab_object(input);
+		queue->input           = NULL;
 		queue->hooks           = NULL;
 		queue->w32thread       = thread;
+		queue->status_page     = thread->queue_status_page;
+		queue->status_seq      = 0;
+		spin_lock_init(&queue->status_lock);
 		queue->last_get_msg    = current_time;
 		INIT_LIST_HEAD(&queue->send_result);
 		INIT_LIST_HEAD(&queue->callback_result);
@@ -368,6 +457,8 @@ static struct msg_queue *create_msg_queue(struct w32thread *thread, struct threa
 		INIT_LIST_HEAD(&queue->expired_timers);
 		for (i = 0; i < NB_MSG_KINDS; i++)
 			INIT_LIST_HEAD(&queue->msg_list[i]);
+		set_queue_input(queue, (struct thread_input *)grab_object(input));
+		publish_queue_status(queue);
 
 		thread->queue = queue;
 		if (!thread->process->queue)
@@ -441,8 +532,7 @@ static inline void set_queue_bits(struct msg_queue *queue, unsigned int bits)
 	ktrace("\n");
 	queue->wake_bits |= bits;
 	queue->changed_bits |= bits;
-	((struct object*)queue)->header.signal_state = 1;
-	queue->w32thread->wake_up = 1;  /* used in dummyfile_poll() */
+	publish_queue_status(queue);
 	if (is_signaled(queue))
 		uk_wake_up(&queue->obj, 0);
 }
@@ -452,7 +542,8 @@ static inline void clear_queue_bits(struct msg_queue *queue, unsigned int bits)
 {
 	queue->wake_bits &= ~bits;
 	queue->changed_bits &= ~bits;
-	((struct object*)queue)->header.signal_state = 0;
+	uk_clear_signal(&queue->obj);
+	publish_queue_status(queue);
 }
 
 /* check whether msg is a keyboard message */
@@ -829,6 +920,8 @@ static int get_quit_message(struct msg_queue *queue, unsigned int flags,
 			queue->quit_message = 0;
 			if (list_empty(&queue->msg_list[POST_MESSAGE]))
 				clear_queue_bits(queue, QS_POSTMESSAGE|QS_ALLPOSTMESSAGE);
+			else
+				publish_queue_status(queue);
 		}
 		return 1;
 	}
@@ -919,6 +1012,7 @@ static int msg_queue_satisfied(struct object *obj, struct w32thread *thread)
 	queue->wake_mask = 0;
 	queue->changed_mask = 0;
 	obj->header.signal_state = 0;
+	publish_queue_status(queue);
 	return 0;  /* Not abandoned */
 }
 
@@ -944,12 +1038,13 @@ static void msg_queue_destroy(struct object *obj)
 	}
 	if (queue->timeout)
 		remove_timeout_user(queue->timeout);
-	if (queue->input)
-		release_object(queue->input);
+	set_queue_input(queue, NULL);
 	if (queue->hooks)
 		release_object(queue->hooks);
-	if (queue->fd)
+	if (queue->fd) {
+		fd_unhook_wait(queue->fd);
 		release_object(queue->fd);
+	}
 }
 
 static void msg_queue_poll_event(struct fd *fd, int event)
@@ -1043,15 +1138,14 @@ int attach_thread_input(struct w32thread *thread_from, struct w32thread *thread_
 	}
 	release_object(desktop);
 
-	if (thread_from->queue) {
-		release_thread_input(thread_from);
-		thread_from->queue->input = input;
-	}
+	if (thread_from->queue)
+		set_queue_input(thread_from->queue, input);
 	else {
 		if (!(thread_from->queue = create_msg_queue(thread_from, input)))
 			return 0;
 	}
 	memset(input->keystate, 0, sizeof(input->keystate));
+	publish_keystate(input);
 	return 1;
 }
 
@@ -1060,10 +1154,8 @@ void detach_thread_input(struct w32thread *thread_from)
 {
 	struct thread_input *input;
 
-	if ((input = create_thread_input(thread_from))) {
-		release_thread_input(thread_from);
-		thread_from->queue->input = input;
-	}
+	if ((input = create_thread_input(thread_from)))
+		set_queue_input(thread_from->queue, input);
 }
 
 
@@ -1270,7 +1362,10 @@ static void update_input_key_state(struct thread_input *input, const struct mess
 					break;
 			}
 			break;
+		default:
+			return;
 	}
+	publish_keystate(input);
 }
 
 /* release the hardware message currently being processed by the given thread */
@@ -1638,14 +1733,10 @@ static int msg_queue_signaled(struct object *obj, struct w32thread *thread)
 	struct msg_queue *queue = (struct msg_queue *)obj;
 	int ret = 0;
 
-	if (queue->fd) {
-		if ((ret = check_fd_events(queue->fd, POLLIN)))
-			/* stop waiting on select() if we are signaled */
-			set_fd_events(queue->fd, 0);
-		else if (!list_empty(&obj->wait_queue))
-			/* restart waiting on poll() if we are no longer signaled */
-			set_fd_events(queue->fd, POLLIN);
-	}
+	/* called under the dispatcher lock, waiters are woken through the fd's
+	 * wait queue hook so the epoll events are left alone here */
+	if (queue->fd)
+		ret = check_fd_events_atomic(queue->fd, POLLIN);
 	return ret || is_signaled(queue);
 }
 
@@ -1720,6 +1811,7 @@ DECL_HANDLER(set_queue_mask)
 		queue->changed_mask = req->changed_mask;
 		reply->wake_bits    = queue->wake_bits;
 		reply->changed_bits = queue->changed_bits;
+		publish_queue_status(queue);
 		if (is_signaled(queue)) {
 			/* if skip wait is set, do what would have been done in the subsequent wait */
 			if (req->skip_wait)
@@ -1740,8 +1832,10 @@ DECL_HANDLER(get_queue_status)
 	if (queue) {
 		reply->wake_bits    = queue->wake_bits;
 		reply->changed_bits = queue->changed_bits;
-		if (req->clear)
+		if (req->clear && queue->changed_bits) {
 			queue->changed_bits = 0;
+			publish_queue_status(queue);
+		}
 	}
 	else
 		reply->wake_bits = reply->changed_bits = 0;
@@ -1910,6 +2004,7 @@ DECL_HANDLER(get_message)
 		queue->changed_bits &= ~QS_INPUT;
 	if (filter & QS_PAINT)
 		queue->changed_bits &= ~QS_PAINT;
+	publish_queue_status(queue);
 
 	/* then check for posted messages */
 	if ((filter & QS_POSTMESSAGE) &&
@@ -1960,6 +2055,7 @@ DECL_HANDLER(get_message)
 
 	queue->wake_mask = req->wake_mask;
 	queue->changed_mask = req->changed_mask;
+	publish_queue_status(queue);
 	set_error(STATUS_PENDING);  /* FIXME */
 }
 
@@ -2218,8 +2314,10 @@ DECL_HANDLER(set_key_state)
 	input = thread->queue ? thread->queue->input : NULL;
 	if (input) {
 		data_size_t size = min(sizeof(input->keystate), get_req_data_size());
-		if (size)
+		if (size) {
 			memcpy(input->keystate, get_req_data(), size);
+			publish_keystate(input);
+		}
 	}
 	release_object(thread);
 }
@@ -2364,4 +2462,68 @@ DECL_HANDLER(get_last_input_time)
 	ktrace("\n");
 	reply->time = last_input_time;
 }
+
+/* unpin the queue status page, also called from cleanup_thread */
+void free_queue_status(struct w32thread *thread)
+{
+	unsigned long flags;
+
+	if (!thread->queue_status_page)
+		return;
+
+	if (thread->queue) {
+		spin_lock_irqsave(&thread->queue->status_lock, flags);
+		thread->queue->status_page = NULL;
+		spin_unlock_irqrestore(&thread->queue->status_lock, flags);
+	}
+	set_page_dirty_lock(thread->queue_status_page);
+	put_page(thread->queue_status_page);
+
+	thread->queue_status_page = NULL;
+}
+
+/* 237 */
+NTSTATUS SERVICECALL
+NtRegisterQueueStatus(IN PVOID Status)
+{
+	struct w32thread *thread = (PTSB)get_current_w32thread();
+	unsigned long addr = (unsigned long)Status;
+	struct uk_queue_status *status;
+	struct page *page;
+	unsigned long flags;
+	int ret;
+
+	ktrace("Status %p\n", Status);
+	if (!thread)
+		return STATUS_UNSUCCESSFUL;
+
+	free_queue_status(thread);
+	if (!Status)
+		return STATUS_SUCCESS;
+
+	if ((addr & ~PAGE_MASK) || addr >= TASK_SIZE)
+		return STATUS_INVALID_PARAMETER;
+
+	down_read(&current->mm->mmap_sem);
+	ret = get_user_pages(current, current->mm, addr, 1, 1, 0, &page, NULL);
+	up_read(&current->mm->mmap_sem);
+	if (ret != 1)
+		return STATUS_INVALID_PARAMETER;
+
+	status = kmap_atomic(page, KM_USER0);
+	memset(status, 0, sizeof(struct uk_queue_status));
+	kunmap_atomic(status, KM_USER0);
+	thread->queue_status_page = page;
+
+	if (thread->queue) {
+		spin_lock_irqsave(&thread->queue->status_lock, flags);
+		thread->queue->status_page = page;
+		spin_unlock_irqrestore(&thread->queue->status_lock, flags);
+		publish_queue_status(thread->queue);
+		if (thread->queue->input)
+			publish_keystate(thread->queue->input);
+	}
+	return STATUS_SUCCESS;
+}
+EXPORT_SYMBOL(NtRegisterQueueStatus);
 #endif /* CONFIG_UNIFIED_KERNEL */
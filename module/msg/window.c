@@ -196,6 +196,7 @@ struct window
 	unsigned int     is_unicode : 1;  /* ANSI or unicode */
 	unsigned int     is_linked : 1;   /* is it linked into the parent z-order list? */
 	unsigned int     is_layered : 1;  /* has layered info been set? */
+	unsigned int     child_index_valid : 1; /* child_index matches the children */
 	unsigned int     color_key;       /* color key for a layered window */
 	unsigned int     alpha;           /* alpha value for a layered window */
 	unsigned int     layered_flags;   /* flags for a layered window */
@@ -205,10 +206,42 @@ struct window
 	int              prop_inuse;      /* number of in-use window properties */
 	int              prop_alloc;      /* number of allocated window properties */
 	struct property *properties;      /* window properties array */
+	struct child_index *child_index;  /* spatial index of the children, NULL for a few */
+	int              paint_tree;      /* pending paints (update region, internal paint) of the subtree */
+	struct region   *vis_cache;       /* last visible region computed for the window */
+	unsigned int     vis_cache_flags; /* DCX flags it was computed with */
+	unsigned int     vis_cache_serial;/* vis_serial of the top and desktop windows it was computed at */
+	unsigned int     vis_serial;      /* for a top window, changed when anything in it moves */
 	int              nb_extra_bytes;  /* number of extra bytes */
 	char             extra_bytes[1];  /* extra bytes storage */
 };
 
+/* grid of cells over the children of a window, each listing the children */
+/* whose visible rect overlaps it, in Z-order */
+struct child_index
+{
+	rectangle_t     bounds;       /* union of the visible rects of the children */
+	int             cols;
+	int             rows;
+	int             cell_width;
+	int             cell_height;
+	unsigned int   *cell_start;   /* first entry of each cell, then the end of the last one */
+	struct window **entries;
+	atomic_t        refs;         /* the parent's and its readers' */
+};
+
+#define CHILD_INDEX_MIN    32     /* fewer children are simply searched in Z-order */
+#define CHILD_INDEX_CELLS  64     /* most cells in a row or a column */
+#define CHILD_INDEX_OVERLAP 8     /* most cells per child on average */
+
+/* DCX flags the visible region depends on */
+#define VIS_CACHE_FLAGS    (DCX_WINDOW | DCX_PARENTCLIP | DCX_CLIPCHILDREN)
+
+static unsigned int vis_serial;
+
+/* guards child_index and vis_cache, rebuilt by concurrent readers */
+static DEFINE_MUTEX(window_cache_lock);
+
 #define PAINT_INTERNAL      0x01  /* internal WM_PAINT pending */
 #define PAINT_ERASE         0x02  /* needs WM_ERASEBKGND */
 #define PAINT_NONCLIENT     0x04  /* needs WM_NCPAINT */
@@ -279,6 +312,170 @@ static inline struct window *get_last_child(struct window *win)
 	return ptr ? LIST_ENTRY(ptr, struct window, entry) : NULL;
 }
 
+/* get the top-level window to clip against for a given window */
+static inline struct window *get_top_clipping_window(struct window *win)
+{
+	while (win->parent && !is_desktop_window(win->parent))
+		win = win->parent;
+	return win;
+}
+
+/* forget the visible regions computed for the windows of the same top window */
+/* top windows don't clip each other, so the others keep theirs */
+static inline void invalidate_vis_cache(struct window *win)
+{
+	get_top_clipping_window(win)->vis_serial = ++vis_serial;
+}
+
+/* the position of a window among its siblings changed */
+static inline void window_moved(struct window *win)
+{
+	if (win->parent)
+		win->parent->child_index_valid = 0;
+	invalidate_vis_cache(win);
+}
+
+/* add incr pending paints to a window and its ancestors */
+static inline void inc_paint_tree(struct window *win, int incr)
+{
+	for (; win; win = win->parent)
+		win->paint_tree += incr;
+}
+
+static void free_child_index(struct child_index *index)
+{
+	if (!index)
+		return;
+	free(index->cell_start);
+	free(index->entries);
+	free(index);
+}
+
+static void release_child_index(struct child_index *index)
+{
+	if (index && atomic_dec_and_test(&index->refs))
+		free_child_index(index);
+}
+
+/* cells of the index covered by a rectangle, clamped to the grid */
+static void get_index_cells(struct child_index *index, const rectangle_t *rect,
+				int *col1, int *row1, int *col2, int *row2)
+{
+	*col1 = max(0, (rect->left - index->bounds.left) / index->cell_width);
+	*row1 = max(0, (rect->top - index->bounds.top) / index->cell_height);
+	*col2 = min(index->cols - 1, (rect->right - 1 - index->bounds.left) / index->cell_width);
+	*row2 = min(index->rows - 1, (rect->bottom - 1 - index->bounds.top) / index->cell_height);
+}
+
+/* build the index of the children of a window, NULL if there are too few of them */
+static struct child_index *build_child_index(struct window *parent)
+{
+	struct child_index *index;
+	struct window *ptr;
+	rectangle_t bounds = { 0, 0, 0, 0 };
+	unsigned int count = 0, total = 0, nb_cells, cell;
+	int col, row, col1, row1, col2, row2;
+
+	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
+		const rectangle_t *rect = &ptr->visible_rect;
+
+		if (rect->left >= rect->right || rect->top >= rect->bottom)
+			continue;  /* never contains a point */
+		if (!count++)
+			bounds = *rect;
+		else {
+			bounds.left   = min(bounds.left, rect->left);
+			bounds.top    = min(bounds.top, rect->top);
+			bounds.right  = max(bounds.right, rect->right);
+			bounds.bottom = max(bounds.bottom, rect->bottom);
+		}
+	}
+	if (count < CHILD_INDEX_MIN)
+		return NULL;
+
+	if (!(index = mem_alloc(sizeof(*index))))
+		goto failed;
+	index->bounds = bounds;
+	atomic_set(&index->refs, 1);
+	index->cols = index->rows = min_t(int, int_sqrt(count), CHILD_INDEX_CELLS);
+	index->cell_width  = (bounds.right - bounds.left + index->cols - 1) / index->cols;
+	index->cell_height = (bounds.bottom - bounds.top + index->rows - 1) / index->rows;
+	nb_cells = index->cols * index->rows;
+	index->entries = NULL;
+	if (!(index->cell_start = calloc(nb_cells + 1, sizeof(*index->cell_start))))
+		goto failed;
+
+	/* count the children of each cell, after the start of the previous one */
+	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
+		if (ptr->visible_rect.left >= ptr->visible_rect.right ||
+				ptr->visible_rect.top >= ptr->visible_rect.bottom)
+			continue;
+		get_index_cells(index, &ptr->visible_rect, &col1, &row1, &col2, &row2);
+		for (row = row1; row <= row2; row++)
+			for (col = col1; col <= col2; col++)
+				index->cell_start[row * index->cols + col + 1]++;
+		total += (row2 - row1 + 1) * (col2 - col1 + 1);
+	}
+	if (total > CHILD_INDEX_OVERLAP * count)
+		goto failed;  /* children piled on each other, a grid won't help */
+	for (cell = 1; cell <= nb_cells; cell++)
+		index->cell_start[cell] += index->cell_start[cell - 1];
+
+	if (!(index->entries = mem_alloc(total * sizeof(*index->entries))))
+		goto failed;
+
+	/* fill the cells in Z-order, which leaves each start at the start of the next cell */
+	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
+		if (ptr->visible_rect.left >= ptr->visible_rect.right ||
+				ptr->visible_rect.top >= ptr->visible_rect.bottom)
+			continue;
+		get_index_cells(index, &ptr->visible_rect, &col1, &row1, &col2, &row2);
+		for (row = row1; row <= row2; row++)
+			for (col = col1; col <= col2; col++)
+				index->entries[index->cell_start[row * index->cols + col]++] = ptr;
+	}
+	memmove(index->cell_start + 1, index->cell_start, nb_cells * sizeof(*index->cell_start));
+	index->cell_start[0] = 0;
+	return index;
+
+failed:
+	free_child_index(index);
+	clear_error();  /* the children are searched in the list instead */
+	return NULL;
+}
+
+/* get the children of a window that may contain a point (in parent-relative coords), */
+/* in Z-order; return NULL if they are not indexed and the whole list has to be searched */
+/* otherwise the index is held, and the caller releases *held once done with the children */
+static struct window **get_children_at_point(struct window *parent, int x, int y,
+				unsigned int *count, struct child_index **held)
+{
+	struct child_index *index, *old = NULL;
+	unsigned int cell;
+
+	mutex_lock(&window_cache_lock);
+	if (!parent->child_index_valid) {
+		old = parent->child_index;
+		parent->child_index = build_child_index(parent);
+		parent->child_index_valid = 1;
+	}
+	if ((index = parent->child_index))
+		atomic_inc(&index->refs);
+	mutex_unlock(&window_cache_lock);
+	release_child_index(old);
+	if (!(*held = index))
+		return NULL;
+
+	*count = 0;
+	if (x < index->bounds.left || x >= index->bounds.right ||
+			y < index->bounds.top || y >= index->bounds.bottom)
+		return index->entries;
+	cell = (y - index->bounds.top) / index->cell_height * index->cols +
+		(x - index->bounds.left) / index->cell_width;
+	*count = index->cell_start[cell + 1] - index->cell_start[cell];
+	return index->entries + index->cell_start[cell];
+}
+
 /* link a window at the right place in the siblings list */
 static void link_window(struct window *win, struct window *previous)
 {
@@ -320,6 +517,7 @@ static void link_window(struct window *win, struct window *previous)
 	}
 
 	win->is_linked = 1;
+	window_moved(win);
 }
 
 /* change the parent of a window (or unlink the window if the new parent is NULL) */
@@ -336,7 +534,10 @@ static int set_parent_window(struct window *win, struct window *parent)
 	}
 
 	if (parent) {
+		window_moved(win);
+		inc_paint_tree(win->parent, -win->paint_tree);
 		win->parent = parent;
+		inc_paint_tree(parent, win->paint_tree);
 		link_window(win, WINPTR_TOP);
 
 		/* if parent belongs to a different thread and the window isn't */
@@ -348,6 +549,7 @@ static int set_parent_window(struct window *win, struct window *parent)
 		list_remove(&win->entry);  /* unlink it from the previous location */
 		list_add_head(&win->parent->unlinked, &win->entry);
 		win->is_linked = 0;
+		window_moved(win);
 	}
 	return 1;
 }
@@ -509,11 +711,18 @@ void destroy_window(struct window *win)
 	if (is_desktop_window(win)) {
 		win->desktop->top_window = NULL;
 	}
+	else {
+		window_moved(win);
+		inc_paint_tree(win->parent, -win->paint_tree);
+	}
 	detach_window_thread(win);
 	if (win->win_region)
 		free_region(win->win_region);
 	if (win->update_region)
 		free_region(win->update_region);
+	if (win->vis_cache)
+		free_region(win->vis_cache);
+	release_child_index(win->child_index);
 	if (win->class)
 		release_class(win->class);
 	free(win->text);
@@ -583,6 +792,13 @@ static struct window *create_window(struct window *parent, struct window *owner,
 	win->prop_inuse     = 0;
 	win->prop_alloc     = 0;
 	win->properties     = NULL;
+	win->child_index    = NULL;
+	win->child_index_valid = 0;
+	win->paint_tree     = 0;
+	win->vis_cache      = NULL;
+	win->vis_cache_flags  = 0;
+	win->vis_cache_serial = 0;
+	win->vis_serial     = 0;
 	win->nb_extra_bytes = extra_bytes;
 	win->window_rect = win->visible_rect = win->client_rect = empty_rect;
 	memset(win->extra_bytes, 0, extra_bytes);
@@ -711,6 +927,7 @@ int make_window_active(user_handle_t window)
 /* increment (or decrement) the window paint count */
 static inline void inc_window_paint_count(struct window *win, int incr)
 {
+	inc_paint_tree(win, incr);
 	if (win->thread)
 		inc_queue_paint_count(win->thread, incr);
 }
@@ -756,50 +973,88 @@ static inline int is_point_in_window(struct window *win, int x, int y)
 	return 1;
 }
 
+/* find the topmost child of 'parent' that contains the given point (in parent-relative coords) */
+static struct window *first_child_from_point(struct window *parent, int x, int y)
+{
+	struct window *ptr, **children;
+	struct child_index *index;
+	unsigned int i, count;
+
+	if ((children = get_children_at_point(parent, x, y, &count, &index))) {
+		for (ptr = NULL, i = 0; i < count && !ptr; i++)
+			if (is_point_in_window(children[i], x, y))
+				ptr = children[i];
+		release_child_index(index);
+		return ptr;
+	}
+
+	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
+		if (is_point_in_window(ptr, x, y))
+			return ptr;
+	}
+	return NULL;
+}
+
 /* find child of 'parent' that contains the given point (in parent-relative coords) */
 static struct window *child_window_from_point(struct window *parent, int x, int y)
 {
 	struct window *ptr;
 
-	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
-		if (!is_point_in_window(ptr, x, y))
-			continue;  /* skip it */
+	if (!(ptr = first_child_from_point(parent, x, y)))
+		return parent;  /* not found any child */
 
-		/* if window is minimized or disabled, return at once */
-		if (ptr->style & (WS_MINIMIZE|WS_DISABLED))
-			return ptr;
+	/* if window is minimized or disabled, return at once */
+	if (ptr->style & (WS_MINIMIZE|WS_DISABLED))
+		return ptr;
 
-		/* if point is not in client area, return at once */
-		if (x < ptr->client_rect.left || x >= ptr->client_rect.right ||
-				y < ptr->client_rect.top || y >= ptr->client_rect.bottom)
-			return ptr;
+	/* if point is not in client area, return at once */
+	if (x < ptr->client_rect.left || x >= ptr->client_rect.right ||
+			y < ptr->client_rect.top || y >= ptr->client_rect.bottom)
+		return ptr;
+
+	return child_window_from_point(ptr, x - ptr->client_rect.left, y - ptr->client_rect.top);
+}
+
+static int get_window_children_from_point(struct window *parent, int x, int y,
+                                           struct user_handle_array *array);
 
-		return child_window_from_point(ptr, x - ptr->client_rect.left, y - ptr->client_rect.top);
+/* add a child and its children that contain the given point (in parent-relative coords) */
+static int add_child_from_point(struct window *ptr, int x, int y, struct user_handle_array *array)
+{
+	if (!is_point_in_window(ptr, x, y))
+		return 1;  /* skip it */
+
+	/* if point is in client area, and window is not minimized or disabled, check children */
+	if (!(ptr->style & (WS_MINIMIZE|WS_DISABLED)) &&
+			x >= ptr->client_rect.left && x < ptr->client_rect.right &&
+			y >= ptr->client_rect.top && y < ptr->client_rect.bottom) {
+		if (!get_window_children_from_point(ptr, x - ptr->client_rect.left,
+					y - ptr->client_rect.top, array))
+			return 0;
 	}
-	return parent;  /* not found any child */
+
+	/* now add window to the array */
+	return add_handle_to_array(array, ptr->handle);
 }
 
 /* find all children of 'parent' that contain the given point */
 static int get_window_children_from_point(struct window *parent, int x, int y,
                                            struct user_handle_array *array)
 {
-	struct window *ptr;
+	struct window *ptr, **children;
+	struct child_index *index;
+	unsigned int i, count;
+	int ret = 1;
 
-	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
-		if (!is_point_in_window(ptr, x, y))
-			continue;  /* skip it */
-
-		/* if point is in client area, and window is not minimized or disabled, check children */
-		if (!(ptr->style & (WS_MINIMIZE|WS_DISABLED)) &&
-				x >= ptr->client_rect.left && x < ptr->client_rect.right &&
-				y >= ptr->client_rect.top && y < ptr->client_rect.bottom) {
-			if (!get_window_children_from_point(ptr, x - ptr->client_rect.left,
-						y - ptr->client_rect.top, array))
-				return 0;
-		}
+	if ((children = get_children_at_point(parent, x, y, &count, &index))) {
+		for (i = 0; i < count && ret; i++)
+			ret = add_child_from_point(children[i], x, y, array);
+		release_child_index(index);
+		return ret;
+	}
 
-		/* now add window to the array */
-		if (!add_handle_to_array(array, ptr->handle))
+	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
+		if (!add_child_from_point(ptr, x, y, array))
 			return 0;
 	}
 	return 1;
@@ -871,6 +1126,8 @@ static struct window *find_child_to_repaint(struct window *parent, struct w32thr
 	LIST_FOR_EACH_ENTRY(ptr, &parent->children, struct window, entry) {
 		if (!(ptr->style & WS_VISIBLE))
 			continue;
+		if (!ptr->paint_tree)
+			continue;  /* nothing to paint in there */
 		if (ptr->thread == thread && win_needs_repaint(ptr))
 			ret = ptr;
 		else if (!(ptr->style & WS_MINIMIZE)) /* explore its children */
@@ -919,6 +1176,8 @@ user_handle_t find_window_to_repaint(user_handle_t parent, struct w32thread *thr
 	}
 	if (!win)
 		return 0;
+	if (win->paint_flags & PAINT_INTERNAL)
+		inc_paint_tree(win, -1);
 	win->paint_flags &= ~PAINT_INTERNAL;
 	return win->handle;
 }
@@ -1025,16 +1284,8 @@ static void set_region_client_rect(struct region *region, struct window *win)
 	set_region_rect(region, &rect);
 }
 
-/* get the top-level window to clip against for a given window */
-static inline struct window *get_top_clipping_window(struct window *win)
-{
-	while (win->parent && !is_desktop_window(win->parent))
-		win = win->parent;
-	return win;
-}
-
 /* compute the visible region of a window, in window coordinates */
-static struct region *get_visible_region(struct window *win, unsigned int flags)
+static struct region *build_visible_region(struct window *win, unsigned int flags)
 {
 	struct region *tmp = NULL, *region;
 	int offset_x, offset_y;
@@ -1122,6 +1373,57 @@ error:
 	return NULL;
 }
 
+/* serial that changes when anything the visible region of a window depends on changes */
+static inline unsigned int get_vis_cache_serial(struct window *win)
+{
+	struct window *top = get_top_clipping_window(win);
+
+	return top->parent ? max(top->vis_serial, top->parent->vis_serial) : top->vis_serial;
+}
+
+/* get the visible region of a window, in window coordinates; the caller owns it */
+static struct region *get_visible_region(struct window *win, unsigned int flags)
+{
+	struct region *region, *cache;
+	unsigned int serial;
+
+	/* the desktop is clipped by every top window, don't bother */
+	if (is_desktop_window(win))
+		return build_visible_region(win, flags);
+
+	flags &= VIS_CACHE_FLAGS;
+	serial = get_vis_cache_serial(win);
+	mutex_lock(&window_cache_lock);
+	if (win->vis_cache && win->vis_cache_serial == serial && win->vis_cache_flags == flags) {
+		if ((region = create_empty_region()) && !copy_region(region, win->vis_cache)) {
+			free_region(region);
+			region = NULL;
+		}
+		mutex_unlock(&window_cache_lock);
+		return region;
+	}
+	mutex_unlock(&window_cache_lock);
+
+	if (!(region = build_visible_region(win, flags)))
+		return NULL;
+	if ((cache = create_empty_region()) && !copy_region(cache, region)) {
+		free_region(cache);
+		cache = NULL;
+	}
+	if (!cache)
+		clear_error();  /* the region itself was computed */
+
+	/* readers copy the cache under the lock, so the old one can go once swapped out */
+	mutex_lock(&window_cache_lock);
+	swap(win->vis_cache, cache);
+	win->vis_cache_flags = flags;
+	win->vis_cache_serial = serial;
+	mutex_unlock(&window_cache_lock);
+	if (cache)
+		free_region(cache);
+	return region;
+}
+
 
 /* get the window class of a window */
 struct window_class* get_window_class(user_handle_t window)
@@ -1658,6 +1960,7 @@ static void set_window_pos(struct window *win, struct window *previous,
 		win->visible_rect.right = min(window_rect->right, client_rect->right);
 	if (win->visible_rect.bottom < client_rect->bottom)
 		win->visible_rect.bottom = min(window_rect->bottom, client_rect->bottom);
+	window_moved(win);
 
 	/* if the window is not visible, everything is easy */
 	if (!visible)
@@ -1780,12 +2083,14 @@ static void set_window_visible_rect(struct window *win, const rectangle_t *visib
 	/* if the window is not visible, everything is easy */
 	if (!is_visible(win) || (swp_flags & SWP_NOREDRAW)) {
 		win->visible_rect = *visible_rect;
+		window_moved(win);
 		return;
 	}
 
 	if (!(old_vis_rgn = get_visible_region(win, DCX_WINDOW)))
 		return;
 	win->visible_rect = *visible_rect;
+	window_moved(win);
 
 	/* expose anything revealed by the change */
 
@@ -1821,6 +2126,7 @@ static void set_window_region(struct window *win, struct region *region, int red
 	if (win->win_region)
 		free_region(win->win_region);
 	win->win_region = region;
+	invalidate_vis_cache(win);
 
 	/* expose anything revealed by the change */
 	if (old_vis_rgn && ((exposed_rgn = expose_window(win, &win->window_rect, old_vis_rgn)))) {
@@ -2019,6 +2325,8 @@ DECL_HANDLER(set_window_info)
 	if (req->flags & SET_WIN_EXTRA)
 		memcpy(win->extra_bytes + req->extra_offset,
 				&req->extra_value, req->extra_size);
+	if (req->flags & (SET_WIN_STYLE | SET_WIN_EXSTYLE))
+		invalidate_vis_cache(win);
 
 	/* changing window style triggers a non-client paint */
 	if (req->flags & SET_WIN_STYLE)
@@ -2483,6 +2791,7 @@ DECL_HANDLER(update_window_zorder)
 		if (!(ptr->ex_style & WS_EX_TOPMOST) || (win->ex_style & WS_EX_TOPMOST)) {
 			list_remove(&win->entry);
 			list_add_before(&ptr->entry, &win->entry);
+			window_moved(win);
 		}
 		break;
 	}
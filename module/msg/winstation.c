@@ -272,11 +272,13 @@ struct desktop *get_desktop_obj(struct w32process *process, obj_handle_t handle,
 	return (struct desktop *)get_wine_handle_obj(process, handle, access, &desktop_ops);
 }
 
+/* len is in bytes, the name is cut to the buffer */
 static inline void print_wcs(WCHAR *wcs, int len)
 {
 	int	i;
 	char buf[128];
 
+	len = min_t(int, len / sizeof(WCHAR), sizeof(buf) - 1);
 	for (i = 0; i < len; i++)
 		buf[i] = (char)wcs[i];
 	buf[i] = 0;
@@ -143,7 +143,8 @@ NtQueryDirectoryObject(IN HANDLE DirectoryHandle,
 		OUT PULONG ReturnLength OPTIONAL)
 {
 	PVOID TempBuffer;
-	ULONG SkipEntries, SkipEntries2, Bucket, EntrySize;
+	PVOID *Objects;
+	ULONG SkipEntries, SkipEntries2, Bucket, EntrySize, Count, i;
 	ULONG RequiredSize = 0;
 	ULONG NextEntry = 0;
 	ULONG EntriesFound = 0;
@@ -176,7 +177,8 @@ NtQueryDirectoryObject(IN HANDLE DirectoryHandle,
 	if (!NT_SUCCESS(Status))
 		return Status;
 
-	for (Bucket = 0; Bucket < NUMBER_HASH_BUCKETS; Bucket++) {
+	read_lock(obdir_lock(Directory));
+	for (Bucket = 0; Directory->HashBuckets && Bucket < (1U << Directory->HashBits); Bucket++) {
 		DirectoryEntry = Directory->HashBuckets[Bucket];
 
 		while (DirectoryEntry) {
@@ -184,13 +186,15 @@ NtQueryDirectoryObject(IN HANDLE DirectoryHandle,
 				EntriesFound ++;
 
 				if (ReturnSingleEntry)
-					goto found;
+					goto counted;
 				else
 					SkipEntries++;
 			}
 			DirectoryEntry = DirectoryEntry->ChainLink;
 		}
 	}
+counted:
+	read_unlock(obdir_lock(Directory));
 
 	if (EntriesFound == 0) {
 		*Context = 0;
@@ -198,7 +202,6 @@ NtQueryDirectoryObject(IN HANDLE DirectoryHandle,
 		return STATUS_NO_MORE_ENTRIES;
 	}
 
-found:
 	TempBuffer = kmalloc(EntriesFound * sizeof(OBJECT_DIRECTORY_INFORMATION), GFP_KERNEL);
 	if (!TempBuffer) {
 		deref_object(Directory);
@@ -216,63 +219,83 @@ found:
 
 	DirInfo = (POBJECT_DIRECTORY_INFORMATION)TempBuffer;
 
-	Status = STATUS_NO_MORE_ENTRIES;
-	NextEntry = 0;
-	for (Bucket = 0; Bucket < NUMBER_HASH_BUCKETS; Bucket++) {
-		DirectoryEntry = Directory->HashBuckets[Bucket];
-
-		while (DirectoryEntry) {
-			if (SkipEntries2 == NextEntry++) {
-				ObjectHeader = BODY_TO_HEADER(DirectoryEntry->Object);
-				NameInfo = HEADER_TO_OBJECT_NAME(ObjectHeader);
-
-				if (NameInfo)
-					ObjectName = NameInfo->Name;
-				else
-					init_unistr(&ObjectName, NULL);
+	/* the names are copied out without the directory lock, pin the objects */
+	Objects = kmalloc(EntriesFound * sizeof(PVOID), GFP_KERNEL);
+	if (!Objects) {
+		Status = STATUS_NO_MEMORY;
+		goto out;
+	}
 
-				EntrySize = sizeof(OBJECT_DIRECTORY_INFORMATION) +
-					(ObjectName.Length + sizeof(WCHAR)) +
-					(ObjectHeader->Type->Name.Length + sizeof(WCHAR));
+	Count = 0;
+	NextEntry = 0;
+	read_lock(obdir_lock(Directory));
+	for (Bucket = 0; Directory->HashBuckets && Bucket < (1U << Directory->HashBits); Bucket++) {
+		for (DirectoryEntry = Directory->HashBuckets[Bucket]; DirectoryEntry;
+				DirectoryEntry = DirectoryEntry->ChainLink) {
+			if (NextEntry++ < SkipEntries2 || Count == EntriesFound)
+				continue;
+			/* skip objects being deleted */
+			if (atomic_inc_not_zero(&BODY_TO_HEADER(DirectoryEntry->Object)->PointerCount))
+				Objects[Count++] = DirectoryEntry->Object;
+		}
+	}
+	read_unlock(obdir_lock(Directory));
 
-				if (RequiredSize + EntrySize > BufferLength) {
-					if (ReturnSingleEntry) {
-						RequiredSize += EntrySize;
-						Status = STATUS_BUFFER_TOO_SMALL;
-					} else 
-						Status = STATUS_MORE_ENTRIES;
+	Status = STATUS_NO_MORE_ENTRIES;
+	NextEntry = SkipEntries2;
+	for (i = 0; i < Count; i++) {
+		NextEntry++;
+		ObjectHeader = BODY_TO_HEADER(Objects[i]);
+		NameInfo = HEADER_TO_OBJECT_NAME(ObjectHeader);
+
+		if (NameInfo)
+			ObjectName = NameInfo->Name;
+		else
+			init_unistr(&ObjectName, NULL);
+
+		EntrySize = sizeof(OBJECT_DIRECTORY_INFORMATION) +
+			(ObjectName.Length + sizeof(WCHAR)) +
+			(ObjectHeader->Type->Name.Length + sizeof(WCHAR));
+
+		if (RequiredSize + EntrySize > BufferLength) {
+			if (ReturnSingleEntry) {
+				RequiredSize += EntrySize;
+				Status = STATUS_BUFFER_TOO_SMALL;
+			} else 
+				Status = STATUS_MORE_ENTRIES;
 
-					NextEntry--;
-					goto done;
-				}
+			NextEntry--;
+			break;
+		}
 
-				DirInfo->ObjectName.Length = ObjectName.Length;
-				DirInfo->ObjectName.MaximumLength = 
-					(USHORT)(ObjectName.Length + sizeof(WCHAR));
-				memcpy(DirInfo->ObjectName.Buffer, ObjectName.Buffer, ObjectName.Length);
+		DirInfo->ObjectName.Length = ObjectName.Length;
+		DirInfo->ObjectName.MaximumLength = 
+			(USHORT)(ObjectName.Length + sizeof(WCHAR));
+		memcpy(DirInfo->ObjectName.Buffer, ObjectName.Buffer, ObjectName.Length);
 
-				DirInfo->ObjectTypeName.Length = ObjectHeader->Type->Name.Length;
-				DirInfo->ObjectTypeName.MaximumLength = 
-					(USHORT)(ObjectHeader->Type->Name.Length + sizeof(WCHAR));
-				memcpy(DirInfo->ObjectTypeName.Buffer, ObjectHeader->Type->Name.Buffer,
-					ObjectHeader->Type->Name.Length);
+		DirInfo->ObjectTypeName.Length = ObjectHeader->Type->Name.Length;
+		DirInfo->ObjectTypeName.MaximumLength = 
+			(USHORT)(ObjectHeader->Type->Name.Length + sizeof(WCHAR));
+		memcpy(DirInfo->ObjectTypeName.Buffer, ObjectHeader->Type->Name.Buffer,
+			ObjectHeader->Type->Name.Length);
 
-				Status = STATUS_SUCCESS;
+		Status = STATUS_SUCCESS;
 
-				RequiredSize += EntrySize;
-				DirInfo++;
+		RequiredSize += EntrySize;
+		DirInfo++;
 
-				if (ReturnSingleEntry) 
-					goto done;
-				else
-					SkipEntries2++;
-			}
+		if (ReturnSingleEntry) 
+			break;
+	}
 
-			DirectoryEntry = DirectoryEntry->ChainLink;
-		}
+	for (i = 0; i < Count; i++) {
+		if (IS_WINE_OBJECT(BODY_TO_HEADER(Objects[i])))
+			release_object(Objects[i]);
+		else
+			deref_object(Objects[i]);
 	}
+	kfree(Objects);
 
-done:
 	if (!NT_SUCCESS(Status))
 		goto out;
 
@@ -324,7 +347,8 @@ NTSTATUS delete_object_dir(PVOID dir)
 	if (BODY_TO_HEADER(dir)->Type != dir_object_type)
 		return STATUS_INVALID_PARAMETER;
 
-	for (i = 0; i < NUMBER_HASH_BUCKETS; i++) {
+	/* module exit, nothing else runs */
+	for (i = 0; ((POBJECT_DIRECTORY)dir)->HashBuckets && i < (1 << ((POBJECT_DIRECTORY)dir)->HashBits); i++) {
 		head_entry = (POBJECT_DIRECTORY_ENTRY)((POBJECT_DIRECTORY)dir)->HashBuckets[i];
 
 		/* 
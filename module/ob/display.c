@@ -110,7 +110,8 @@ void display_object_dir(POBJECT_DIRECTORY DirectoryObject, LONG Depth)
 	if (!DirectoryObject)
 		DirectoryObject = name_space_root;
 	display_object((PVOID)DirectoryObject, Depth - 1, FALSE);
-	for (i = 0; i < NUMBER_HASH_BUCKETS; i++) {
+	/* debug dump, does not take the directory lock */
+	for (i = 0; DirectoryObject->HashBuckets && i < (1 << DirectoryObject->HashBits); i++) {
 		HeadDirectoryEntry = &DirectoryObject->HashBuckets[i];
 		while ((DirectoryEntry = *HeadDirectoryEntry) != NULL) {
 			if (BODY_TO_HEADER(DirectoryEntry->Object)->Type == dir_object_type)
@@ -32,7 +32,6 @@
 static BOOLEAN initialized = FALSE;
 static struct list_head handle_table_head;
 static FAST_MUTEX handle_table_lock;
-static LARGE_INTEGER handle_short_wait;
 struct handle_table *kernel_handle_table = NULL;
 EXPORT_SYMBOL(kernel_handle_table);
 
@@ -114,94 +113,19 @@ EXPORT_SYMBOL(delete_resource);
 VOID
 init_handle_tables(VOID)
 {
-	handle_short_wait.QuadPart = -50000;
 	INIT_LIST_HEAD(&handle_table_head);
 	init_fast_mutex(&handle_table_lock);
 	initialized = TRUE;
 } /* init_handle_tables */
 
-static BOOLEAN
-lock_entry_no_check(IN struct handle_table *HandleTable,
-		IN struct handle_table_entry *Entry)
-{
-	ULONG_PTR Current, New;
-
-	if (!HandleTable || !Entry)
-		return FALSE;
-
-	for (;;) {
-		Current = (ULONG_PTR)Entry->u1.object;
-
-		if (!Current)
-			break;
-
-		if (!(Current & EX_HANDLE_ENTRY_LOCKED)) {
-			New = Current | EX_HANDLE_ENTRY_LOCKED;
-			__xchg((void *)New, &Entry->u1.object, sizeof(Entry->u1.object));
-			return TRUE;
-		}
-
-		wait_for_single_object(&HandleTable->handle_contention_event,
-				Executive,
-				KernelMode,
-				FALSE,
-				&handle_short_wait);
-	}
-
-	return FALSE;
-} /* end lock_entry_no_check */
-
-BOOLEAN
-lock_handle_table_entry(IN struct handle_table *HandleTable,
-		IN struct handle_table_entry *Entry)
-{
-	ULONG_PTR Current, New;
-
-	if (!HandleTable || !Entry)
-		return FALSE;
-
-	for (;;) {
-		Current = (ULONG_PTR)Entry->u1.object;
-
-		if (!Current || (HandleTable->flags & EX_HANDLE_TABLE_CLOSING))
-			break;
-
-		if (!(Current & EX_HANDLE_ENTRY_LOCKED)) {
-			New = Current | EX_HANDLE_ENTRY_LOCKED;
-			__xchg((void *)New, &Entry->u1.object, sizeof(Entry->u1.object));
-			return TRUE;
-		}
-
-		wait_for_single_object(&HandleTable->handle_contention_event,
-				Executive,
-				KernelMode,
-				FALSE,
-				&handle_short_wait);
-	}
-
-	return FALSE;
-} /* end lock_handle_table_entry */
-
-VOID
-unlock_handle_table_entry(IN struct handle_table *HandleTable,
-		IN struct handle_table_entry *Entry)
-{
-	ULONG_PTR Current, New;
-
-	if (!HandleTable || !Entry)
-		return;
-
-	Current	= (ULONG_PTR)Entry->u1.object;
-
-	if (Current & EX_HANDLE_ENTRY_LOCKED) {
-		New = Current &~EX_HANDLE_ENTRY_LOCKED;
-		__xchg((void *)New, &Entry->u1.object, sizeof(Entry->u1.object));
-
-		pulse_event(&HandleTable->handle_contention_event,
-			0,
-			FALSE);
-	}
-} /* end unlock_handle_table_entry */
+/*
+ * Handle table entries are never locked individually. Entries and the table
+ * levels are only changed under handle_table_lock.spinlock, lookups walk the
+ * table under rcu_read_lock() and take their reference with
+ * atomic_inc_not_zero(), object headers and sub tables are freed after a
+ * grace period. An entry holds the object header pointer as is, with the
+ * attribute flags in its low bits.
+ */
 	
 struct handle_table *
 __create_handle_table(IN struct eprocess *QuotaProcess  OPTIONAL)
@@ -226,7 +150,6 @@ __create_handle_table(IN struct eprocess *QuotaProcess  OPTIONAL)
 	handle_table->unique_processid = (QuotaProcess ? QuotaProcess->unique_processid : NULL);
 
 	init_resource(&handle_table->handle_table_lock);
-	event_init(&handle_table->handle_contention_event, NotificationEvent, FALSE);
 
 	memset(handle_table->table, 0, N_TOPLEVEL_POINTERS * sizeof(struct handle_table_entry **));
 
@@ -296,8 +219,6 @@ __destroy_handle_table(IN struct handle_table *HandleTable,
 	
 	HandleTable->flags |= EX_HANDLE_TABLE_CLOSING;
 
-	pulse_event(&HandleTable->handle_contention_event, 0, FALSE);
-
 	acquire_handle_table_lock();
 	list_del(&HandleTable->handle_table_list);
 	release_handle_table_lock();
@@ -314,14 +235,11 @@ __destroy_handle_table(IN struct handle_table *HandleTable,
 
 						laste = *mlp + N_SUBHANDLE_ENTRIES;
 						for(cure = *mlp; cure != laste; cure++) {
-							if (cure->u1.object && 
-							    lock_entry_no_check(HandleTable, cure)) {
+							if (cure->u1.object)
 								DestroyHandleCallback(HandleTable,
 										cure->u1.object,
 										cure->u2.granted_access,
 										Context);
-								unlock_handle_table_entry(HandleTable, cure);
-							}
 						}
 					}
 				}
@@ -329,6 +247,11 @@ __destroy_handle_table(IN struct handle_table *HandleTable,
 		}
 	}
 
+	spin_unlock(&HandleTable->handle_table_lock.spinlock);
+
+	/* lookups may still be walking the table */
+	synchronize_rcu();
+
 	/* Free the table if necessary */
 	for (tlp = HandleTable->table; tlp != lasttlp; tlp++) {
 		if (*tlp) {
@@ -341,8 +264,6 @@ __destroy_handle_table(IN struct handle_table *HandleTable,
 		}
 	}
 
-	spin_unlock(&HandleTable->handle_table_lock.spinlock);
-
 	leave_critical_region();
 
 	delete_resource(&HandleTable->handle_table_lock);
@@ -414,8 +335,7 @@ dup_handle_table(IN struct eprocess *QuotaProcess OPTIONAL,
 					estbl = *srcmlp + N_SUBHANDLE_ENTRIES;
 					for (srcstbl = *srcmlp, stbl = *mlp; srcstbl != estbl;
 					    srcstbl++, stbl++, eli++) {
-						if (srcstbl->u1.object && 
-						    lock_handle_table_entry(SourceHandleTable, srcstbl)) {
+						if (srcstbl->u1.object) {
 							/* Ask the caller if this handle should be duplicated */
 							if (dup_handle_callback && 
 							    !dup_handle_callback(handle_table, srcstbl, Context)) {
@@ -434,14 +354,10 @@ dup_handle_table(IN struct eprocess *QuotaProcess OPTIONAL,
 								objhdr = (void*)((unsigned int)stbl->u1.object &
 										~(EX_HANDLE_ENTRY_PROTECTFROMCLOSE | EX_HANDLE_ENTRY_INHERITABLE));
 
-
-								stbl->u1.obattributes &= ~EX_HANDLE_ENTRY_LOCKED;
-
 								set_handle_info(QuotaProcess,
 										EX_HANDLE_TO_HANDLE(BUILD_HANDLE(tli, mli, eli)),
 										(struct object*)&objhdr->Body);
 							}
-							unlock_handle_table_entry(SourceHandleTable, srcstbl);
 						}
 						else *stbl = *srcstbl;
 					}
@@ -540,7 +456,7 @@ alloc_handle_table_entry(IN struct handle_table *HandleTable,
 		}
 
 		entry = ntbl;
-		entry->u1.obattributes = EX_HANDLE_ENTRY_LOCKED;
+		entry->u1.object = NULL;
 		entry->u2.next_free_table_entry = 0;
 
 		/* next_index_needing_pool has been set to 0 in __create_handle_table() */
@@ -559,9 +475,9 @@ alloc_handle_table_entry(IN struct handle_table *HandleTable,
 		/* truncate the free entry list */
 		(cure - 1)->u2.next_free_table_entry = -1;
 
-		__xchg((void *)ntbl, &nmtbl[mli], sizeof(nmtbl[mli]));
+		rcu_assign_pointer(nmtbl[mli], ntbl);
 		if (allocated)
-			__xchg((void *)nmtbl, &HandleTable->table[tli], sizeof(HandleTable->table[tli]));
+			rcu_assign_pointer(HandleTable->table[tli], nmtbl);
 
 		/* Set the next index needing pool to the next index */
 		HandleTable->next_index_needing_pool += N_SUBHANDLE_ENTRIES;
@@ -577,10 +493,7 @@ create_ex_handle(IN struct handle_table *HandleTable,
 	struct handle_table_entry *new_entry;
 	LONG handle = EX_INVALID_HANDLE;
 	
-	if (!HandleTable || !Entry)
-		return 0;
-
-	if (!((ULONG_PTR)Entry->u1.object & EX_HANDLE_ENTRY_LOCKED))
+	if (!HandleTable || !Entry || !Entry->u1.object)
 		return 0;
 
 	enter_critical_region();
@@ -590,8 +503,9 @@ create_ex_handle(IN struct handle_table *HandleTable,
 	new_entry = alloc_handle_table_entry(HandleTable, &handle);
 
 	if (new_entry) {
-		*new_entry = *Entry;
-		unlock_handle_table_entry(HandleTable, new_entry);
+		/* lookups test u1 first, publish it last */
+		new_entry->u2 = Entry->u2;
+		rcu_assign_pointer(new_entry->u1.object, Entry->u1.object);
 	}
 
 	spin_unlock(&HandleTable->handle_table_lock.spinlock);
@@ -619,8 +533,6 @@ create_handle(struct eprocess *Process,
 		return STATUS_INVALID_PARAMETER;
 
 	object_header = BODY_TO_HEADER(ObjectBody);
-	if (!((ULONG_PTR)object_header & EX_HANDLE_ENTRY_LOCKED))
-		return STATUS_WAS_LOCKED;
 
 	if (GrantedAccess & MAXIMUM_ALLOWED) {
 		GrantedAccess &= ~MAXIMUM_ALLOWED;
@@ -683,34 +595,101 @@ lookup_handle_table_entry(IN struct handle_table *HandleTable,
 		mli = MLI_FROM_HANDLE(Handle);
 		eli = ELI_FROM_HANDLE(Handle);
 
-		mlp = HandleTable->table[tli];
+		mlp = rcu_dereference(HandleTable->table[tli]);
+		if (Handle < HandleTable->next_index_needing_pool && mlp) {
+			struct handle_table_entry *stbl = rcu_dereference(mlp[mli]);
 
-		if (Handle < HandleTable->next_index_needing_pool && mlp && mlp[mli] && mlp[mli][eli].u1.object)
-			entry = &mlp[mli][eli];
+			if (stbl && stbl[eli].u1.object)
+				entry = &stbl[eli];
+		}
 	}
 
 	return entry;
 } /* end lookup_handle_table_entry */
 EXPORT_SYMBOL(lookup_handle_table_entry);
 
+/*
+ * the entry stays valid while the caller holds rcu_read_lock() or the table
+ * spinlock, only the latter keeps it from being closed meanwhile
+ */
 struct handle_table_entry *
 map_handle_to_pointer(IN struct handle_table *HandleTable,
 		IN LONG Handle)
 {
 	struct handle_table_entry *entry;
 
-	if (!HandleTable)
+	if (!HandleTable || (HandleTable->flags & EX_HANDLE_TABLE_CLOSING))
 		return NULL;
 
 	entry = lookup_handle_table_entry(HandleTable, Handle);
 
-	if (entry && entry->u1.object && lock_handle_table_entry(HandleTable, entry))
+	if (entry && entry->u1.object)
 		return entry;
 
 	return NULL;
 } /* end map_handle_to_pointer */
 EXPORT_SYMBOL(map_handle_to_pointer);
 
+static inline VOID
+put_object(POBJECT_HEADER ObjectHeader)
+{
+	if (IS_WINE_OBJECT(ObjectHeader))
+		release_object(&ObjectHeader->Body);
+	else
+		deref_object(&ObjectHeader->Body);
+} /* end put_object */
+
+/*
+ * take a reference on the object of a handle without writing to the entry
+ * returns the object header, or NULL if the handle is not open
+ */
+static POBJECT_HEADER
+ref_handle_table_entry(IN struct handle_table *HandleTable,
+		IN LONG Handle,
+		OUT ACCESS_MASK *GrantedAccess,
+		OUT ULONG *Attributes)
+{
+	struct handle_table_entry *entry;
+	POBJECT_HEADER object_header = NULL;
+	PVOID object;
+	BOOLEAN stale = FALSE;
+
+	rcu_read_lock();
+
+	entry = map_handle_to_pointer(HandleTable, Handle);
+	if (!entry || !(object = rcu_dereference(entry->u1.object)))
+		goto out;
+
+	smp_rmb();
+	*GrantedAccess = entry->u2.granted_access;
+	*Attributes = (ULONG_PTR)object & (EX_HANDLE_ENTRY_PROTECTFROMCLOSE |
+					EX_HANDLE_ENTRY_INHERITABLE |
+					EX_HANDLE_ENTRY_AUDITONCLOSE);
+
+	object_header = EX_OBJ_TO_HDR(object);
+	if (!atomic_inc_not_zero(&object_header->PointerCount)) {
+		/* being deleted */
+		if (!(object_header->Flags & OB_FLAG_PERMANENT)) {
+			object_header = NULL;
+			goto out;
+		}
+		atomic_inc(&object_header->PointerCount);
+	}
+
+	/* the handle may have been closed and reused meanwhile */
+	if (EX_OBJ_TO_HDR(entry->u1.object) != object_header || entry->u2.granted_access != *GrantedAccess)
+		stale = TRUE;
+
+out:
+	rcu_read_unlock();
+
+	if (stale) {
+		put_object(object_header);
+		return NULL;
+	}
+	return object_header;
+} /* end ref_handle_table_entry */
+
 NTSTATUS
 ref_object_by_handle(HANDLE Handle,
 			ACCESS_MASK DesiredAccess,
@@ -722,7 +701,6 @@ ref_object_by_handle(HANDLE Handle,
 	struct ethread *thread = NULL;
 	struct eprocess *process = NULL;
 	struct handle_table *handle_table;
-	struct handle_table_entry *handle_entry;
 	LONG ex_handle;
 	POBJECT_HEADER object_header;
 	PVOID object_body;
@@ -794,46 +772,26 @@ ref_object_by_handle(HANDLE Handle,
 		ex_handle = HANDLE_TO_EX_HANDLE(Handle);
 	}
 
-	enter_critical_region();
-
 	/* Lookup the entry from the handle table */
-	handle_entry = map_handle_to_pointer(handle_table, ex_handle);
-
-	if (!handle_entry) {
-		leave_critical_region();
+	object_header = ref_handle_table_entry(handle_table, ex_handle, &access, &attributes);
+	if (!object_header)
 		return STATUS_INVALID_HANDLE;
-	}
 
-	object_header = EX_HTE_TO_HDR(handle_entry);
 	object_body = &object_header->Body;
 
 	if (ObjectType && ObjectType != object_header->Type && !object_header->ops) {
-		unlock_handle_table_entry(handle_table, handle_entry);
-		leave_critical_region();
+		put_object(object_header);
 		return STATUS_OBJECT_TYPE_MISMATCH;
 	}
 
-	if ((DesiredAccess & GENERIC_ANY) && BODY_TO_HEADER(object_body)->Type)
-		map_generic_mask(&DesiredAccess, &BODY_TO_HEADER(object_body)->Type->TypeInfo.GenericMapping);
-
-	access = handle_entry->u2.granted_access;
+	if ((DesiredAccess & GENERIC_ANY) && object_header->Type)
+		map_generic_mask(&DesiredAccess, &object_header->Type->TypeInfo.GenericMapping);
 
 	if (AccessMode != KernelMode && (~access & DesiredAccess)) {
-		unlock_handle_table_entry(handle_table, handle_entry);
-		leave_critical_region();
+		put_object(object_header);
 		return STATUS_ACCESS_DENIED;
 	}
 
-	ref_object(object_body);
-
-	access = handle_entry->u2.granted_access;
-	attributes = handle_entry->u1.obattributes & (EX_HANDLE_ENTRY_PROTECTFROMCLOSE | 
-						EX_HANDLE_ENTRY_INHERITABLE |
-						EX_HANDLE_ENTRY_AUDITONCLOSE);
-
-	unlock_handle_table_entry(handle_table, handle_entry);
-	leave_critical_region();
-
 	if (HandleInformation) {
 		HandleInformation->HandleAttributes = attributes;
 		HandleInformation->GrantedAccess = access;
@@ -866,9 +824,8 @@ decrement_handle_count(PVOID ObjectBody)
 
 	if (new_count == 0) {
 		if (object_name && object_name->Directory && !(object_header->Flags & OB_FLAG_PERMANENT)) {
-			/* Delete the directory when the last handle got closed */
-			lookup_obdir_entry(object_name->Directory, &object_name->Name, OBJ_CASE_INSENSITIVE);
-			delete_obdir_entry(object_name->Directory);
+			/* Delete the directory entry when the last handle got closed */
+			delete_obdir_entry(object_name->Directory, ObjectBody);
 		}
 
 		creator_info = HEADER_TO_CREATOR_INFO(object_header);
@@ -903,13 +860,12 @@ destroy_handle_by_entry(IN struct handle_table *HandleTable,
 	if (!HandleTable || !Entry)
 		return;
 
-	if (!((ULONG_PTR)Entry->u1.object & EX_HANDLE_ENTRY_LOCKED))
-		return;
-
 	enter_critical_region();
 	spin_lock(&HandleTable->handle_table_lock.spinlock);
 
-	free_handle_table_entry(HandleTable, Entry, Handle);
+	/* the entry may have been closed, or reused, since it was looked up */
+	if (lookup_handle_table_entry(HandleTable, Handle) == Entry && Entry->u1.object)
+		free_handle_table_entry(HandleTable, Entry, Handle);
 
 	spin_unlock(&HandleTable->handle_table_lock.spinlock);
 	leave_critical_region();
@@ -936,27 +892,32 @@ delete_handle(struct handle_table *HandleTable,
 		ex_handle = HANDLE_TO_EX_HANDLE(Handle);
 	}
 	enter_critical_region();
+	spin_lock(&handle_table->handle_table_lock.spinlock);
 
 	handle_entry = map_handle_to_pointer(handle_table, ex_handle);
 	if (!handle_entry) {
+		spin_unlock(&handle_table->handle_table_lock.spinlock);
 		leave_critical_region();
 		return STATUS_INVALID_HANDLE;
 	}
 
 	if (handle_entry->u1.obattributes & EX_HANDLE_ENTRY_PROTECTFROMCLOSE) {
-		unlock_handle_table_entry(HandleTable, handle_entry);
+		spin_unlock(&handle_table->handle_table_lock.spinlock);
 		leave_critical_region();
 		return STATUS_HANDLE_NOT_CLOSABLE;
 	}
 
+	/* Destroy the handle entry, a concurrent close of the same handle fails now */
 	object_header = EX_HTE_TO_HDR(handle_entry);
+	free_handle_table_entry(handle_table, handle_entry, ex_handle);
+
+	spin_unlock(&handle_table->handle_table_lock.spinlock);
+
 	if (IS_WINE_OBJECT(object_header))
 		release_object(&object_header->Body);
 	else   /* not a wine object */
 		decrement_handle_count(&object_header->Body);
 
-	  /* Destroy the handle entry */
-	destroy_handle_by_entry(HandleTable, handle_entry, ex_handle);
 	leave_critical_region();
 	return STATUS_SUCCESS;
 } /*end delete_handle */
@@ -976,7 +937,7 @@ destroy_handle(IN struct handle_table *HandleTable,
 
 	entry = lookup_handle_table_entry(HandleTable, Handle);
 
-	if (entry && lock_handle_table_entry(HandleTable, entry)) {
+	if (entry) {
 		free_handle_table_entry(HandleTable, entry, Handle);
 		ret = TRUE;
 	}
@@ -1059,6 +1020,7 @@ unsigned int get_handle_access(struct eprocess *process, HANDLE handle)
 	LONG	ex_handle;
 	struct handle_table *handle_table;
 	struct handle_table_entry *entry;
+	unsigned int access;
 
 	if (process) {
 		handle_table = process->object_table;
@@ -1068,19 +1030,20 @@ unsigned int get_handle_access(struct eprocess *process, HANDLE handle)
 		ex_handle = HANDLE_TO_EX_HANDLE(KERNEL_HANDLE_TO_HANDLE(handle));
 	}
 
-	enter_critical_region();
+	rcu_read_lock();
 
 	entry = map_handle_to_pointer(handle_table, ex_handle);
 	if (!entry) {
-		leave_critical_region();
+		rcu_read_unlock();
 		set_error(STATUS_INVALID_HANDLE);
 		return 0;
 	}
 
-	unlock_handle_table_entry(handle_table, entry);
-	leave_critical_region();
+	smp_rmb();
+	access = entry->u2.granted_access;
+	rcu_read_unlock();
 
-	return entry->u2.granted_access; /* FIXME: & ~RESERVED_ALL; */
+	return access; /* FIXME: & ~RESERVED_ALL; */
 }
 
 int close_handle(struct eprocess *process, HANDLE handle)
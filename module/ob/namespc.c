@@ -117,6 +117,7 @@ BOOLEAN init_object()
 	ObjectTypeInitializer.MaintainTypeList = FALSE;
 	ObjectTypeInitializer.GenericMapping = dir_mapping;
 	ObjectTypeInitializer.DefaultNonPagedPoolCharge = sizeof(OBJECT_DIRECTORY);
+	ObjectTypeInitializer.DeleteProcedure = free_obdir_table;
 	create_type_object(&ObjectTypeInitializer, &Name, &dir_object_type);
 
 	/* FIXME Initialize the resource that protects the object name space directory structure */
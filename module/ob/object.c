@@ -331,22 +331,15 @@ lookup_object_name(
 
 				/*  The object does not exist and are allowed to create one. */
 				NewName = kmalloc(ComponentName.Length + sizeof(WCHAR), GFP_KERNEL);
-				if ((!NewName) || !insert_obdir_entry(Directory, InsertObject)) {
-					if (NewName)
-						kfree(NewName);
+				if (!NewName) {
 					Status = STATUS_INSUFFICIENT_RESOURCES;
 					break;
 				}
 
-				ref_object(Directory);
-				/* FIXME */
-#if 0
-				ref_object(InsertObject);
-#endif
 				ObjectHeader = BODY_TO_HEADER(InsertObject);
 				NameInfo = HEADER_TO_OBJECT_NAME(ObjectHeader);
 
-				/* copy object name info */
+				/* copy object name info, the directory hashes it */
 				memcpy(NewName, ComponentName.Buffer, ComponentName.Length);
 				if (NameInfo->Name.Buffer)
 					kfree(NameInfo->Name.Buffer);
@@ -354,6 +347,19 @@ lookup_object_name(
 				NameInfo->Name.Length = ComponentName.Length;
 				NameInfo->Name.MaximumLength = ComponentName.Length + sizeof(WCHAR);
 
+				if (!insert_obdir_entry(Directory, InsertObject)) {
+					/* somebody created the same name meanwhile */
+					Object = lookup_obdir_entry(Directory, &NameInfo->Name, Attributes);
+					Status = Object ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+					break;
+				}
+
+				ref_object(Directory);
+				/* FIXME */
+#if 0
+				ref_object(InsertObject);
+#endif
+
 				Object = InsertObject;
 				Status = STATUS_SUCCESS;
 
@@ -843,6 +849,52 @@ NTSTATUS open_object_by_name(IN POBJECT_ATTRIBUTES ObjectAttributes,
 } /* end open_object_by_name */
 EXPORT_SYMBOL(open_object_by_name);
 
+rwlock_t obdir_locks[OBDIR_LOCK_COUNT] = {
+	[0 ... OBDIR_LOCK_COUNT - 1] = __RW_LOCK_UNLOCKED(obdir_locks)
+};
+EXPORT_SYMBOL(obdir_locks);
+
+/* names differing only in case hash the same */
+static ULONG
+hash_obdir_name(IN PUNICODE_STRING Name)
+{
+	PWCH Buffer = Name->Buffer;
+	ULONG WcharLength = Name->Length / sizeof(*Buffer);
+	ULONG HashValue = 0;
+
+	while (WcharLength--)
+		HashValue = HashValue * 31 + toupperW(*Buffer++);
+
+	return HashValue;
+} /* end hash_obdir_name */
+
+/* called with the directory lock held */
+static POBJECT_DIRECTORY_ENTRY
+find_obdir_entry(IN POBJECT_DIRECTORY Directory,
+		IN PUNICODE_STRING Name,
+		IN ULONG HashValue,
+		IN BOOLEAN CaseInSensitive)
+{
+	POBJECT_DIRECTORY_ENTRY DirectoryEntry;
+	POBJECT_HEADER_NAME_INFO NameInfo;
+
+	if (!Directory->HashBuckets)
+		return NULL;
+
+	DirectoryEntry = Directory->HashBuckets[hash_long(HashValue, Directory->HashBits)];
+	for (; DirectoryEntry; DirectoryEntry = DirectoryEntry->ChainLink) {
+		if (DirectoryEntry->HashValue != HashValue)
+			continue;
+
+		NameInfo = HEADER_TO_OBJECT_NAME(BODY_TO_HEADER(DirectoryEntry->Object));
+		if (NameInfo && Name->Length == NameInfo->Name.Length &&
+				equal_unistr(Name, &NameInfo->Name, CaseInSensitive))
+			return DirectoryEntry;
+	}
+
+	return NULL;
+} /* end find_obdir_entry */
+
 PVOID
 lookup_obdir_entry(
 		IN POBJECT_DIRECTORY Directory,
@@ -850,80 +902,76 @@ lookup_obdir_entry(
 		IN ULONG Attributes
 		)
 {
-	POBJECT_DIRECTORY_ENTRY *HeadDirectoryEntry;
 	POBJECT_DIRECTORY_ENTRY DirectoryEntry;
-	POBJECT_HEADER ObjectHeader;
-	POBJECT_HEADER_NAME_INFO NameInfo;
-	PWCH Buffer;
-	WCHAR Wchar;
-	ULONG HashIndex;
-	ULONG WcharLength;
-	BOOLEAN CaseInSensitive;
+	PVOID Object = NULL;
+	ULONG HashValue;
 
 	if (!Directory || !Name)
 		return NULL;
 
-	CaseInSensitive = (Attributes & OBJ_CASE_INSENSITIVE) ? TRUE : FALSE;
-
 	/* check object name */
-	Buffer = Name->Buffer;
-	WcharLength = Name->Length / sizeof(*Buffer);
-	if (!WcharLength || !Buffer)
+	if (!Name->Length || !Name->Buffer)
 		return NULL;
 
-	/* Compute the HASH value */
-	HashIndex = 0;
-	while (WcharLength--) {
-		Wchar = *Buffer++;
-		HashIndex += (HashIndex << 1) + (HashIndex >> 1);
-
-		if (Wchar < 'a')
-			HashIndex += Wchar;
-		else if (Wchar > 'z')
-			HashIndex += Wchar;	/* FIXME: RtlUpcaseUnicodeChar(Wchar); */
-		else
-			HashIndex += (Wchar - ('a'-'A'));
-	}
+	HashValue = hash_obdir_name(Name);
 
-	HashIndex %= NUMBER_HASH_BUCKETS;
-	HeadDirectoryEntry = (POBJECT_DIRECTORY_ENTRY *)&Directory->HashBuckets[HashIndex];
-	Directory->LookupBucket = HeadDirectoryEntry;
-
-	/* Walk the chain of directory entries for this hash bucket, looking
-	 * for either a match, or the insertion point if no match in the chain. */
-	while ((DirectoryEntry = *HeadDirectoryEntry) != NULL) {
-		ObjectHeader = BODY_TO_HEADER(DirectoryEntry->Object);
-		NameInfo = HEADER_TO_OBJECT_NAME(ObjectHeader);
-
-		if (NameInfo) {
-			/* Compare strings using appropriate function. */
-			if ((Name->Length == NameInfo->Name.Length) &&
-					equal_unistr(Name, &NameInfo->Name, CaseInSensitive))
-				break;	/* match */
-		}
+	read_lock(obdir_lock(Directory));
+	if ((DirectoryEntry = find_obdir_entry(Directory, Name, HashValue,
+					(Attributes & OBJ_CASE_INSENSITIVE) ? TRUE : FALSE)))
+		Object = DirectoryEntry->Object;
+	read_unlock(obdir_lock(Directory));
 
-		HeadDirectoryEntry = &DirectoryEntry->ChainLink;
+	return Object;
+} /* end lookup_obdir_entry */
+EXPORT_SYMBOL(lookup_obdir_entry);
+
+/* double the buckets of a directory, the table is allocated without the lock */
+static VOID
+grow_obdir_table(IN POBJECT_DIRECTORY Directory, IN ULONG HashBits)
+{
+	POBJECT_DIRECTORY_ENTRY *NewBuckets, *OldBuckets, *HeadDirectoryEntry;
+	POBJECT_DIRECTORY_ENTRY DirectoryEntry, NextEntry;
+	ULONG Bucket;
+
+	if (HashBits >= OBDIR_MAX_BITS)
+		return;
+
+	/* on failure the chains just get longer */
+	NewBuckets = kmalloc(sizeof(*NewBuckets) << (HashBits + 1), GFP_KERNEL);
+	if (!NewBuckets)
+		return;
+	memset(NewBuckets, 0, sizeof(*NewBuckets) << (HashBits + 1));
+
+	write_lock(obdir_lock(Directory));
+
+	/* somebody else grew it meanwhile */
+	if (Directory->HashBits != HashBits || !Directory->HashBuckets) {
+		write_unlock(obdir_lock(Directory));
+		kfree(NewBuckets);
+		return;
 	}
 
-	if (DirectoryEntry) {
-		/* found an entry that matched and DirectoryEntry points to that entry. */
-		Directory->LookupFound = TRUE;
-		if (HeadDirectoryEntry != Directory->LookupBucket) {
-			*HeadDirectoryEntry = DirectoryEntry->ChainLink;
-			DirectoryEntry->ChainLink = *(Directory->LookupBucket);
-			*(Directory->LookupBucket) = DirectoryEntry;
+	OldBuckets = Directory->HashBuckets;
+	for (Bucket = 0; Bucket < (1U << HashBits); Bucket++) {
+		for (DirectoryEntry = OldBuckets[Bucket]; DirectoryEntry; DirectoryEntry = NextEntry) {
+			NextEntry = DirectoryEntry->ChainLink;
+			HeadDirectoryEntry = &NewBuckets[hash_long(DirectoryEntry->HashValue, HashBits + 1)];
+			DirectoryEntry->ChainLink = *HeadDirectoryEntry;
+			*HeadDirectoryEntry = DirectoryEntry;
 		}
+	}
+	Directory->HashBuckets = NewBuckets;
+	Directory->HashBits = HashBits + 1;
 
-		return DirectoryEntry->Object;
-	} else {
-		/* did not find an entry that matched and DirectoryEntry is NULL. */
-		Directory->LookupFound = FALSE;
+	write_unlock(obdir_lock(Directory));
 
-		return NULL;
-	}
-} /* end lookup_obdir_entry */
-EXPORT_SYMBOL(lookup_obdir_entry);
+	kfree(OldBuckets);
+} /* end grow_obdir_table */
 
+/*
+ * insert a named object, fails if the directory already holds an object
+ * of that name
+ */
 BOOLEAN
 insert_obdir_entry(
 		IN POBJECT_DIRECTORY Directory,
@@ -932,32 +980,63 @@ insert_obdir_entry(
 {
 	POBJECT_DIRECTORY_ENTRY	*HeadDirectoryEntry;
 	POBJECT_DIRECTORY_ENTRY	NewDirectoryEntry;
+	POBJECT_DIRECTORY_ENTRY	*NewBuckets = NULL;
 	POBJECT_HEADER_NAME_INFO	NameInfo;
+	ULONG HashBits = 0;
 
-	/* have a directory and that the last search was successful */
-	if (!Directory || Directory->LookupFound)
-		return FALSE;
-
-	HeadDirectoryEntry = Directory->LookupBucket;
-	if (!HeadDirectoryEntry)
+	if (!Directory)
 		return FALSE;
 
 	/* check the object name */
-	if (!(NameInfo = HEADER_TO_OBJECT_NAME(BODY_TO_HEADER(Object))))
+	if (!(NameInfo = HEADER_TO_OBJECT_NAME(BODY_TO_HEADER(Object))) || !NameInfo->Name.Length)
 		return FALSE;
 
 	NewDirectoryEntry = (POBJECT_DIRECTORY_ENTRY)kmalloc(sizeof(OBJECT_DIRECTORY_ENTRY), GFP_KERNEL);
 	if (!NewDirectoryEntry)
 		return FALSE;
 
+	NewDirectoryEntry->Object = Object;
+	NewDirectoryEntry->HashValue = hash_obdir_name(&NameInfo->Name);
+
+	if (!Directory->HashBuckets) {
+		NewBuckets = kmalloc(sizeof(*NewBuckets) << OBDIR_MIN_BITS, GFP_KERNEL);
+		if (!NewBuckets) {
+			kfree(NewDirectoryEntry);
+			return FALSE;
+		}
+		memset(NewBuckets, 0, sizeof(*NewBuckets) << OBDIR_MIN_BITS);
+	}
+
+	write_lock(obdir_lock(Directory));
+
+	if (!Directory->HashBuckets && NewBuckets) {
+		Directory->HashBuckets = NewBuckets;
+		Directory->HashBits = OBDIR_MIN_BITS;
+		NewBuckets = NULL;
+	}
+
+	if (find_obdir_entry(Directory, &NameInfo->Name, NewDirectoryEntry->HashValue, TRUE)) {
+		write_unlock(obdir_lock(Directory));
+		kfree(NewBuckets);
+		kfree(NewDirectoryEntry);
+		return FALSE;
+	}
+
 	/* insert at the bucket chain head */
+	HeadDirectoryEntry = &Directory->HashBuckets[hash_long(NewDirectoryEntry->HashValue, Directory->HashBits)];
 	NewDirectoryEntry->ChainLink = *HeadDirectoryEntry;
 	*HeadDirectoryEntry = NewDirectoryEntry;
-	NewDirectoryEntry->Object = Object;
 
 	NameInfo->Directory = Directory;
 
-	Directory->LookupFound = TRUE;
+	if (++Directory->EntryCount > (2U << Directory->HashBits))
+		HashBits = Directory->HashBits;
+
+	write_unlock(obdir_lock(Directory));
+
+	kfree(NewBuckets);
+	if (HashBits)
+		grow_obdir_table(Directory, HashBits);
 
 	return TRUE;
 } /* end insert_obdir_entry */
@@ -1067,27 +1146,46 @@ EXPORT_SYMBOL(insert_object);
 
 BOOLEAN
 delete_obdir_entry (
-		IN POBJECT_DIRECTORY Directory
+		IN POBJECT_DIRECTORY Directory,
+		IN PVOID Object
 		)
 {
 	POBJECT_DIRECTORY_ENTRY *HeadDirectoryEntry;
-	POBJECT_DIRECTORY_ENTRY DirectoryEntry;
+	POBJECT_DIRECTORY_ENTRY DirectoryEntry = NULL;
+	POBJECT_HEADER_NAME_INFO NameInfo;
+	ULONG HashValue;
 
-	if (!Directory || !Directory->LookupFound)
+	if (!Directory || !Object)
 		return FALSE;
 
-	/* Also make sure that the lookup bucket is valid */
-	HeadDirectoryEntry = Directory->LookupBucket;
-	if (!HeadDirectoryEntry)
+	if (!(NameInfo = HEADER_TO_OBJECT_NAME(BODY_TO_HEADER(Object))))
 		return FALSE;
-	DirectoryEntry = *HeadDirectoryEntry;
+
+	HashValue = hash_obdir_name(&NameInfo->Name);
+
+	write_lock(obdir_lock(Directory));
+
+	if (Directory->HashBuckets) {
+		HeadDirectoryEntry = &Directory->HashBuckets[hash_long(HashValue, Directory->HashBits)];
+		while ((DirectoryEntry = *HeadDirectoryEntry) != NULL) {
+			if (DirectoryEntry->Object == Object) {
+				/* Unlink the entry from the bucket chain */
+				*HeadDirectoryEntry = DirectoryEntry->ChainLink;
+				Directory->EntryCount--;
+				if (NameInfo->Directory == Directory)
+					NameInfo->Directory = NULL;
+				break;
+			}
+			HeadDirectoryEntry = &DirectoryEntry->ChainLink;
+		}
+	}
+
+	write_unlock(obdir_lock(Directory));
+
+	/* not in the directory, or already removed */
 	if (!DirectoryEntry)
 		return FALSE;
 
-	/* Unlink the entry from the head of the bucket chain and free the memory for the entry. */
-	*HeadDirectoryEntry = DirectoryEntry->ChainLink;
-	DirectoryEntry->ChainLink = NULL;
-
 	kfree(DirectoryEntry);
 	deref_object(Directory);
 
@@ -1095,6 +1193,18 @@ delete_obdir_entry (
 } /* end delete_obdir_entry */
 EXPORT_SYMBOL(delete_obdir_entry);
 
+/* free the buckets of a directory that has no entries left */
+VOID
+free_obdir_table(IN PVOID Directory)
+{
+	POBJECT_DIRECTORY dir = (POBJECT_DIRECTORY)Directory;
+
+	kfree(dir->HashBuckets);
+	dir->HashBuckets = NULL;
+	dir->HashBits = 0;
+} /* end free_obdir_table */
+EXPORT_SYMBOL(free_obdir_table);
+
 VOID
 deref_object(IN PVOID Object)
 {
@@ -1105,23 +1215,43 @@ deref_object(IN PVOID Object)
 } /* end deref_object */
 EXPORT_SYMBOL(deref_object);
 
-NTSTATUS
-delete_object(POBJECT_HEADER Header)
+/* To find the header, walk backwards from how we allocated */
+static PVOID
+header_location(POBJECT_HEADER Header)
 {
-	PVOID header_location = Header;
+	PVOID location = Header;
 	POBJECT_HEADER_CREATOR_INFO creator_info;
 	POBJECT_HEADER_NAME_INFO name_info;
 	POBJECT_HEADER_HANDLE_INFO handle_info;
 
+	if ((creator_info = HEADER_TO_CREATOR_INFO(Header)))
+		location = creator_info;
+	if ((name_info = HEADER_TO_OBJECT_NAME(Header)))
+		location = name_info;
+	if ((handle_info = HEADER_TO_HANDLE_INFO(Header)))
+		location = handle_info;
+
+	return location;
+} /* end header_location */
+
+static void
+free_object_rcu(struct rcu_head *head)
+{
+	kfree(header_location(container_of(head, OBJECT_HEADER, Rcu)));
+} /* end free_object_rcu */
+
+NTSTATUS
+delete_object(POBJECT_HEADER Header)
+{
+	POBJECT_HEADER_NAME_INFO name_info;
+
 	if (Header->Type && Header->Type->TypeInfo.DeleteProcedure)
 		Header->Type->TypeInfo.DeleteProcedure(&Header->Body);
 
 	name_info = HEADER_TO_OBJECT_NAME(Header);
 #if 0
-	if (name_info && name_info->Directory) {
-		lookup_obdir_entry(name_info->Directory, &name_info->Name, OBJ_CASE_INSENSITIVE);
-		delete_obdir_entry(name_info->Directory);
-	}
+	if (name_info && name_info->Directory)
+		delete_obdir_entry(name_info->Directory, &Header->Body);
 #endif
 
 	if (name_info && name_info->Name.Buffer && Header->Type != type_object_type)
@@ -1132,15 +1262,8 @@ delete_object(POBJECT_HEADER Header)
 		kfree(Header->ObjectCreateInfo);
 	}
 
-	/* To find the header, walk backwards from how we allocated */
-	if ((creator_info = HEADER_TO_CREATOR_INFO(Header)))
-		header_location = creator_info;
-	if (name_info)
-		header_location = name_info;
-	if ((handle_info = HEADER_TO_HANDLE_INFO(Header)))
-		header_location = handle_info;
-
-	kfree(header_location);
+	/* lockless handle lookups may still be looking at the header */
+	call_rcu(&Header->Rcu, free_object_rcu);
 
 	return STATUS_SUCCESS;
 } /* end delete_object */
@@ -1190,9 +1313,14 @@ duplicate_object(struct eprocess *SourceProcess,
 		SourceHandleTable = SourceProcess->object_table;
 
 	ExSourceHandle = HANDLE_TO_EX_HANDLE(SourceHandle);
+
+	/* keep the source handle open until the object is referenced */
+	spin_lock(&SourceHandleTable->handle_table_lock.spinlock);
 	SourceHandleEntry = map_handle_to_pointer(SourceHandleTable, ExSourceHandle);
-	if (!SourceHandleEntry)
+	if (!SourceHandleEntry) {
+		spin_unlock(&SourceHandleTable->handle_table_lock.spinlock);
 		return STATUS_INVALID_HANDLE;
+	}
 
 	ObjectHeader = EX_HTE_TO_HDR(SourceHandleEntry);
 	ObjectBody = &ObjectHeader->Body;
@@ -1214,12 +1342,14 @@ duplicate_object(struct eprocess *SourceProcess,
 		NewHandleEntry.u2.granted_access = SourceHandleEntry->u2.granted_access;
 	}
 
-	if (atomic_inc_return(&ObjectHeader->HandleCount) < 2)
+	if (atomic_inc_return(&ObjectHeader->HandleCount) < 2) {
+		spin_unlock(&SourceHandleTable->handle_table_lock.spinlock);
 		return STATUS_UNSUCCESSFUL;
+	}
 
 	ref_object(ObjectBody);
 
-	unlock_handle_table_entry(SourceHandleTable, SourceHandleEntry); 
+	spin_unlock(&SourceHandleTable->handle_table_lock.spinlock);
 
 	ExTargetHandle = create_ex_handle(TargetProcess->object_table, &NewHandleEntry);
 	if (ExTargetHandle != EX_INVALID_HANDLE) {
@@ -1257,9 +1387,13 @@ set_handle_attr(HANDLE Handle,
 		ExHandle = HANDLE_TO_EX_HANDLE(Handle);
 	}
 
+	spin_lock(&HandleTable->handle_table_lock.spinlock);
+
 	HandleTableEntry = map_handle_to_pointer(HandleTable, ExHandle);
-	if (!HandleTableEntry)
+	if (!HandleTableEntry) {
+		spin_unlock(&HandleTable->handle_table_lock.spinlock);
 		return STATUS_INVALID_HANDLE;
+	}
 
 	if (HandleInfo->Inherit)
 		HandleTableEntry->u1.obattributes |= EX_HANDLE_ENTRY_INHERITABLE;
@@ -1271,7 +1405,7 @@ set_handle_attr(HANDLE Handle,
 	else
 		HandleTableEntry->u1.obattributes &= ~EX_HANDLE_ENTRY_PROTECTFROMCLOSE;
 
-	unlock_handle_table_entry(HandleTable, HandleTableEntry);
+	spin_unlock(&HandleTable->handle_table_lock.spinlock);
 
 	return STATUS_SUCCESS;
 } /* end set_handle_attr */
@@ -1295,14 +1429,18 @@ query_handle_attr(HANDLE Handle,
 		ExHandle = HANDLE_TO_EX_HANDLE(Handle);
 	}
 
+	rcu_read_lock();
+
 	HandleTableEntry = map_handle_to_pointer(HandleTable, ExHandle);
-	if (!HandleTableEntry)
+	if (!HandleTableEntry) {
+		rcu_read_unlock();
 		return STATUS_INVALID_HANDLE;
+	}
 
 	HandleInfo->Inherit = (HandleTableEntry->u1.obattributes & EX_HANDLE_ENTRY_INHERITABLE) != 0;
 	HandleInfo->ProtectFromClose = (HandleTableEntry->u1.obattributes & EX_HANDLE_ENTRY_PROTECTFROMCLOSE) != 0;
 
-	unlock_handle_table_entry(HandleTable, HandleTableEntry);
+	rcu_read_unlock();
 
 	return STATUS_SUCCESS;
 } /* end query_handle_attr */
@@ -1322,10 +1460,8 @@ set_permanent_object(IN PVOID ObjectBody, IN BOOLEAN Permanent)
 
 		ObjectHeader->Flags &= ~OB_FLAG_PERMANENT;
 		if (atomic_read(&ObjectHeader->HandleCount) == 0 && 
-				name_info && name_info->Directory) {
-			lookup_obdir_entry(name_info->Directory, &name_info->Name, OBJ_CASE_INSENSITIVE);
-			delete_obdir_entry(name_info->Directory);
-		}
+				name_info && name_info->Directory)
+			delete_obdir_entry(name_info->Directory, ObjectBody);
 	}
 } /* end set_permanent_object */
 EXPORT_SYMBOL(set_permanent_object);
@@ -1518,10 +1654,8 @@ void release_object(void *object)
 		kfree(obj);   /* how to free OBJECT_HEADER?
 						   should we close the fd in kernel? */
 #endif
-		if (obj_name && obj_name->Directory && !(obj_header->Flags & OB_FLAG_PERMANENT)) {
-			lookup_obdir_entry(obj_name->Directory, &obj_name->Name, OBJ_CASE_INSENSITIVE);
-			delete_obdir_entry(obj_name->Directory);
-		}
+		if (obj_name && obj_name->Directory && !(obj_header->Flags & OB_FLAG_PERMANENT))
+			delete_obdir_entry(obj_name->Directory, obj);
 		delete_object(obj_header);
 	}
 }
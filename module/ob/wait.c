@@ -32,6 +32,17 @@
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
+extern void flush_request_ring(struct w32thread *thread);
+
+/* fire and forget requests such as set_queue_mask must be seen before we block */
+static inline void flush_current_request_ring(void)
+{
+	struct w32thread *thread = get_current_w32thread();
+
+	if (thread)
+		flush_request_ring(thread);
+}
+
 NTSTATUS SERVICECALL
 NtWaitForSingleObject(IN HANDLE ObjectHandle,
 		IN BOOLEAN Alertable,
@@ -61,6 +72,9 @@ NtWaitForSingleObject(IN HANDLE ObjectHandle,
 	if (!NT_SUCCESS(status))
 		return status;
 
+	if (previous_mode == UserMode)
+		flush_current_request_ring();
+
 	if(TimeOut){
 		status = wait_for_single_object(object,
 				UserRequest,
@@ -128,6 +142,9 @@ NtSignalAndWaitForSingleObject(IN HANDLE ObjectHandleToSignal,
 		return status;
 	}
 
+	if (previous_mode == UserMode)
+		flush_current_request_ring();
+
 	signal_header = (struct dispatcher_header *)signal_obj;
 
 	if (is_wine_object(signal_header->type)) {
@@ -140,15 +157,10 @@ NtSignalAndWaitForSingleObject(IN HANDLE ObjectHandleToSignal,
 		switch (signal_header->type) {
 			case EventNotificationObject:
 			case EventSynchronizationObject:
-				set_event(signal_obj, EVENT_INCREMENT, TRUE);
-				break;
-
 			case MutantObject:
-				release_mutant(signal_obj, IO_NO_INCREMENT, FALSE, TRUE);
-				break;
-
 			case SemaphoreObject:
-				release_semaphore(signal_obj, SEMAPHORE_INCREMENT, 1, TRUE);
+				/* signalled by the wait, once it holds the locks of both objects */
+				get_current_ethread()->tcb.signal_object = signal_header;
 				break;
 
 			default:
@@ -217,6 +229,9 @@ NtWaitForMultipleObjects(IN ULONG ObjectCount,
 		memcpy(ObjectsArray, hobj, sizeof(HANDLE)*ObjectCount);
 	}
 
+	if (previous_mode == UserMode)
+		flush_current_request_ring();
+
 	if (ObjectCount == 0) {
 		wait_block = (struct kwait_block *)kmalloc(MAXIMUM_WAIT_OBJECTS * sizeof(struct kwait_block), GFP_KERNEL);
 		if (!wait_block) {
@@ -78,7 +78,9 @@ int delete_cid_handle(HANDLE cid_handle, POBJECT_TYPE obj_type)
 	struct handle_table_entry * entry;
 	long ex_handle = HANDLE_TO_EX_HANDLE(cid_handle) - CID_RESERVE_OFFSET;
 
+	/* look up, check and free under the table lock, as delete_handle does */
 	enter_critical_region();
+	spin_lock(&cid_table->handle_table_lock.spinlock);
 	
 	if (!(entry = map_handle_to_pointer(cid_table, ex_handle)))
 		goto invalid;
@@ -87,23 +89,27 @@ int delete_cid_handle(HANDLE cid_handle, POBJECT_TYPE obj_type)
 			((entry->u2.granted_access & CID_FLAG_MASK) == CID_FLAG_THREAD)) || 
 	    ((obj_type == process_object_type) && 
 	     		((entry->u2.granted_access & CID_FLAG_MASK) == CID_FLAG_PROCESS))) {
-		destroy_handle_by_entry(cid_table, entry, ex_handle);
+		free_handle_table_entry(cid_table, entry, ex_handle);
+		spin_unlock(&cid_table->handle_table_lock.spinlock);
 		leave_critical_region();
 		return 0;
-	} else
-		unlock_handle_table_entry(cid_table, entry);
+	}
 	
 invalid:
+	spin_unlock(&cid_table->handle_table_lock.spinlock);
 	leave_critical_region();
 	return STATUS_INVALID_PARAMETER;
 }
 EXPORT_SYMBOL(delete_cid_handle);
 
+/*
+ * must be called under rcu_read_lock(), the object is not referenced,
+ * use get_cid_object() before leaving the read side section
+ */
 struct handle_table_entry* lookup_cid_handle(HANDLE cid_handle, POBJECT_TYPE obj_type, PVOID *object)
 {
 	struct handle_table_entry *entry;
 
-	enter_critical_region();
 	if (!(entry = map_handle_to_pointer(cid_table, 
 					HANDLE_TO_EX_HANDLE(cid_handle) - CID_RESERVE_OFFSET)))
 		goto no_target;
@@ -113,17 +119,20 @@ struct handle_table_entry* lookup_cid_handle(HANDLE cid_handle, POBJECT_TYPE obj
 			((obj_type == process_object_type) && 
 			 ((entry->u2.granted_access & CID_FLAG_MASK) == CID_FLAG_PROCESS))) {
 		*object = entry->u1.object;
-		leave_critical_region();
 		return entry;
-	} else
-		unlock_handle_table_entry(cid_table, entry); 
+	}
 
 no_target:
-	leave_critical_region();
 	return NULL;
 }
 EXPORT_SYMBOL(lookup_cid_handle);
 
+/* reference an object found by lookup_cid_handle, fails if it is being deleted */
+static inline int get_cid_object(PVOID object)
+{
+	return atomic_inc_not_zero(&BODY_TO_HEADER(object)->PointerCount);
+}
+
 int lookup_process_by_pid(HANDLE pid, struct eprocess** process)
 {
 	struct handle_table_entry* entry;
@@ -132,12 +141,14 @@ int lookup_process_by_pid(HANDLE pid, struct eprocess** process)
 	if (!process)
 		goto invalid_parameter;
 	
-	if ((entry = lookup_cid_handle(pid, process_object_type, (PVOID *) &found_process))) {
-		ref_object(found_process);
-		unlock_handle_table_entry(cid_table, entry);
+	rcu_read_lock();
+	if ((entry = lookup_cid_handle(pid, process_object_type, (PVOID *) &found_process))
+			&& get_cid_object(found_process)) {
+		rcu_read_unlock();
 		*process = found_process;
 		return 0;	
 	}
+	rcu_read_unlock();
 		
 invalid_parameter:
 	return STATUS_INVALID_PARAMETER;
@@ -152,12 +163,14 @@ int lookup_thread_by_tid(HANDLE tid, struct ethread** thread)
 	if (!thread)
 		goto invalid_parameter;
 	
-	if ((entry = lookup_cid_handle(tid, thread_object_type, (PVOID *) &found_thread))) {
-		ref_object(found_thread);
-		unlock_handle_table_entry(cid_table, entry);
+	rcu_read_lock();
+	if ((entry = lookup_cid_handle(tid, thread_object_type, (PVOID *) &found_thread))
+			&& get_cid_object(found_thread)) {
+		rcu_read_unlock();
 		*thread = found_thread;
 		return 0;	
 	}
+	rcu_read_unlock();
 		
 invalid_parameter:
 	return STATUS_INVALID_PARAMETER;
@@ -172,9 +185,11 @@ NTSTATUS lookup_process_thread_by_cid(PCLIENT_ID cid, PEPROCESS *process, PETHRE
 	if (!thread)
 		return STATUS_INVALID_PARAMETER;
 
+	rcu_read_lock();
 	if ((entry = lookup_cid_handle(cid->UniqueThread, thread_object_type, (PVOID *)&found_thread))) {
-		if (found_thread->cid.unique_process == cid->UniqueProcess) {
-			ref_object(found_thread);
+		if (found_thread->cid.unique_process == cid->UniqueProcess
+				&& get_cid_object(found_thread)) {
+			rcu_read_unlock();
 			*thread = found_thread;
 
 			if (process) {
@@ -185,6 +200,7 @@ NTSTATUS lookup_process_thread_by_cid(PCLIENT_ID cid, PEPROCESS *process, PETHRE
 			return STATUS_SUCCESS;
 		}
 	}
+	rcu_read_unlock();
 
 	return STATUS_INVALID_CID;
 
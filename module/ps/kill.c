@@ -41,6 +41,9 @@ delete_handle_callback(struct handle_table *HandleTable,
 		PVOID Context);
 extern struct w32thread *console_get_renderer(struct console_input *console);
 extern int free_console(struct w32process *process);
+extern void free_request_ring(struct w32thread *thread);
+extern void free_queue_status(struct w32thread *thread);
+extern void stop_poll_loop(struct eprocess *process);
 
 static void process_killed(struct w32process *process);
 
@@ -56,6 +59,7 @@ delete_teb(PTEB Teb)
 void __exit_process(struct eprocess * process)
 {
 	unsigned long old_state;
+	unsigned long flags;
 
 	ktrace("()\n");
 	/* close all handles associated with our process, this needs to be done 
@@ -66,9 +70,6 @@ void __exit_process(struct eprocess * process)
 	remove_all_win32_area(&process->ep_reserved_head);
 	remove_all_win32_area(&process->ep_mapped_head);
 
-	/* FIXME: spin_lock_irq(&t); */
-	local_irq_disable();
-
 #if 0
 	if (process->win32process)
 		kfree(process->win32process);
@@ -80,6 +81,7 @@ void __exit_process(struct eprocess * process)
 		process->ep_handle_info_table = NULL;
 	}
 
+	flags = lock_dispatcher_object(&process->pcb);
 	old_state = process->pcb.header.signal_state;
 	process->pcb.header.signal_state = true;
 	if ((!old_state) && !list_empty(&process->pcb.header.wait_list_head)) {
@@ -87,8 +89,7 @@ void __exit_process(struct eprocess * process)
 		wait_test((struct dispatcher_header *)&process->pcb,IO_NO_INCREMENT);
 	}
 
-	local_irq_enable();
-	/* FIXME: spin_unlock_irq(&t); */
+	unlock_dispatcher_object(&process->pcb, flags);
 }
 EXPORT_SYMBOL(__exit_process);
 
@@ -126,10 +127,6 @@ void terminate_process(struct w32process *process, int exit_code)
 		remove_process_thread(process, thread);
 		release_object(thread);
 	}
-	if (process->dummyfd != -1) {
-		close(process->dummyfd);
-		process->dummyfd = -1;
-	}
 	release_object(process);
 }
 
@@ -290,8 +287,6 @@ void remove_process_thread(struct w32process *process, struct w32thread *thread)
 	if (!--process->running_threads) {
 		/* we have removed the last running thread, exit the process */
 		process->exit_code = thread->exit_code;
-		close(process->dummyfd);
-		process->dummyfd = -1;
 		process_killed(process);
 	}
 	release_object(thread);
@@ -340,6 +335,7 @@ static void process_killed(struct w32process *process)
 	}
 	destroy_process_classes(process);
 	remove_process_locks(process);
+	stop_poll_loop(process->eprocess);
 	set_process_startup_state(process, STARTUP_ABORTED);
 }
 
@@ -350,6 +346,8 @@ static void cleanup_thread(struct w32thread *thread)
 	free(thread->req_data);
 	free(thread->reply_data);
 	free(thread->suspend_context);
+	free_request_ring(thread);
+	free_queue_status(thread);
 	free_msg_queue(thread);
 	cleanup_clipboard_thread(thread);
 	destroy_thread_windows(thread);
@@ -43,7 +43,6 @@ struct w32process *create_w32process(struct w32process *parent, int inherit_all,
 
 extern HANDLE base_dir_handle;
 extern char ntdll_name[];
-extern void create_dummy_file(struct w32process *process);
 
 extern long do_fork_from_task(struct task_struct *ptsk,
 		unsigned long process_flags,
@@ -211,7 +210,7 @@ void eprocess_init(struct eprocess *parent, BOOLEAN inherit, struct eprocess *pr
 
 	process->ep_handle_info_table = alloc_handle_info_table();
 
-	process->epoll_fd = -1;
+	process->poll_loop = NULL;
 
 	/* alloc handle table */
 	if (parent) {
@@ -792,9 +791,11 @@ create_ppb(PRTL_USER_PROCESS_PARAMETERS *ppb_res,
 	/* get current working directory */
 	old_fs = get_fs();
 	set_fs(KERNEL_DS);
-	sys_getcwd(cwd, size);
+	if (sys_getcwd(cwd, size) < 0)
+		cwd[0] = 0;
 	set_fs(old_fs);
-	ktrace("cdir=%s, image_name=%s, cwd=%s\n", cdir, image_name, cwd);
+	/* cdir is only filled in below */
+	ktrace("image_name=%s, cwd=%s\n", image_name, cwd);
 
 	if (*image_name == '/')
 		strcpy(cdir, image_name);
@@ -1077,7 +1078,6 @@ struct w32process *create_w32process(struct w32process *parent, int inherit_all,
 	process->desktop         = 0;
 	process->token           = NULL;
 	process->trace_data      = 0;
-	process->dummyfd         = -1;
 	INIT_LIST_HEAD(&process->thread_list);
 	INIT_LIST_HEAD(&process->locks);
 	INIT_LIST_HEAD(&process->classes);
@@ -1090,12 +1090,9 @@ struct w32process *create_w32process(struct w32process *parent, int inherit_all,
 	process->eprocess = eprocess;
 
 	if (!parent) {
-		create_dummy_file(process);
 		process->token = token_create_admin();
 	}
 	else {
-		/* can not call create_dummy_file here, because in parent space,
-		 * create_dummy_file is called in user_thread_startup */
 		process->parent = (struct w32process *)grab_object(parent);
 		/* Note: for security reasons, starting a new process does not attempt
 		 * to use the current impersonation token for the new process */
@@ -76,8 +76,10 @@ resume_thread(PKTHREAD Thread)
 		/* Decrease the current Suspend Count and Check Freeze Count */ 
 		if ((!Thread->suspend_count) && (!Thread->freeze_count)) { 
 			/*TODO Signal the Suspend Semaphore */ 
+			spin_lock(dispatcher_lock(&Thread->suspend_semaphore));
 			Thread->suspend_semaphore.header.signal_state++; 
 			wait_test(&Thread->suspend_semaphore.header, IO_NO_INCREMENT); 
+			spin_unlock(dispatcher_lock(&Thread->suspend_semaphore));
 		} 
 	} 
 
@@ -108,7 +110,9 @@ suspend_thread(PKTHREAD Thread)
 		/* Insert the APC */
 		if (!__insert_queue_apc(&Thread->suspend_apc, IO_NO_INCREMENT)) {
 			/* FIXME Unsignal the Semaphore, the APC already got inserted */
+			spin_lock(dispatcher_lock(&Thread->suspend_semaphore));
 			Thread->suspend_semaphore.header.signal_state--;
+			spin_unlock(dispatcher_lock(&Thread->suspend_semaphore));
 		}
 	}
 
@@ -181,14 +185,16 @@ alert_resume_thread(IN PKTHREAD Thread)
 		/* Decrease count. If we are now zero, unwait it completely */
 		if (--Thread->suspend_count) {
 			/* Signal and satisfy */
+			spin_lock(dispatcher_lock(&Thread->suspend_semaphore));
 			Thread->suspend_semaphore.header.signal_state++;
 			wait_test(&Thread->suspend_semaphore.header, IO_NO_INCREMENT);
+			spin_unlock(dispatcher_lock(&Thread->suspend_semaphore));
 		}
 	}
 
 	/* Release Locks and return the Old State */
 	spin_unlock(&Thread->apc_queue_lock);/* TODO consider again */
-	spin_lock_irq(&((struct ethread * ) Thread)->thread_lock);
+	spin_unlock_irq(&((struct ethread * ) Thread)->thread_lock);
 
 	return previous_count;
 }
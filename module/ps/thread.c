@@ -63,7 +63,6 @@ extern unsigned long get_ntdll_entry(void);
 extern unsigned long get_interp_entry(void);
 extern unsigned long get_thread_entry(void);
 
-extern void create_dummy_file(struct w32process *process);
 extern void add_process_thread(struct w32process *process, struct w32thread *thread);
 
 extern int ptrace_set_breakpoint_addr(struct task_struct *tsk, int nr, unsigned long addr);
@@ -89,6 +88,7 @@ static const struct ethread_operations ethread_ops = {
 static int thread_signaled(struct object *obj, struct w32thread *thread);
 static unsigned int thread_map_access(struct object *obj, unsigned int access);
 extern void destroy_thread(struct object *obj);
+extern void completion_thread_exit(struct kthread *thread);
 
 static const struct object_ops thread_ops =
 {
@@ -235,27 +235,42 @@ void rundown_thread(void)
 	struct kthread * thread = (struct kthread *) get_current_ethread();
 	struct kmutant * mutant;
 	struct list_head * cur_entry;
+	unsigned long flags;
 
 	ktrace("\n");
 
-	local_irq_disable();
-	while (!list_empty(&thread->mutant_list_head)) {
+	for (;;) {
 		/* Get the Mutant */
+		spin_lock_irq(&thread->mutant_list_lock);
+		if (list_empty(&thread->mutant_list_head)) {
+			spin_unlock_irq(&thread->mutant_list_lock);
+			break;
+		}
 		cur_entry = thread->mutant_list_head.next;
 		mutant = list_entry(cur_entry, struct kmutant, mutant_list_entry);
+		spin_unlock_irq(&thread->mutant_list_lock);
+
+		/* the mutant's dispatcher lock nests outside the list lock */
+		flags = lock_dispatcher_object(mutant);
+		if (mutant->owner_thread != thread) {
+			unlock_dispatcher_object(mutant, flags);
+			continue;
+		}
 
 		/* check apc disable */
 
 		mutant->header.signal_state = 1;
 		mutant->abandoned = 1;
 		mutant->owner_thread = NULL;
+		spin_lock(&thread->mutant_list_lock);
 		list_del(&mutant->mutant_list_entry);
+		spin_unlock(&thread->mutant_list_lock);
 
 		if(!list_empty(&mutant->header.wait_list_head)) {
 			wait_test(&mutant->header, MUTANT_INCREMENT);
 		}
+		unlock_dispatcher_object(mutant, flags);
 	}
-	local_irq_enable();
 }
 
 /*
@@ -267,6 +282,7 @@ static void thread_exit(struct ethread *thread, int exit_status)
 {
 	struct eprocess	*process = thread->threads_process;
 	BOOLEAN last;
+	unsigned long flags;
 
 	/* if Terminated, do nothing */
 	ktrace("thread %p, exit_status %ld\n", thread, thread->exit_status);
@@ -324,12 +340,15 @@ static void thread_exit(struct ethread *thread, int exit_status)
 	/* Rundown Mutexes */
 	rundown_thread();
 
+	/* Leave the completion port */
+	completion_thread_exit(&thread->tcb);
+
 	/* Satisfy waits */
-	local_irq_disable();
+	flags = lock_dispatcher_object(&thread->tcb);
 	thread->tcb.header.signal_state = true;
 	if (!list_empty(&thread->tcb.header.wait_list_head))
 		wait_test((struct dispatcher_header *)&thread->tcb, IO_NO_INCREMENT);
-	local_irq_enable();
+	unlock_dispatcher_object(&thread->tcb, flags);
 } /* end thread_exit() */
 
 /*
@@ -409,6 +428,12 @@ void kthread_init(struct kthread *thread, struct eprocess *process)
 
 	/* initialize the mutant list */
 	INIT_LIST_HEAD(&thread->mutant_list_head);
+	spin_lock_init(&thread->mutant_list_lock);
+	atomic_set(&thread->wait_claimed, WAIT_ENDED);
+
+	/* not associated with a completion port */
+	thread->queue = NULL;
+	INIT_LIST_HEAD(&thread->queue_list_entry);
 
 	/* setup apc fields */
 	INIT_LIST_HEAD(&thread->apc_state.apc_list_head[0]);
@@ -479,6 +504,7 @@ void ethread_init(struct ethread *thread, struct eprocess *process, struct task_
 
 	/* FIXME */
 	thread->et_ops = (struct ethread_operations *)&ethread_ops;
+	thread->et_syscall = -1;
 
 	INIT_LIST_HEAD(&thread->lpc_reply_chain);
 	INIT_LIST_HEAD(&thread->irp_list);
@@ -521,9 +547,6 @@ user_thread_startup(PKSTART_ROUTINE StartRoutine,
 		return;
 	}
 
-	/* create dummy file */
-	create_dummy_file(thread->threads_process->win32process);
-
 	if (!(thread_apc = kmalloc(sizeof(struct kapc),GFP_KERNEL))) {
 		return;
 	}
@@ -25,71 +25,12 @@
  * Refered to Wine code
  */
 
-#include <asm/poll.h>
 #include "wineserver/lib.h"
 
 #ifdef CONFIG_UNIFIED_KERNEL
 
 extern char *rootdir;
 
-static unsigned int dummyfile_poll(struct file *f, struct poll_table_struct *p)
-{
-	if (current_thread->wake_up) {
-		current_thread->wake_up = 0;
-		ktrace("ret %d\n", current_thread->wake_up);
-		return POLLIN;
-	} else {
-		ktrace("ret 0\n");
-		return 0;
-	}
-}
-
-/* dummy file used in NtWaitforMultipleObjects() */
-const struct file_operations dummy_fops = {
-	.owner      = THIS_MODULE,
-	.poll       = dummyfile_poll,
-};
-
-static struct file dummyfile_dft = {
-	.f_op       = &dummy_fops,
-};
-
-static struct file *dummyfile = &dummyfile_dft;
-
-void open_dummy_file(void)
-{
-	struct file *filp;
-
-	filp = filp_open("/proc/unifiedkernel/io/dummy", O_RDWR, 0);
-	if (!IS_ERR(filp)) {
-		dummyfile = filp;
-		ktrace("dummy file opened\n");
-	}
-}
-
-void close_dummy_file(void)
-{
-	if (dummyfile != &dummyfile_dft)
-		filp_close(dummyfile, NULL);
-}
-
-void create_dummy_file(struct w32process *process)
-{
-	int fd;
-
-	if (process->dummyfd != -1)
-		return;
-
-	fd = get_unused_fd_flags(O_CLOEXEC);
-	if (fd >= 0) {
-		get_file(dummyfile);
-		fd_install(fd, dummyfile);
-    	process->dummyfd = fd;
-	}
-
-	ktrace("process %p, dummyfd %d\n", process, process->dummyfd);
-}
-
 /* find $HOME from environment varibale and init rootdir */
 void init_rootdir(void)
 {
@@ -406,6 +406,20 @@ long fclose(struct LIBC_FILE *fp)
 	return -1;
 }
 
+/* write out the buffered data, keep the file open */
+long fflush(struct LIBC_FILE *fp)
+{
+	ssize_t ret = 0;
+
+	if (fp && fp->buf && fp->validlen) {
+		ret = filp_write(fp->filp, (fp->buf + fp->bufpos-fp->validlen), fp->validlen);
+		fp->bufpos = 0;
+		fp->validlen = 0;
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
 ssize_t read(unsigned int fd, void *buf, size_t size)
 {
 	ssize_t ret;
@@ -827,13 +841,27 @@ timeout_t get_current_time(void)
 
 void uk_wake_up(struct object *obj, int max)
 {
+	unsigned long flags;
+
 	if (!max) {
+		flags = lock_dispatcher_object(obj);
 		obj->header.signal_state = 1;
 		wait_test((struct dispatcher_header *)obj, IO_NO_INCREMENT);
+		unlock_dispatcher_object(obj, flags);
 	} else {
 		ktrace("max != 0, not supported yet!\n");
 		/* TODO */
 	}
 }
 
+/* make an object non signaled, its waiters stay queued */
+void uk_clear_signal(struct object *obj)
+{
+	unsigned long flags;
+
+	flags = lock_dispatcher_object(obj);
+	obj->header.signal_state = 0;
+	unlock_dispatcher_object(obj, flags);
+}
+
 #endif /* CONFIG_UNIFIED_KERNEL */
@@ -0,0 +1,350 @@
+/*
+ * index.c
+ *
+ * Copyright (C) 2006  Insigma Co., Ltd
+ *
+ * This software has been developed while working on the Linux Unified Kernel
+ * project (http://www.longene.org) in the Insigma Research Institute,
+ * which is a subdivision of Insigma Co., Ltd (http://www.insigma.com.cn).
+ *
+ * The project is sponsored by Insigma Co., Ltd.
+ *
+ * The authors can be reached at linux@insigma.com.cn.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation; either version 2 of the  License, or (at your
+ * option) any later version.
+ *
+ * Revision History:
+ *   Oct 2026 - Created.
+ */
+
+/*
+ * index.c: name index for the subkeys and values of a registry key
+ *
+ * Entries are sorted case-insensitively, a shorter name first when one is
+ * a prefix of the other, which is the order enum_key and enum_value number
+ * them in.  They are kept in blocks of REG_INDEX_BLOCK pointers so that an
+ * insert or a removal moves at most one block, however wide the key.
+ * Once there are REG_INDEX_HASH_MIN entries, a hash table on the name
+ * answers exact lookups without searching.  Access by position goes through
+ * a cursor, enumerating from 0 upwards costs O(1) per entry.
+ */
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
+#include "wineserver/reg.h"
+
+#ifdef CONFIG_UNIFIED_KERNEL
+
+static void *index_alloc(size_t size)
+{
+	return size > 2 * PAGE_SIZE ? vmalloc(size) : kmalloc(size, GFP_KERNEL);
+}
+
+static void index_free(void *ptr)
+{
+	if (is_vmalloc_addr(ptr))
+		vfree(ptr);
+	else
+		kfree(ptr);
+}
+
+static int compare_name(struct reg_index *index, const void *entry,
+		const WCHAR *name, data_size_t len)
+{
+	data_size_t entry_len;
+	const WCHAR *entry_name = index->get_name(entry, &entry_len);
+	int res;
+
+	res = memicmpW(entry_name, name, min(entry_len, len) / sizeof(WCHAR));
+	if (!res)
+		res = entry_len - len;
+	return res;
+}
+
+static unsigned int hash_name(const WCHAR *name, data_size_t len)
+{
+	unsigned int hash = 0;
+
+	for (len /= sizeof(WCHAR); len; len--, name++)
+		hash = hash * 31 + tolowerW(*name);
+	return hash;
+}
+
+static unsigned int hash_slot(struct reg_index *index, const void *entry)
+{
+	data_size_t len;
+	const WCHAR *name = index->get_name(entry, &len);
+
+	return hash_long(hash_name(name, len), index->hash_bits);
+}
+
+static void hash_add(struct reg_index *index, void *entry)
+{
+	unsigned int mask = (1 << index->hash_bits) - 1;
+	unsigned int i = hash_slot(index, entry);
+
+	while (index->hash[i])
+		i = (i + 1) & mask;
+	index->hash[i] = entry;
+}
+
+/* (re)build the hash table for the current entries, drop it if there is no memory */
+static void hash_rebuild(struct reg_index *index)
+{
+	unsigned int bits = 6, b, i;
+
+	while ((1U << bits) < 2 * (index->count + 1))
+		bits++;
+
+	if (index->hash)
+		index_free(index->hash);
+	index->hash_bits = 0;
+	if (!(index->hash = index_alloc(sizeof(void *) << bits)))
+		return;
+	memset(index->hash, 0, sizeof(void *) << bits);
+	index->hash_bits = bits;
+
+	for (b = 0; b < index->nb_blocks; b++)
+		for (i = 0; i < index->blocks[b]->count; i++)
+			hash_add(index, index->blocks[b]->entries[i]);
+}
+
+/* remove an entry, moving back the ones that probed past it */
+static void hash_del(struct reg_index *index, const void *entry)
+{
+	unsigned int mask = (1 << index->hash_bits) - 1;
+	unsigned int i = hash_slot(index, entry), j, k;
+
+	while (index->hash[i] != entry) {
+		if (!index->hash[i])
+			return;
+		i = (i + 1) & mask;
+	}
+	index->hash[i] = NULL;
+
+	for (j = (i + 1) & mask; index->hash[j]; j = (j + 1) & mask) {
+		k = hash_slot(index, index->hash[j]);
+		/* leave it alone if its home slot is cyclically in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		index->hash[i] = index->hash[j];
+		index->hash[j] = NULL;
+		i = j;
+	}
+}
+
+/* find the block and slot where name is, or would be inserted; return 1 if found */
+static int locate(struct reg_index *index, const WCHAR *name, data_size_t len,
+		unsigned int *block, unsigned int *slot)
+{
+	struct reg_index_block *b;
+	int i, min, max, res;
+
+	*block = *slot = 0;
+	if (!index->nb_blocks)
+		return 0;
+
+	/* last block starting with a name not after this one */
+	min = 1;
+	max = index->nb_blocks - 1;
+	while (min <= max) {
+		i = (min + max) / 2;
+		if (compare_name(index, index->blocks[i]->entries[0], name, len) <= 0) {
+			*block = i;
+			min = i + 1;
+		} else
+			max = i - 1;
+	}
+
+	b = index->blocks[*block];
+	min = 0;
+	max = b->count - 1;
+	while (min <= max) {
+		i = (min + max) / 2;
+		res = compare_name(index, b->entries[i], name, len);
+		if (!res) {
+			*slot = i;
+			return 1;
+		}
+		if (res > 0)
+			max = i - 1;
+		else
+			min = i + 1;
+	}
+	*slot = min;
+	return 0;
+}
+
+/* insert an empty block at position pos */
+static struct reg_index_block *add_block(struct reg_index *index, unsigned int pos)
+{
+	struct reg_index_block *block;
+
+	if (index->nb_blocks == index->max_blocks) {
+		unsigned int max_blocks = index->max_blocks ? index->max_blocks * 2 : 4;
+		struct reg_index_block **blocks;
+
+		if (!(blocks = index_alloc(max_blocks * sizeof(*blocks))))
+			return NULL;
+		if (index->blocks) {
+			memcpy(blocks, index->blocks, index->nb_blocks * sizeof(*blocks));
+			index_free(index->blocks);
+		}
+		index->blocks = blocks;
+		index->max_blocks = max_blocks;
+	}
+
+	if (!(block = kmalloc(sizeof(*block), GFP_KERNEL)))
+		return NULL;
+	block->count = 0;
+	memmove(index->blocks + pos + 1, index->blocks + pos,
+			(index->nb_blocks - pos) * sizeof(*index->blocks));
+	index->blocks[pos] = block;
+	index->nb_blocks++;
+	return block;
+}
+
+static void remove_block(struct reg_index *index, unsigned int pos)
+{
+	kfree(index->blocks[pos]);
+	index->nb_blocks--;
+	memmove(index->blocks + pos, index->blocks + pos + 1,
+			(index->nb_blocks - pos) * sizeof(*index->blocks));
+}
+
+void reg_index_init(struct reg_index *index,
+		const WCHAR *(*get_name)(const void *entry, data_size_t *len))
+{
+	memset(index, 0, sizeof(*index));
+	index->get_name = get_name;
+}
+
+/* free the index itself, the entries belong to the caller */
+void reg_index_free(struct reg_index *index)
+{
+	unsigned int i;
+
+	for (i = 0; i < index->nb_blocks; i++)
+		kfree(index->blocks[i]);
+	if (index->blocks)
+		index_free(index->blocks);
+	if (index->hash)
+		index_free(index->hash);
+	reg_index_init(index, index->get_name);
+}
+
+void *reg_index_find(struct reg_index *index, const struct unicode_str *name)
+{
+	unsigned int block, slot;
+
+	if (index->hash) {
+		unsigned int mask = (1 << index->hash_bits) - 1;
+		unsigned int i = hash_long(hash_name(name->str, name->len), index->hash_bits);
+
+		for (; index->hash[i]; i = (i + 1) & mask)
+			if (!compare_name(index, index->hash[i], name->str, name->len))
+				return index->hash[i];
+		return NULL;
+	}
+
+	if (!locate(index, name->str, name->len, &block, &slot))
+		return NULL;
+	return index->blocks[block]->entries[slot];
+}
+
+/* return the entry at a given position, NULL past the end */
+void *reg_index_get(struct reg_index *index, unsigned int pos)
+{
+	if (pos >= index->count)
+		return NULL;
+
+	if (pos < index->cur_base)
+		index->cur_block = index->cur_base = 0;
+	while (pos >= index->cur_base + index->blocks[index->cur_block]->count) {
+		index->cur_base += index->blocks[index->cur_block]->count;
+		index->cur_block++;
+	}
+	return index->blocks[index->cur_block]->entries[pos - index->cur_base];
+}
+
+/* insert an entry whose name is not in the index yet; return 1 if OK, 0 on error */
+int reg_index_insert(struct reg_index *index, void *entry)
+{
+	struct reg_index_block *b, *next;
+	unsigned int block, slot, half;
+	data_size_t len;
+	const WCHAR *name = index->get_name(entry, &len);
+
+	if (!index->nb_blocks) {
+		if (!add_block(index, 0))
+			return 0;
+		block = slot = 0;
+	} else {
+		/* entries loaded from a file or a hive come in order */
+		b = index->blocks[index->nb_blocks - 1];
+		if (compare_name(index, b->entries[b->count - 1], name, len) < 0) {
+			block = index->nb_blocks - 1;
+			slot = b->count;
+		} else
+			locate(index, name, len, &block, &slot);
+	}
+
+	b = index->blocks[block];
+	if (b->count == REG_INDEX_BLOCK) {
+		if (slot == REG_INDEX_BLOCK) {
+			/* appending, start a new block rather than leave two half full */
+			if (!(b = add_block(index, ++block)))
+				return 0;
+			slot = 0;
+		} else {
+			half = REG_INDEX_BLOCK / 2;
+			if (!(next = add_block(index, block + 1)))
+				return 0;
+			memcpy(next->entries, b->entries + half, (REG_INDEX_BLOCK - half) * sizeof(void *));
+			next->count = REG_INDEX_BLOCK - half;
+			b->count = half;
+			if (slot > half) {
+				b = next;
+				slot -= half;
+			}
+		}
+	}
+
+	memmove(b->entries + slot + 1, b->entries + slot, (b->count - slot) * sizeof(void *));
+	b->entries[slot] = entry;
+	b->count++;
+	index->count++;
+	index->cur_block = index->cur_base = 0;
+
+	if (index->hash && 2 * index->count <= (1U << index->hash_bits))
+		hash_add(index, entry);
+	else if (index->count >= REG_INDEX_HASH_MIN)
+		hash_rebuild(index);
+	return 1;
+}
+
+void reg_index_remove(struct reg_index *index, const void *entry)
+{
+	struct reg_index_block *b;
+	unsigned int block, slot;
+	data_size_t len;
+	const WCHAR *name = index->get_name(entry, &len);
+
+	if (!locate(index, name, len, &block, &slot))
+		return;
+	b = index->blocks[block];
+	if (b->entries[slot] != entry)
+		return;
+
+	if (index->hash)
+		hash_del(index, entry);
+
+	memmove(b->entries + slot, b->entries + slot + 1, (b->count - slot - 1) * sizeof(void *));
+	if (!--b->count)
+		remove_block(index, block);
+	index->count--;
+	index->cur_block = index->cur_base = 0;
+}
+#endif /* CONFIG_UNIFIED_KERNEL */
@@ -70,6 +70,19 @@ struct reg_key *sys_key, *user_key, *udef_key;
 void write_back_branches(void);
 void write_registry(void);
 
+/* journal_mutex serializes journal writes and hive loading against syncing and compaction */
+static DEFINE_MUTEX(journal_mutex);
+/* compact_mutex keeps the save thread and flush requests from compacting at once */
+static DEFINE_MUTEX(compact_mutex);
+static void load_hive_key(struct reg_key *key);
+static void put_hive(struct reg_hive *hive);
+static void journal_key(const struct reg_key *key);
+static void journal_delete_key(const struct reg_key *key);
+static void journal_value(const struct reg_key *key, const struct key_value *value);
+static void journal_delete_value(const struct reg_key *key, const struct unicode_str *name);
+struct reg_key *open_key(struct reg_key *key, const struct unicode_str *name);
+extern long filp_truncate(struct file *file, loff_t length, int small);
+
 extern char* rootdir;
 extern int unistr2charstr(PWSTR unistr, LPCSTR chstr);
 static char debug_buf[1024];
@@ -90,7 +103,21 @@ char *wcsdebug(WCHAR *wcs)
 
 static void delete_reg_key(PVOID key)
 {
+	struct reg_key *k = key;
+	unsigned int i;
+
 	kdebug("delete key %p\n", key);
+	if (k->hive)
+		put_hive(k->hive);
+	for (i = 0; i < k->values.count; i++) {
+		struct key_value *value = reg_index_get(&k->values, i);
+
+		free(value->name);
+		free(value->data);
+		free(value);
+	}
+	reg_index_free(&k->values);
+	reg_index_free(&k->subkeys);
 }
 
 	VOID
@@ -255,15 +282,15 @@ void make_dirty(struct reg_key *key)
 /* mark a key and all its subkeys as clean (not modified) */
 void make_clean(struct reg_key *key)
 {
-	int i;
+	unsigned int i;
 
 	if (key->flags & KEY_VOLATILE)
 		return;
 	if (!(key->flags & KEY_DIRTY))
 		return;
 	key->flags &= ~KEY_DIRTY;
-	for (i = 0; i <= key->last_subkey; i++)
-		make_clean(key->subkeys[i]);
+	for (i = 0; i < key->subkeys.count; i++)
+		make_clean(reg_index_get(&key->subkeys, i));
 }
 
 /* return the next token in a given path */
@@ -292,56 +319,29 @@ struct unicode_str *get_path_token(const struct unicode_str *path, struct unicod
 	return token;
 }
 
-/* find the named child of a given key and return its index */
-struct reg_key *find_subkey(const struct reg_key *key, const struct unicode_str *name, int *index)
+static const WCHAR *key_index_name(const void *entry, data_size_t *len)
 {
-	int i, min, max, res;
-	data_size_t len;
+	const struct reg_key *key = entry;
 
-	min = 0;
-	max = key->last_subkey;
-	while (min <= max) {
-		i = (min + max) / 2;
-		len = min((int)key->subkeys[i]->namelen, (int)name->len);
-		res = memicmpW(key->subkeys[i]->name, name->str, len / sizeof(WCHAR));
-		if (!res)
-			res = key->subkeys[i]->namelen - name->len;
-		if (!res) {
-			*index = i;
-			return key->subkeys[i];
-		}
-		if (res > 0)
-			max = i - 1;
-		else
-			min = i + 1;
-	}
-	*index = min;  /* this is where we should insert it */
-
-	/* not found */
-	return NULL;
+	*len = key->namelen;
+	return key->name;
 }
 
-/* try to grow the array of subkeys; return 1 if OK, 0 on error */
-int grow_subkeys(struct reg_key *key)
+static const WCHAR *value_index_name(const void *entry, data_size_t *len)
 {
-	struct reg_key **new_subkeys;
-	int nb_subkeys;
+	const struct key_value *value = entry;
 
-	if (key->nb_subkeys) {
-		nb_subkeys = key->nb_subkeys + (key->nb_subkeys / 2);  /* grow by 50% */
-		if (!(new_subkeys = realloc(key->subkeys,
-						nb_subkeys * sizeof(*new_subkeys),
-						key->nb_subkeys * sizeof(*new_subkeys))))
-			return 0;
-	} else {
-		nb_subkeys = MIN_VALUES;
-		if (!(new_subkeys = mem_alloc(nb_subkeys * sizeof(*new_subkeys))))
-			return 0;
-	}
-	key->subkeys    = new_subkeys;
-	key->nb_subkeys = nb_subkeys;
+	*len = value->namelen;
+	return value->name;
+}
 
-	return 1;
+/* find the named child of a given key */
+struct reg_key *find_subkey(struct reg_key *key, const struct unicode_str *name)
+{
+	if (key->hive)
+		load_hive_key(key);
+
+	return reg_index_find(&key->subkeys, name);
 }
 
 static struct reg_key *alloc_key(const struct unicode_str *name, time_t modif)
@@ -371,14 +371,12 @@ static struct reg_key *alloc_key(const struct unicode_str *name, time_t modif)
 		key->namelen     = name->len;
 		key->classlen    = 0;
 		key->flags       = 0;
-		key->last_subkey = -1;
-		key->nb_subkeys  = 0;
-		key->subkeys     = NULL;
-		key->nb_values   = 0;
-		key->last_value  = -1;
-		key->values[0] = key->values[1] = key->values[2] = key->values[3] = NULL;
 		key->modif       = modif;
 		key->parent      = NULL;
+		key->hive        = NULL;
+		key->hive_offset = 0;
+		reg_index_init(&key->subkeys, key_index_name);
+		reg_index_init(&key->values, value_index_name);
 		INIT_LIST_HEAD(&key->notify_list);
 		if (name->len && !(key->name = memdup(name->str, name->len))) {
 			release_object(key);
@@ -389,41 +387,33 @@ static struct reg_key *alloc_key(const struct unicode_str *name, time_t modif)
 	return key;
 }
 
-/* allocate a subkey for a given key, and return its index */
+/* allocate a subkey for a given key, the name must not exist yet */
 struct reg_key *alloc_subkey(struct reg_key *parent, const struct unicode_str *name,
-		int index, time_t modif)
+		time_t modif)
 {
 	struct reg_key *key;
-	int i;
 
 	if (name->len > MAX_NAME_LEN * sizeof(WCHAR)) {
 		set_error(STATUS_NAME_TOO_LONG);
 		return NULL;
 	}
-	if (parent->last_subkey + 1 == parent->nb_subkeys) /* need to grow the array */
-		if (!grow_subkeys(parent))
-			return NULL;
 
 	if ((key = alloc_key(name, modif))) {
+		if (!reg_index_insert(&parent->subkeys, key)) {
+			set_error(STATUS_NO_MEMORY);
+			release_object(key);
+			return NULL;
+		}
 		key->parent = parent;
-		for (i = ++parent->last_subkey; i > index; i--)
-			parent->subkeys[i] = parent->subkeys[i - 1];
-		parent->subkeys[index] = key;
 	}
 
 	return key;
 }
 
 /* free a subkey of a given key */
-void free_subkey(struct reg_key *parent, int index)
+void free_subkey(struct reg_key *parent, struct reg_key *key)
 {
-	struct reg_key *key;
-	int i;
-
-	key = parent->subkeys[index];
-	for (i = index; i < parent->last_subkey; i++)
-		parent->subkeys[i] = parent->subkeys[i + 1];
-	parent->last_subkey--;
+	reg_index_remove(&parent->subkeys, key);
 	key->flags |= KEY_DELETED;
 	key->parent = NULL;
 	release_object(key); /* TODO */
@@ -434,7 +424,6 @@ struct reg_key *create_key(struct reg_key *key, const struct unicode_str *name,
 		const struct unicode_str *class, int flags, time_t modif, int *created)
 {
 	struct reg_key *base;
-	int index;
 	struct unicode_str token;
 
 	/* we cannot create a subkey under a deleted key */
@@ -459,7 +448,7 @@ struct reg_key *create_key(struct reg_key *key, const struct unicode_str *name,
 	while (token.len) {
 		struct reg_key *subkey;
 
-		if (!(subkey = find_subkey(key, &token, &index)))
+		if (!(subkey = find_subkey(key, &token)))
 			break;
 		key = subkey;
 		get_path_token(name, &token);
@@ -472,7 +461,7 @@ struct reg_key *create_key(struct reg_key *key, const struct unicode_str *name,
 	*created = 1;
 	if (flags & KEY_DIRTY)
 		make_dirty(key);
-	if (!(key = alloc_subkey(key, &token, index, modif)))
+	if (!(key = alloc_subkey(key, &token, modif)))
 		return NULL;
 	base = key;
 
@@ -482,9 +471,8 @@ struct reg_key *create_key(struct reg_key *key, const struct unicode_str *name,
 		if (!token.len)
 			break;
 
-		/* we know the index is always 0 in a new key */
-		if (!(key = alloc_subkey(key, &token, 0, modif))) {
-			free_subkey(base, index);
+		if (!(key = alloc_subkey(key, &token, modif))) {
+			free_subkey(base->parent, base);
 			return NULL;
 		}
 	}
@@ -495,7 +483,10 @@ done:
 		free(key->class);
 		if (!(key->class = memdup(class->str, key->classlen)))
 			key->classlen = 0;
+		make_dirty(key);
 	}
+	if (*created || (class && class->len))
+		journal_key(key);
 	grab_object(key);
 
 	return key;
@@ -518,10 +509,9 @@ void touch_key(struct reg_key *key, unsigned int change)
 /* delete a key and its values */
 int delete_key(struct reg_key *key, int recurse)
 {
-	int index;
 	struct reg_key *parent;
 
-	/* must find parent and index */
+	/* must find parent */
 	if (key == root_key) {
 		set_error(STATUS_ACCESS_DENIED);
 		return -1;
@@ -532,21 +522,20 @@ int delete_key(struct reg_key *key, int recurse)
 		return -1;
 	}
 
-	while (recurse && (key->last_subkey >= 0))
-		if (delete_key(key->subkeys[key->last_subkey], 1) == -1)
+	if (key->hive)
+		load_hive_key(key);
+	while (recurse && key->subkeys.count)
+		if (delete_key(reg_index_get(&key->subkeys, key->subkeys.count - 1), 1) == -1)
 			return -1;
 
-	for (index = 0; index <= parent->last_subkey; index++)
-		if (parent->subkeys[index] == key)
-			break;
-
 	/* we can only delete a key that has no subkeys */
-	if (key->last_subkey >= 0) {
+	if (key->subkeys.count) {
 		set_error(STATUS_ACCESS_DENIED);
 		return -1;
 	}
 
-	free_subkey(parent, index);
+	journal_delete_key(key);
+	free_subkey(parent, key);
 	touch_key(parent, REG_NOTIFY_CHANGE_NAME);
 
 	set_error(STATUS_SUCCESS);
@@ -554,23 +543,29 @@ int delete_key(struct reg_key *key, int recurse)
 }
 
 /* query information about a key or a subkey */
-void enum_key(const struct reg_key *key, int index, int info_class,
+void enum_key(struct reg_key *key, int index, int info_class,
 		struct enum_key_reply *reply)
 {
-	int i;
+	unsigned int i;
 	data_size_t len, namelen, classlen;
 	data_size_t max_subkey = 0, max_class = 0;
 	data_size_t max_value = 0, max_data = 0;
 	char *data;
 
 	if (index != -1) { /* -1 means use the specified key directly */
-		if ((index < 0) || (index > key->last_subkey)) {
+		if (key->hive)
+			load_hive_key(key);
+		if ((index < 0) || ((unsigned int)index >= key->subkeys.count)) {
 			set_error(STATUS_NO_MORE_ENTRIES);
 			return;
 		}
-		key = key->subkeys[index];
+		key = reg_index_get(&key->subkeys, index);
 	}
 
+	/* only the full information needs the counts, don't load every key of an enumeration */
+	if (info_class == KeyFullInformation && key->hive)
+		load_hive_key(key);
+
 	namelen = key->namelen;
 	classlen = key->classlen;
 
@@ -585,8 +580,8 @@ void enum_key(const struct reg_key *key, int index, int info_class,
 			reply->max_data   = 0;
 			break;
 		case KeyFullInformation:
-			for (i = 0; i <= key->last_subkey; i++) {
-				struct reg_key *subkey = key->subkeys[i];
+			for (i = 0; i < key->subkeys.count; i++) {
+				struct reg_key *subkey = reg_index_get(&key->subkeys, i);
 
 				len = subkey->namelen / sizeof(WCHAR);
 				if (len > max_subkey)
@@ -595,13 +590,13 @@ void enum_key(const struct reg_key *key, int index, int info_class,
 				if (len > max_class)
 					max_class = len;
 			}
-			for (i = 0; i <= key->last_value; i++) {
-				int m = i / VALUES_PER_BLOCK, n = i % VALUES_PER_BLOCK;
+			for (i = 0; i < key->values.count; i++) {
+				struct key_value *value = reg_index_get(&key->values, i);
 
-				len = key->values[m][n].namelen / sizeof(WCHAR);
+				len = value->namelen / sizeof(WCHAR);
 				if (len > max_value)
 					max_value = len;
-				len = key->values[m][n].len;
+				len = value->len;
 				if (len > max_data)
 					max_data = len;
 			}
@@ -615,8 +610,8 @@ void enum_key(const struct reg_key *key, int index, int info_class,
 			set_error(STATUS_INVALID_PARAMETER);
 			return;
 	}
-	reply->subkeys = key->last_subkey + 1;
-	reply->values  = key->last_value + 1;
+	reply->subkeys = key->subkeys.count;
+	reply->values  = key->values.count;
 	reply->modif   = key->modif;
 	reply->total   = namelen + classlen;
 
@@ -634,100 +629,42 @@ void enum_key(const struct reg_key *key, int index, int info_class,
 	set_error(STATUS_SUCCESS);
 }
 
-/* try to grow the array of values; return 1 if OK, 0 on error */
-int grow_values(struct reg_key *key)
+/* find the named value of a given key */
+struct key_value *find_value(struct reg_key *key, const struct unicode_str *name)
 {
-	struct key_value *new_val;
-	int nb_values, m;
-
-	nb_values = key->nb_values;
-	if (key->nb_values) {
-		if (key->nb_values < (VALUES_PER_BLOCK)) {
-			if (key->nb_values < (VALUES_PER_BLOCK / 2))
-				nb_values = key->nb_values + (key->nb_values / 2);  /* grow by 50% */
-			else
-				nb_values = VALUES_PER_BLOCK;
-
-			if (!(new_val = realloc(key->values[0], 
-							nb_values * sizeof(*new_val), key->nb_values * sizeof(*new_val)))) {
-				kdebug("fails\n");
-				return 0;
-			}
-		} else {
-			nb_values += VALUES_PER_BLOCK;
-			if (!(new_val = mem_alloc(VALUES_PER_BLOCK * sizeof(*new_val))))
-				return 0;
-		}
-	} else {
-		nb_values = MIN_VALUES;
-		if (!(new_val = mem_alloc(nb_values * sizeof(*new_val))))
-			return 0;
-	}
-	m = (nb_values - 1) / VALUES_PER_BLOCK;
-	key->values[m] = new_val;
-	key->nb_values = nb_values;
-
-	return 1;
-}
-
-/* find the named value of a given key and return its index in the array */
-struct key_value *find_value(const struct reg_key *key, const struct unicode_str *name, int *index)
-{
-	int i, min, max, res;
-	int m, n;
-	data_size_t len;
-
-	min = 0;
-	max = key->last_value;
-	while (min <= max) {
-		i = (min + max) / 2;
-		m = i / VALUES_PER_BLOCK;
-		n = i % VALUES_PER_BLOCK;
-		len = min((int)key->values[m][n].namelen, (int)name->len);
-		res = memicmpW(key->values[m][n].name, name->str, len / sizeof(WCHAR));
-		if (!res)
-			res = key->values[m][n].namelen - name->len;
-		if (!res) {
-			*index = i;
-			return &key->values[m][n];
-		}
-		if (res > 0)
-			max = i - 1;
-		else
-			min = i + 1;
-	}
+	if (key->hive)
+		load_hive_key(key);
 
-	*index = min;  /* this is where we should insert it */
-	return NULL;
+	return reg_index_find(&key->values, name);
 }
 
-/* insert a new value; the index must have been returned by find_value */
-struct key_value *insert_value(struct reg_key *key, const struct unicode_str *name, int index)
+/* insert a new value, the name must not exist yet */
+struct key_value *insert_value(struct reg_key *key, const struct unicode_str *name)
 {
 	struct key_value *value;
 	WCHAR *new_name = NULL;
-	int i;
 
 	if (name->len > MAX_VALUE_LEN * sizeof(WCHAR)) {
 		set_error(STATUS_NAME_TOO_LONG);
 		return NULL;
 	}
-	if (key->last_value + 1 == key->nb_values) {
-		if (!grow_values(key))
-			return NULL;
-	}
-	if (name->len && !(new_name = memdup(name->str, name->len)))
+	if (!(value = malloc(sizeof(*value))))
+		return NULL;
+	if (name->len && !(new_name = memdup(name->str, name->len))) {
+		free(value);
 		return NULL;
-	for (i = ++key->last_value; i > index; i--) {
-		int m = i / VALUES_PER_BLOCK, n = i % VALUES_PER_BLOCK;
-		int j = (i - 1) / VALUES_PER_BLOCK, k = (i - 1) % VALUES_PER_BLOCK;
-		key->values[m][n] = key->values[j][k];
 	}
-	value = &key->values[index / VALUES_PER_BLOCK][index % VALUES_PER_BLOCK];
 	value->name    = new_name;
 	value->namelen = name->len;
+	value->type    = 0;
 	value->len     = 0;
 	value->data    = NULL;
+	if (!reg_index_insert(&key->values, value)) {
+		set_error(STATUS_NO_MEMORY);
+		free(new_name);
+		free(value);
+		return NULL;
+	}
 	return value;
 }
 
@@ -737,9 +674,8 @@ void set_value(struct reg_key *key, const struct unicode_str *name,
 {
 	struct key_value *value;
 	void *ptr = NULL;
-	int index;
 
-	if ((value = find_value(key, name, &index))) {
+	if ((value = find_value(key, name))) {
 		/* check if the new value is identical to the existing one */
 		if (value->type == type && value->len == len &&
 				value->data && !memcmp(value->data, data, len)) {
@@ -751,7 +687,7 @@ void set_value(struct reg_key *key, const struct unicode_str *name,
 		return;
 
 	if (!value) {
-		if (!(value = insert_value(key, name, index))) {
+		if (!(value = insert_value(key, name))) {
 			free(ptr);
 			return;
 		}
@@ -762,6 +698,7 @@ void set_value(struct reg_key *key, const struct unicode_str *name,
 	value->len   = len;
 	value->data  = ptr;
 	touch_key(key, REG_NOTIFY_CHANGE_LAST_SET);
+	journal_value(key, value);
 	set_error(STATUS_SUCCESS);
 }
 
@@ -770,15 +707,15 @@ void enum_value(struct reg_key *key, int i, int info_class, struct enum_key_valu
 {
 	struct key_value *value;
 
-	if (i < 0 || i > key->last_value)
+	if (key->hive)
+		load_hive_key(key);
+	if (i < 0 || (unsigned int)i >= key->values.count)
 		set_error(STATUS_NO_MORE_ENTRIES);
 	else {
 		void *data;
 		data_size_t namelen, maxlen;
-		int m = i / VALUES_PER_BLOCK;
-		int n = i % VALUES_PER_BLOCK;
 
-		value = &key->values[m][n];
+		value = reg_index_get(&key->values, i);
 		reply->type = value->type;
 		namelen = value->namelen;
 
@@ -817,9 +754,8 @@ void enum_value(struct reg_key *key, int i, int info_class, struct enum_key_valu
 void get_value(struct reg_key *key, const struct unicode_str *name, int *type, data_size_t *len)
 {
 	struct key_value *value;
-	int index;
 
-	if ((value = find_value(key, name, &index))) {
+	if ((value = find_value(key, name))) {
 		*type = value->type;
 		*len  = value->len;
 		if (value->data)
@@ -836,24 +772,202 @@ void get_value(struct reg_key *key, const struct unicode_str *name, int *type, d
 void delete_value(struct reg_key *key, const struct unicode_str *name)
 {
 	struct key_value *value;
-	int i, index;
 
-	if (!(value = find_value(key, name, &index))) {
+	if (!(value = find_value(key, name))) {
 		set_error(STATUS_OBJECT_NAME_NOT_FOUND);
 		return;
 	}
 
+	reg_index_remove(&key->values, value);
+	touch_key(key, REG_NOTIFY_CHANGE_LAST_SET);
+	journal_delete_value(key, name);  /* name may point into value */
 	free(value->name);
 	free(value->data);
-	for (i = index; i < key->last_value; i++) {
-		int m = i / VALUES_PER_BLOCK, n = i % VALUES_PER_BLOCK;
-		int j = (i + 1) / VALUES_PER_BLOCK, k = (i + 1) % VALUES_PER_BLOCK;
+	free(value);
+	set_error(STATUS_SUCCESS);
+}
+
+#define HIVE_TABLE_CHUNK 64  /* table entries read at a time */
 
-		key->values[m][n] = key->values[j][k];
+/* read a piece of a hive, return 1 if OK */
+static int hive_read(struct reg_hive *hive, unsigned int offset, void *buf, unsigned int len)
+{
+	return !len || kernel_read(hive->filp, offset, buf, len) == (int)len;
+}
+
+static void put_hive(struct reg_hive *hive)
+{
+	if (atomic_dec_and_test(&hive->refcount)) {
+		fput(hive->filp);
+		kfree(hive);
 	}
-	key->last_value--;
-	touch_key(key, REG_NOTIFY_CHANGE_LAST_SET);
-	set_error(STATUS_SUCCESS);
+}
+
+/* add a subkey for a key record of the hive, its own contents stay on disk */
+static struct reg_key *load_hive_subkey(struct reg_key *parent, struct reg_hive *hive,
+		unsigned int offset, WCHAR *buf)
+{
+	struct hive_key hk;
+	struct unicode_str name;
+	struct reg_key *key;
+
+	if (!hive_read(hive, offset, &hk, sizeof(hk))
+			|| hk.namelen > MAX_NAME_LEN * sizeof(WCHAR)
+			|| !hive_read(hive, offset + sizeof(hk), buf, hk.namelen))
+		return NULL;
+
+	name.str = buf;
+	name.len = hk.namelen;
+	if (!(key = alloc_subkey(parent, &name, hk.modif)))
+		return NULL;
+
+	if (hk.classlen && (key->class = malloc(hk.classlen))) {
+		if (hive_read(hive, offset + sizeof(hk) + hk.namelen, key->class, hk.classlen))
+			key->classlen = hk.classlen;
+		else {
+			free(key->class);
+			key->class = NULL;
+		}
+	}
+	atomic_inc(&hive->refcount);
+	key->hive = hive;
+	key->hive_offset = offset;
+	return key;
+}
+
+/* add a value for a value record of the hive */
+static int load_hive_value(struct reg_key *key, struct reg_hive *hive,
+		unsigned int offset, WCHAR *buf)
+{
+	struct hive_value hv;
+	struct key_value *value;
+	struct unicode_str name;
+	void *data = NULL;
+
+	if (!hive_read(hive, offset, &hv, sizeof(hv))
+			|| hv.namelen > MAX_VALUE_LEN * sizeof(WCHAR)
+			|| !hive_read(hive, offset + sizeof(hv), buf, hv.namelen))
+		return 0;
+
+	if (hv.len) {
+		if (!(data = malloc(hv.len)))
+			return 0;
+		if (!hive_read(hive, offset + sizeof(hv) + hv.namelen, data, hv.len)) {
+			free(data);
+			return 0;
+		}
+	}
+
+	name.str = buf;
+	name.len = hv.namelen;
+	if (!(value = insert_value(key, &name))) {
+		free(data);
+		return 0;
+	}
+	value->type = hv.type;
+	value->len  = hv.len;
+	value->data = data;
+	return 1;
+}
+
+/* bring the subkeys and values of a key in from its hive, on first access */
+static void load_hive_key(struct reg_key *key)
+{
+	unsigned int table[HIVE_TABLE_CHUNK];
+	unsigned int i, j, count;
+	struct reg_hive *hive;
+	struct hive_key hk;
+	WCHAR *buf;
+
+	mutex_lock(&journal_mutex);
+	if (!(hive = key->hive))
+		goto out;  /* somebody else loaded it */
+	if (!(buf = malloc((MAX_NAME_LEN + 1) * sizeof(WCHAR))))
+		goto out;
+	key->hive = NULL;
+
+	if (!hive_read(hive, key->hive_offset, &hk, sizeof(hk)))
+		goto error;
+
+	/* records are sorted the same way as the arrays, so just append */
+	for (i = 0; i < hk.nb_subkeys; i += count) {
+		count = min(hk.nb_subkeys - i, (unsigned int)HIVE_TABLE_CHUNK);
+		if (!hive_read(hive, hk.subkeys + i * sizeof(table[0]), table, count * sizeof(table[0])))
+			goto error;
+		for (j = 0; j < count; j++)
+			if (!load_hive_subkey(key, hive, table[j], buf))
+				goto error;
+	}
+	for (i = 0; i < hk.nb_values; i += count) {
+		count = min(hk.nb_values - i, (unsigned int)HIVE_TABLE_CHUNK);
+		if (!hive_read(hive, hk.values + i * sizeof(table[0]), table, count * sizeof(table[0])))
+			goto error;
+		for (j = 0; j < count; j++)
+			if (!load_hive_value(key, hive, table[j], buf))
+				goto error;
+	}
+	put_hive(hive);
+	goto done;
+
+error:
+	/* drop what was loaded, and try again on next access */
+	kdebug("could not load key %p from registry hive at %x\n", key, key->hive_offset);
+	while (key->subkeys.count)
+		free_subkey(key, reg_index_get(&key->subkeys, 0));
+	while (key->values.count) {
+		struct key_value *value = reg_index_get(&key->values, 0);
+
+		reg_index_remove(&key->values, value);
+		free(value->name);
+		free(value->data);
+		free(value);
+	}
+	key->hive = hive;
+done:
+	free(buf);
+out:
+	mutex_unlock(&journal_mutex);
+}
+
+/* adopt the hive of a branch instead of parsing its text file, unless the text file is newer */
+static int open_hive(const char *path, struct reg_key *key, const struct timespec *text_mtime)
+{
+	struct hive_header header;
+	struct hive_key hk;
+	struct reg_hive *hive;
+	struct inode *inode;
+	struct file *filp;
+
+	if (key->hive || key->subkeys.count || key->values.count)
+		return 0;
+
+	filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(filp))
+		return 0;
+	inode = filp->f_path.dentry->d_inode;
+	if (text_mtime && timespec_compare(&inode->i_mtime, text_mtime) < 0)
+		goto error;
+
+	if (kernel_read(filp, 0, (char *)&header, sizeof(header)) != sizeof(header)
+			|| memcmp(header.magic, HIVE_MAGIC, sizeof(header.magic))
+			|| header.size != i_size_read(inode)
+			|| kernel_read(filp, header.root, (char *)&hk, sizeof(hk)) != sizeof(hk)) {
+		kdebug("%s is not a valid registry hive\n", path);
+		goto error;
+	}
+
+	if (!(hive = kmalloc(sizeof(*hive), GFP_KERNEL)))
+		goto error;
+	atomic_set(&hive->refcount, 1);
+	hive->filp = filp;
+	key->hive = hive;
+	key->hive_offset = header.root;
+	key->modif = hk.modif;
+	return 1;
+
+error:
+	fput(filp);
+	return 0;
 }
 
 /* read a line from the input file */
@@ -992,7 +1106,6 @@ struct key_value *parse_value_name(struct reg_key *key, const char *buffer,
 {
 	struct key_value *value;
 	struct unicode_str name;
-	int index;
 	data_size_t maxlen = strlen(buffer) * sizeof(WCHAR);
 
 	if (!get_file_tmp_space(info, maxlen))
@@ -1017,8 +1130,8 @@ struct key_value *parse_value_name(struct reg_key *key, const char *buffer,
 	(*len)++;
 	while (isspace(buffer[*len]))
 		(*len)++;
-	if (!(value = find_value(key, &name, &index)))
-		value = insert_value(key, &name, index);
+	if (!(value = find_value(key, &name)))
+		value = insert_value(key, &name);
 	return value;
 
 error:
@@ -1062,6 +1175,15 @@ int load_value(struct reg_key *key, const char *buffer, struct file_load_info *i
 	if (!(value = parse_value_name(key, buffer, &len, info)))
 		return 0;
 
+	if (buffer[len] == '-') {  /* deleted value, only written to journals */
+		struct unicode_str name;
+
+		name.str = value->name;
+		name.len = value->namelen;
+		delete_value(key, &name);
+		return 1;
+	}
+
 	if (!(res = get_data_type(buffer + len, &type, &parse_type)))
 		goto error;
 	buffer += len + res;
@@ -1119,6 +1241,7 @@ int load_value(struct reg_key *key, const char *buffer, struct file_load_info *i
 	value->len  = len;
 	value->type = type;
 	make_dirty(key);
+	journal_value(key, value);
 	return 1;
 
 error:
@@ -1126,6 +1249,62 @@ error:
 	return 0;
 }
 
+/* delete a key named in the input file, the branch itself is never deleted */
+void load_deleted_key(struct reg_key *base, const char *buffer, int prefix_len,
+		struct file_load_info *info)
+{
+	WCHAR *p;
+	struct reg_key *key;
+	struct unicode_str name;
+	data_size_t len = strlen(buffer) * sizeof(WCHAR);
+
+	if (!get_file_tmp_space(info, len))
+		return;
+
+	if (parse_strW(info->tmp, &len, buffer, ']') == -1) {
+		file_read_error("Malformed key", info);
+		return;
+	}
+
+	p = info->tmp;
+	while (prefix_len && *p) {
+		if (*p++ == '\\')
+			prefix_len--;
+	}
+	if (!*p)
+		return;
+
+	name.str = p;
+	name.len = len - (p - info->tmp + 1) * sizeof(WCHAR);
+	if ((key = open_key(base, &name))) {
+		delete_key(key, 1);
+		release_object(key);
+	} else
+		set_error(STATUS_SUCCESS);  /* already gone */
+}
+
+/* set the class of a key from the input file, only written to journals */
+static void load_key_class(struct reg_key *key, const char *buffer, struct file_load_info *info)
+{
+	data_size_t len = strlen(buffer) * sizeof(WCHAR);
+	WCHAR *class = NULL;
+
+	if (!get_file_tmp_space(info, len))
+		return;
+
+	if (parse_strW(info->tmp, &len, buffer, '\"') == -1) {
+		file_read_error("Malformed key class", info);
+		return;
+	}
+
+	len -= sizeof(WCHAR);  /* drop the terminating null */
+	if (len && !(class = memdup(info->tmp, len)))
+		return;
+	free(key->class);
+	key->class = class;
+	key->classlen = len;
+}
+
 struct file_load_info info;
 
 void load_keys(struct reg_key *key, const char *filename, struct LIBC_FILE *fp, int prefix_len)
@@ -1175,7 +1354,19 @@ void load_keys(struct reg_key *key, const char *filename, struct LIBC_FILE *fp,
 				else
 					file_read_error("Value without key", &info);
 				break;
-			case '#':   /* comment */
+			case '-':   /* deleted key, only written to journals */
+				if (subkey)
+					release_object(subkey);
+				subkey = NULL;
+				if (p[1] == '[')
+					load_deleted_key(key, p + 2, prefix_len == -1 ? 0 : prefix_len, &info);
+				else
+					file_read_error("Unrecognized input", &info);
+				break;
+			case '#':   /* class of the key, only written to journals, or comment */
+				if (subkey && !strncmp(p, "#class=\"", 8))
+					load_key_class(subkey, p + 8, &info);
+				break;
 			case ';':   /* comment */
 			case 0:     /* empty line */
 				break;
@@ -1194,32 +1385,97 @@ done:
 	free(info.tmp);
 }
 
+/* replay the journal left over from the last run, and open it for appending */
+static struct LIBC_FILE *open_journal(const char *path, struct reg_key *key)
+{
+	struct LIBC_FILE	*fp;
+	struct file* filp;
+
+	filp = filp_open(path, O_RDONLY, DEFAULT_FILE_MODE);
+	if (!IS_ERR(filp)) {
+		if ((fp = libc_file_open(filp, "r"))) {
+			load_keys(key, path, fp, 0);
+			fclose(fp);
+		} else
+			fput(filp);
+	}
+
+	filp = filp_open(path, O_RDWR | O_CREAT | O_APPEND, DEFAULT_FILE_MODE);
+	if (IS_ERR(filp)) {
+		kdebug("could not open registry journal %s\n", path);
+		return NULL;
+	}
+	if (!(fp = libc_file_open(filp, "w"))) {
+		fput(filp);
+		return NULL;
+	}
+	if (!i_size_read(filp->f_path.dentry->d_inode))
+		fprintf(fp, "WINE REGISTRY Version 2\n");
+	return fp;
+}
+
 /* load one of the initial registry files */
 void load_init_registry_from_file(const char *filename, struct reg_key *key)
 {
 	struct LIBC_FILE	*fp;
 	struct file* filp;
+	struct save_branch_info *branch;
+	char *hive_path;
+	int stale = 1;
 
 	ktrace("file %s\n", filename);
 
+	if (!(hive_path = malloc(strlen(filename) + sizeof(".hive"))))
+		return;
+	sprintf(hive_path, "%s.hive", filename);
+
+	key->flags |= KEY_LOADING;
+
 	/* FIXME Don't create reg file when insmod module, because there is no .wine now */
 	filp = filp_open(filename, O_RDONLY, DEFAULT_FILE_MODE);
 	if (IS_ERR(filp)) {
 		kdebug("filp_open error:%s\n",filename);
-		if (PTR_ERR(filp) == -ENOENT)
+		if (PTR_ERR(filp) == -ENOENT) {
+			if (open_hive(hive_path, key, NULL))
+				stale = 0;
 			goto dotwine_not_exist;
-		else
-			return;
+		} else
+			goto out;
 	}
 
-	if ((fp = libc_file_open(filp, "r"))) {
+	/* the text file is only parsed when there is no hive, or it was edited since */
+	if (open_hive(hive_path, key, &filp->f_path.dentry->d_inode->i_mtime)) {
+		fput(filp);
+		stale = 0;
+	} else if ((fp = libc_file_open(filp, "r"))) {
 		load_keys(key, filename, fp, 0);
 		fclose(fp);
+		make_clean(key);  /* the file is up to date, only the journal is not */
 	}
 
 dotwine_not_exist:
-	if ((save_branch_info[save_branch_count].path = strdup(filename)))
-		save_branch_info[save_branch_count++].key = (struct reg_key *)grab_object(key);
+	if (save_branch_count >= MAX_SAVE_BRANCH_INFO)
+		goto out;
+	branch = &save_branch_info[save_branch_count];
+	if (!(branch->path = strdup(filename)))
+		goto out;
+	branch->hive_path = hive_path;
+	branch->hive_stale = stale;
+	hive_path = NULL;
+	if ((branch->journal_path = malloc(strlen(filename) + sizeof(".journal")))) {
+		sprintf(branch->journal_path, "%s.journal", filename);
+		branch->journal = open_journal(branch->journal_path, key);
+	}
+	branch->pending = 0;
+	branch->key = (struct reg_key *)grab_object(key);
+
+	mutex_lock(&journal_mutex);
+	save_branch_count++;
+	mutex_unlock(&journal_mutex);
+
+out:
+	key->flags &= ~KEY_LOADING;
+	free(hive_path);
 }
 
 WCHAR *format_user_registry_path(const SID *sid, struct unicode_str *path)
@@ -1346,7 +1602,6 @@ static struct notify *find_notify(struct reg_key *key, struct eprocess *process,
 /* open a subkey */
 struct reg_key *open_key(struct reg_key *key, const struct unicode_str *name)
 {
-	int index;
 	struct unicode_str token;
 
 	token.str = NULL;
@@ -1360,7 +1615,7 @@ struct reg_key *open_key(struct reg_key *key, const struct unicode_str *name)
 		}
 		memcpy(wcs, token.str, token.len);
 		wcs[token.len / sizeof(WCHAR)] = 0;
-		if (!(key = find_subkey(key, &token, &index))) {
+		if (!(key = find_subkey(key, &token))) {
 			set_error(STATUS_OBJECT_NAME_NOT_FOUND);
 			break;
 		}
@@ -1480,27 +1735,26 @@ void dump_value(const struct key_value *value, struct LIBC_FILE *fp)
 
 
 /* save a registry and all its subkeys to a text file */
-static void save_subkeys(const struct reg_key *key, const struct reg_key *base,struct LIBC_FILE *fp)
+static void save_subkeys(struct reg_key *key, const struct reg_key *base,struct LIBC_FILE *fp)
 {
-	int i, m, n;
+	unsigned int i;
 
 	if (key->flags & KEY_VOLATILE)
 		return;
+	if (key->hive)
+		load_hive_key(key);
 
-	if ((key->last_value >= 0) || (key->last_subkey == -1)) {
+	if (key->values.count || !key->subkeys.count) {
 		fprintf(fp, "\n[");
 		if (key != base)
 			dump_path(key, base, fp);
 		fprintf(fp, "] %ld\n", (long)key->modif);
-		for (i = 0; i <= key->last_value; i++) {
-			m = i / VALUES_PER_BLOCK;
-			n = i % VALUES_PER_BLOCK;
-			dump_value(&key->values[m][n], fp);
-		}
+		for (i = 0; i < key->values.count; i++)
+			dump_value(reg_index_get(&key->values, i), fp);
 	}
 
-	for (i = 0; i <= key->last_subkey; i++)
-		save_subkeys(key->subkeys[i], base, fp);
+	for (i = 0; i < key->subkeys.count; i++)
+		save_subkeys(reg_index_get(&key->subkeys, i), base, fp);
 }
 
 unsigned int key_map_access(struct object *obj, unsigned int access)
@@ -1529,33 +1783,28 @@ int key_close_handle(struct object *obj, struct eprocess *process, obj_handle_t
 
 void key_destroy(struct object *obj)
 {
-	int i;
+	unsigned int i;
 	struct list_head  *ptr;
 	struct reg_key *key = (struct reg_key *)obj;
 	/*assert(obj->ops == &key_ops);*/
 
 	free(key->name);
 	free(key->class);
-	for (i = 0; i <= key->last_value; i++) {
-		int m = i / VALUES_PER_BLOCK, n = i % VALUES_PER_BLOCK;
-		if (key->values[m][n].name)
-			free(key->values[m][n].name);
-		if (key->values[m][n].data)
-			free(key->values[m][n].data);
-	}
-	if (key->values[3])
-		free(key->values[3]);
-	if (key->values[2])
-		free(key->values[2]);
-	if (key->values[1])
-		free(key->values[1]);
-	if (key->values[0])
-		free(key->values[0]);
-	for (i = 0; i <= key->last_subkey; i++) {
-		key->subkeys[i]->parent = NULL;
-		release_object(key->subkeys[i]);
-	}
-	free(key->subkeys);
+	for (i = 0; i < key->values.count; i++) {
+		struct key_value *value = reg_index_get(&key->values, i);
+
+		free(value->name);
+		free(value->data);
+		free(value);
+	}
+	reg_index_free(&key->values);
+	for (i = 0; i < key->subkeys.count; i++) {
+		struct reg_key *subkey = reg_index_get(&key->subkeys, i);
+
+		subkey->parent = NULL;
+		release_object(subkey);
+	}
+	reg_index_free(&key->subkeys);
 	/* unconditionally notify everything waiting on this key */
 	while ((ptr = (((&key->notify_list)->next == &key->notify_list) ? (&key->notify_list)->next : NULL))) {
 		struct notify *notify = list_entry(ptr, struct notify, entry);
@@ -1653,7 +1902,11 @@ int save_branch(struct reg_key *key, const char *path)
 		goto done;
 	}
 	save_all_subkeys(key, fp);
-	ret = fclose(fp);
+	/* the journal is dropped once this returns, the data must be on disk by then */
+	if (!(ret = fflush(fp)))
+		ret = vfs_fsync(fp->filp, fp->filp->f_path.dentry, 0);
+	if (fclose(fp))
+		ret = -1;
 	/* if successfully written, rename to final name */
 	if (!ret)
 		ret = rename(tmp, path /* "./system_reg.new"*/);
@@ -1669,61 +1922,461 @@ done:
 	return ret;
 }
 
-void flush_registry(void)
+/* state of a hive being written */
+struct hive_writer
+{
+	struct LIBC_FILE *fp;
+	unsigned int      pos;    /* offset of the next record */
+	WCHAR            *buf;    /* name buffer for copied keys */
+	int               error;
+};
+
+/* append data to the hive, return its offset */
+static unsigned int hive_put(struct hive_writer *w, const void *data, unsigned int len)
+{
+	unsigned int offset = w->pos;
+
+	if (!len)
+		return offset;
+	if (w->pos + len < w->pos)
+		w->error = 1;  /* hive too large */
+	fwrite(w->fp, (void *)data, len);
+	w->pos += len;
+	return offset;
+}
+
+static void hive_align(struct hive_writer *w)
+{
+	static const char pad[4];
+
+	if (w->pos & 3)
+		hive_put(w, pad, 4 - (w->pos & 3));
+}
+
+static unsigned int hive_put_key(struct hive_writer *w, const struct hive_key *hk,
+		const WCHAR *name, const WCHAR *class)
+{
+	unsigned int offset = hive_put(w, hk, sizeof(*hk));
+
+	hive_put(w, name, hk->namelen);
+	hive_put(w, class, hk->classlen);
+	hive_align(w);
+	return offset;
+}
+
+/* copy a value record from an older hive */
+static unsigned int copy_hive_value(struct hive_writer *w, struct reg_hive *hive, unsigned int offset)
+{
+	struct hive_value hv;
+	unsigned int ret = 0;
+	char *data;
+
+	if (!hive_read(hive, offset, &hv, sizeof(hv))
+			|| !(data = malloc(hv.namelen + hv.len + 1))) {
+		w->error = 1;
+		return 0;
+	}
+	if (hive_read(hive, offset + sizeof(hv), data, hv.namelen + hv.len)) {
+		ret = hive_put(w, &hv, sizeof(hv));
+		hive_put(w, data, hv.namelen + hv.len);
+		hive_align(w);
+	} else
+		w->error = 1;
+	free(data);
+	return ret;
+}
+
+/*
+ * copy a key that was never loaded, and everything below it, from an older hive;
+ * name, class and modification time come from key if it is given
+ */
+static unsigned int copy_hive_key(struct hive_writer *w, struct reg_hive *hive,
+		unsigned int offset, const struct reg_key *key)
+{
+	struct hive_key hk;
+	unsigned int *table = NULL, i, ret = 0;
+	WCHAR *class = NULL;
+
+	if (!hive_read(hive, offset, &hk, sizeof(hk)) || hk.namelen > MAX_NAME_LEN * sizeof(WCHAR))
+		goto error;
+	if ((hk.nb_subkeys || hk.nb_values)
+			&& !(table = malloc(max(hk.nb_subkeys, hk.nb_values) * sizeof(*table))))
+		goto error;
+
+	if (!hive_read(hive, hk.subkeys, table, hk.nb_subkeys * sizeof(*table)))
+		goto error;
+	for (i = 0; i < hk.nb_subkeys && !w->error; i++)
+		table[i] = copy_hive_key(w, hive, table[i], NULL);
+	hk.subkeys = hive_put(w, table, hk.nb_subkeys * sizeof(*table));
+
+	if (!hive_read(hive, hk.values, table, hk.nb_values * sizeof(*table)))
+		goto error;
+	for (i = 0; i < hk.nb_values && !w->error; i++)
+		table[i] = copy_hive_value(w, hive, table[i]);
+	hk.values = hive_put(w, table, hk.nb_values * sizeof(*table));
+
+	if (key) {
+		hk.modif    = key->modif;
+		hk.namelen  = key->namelen;
+		hk.classlen = key->classlen;
+		ret = hive_put_key(w, &hk, key->name, key->class);
+	} else {
+		/* children are written, the name buffer is free again */
+		if (!hive_read(hive, offset + sizeof(hk), w->buf, hk.namelen))
+			goto error;
+		if (hk.classlen && (!(class = malloc(hk.classlen))
+					|| !hive_read(hive, offset + sizeof(hk) + hk.namelen, class, hk.classlen)))
+			goto error;
+		ret = hive_put_key(w, &hk, w->buf, class);
+	}
+	goto out;
+
+error:
+	w->error = 1;
+out:
+	free(class);
+	free(table);
+	return ret;
+}
+
+/* write a key and everything below it, return the offset of its record */
+static unsigned int write_hive_key(struct hive_writer *w, struct reg_key *key)
 {
+	struct hive_key hk;
+	struct hive_value hv;
+	unsigned int *table = NULL;
+	unsigned int i, count;
+
+	if (key->hive)
+		return copy_hive_key(w, key->hive, key->hive_offset, key);
+
+	count = max(key->subkeys.count, key->values.count);
+	if (count && !(table = malloc(count * sizeof(*table)))) {
+		w->error = 1;
+		return 0;
+	}
+
+	for (i = count = 0; i < key->subkeys.count && !w->error; i++) {
+		struct reg_key *subkey = reg_index_get(&key->subkeys, i);
+
+		if (!(subkey->flags & KEY_VOLATILE))
+			table[count++] = write_hive_key(w, subkey);
+	}
+	hk.nb_subkeys = count;
+	hk.subkeys = hive_put(w, table, count * sizeof(*table));
+
+	for (i = 0; i < key->values.count; i++) {
+		struct key_value *value = reg_index_get(&key->values, i);
+
+		hv.namelen = value->namelen;
+		hv.type    = value->type;
+		hv.len     = value->len;
+		table[i] = hive_put(w, &hv, sizeof(hv));
+		hive_put(w, value->name, value->namelen);
+		hive_put(w, value->data, value->len);
+		hive_align(w);
+	}
+	hk.nb_values = key->values.count;
+	hk.values = hive_put(w, table, hk.nb_values * sizeof(*table));
+
+	free(table);
+	hk.modif    = key->modif;
+	hk.namelen  = key->namelen;
+	hk.classlen = key->classlen;
+	return hive_put_key(w, &hk, key->name, key->class);
+}
+
+/* write a snapshot of a registry branch to a temporary hive, called with journal_mutex held */
+static struct file *write_hive(struct save_branch_info *branch, const char *tmp)
+{
+	struct reg_key *key = branch->key;
+	struct hive_header header;
+	struct hive_writer w;
+	struct file *filp;
+	int ret = 0;
+
+	ktrace("reg_key %p, path %s\n", key, tmp);
+
+	memset(&w, 0, sizeof(w));
+	filp = filp_open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE, DEFAULT_FILE_MODE);
+	if (IS_ERR(filp))
+		return NULL;
+	if (!(w.buf = malloc((MAX_NAME_LEN + 1) * sizeof(WCHAR))) || !(w.fp = libc_file_open(filp, "w"))) {
+		fput(filp);
+		goto done;
+	}
+
+	/* the header goes in last, a partly written hive has no magic */
+	memset(&header, 0, sizeof(header));
+	hive_put(&w, &header, sizeof(header));
+	header.root = write_hive_key(&w, key);
+	header.size = w.pos;
+	memcpy(header.magic, HIVE_MAGIC, sizeof(header.magic));
+
+	if (!w.error && !fflush(w.fp)) {
+		filp->f_pos = 0;
+		ret = (filp_write(filp, &header, sizeof(header)) == sizeof(header));
+	}
+	if (ret)
+		get_file(filp);  /* kept for commit_hive */
+	fclose(w.fp);
+
+done:
+	free(w.buf);
+	if (ret)
+		return filp;
+	unlink(tmp);
+	return NULL;
+}
+
+/* make a hive snapshot durable and move it over the branch hive */
+static int commit_hive(struct save_branch_info *branch, struct file *filp, const char *tmp)
+{
+	int ret = !vfs_fsync(filp, filp->f_path.dentry, 0);
+
+	fput(filp);
+	if (ret && !rename(tmp, branch->hive_path))
+		return 1;
+	unlink(tmp);
+	return 0;
+}
+
+/* find the branch whose journal records changes to a key */
+static struct save_branch_info *find_journal_branch(const struct reg_key *key)
+{
+	const struct reg_key *k;
 	int i;
 
-	for (i = 0; i < save_branch_count; i++) {
-		if (!save_branch(save_branch_info[i].key, save_branch_info[i].path)) {
-			kdebug("could not save registry branch to %s\n", save_branch_info[i].path);
-		}
+	if (key->flags & KEY_VOLATILE)
+		return NULL;
+	for (k = key; k; k = k->parent) {
+		if (k->flags & KEY_LOADING)
+			return NULL;
+		for (i = 0; i < save_branch_count; i++)
+			if (save_branch_info[i].key == k)
+				return save_branch_info[i].journal ? &save_branch_info[i] : NULL;
 	}
+	return NULL;
 }
 
-void write_registry(void)
+/* start a journal record for a key, returns with journal_mutex held on success */
+static struct save_branch_info *begin_record(const struct reg_key *key, const char *prefix)
 {
-	int i,j,dirty_count,k=1,write_num=200;
-	unsigned int msecs,timeout;
-	msecs = 10000;
-	timeout = msecs_to_jiffies(msecs)+1;
+	struct save_branch_info *branch;
 
-	ktrace("\n");
-	while (1) {
-		dirty_count = 0;
-		for (i=0;i < save_branch_count;i++){
-			if (save_branch_info[i].key->flags & KEY_DIRTY)
-				dirty_count++;
-			for (j = 0; j < save_branch_info[i].key->last_subkey; j++)
-				if ((*(save_branch_info[i].key->subkeys + j))->flags&KEY_DIRTY)
-					dirty_count++;
-		}
+	mutex_lock(&journal_mutex);
+	if (!(branch = find_journal_branch(key))) {
+		mutex_unlock(&journal_mutex);
+		return NULL;
+	}
+	fprintf(branch->journal, "\n%s[", prefix);
+	if (key != branch->key)
+		dump_path(key, branch->key, branch->journal);
+	fprintf(branch->journal, "] %ld\n", (long)key->modif);
+	return branch;
+}
 
-		if (kthread_should_stop()) {
-			for (i = 0; i < save_branch_count; i++) {
-				if (!save_branch(save_branch_info[i].key, save_branch_info[i].path)) {
-					kdebug("could not save registry branch to %s\n", save_branch_info[i].path);
-				}
-			}
-			return;
+static void end_record(struct save_branch_info *branch)
+{
+	int wake = (++branch->pending == JOURNAL_BATCH);
+
+	mutex_unlock(&journal_mutex);
+	if (wake && !IS_ERR_OR_NULL(save_kernel_task))
+		wake_up_process(save_kernel_task);
+}
+
+/* journal the creation of a key */
+static void journal_key(const struct reg_key *key)
+{
+	struct save_branch_info *branch;
+
+	if ((branch = begin_record(key, ""))) {
+		if (key->classlen) {
+			fprintf(branch->journal, "#class=\"");
+			dump_strW(key->class, key->classlen / sizeof(WCHAR), branch->journal, "\"\"");
+			fprintf(branch->journal, "\"\n");
 		}
-		k = k*2;
-		if (k > (2*write_num))
-			k = k/2;
-		if (dirty_count < write_num/k || dirty_count == 0) {
-			goto sleep;
+		end_record(branch);
+	}
+}
+
+/* journal the deletion of a key, must be called while it is still linked to its parent */
+static void journal_delete_key(const struct reg_key *key)
+{
+	struct save_branch_info *branch;
+
+	if ((branch = begin_record(key, "-")))
+		end_record(branch);
+}
+
+/* journal the new contents of a value */
+static void journal_value(const struct reg_key *key, const struct key_value *value)
+{
+	struct save_branch_info *branch;
+
+	if ((branch = begin_record(key, ""))) {
+		dump_value(value, branch->journal);
+		end_record(branch);
+	}
+}
+
+/* journal the deletion of a value */
+static void journal_delete_value(const struct reg_key *key, const struct unicode_str *name)
+{
+	struct save_branch_info *branch;
+
+	if ((branch = begin_record(key, ""))) {
+		if (name->len) {
+			fputc('\"', branch->journal);
+			dump_strW(name->str, name->len / sizeof(WCHAR), branch->journal, "\"\"");
+			fprintf(branch->journal, "\"=-\n");
+		} else
+			fprintf(branch->journal, "@=-\n");
+		end_record(branch);
+	}
+}
+
+/* push the pending journal records of a branch to disk */
+static void sync_journal(struct save_branch_info *branch)
+{
+	struct file *filp;
+	int ret;
+
+	mutex_lock(&journal_mutex);
+	if (!branch->journal || !branch->pending) {
+		mutex_unlock(&journal_mutex);
+		return;
+	}
+	branch->pending = 0;
+	fflush(branch->journal);
+	filp = branch->journal->filp;
+	get_file(filp);
+	mutex_unlock(&journal_mutex);
+
+	/* appends can go on while the data reaches the disk */
+	if ((ret = vfs_fsync(filp, filp->f_path.dentry, 0)) < 0)
+		kdebug("could not sync registry journal, error %d\n", ret);
+	fput(filp);
+}
+
+static loff_t journal_size(struct save_branch_info *branch)
+{
+	return branch->journal ? i_size_read(branch->journal->filp->f_path.dentry->d_inode) : 0;
+}
+
+/* drop the journal records written before start, the hive holds them now */
+static void trim_journal(struct save_branch_info *branch, loff_t start)
+{
+	struct file *filp = branch->journal->filp;
+	char *tail = NULL;
+	loff_t len;
+
+	fflush(branch->journal);
+	len = journal_size(branch) - start;
+	if (len && (!(tail = vmalloc(len)) || kernel_read(filp, start, tail, len) != len)) {
+		/* replaying a record twice is harmless, keep them all */
+		vfree(tail);
+		return;
+	}
+	filp_truncate(filp, 0, 0);
+	fprintf(branch->journal, "WINE REGISTRY Version 2\n");
+	if (len)
+		fwrite(branch->journal, tail, len);
+	fflush(branch->journal);
+	vfree(tail);
+
+	if (!len)
+		branch->pending = 0;
+	else if (!branch->pending)
+		branch->pending = 1;  /* the records written back are not on disk yet */
+}
+
+/*
+ * rewrite the branch file and trim the journal. The hive is snapshotted to the
+ * page cache under journal_mutex, which also keeps hive loading away from the
+ * walk; syncing and renaming it are left outside, so journal writers only wait
+ * for the snapshot
+ */
+static int compact_branch(struct save_branch_info *branch)
+{
+	struct file *filp = NULL;
+	loff_t start = 0;
+	char *tmp;
+	int ret = 1;
+
+	if (!(tmp = malloc(strlen(branch->hive_path) + sizeof(".tmp"))))
+		return 0;
+	sprintf(tmp, "%s.tmp", branch->hive_path);
+
+	mutex_lock(&compact_mutex);
+	mutex_lock(&journal_mutex);
+	if (branch->journal) {
+		fflush(branch->journal);
+		start = journal_size(branch);
+	}
+	if ((branch->key->flags & KEY_DIRTY) || branch->hive_stale) {
+		make_clean(branch->key);  /* changes made during the save dirty it again */
+		if (!(filp = write_hive(branch, tmp))) {
+			branch->hive_stale = 1;
+			ret = 0;
 		}
-		k = k/2;
-		if(k == 0)
-			k = 1;
+	}
+	mutex_unlock(&journal_mutex);
+
+	if (filp)
+		ret = commit_hive(branch, filp, tmp);
+
+	mutex_lock(&journal_mutex);
+	if (filp)
+		branch->hive_stale = !ret;
+	if (ret && branch->journal)
+		trim_journal(branch, start);
+	mutex_unlock(&journal_mutex);
+	mutex_unlock(&compact_mutex);
+	free(tmp);
+
+	if (!ret)
+		kdebug("could not save registry branch to %s\n", branch->hive_path);
+	return ret;
+}
+
+void flush_registry(void)
+{
+	int i;
+
+	for (i = 0; i < save_branch_count; i++)
+		compact_branch(&save_branch_info[i]);
+}
+
+/*
+ * save thread: syncs the journals every JOURNAL_SYNC_MSECS, or earlier once
+ * JOURNAL_BATCH records are pending, and folds a journal back into the branch
+ * file when it grows past JOURNAL_COMPACT_SIZE
+ */
+void write_registry(void)
+{
+	unsigned int timeout = msecs_to_jiffies(JOURNAL_SYNC_MSECS) + 1;
+	int i;
 
+	ktrace("\n");
+	while (!kthread_should_stop()) {
 		for (i = 0; i < save_branch_count; i++) {
-			if (!save_branch(save_branch_info[i].key, save_branch_info[i].path)) {
-				kdebug("could not save registry branch to %s\n", save_branch_info[i].path);
-			}
+			sync_journal(&save_branch_info[i]);
+			if (journal_size(&save_branch_info[i]) > JOURNAL_COMPACT_SIZE)
+				compact_branch(&save_branch_info[i]);
 		}
-sleep:
 		schedule_timeout_interruptible(timeout);
 	}
+
+	for (i = 0; i < save_branch_count; i++) {
+		compact_branch(&save_branch_info[i]);
+		mutex_lock(&journal_mutex);
+		if (save_branch_info[i].journal) {
+			fclose(save_branch_info[i].journal);
+			save_branch_info[i].journal = NULL;
+		}
+		mutex_unlock(&journal_mutex);
+	}
 }
 
 void write_back_branches(void)
@@ -1768,8 +2421,11 @@ DECL_HANDLER(save_branch)
 {
 	ktrace("\n");
 
-	save_branch(save_branch_info[req->branch_num].key,
-			save_branch_info[req->branch_num].path);
+	if (req->branch_num < 0 || req->branch_num >= save_branch_count) {
+		set_error(STATUS_INVALID_PARAMETER);
+		return;
+	}
+	compact_branch(&save_branch_info[req->branch_num]);
 }
 
 DECL_HANDLER(create_key)
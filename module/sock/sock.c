@@ -547,7 +547,7 @@ static int sock_signaled(struct object *obj, struct w32thread *thread)
 {
 	struct sock *sock = (struct sock *)obj;
 
-	return check_fd_events(sock->fd, sock_get_poll_events(sock->fd)) != 0;
+	return check_fd_events_atomic(sock->fd, sock_get_poll_events(sock->fd)) != 0;
 }
 
 static int sock_get_poll_events(struct fd *fd)
@@ -725,6 +725,7 @@ static void sock_destroy(struct object *obj)
 	if (sock->fd) {
 		/* shut the socket down to force pending poll() calls in the client to return */
 		shutdown(get_unix_fd(sock->fd), SHUT_RDWR);
+		fd_unhook_wait(sock->fd);
 		release_object(sock->fd);
 	}
 }
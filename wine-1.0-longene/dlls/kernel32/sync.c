@@ -1219,7 +1219,8 @@ BOOL WINAPI PeekNamedPipe( HANDLE hPipe, LPVOID lpvBuffer, DWORD cbBuffer,
         ULONG read_size = io.Information - FIELD_OFFSET( FILE_PIPE_PEEK_BUFFER, Data );
         if (lpcbAvail) *lpcbAvail = buffer->ReadDataAvailable;
         if (lpcbRead) *lpcbRead = read_size;
-        if (lpcbMessage) *lpcbMessage = 0;  /* FIXME */
+        if (lpcbMessage) *lpcbMessage = buffer->MessageLength > read_size ?
+                                        buffer->MessageLength - read_size : 0;
         if (lpvBuffer) memcpy( lpvBuffer, buffer->Data, read_size );
     }
     else SetLastError( RtlNtStatusToDosError(status) );
@@ -1398,14 +1399,14 @@ BOOL WINAPI DisconnectNamedPipe(HANDLE hPipe)
  *           TransactNamedPipe   (KERNEL32.@)
  *
  * BUGS
- *  should be done as a single operation in the wineserver or kernel
+ *  overlapped operation is not supported
  */
 BOOL WINAPI TransactNamedPipe(
     HANDLE handle, LPVOID write_buf, DWORD write_size, LPVOID read_buf,
     DWORD read_size, LPDWORD bytes_read, LPOVERLAPPED overlapped)
 {
-    BOOL r;
-    DWORD count;
+    IO_STATUS_BLOCK io;
+    NTSTATUS status;
 
     TRACE("%p %p %d %p %d %p %p\n",
           handle, write_buf, write_size, read_buf,
@@ -1417,11 +1418,16 @@ BOOL WINAPI TransactNamedPipe(
         return FALSE;
     }
 
-    r = WriteFile(handle, write_buf, write_size, &count, NULL);
-    if (r)
-        r = ReadFile(handle, read_buf, read_size, bytes_read, NULL);
-
-    return r;
+    io.Information = 0;
+    status = NtFsControlFile( handle, 0, NULL, NULL, &io, FSCTL_PIPE_TRANSCEIVE,
+                              write_buf, write_size, read_buf, read_size );
+    if (bytes_read) *bytes_read = io.Information;
+    if (status)
+    {
+        SetLastError( RtlNtStatusToDosError(status) );
+        return FALSE;
+    }
+    return TRUE;
 }
 
 /***********************************************************************
@@ -296,6 +296,7 @@ typedef struct
     unsigned int        already;
     unsigned int        count;
     BOOL                avail_mode;
+    BOOL                pipe;
 } async_fileio_read;
 
 typedef struct
@@ -361,6 +362,29 @@ NTSTATUS FILE_GetNtStatus(void)
     }
 }
 
+/* bytes left of the message a pipe read stopped in; must match PIPE_RING_MORE_DATA in the kernel */
+#define PIPE_RING_MORE_DATA _IOR('p', 0xd0, int)
+/* nothing left and the other end gone; must match PIPE_RING_BROKEN in the kernel */
+#define PIPE_RING_BROKEN    _IOR('p', 0xd1, int)
+
+/* status of a pipe read that filled the buffer: the message may go on */
+static NTSTATUS get_pipe_read_status( int fd )
+{
+    int left = 0;
+
+    if (ioctl( fd, PIPE_RING_MORE_DATA, &left ) == 0 && left) return STATUS_BUFFER_OVERFLOW;
+    return STATUS_SUCCESS;
+}
+
+/* status of a pipe read that returned nothing: an empty message, or the end */
+static NTSTATUS get_pipe_empty_read_status( int fd )
+{
+    int broken = 1;
+
+    if (ioctl( fd, PIPE_RING_BROKEN, &broken ) == 0 && !broken) return get_pipe_read_status( fd );
+    return STATUS_PIPE_BROKEN;
+}
+
 /***********************************************************************
  *             FILE_AsyncReadService      (INTERNAL)
  */
@@ -388,13 +412,15 @@ static NTSTATUS FILE_AsyncReadService(void *user, PIO_STATUS_BLOCK iosb, NTSTATU
         }
         else if (result == 0)
         {
-            status = fileio->already ? STATUS_SUCCESS : STATUS_PIPE_BROKEN;
+            if (fileio->already) status = STATUS_SUCCESS;
+            else status = fileio->pipe ? get_pipe_empty_read_status( fd ) : STATUS_PIPE_BROKEN;
         }
         else
         {
             fileio->already += result;
             if (fileio->already >= fileio->count || fileio->avail_mode)
-                status = STATUS_SUCCESS;
+                status = (fileio->already >= fileio->count && fileio->pipe) ?
+                         get_pipe_read_status( fd ) : STATUS_SUCCESS;
             else
             {
                 /* if we only have to read the available data, and none is available,
@@ -621,6 +647,12 @@ NTSTATUS WINAPI NtReadFile(HANDLE hFile, HANDLE hEvent,
         if ((result = read( unix_handle, (char *)buffer + total, length - total )) >= 0)
         {
             total += result;
+            if (result && type == FD_TYPE_PIPE)
+            {
+                /* a pipe read returns at most one message */
+                status = (total == length) ? get_pipe_read_status( unix_handle ) : STATUS_SUCCESS;
+                goto done;
+            }
             if (!result || total == length)
             {
                 if (total)
@@ -636,6 +668,9 @@ NTSTATUS WINAPI NtReadFile(HANDLE hFile, HANDLE hEvent,
                     goto done;
                 case FD_TYPE_SERIAL:
                     break;
+                case FD_TYPE_PIPE:
+                    status = get_pipe_empty_read_status( unix_handle );
+                    goto done;
                 default:
                     status = STATUS_PIPE_BROKEN;
                     goto done;
@@ -677,6 +712,7 @@ NTSTATUS WINAPI NtReadFile(HANDLE hFile, HANDLE hEvent,
             fileio->count = length;
             fileio->buffer = buffer;
             fileio->avail_mode = avail_mode;
+            fileio->pipe = (type == FD_TYPE_PIPE);
 
             SERVER_START_REQ( register_async )
             {
@@ -734,7 +770,7 @@ done:
     if (cvalue) NTDLL_AddCompletion( hFile, cvalue, status, total );
 
 err:
-    if (status == STATUS_SUCCESS)
+    if (status == STATUS_SUCCESS || status == STATUS_BUFFER_OVERFLOW)
     {
         io_status->u.Status = status;
         io_status->Information = total;
@@ -852,7 +888,7 @@ static NTSTATUS FILE_AsyncWriteService(void *user, IO_STATUS_BLOCK *iosb, NTSTAT
                                           &needs_close, &type, NULL )))
             break;
 
-        if (!fileio->count && (type == FD_TYPE_MAILSLOT || type == FD_TYPE_PIPE || type == FD_TYPE_SOCKET))
+        if (!fileio->count && (type == FD_TYPE_MAILSLOT || type == FD_TYPE_SOCKET))
             result = send( fd, fileio->buffer, 0, 0 );
         else
             result = write( fd, &fileio->buffer[fileio->already], fileio->count - fileio->already );
@@ -951,8 +987,8 @@ NTSTATUS WINAPI NtWriteFile(HANDLE hFile, HANDLE hEvent,
 
     for (;;)
     {
-        /* zero-length writes on sockets may not work with plain write(2) */
-        if (!length && (type == FD_TYPE_MAILSLOT || type == FD_TYPE_PIPE || type == FD_TYPE_SOCKET))
+        /* zero-length writes on sockets may not work with plain write(2), pipes take them as empty messages */
+        if (!length && (type == FD_TYPE_MAILSLOT || type == FD_TYPE_SOCKET))
             result = send( unix_handle, buffer, 0, 0 );
         else
             result = write( unix_handle, (const char *)buffer + total, length - total );
@@ -1228,7 +1264,8 @@ static NTSTATUS server_ioctl_file( HANDLE handle, HANDLE event,
         req->async.cvalue   = cvalue;
         wine_server_add_data( req, in_buffer, in_size );
         wine_server_set_reply( req, out_buffer, out_size );
-        if (!(status = wine_server_call( req )))
+        status = wine_server_call( req );
+        if (!status || status == STATUS_BUFFER_OVERFLOW)
             io->Information = wine_server_reply_size( reply );
         wait_handle = reply->wait;
         options     = reply->options;
@@ -1359,61 +1396,6 @@ NTSTATUS WINAPI NtFsControlFile(HANDLE handle, HANDLE event, PIO_APC_ROUTINE apc
         if (!status) status = DIR_unmount_device( handle );
         break;
 
-    case FSCTL_PIPE_PEEK:
-        {
-            FILE_PIPE_PEEK_BUFFER *buffer = out_buffer;
-            int avail = 0, fd, needs_close;
-
-            if (out_size < FIELD_OFFSET( FILE_PIPE_PEEK_BUFFER, Data ))
-            {
-                status = STATUS_INFO_LENGTH_MISMATCH;
-                break;
-            }
-
-            if ((status = server_get_unix_fd( handle, FILE_READ_DATA, &fd, &needs_close, NULL, NULL )))
-                break;
-
-#ifdef FIONREAD
-            if (ioctl( fd, FIONREAD, &avail ) != 0)
-            {
-                TRACE("FIONREAD failed reason: %s\n",strerror(errno));
-                status = FILE_GetNtStatus();
-                break;
-            }
-#endif
-            if (!avail)  /* check for closed pipe */
-            {
-                struct pollfd pollfd;
-                int ret;
-
-                pollfd.fd = fd;
-                pollfd.events = POLLIN;
-                pollfd.revents = 0;
-                ret = poll( &pollfd, 1, 0 );
-                if (ret == -1 || (ret == 1 && (pollfd.revents & (POLLHUP|POLLERR))))
-                {
-                    status = STATUS_PIPE_BROKEN;
-                    break;
-                }
-            }
-            buffer->NamedPipeState    = 0;  /* FIXME */
-            buffer->ReadDataAvailable = avail;
-            buffer->NumberOfMessages  = 0;  /* FIXME */
-            buffer->MessageLength     = 0;  /* FIXME */
-            io->Information = FIELD_OFFSET( FILE_PIPE_PEEK_BUFFER, Data );
-            status = STATUS_SUCCESS;
-            if (avail)
-            {
-                ULONG data_size = out_size - FIELD_OFFSET( FILE_PIPE_PEEK_BUFFER, Data );
-                if (data_size)
-                {
-                    int res = recv( fd, buffer->Data, data_size, MSG_PEEK );
-                    if (res >= 0) io->Information += res;
-                }
-            }
-        }
-        break;
-
     case FSCTL_PIPE_DISCONNECT:
         status = server_ioctl_file( handle, event, apc, apc_context, io, code,
                                     in_buffer, in_size, out_buffer, out_size );
@@ -1438,6 +1420,8 @@ NTSTATUS WINAPI NtFsControlFile(HANDLE handle, HANDLE event, PIO_APC_ROUTINE apc
 
     case FSCTL_PIPE_LISTEN:
     case FSCTL_PIPE_WAIT:
+    case FSCTL_PIPE_PEEK:
+    case FSCTL_PIPE_TRANSCEIVE:
     default:
         status = server_ioctl_file( handle, event, apc, apc_context, io, code,
                                     in_buffer, in_size, out_buffer, out_size );
@@ -368,16 +368,31 @@ static WCHAR *get_dll_path(UNICODE_STRING* full_exe_name)
     return NULL;
 }
 
+static void **get_log_ring_slot(void)
+{
+    return &ntdll_get_thread_data()->log_ring;
+}
+
 /* initialize all options at startup for Unified Kernel */
 void __debug_init(void)
 {
-    char *wine_debug;
+    char *wine_debug, *wine_log;
 
     if ((wine_debug = getenv("WINEDEBUG")))
     {
         if (!strcmp(wine_debug, "help")) debug_usage();
         parse_options(wine_debug);
     }
+
+    wine_log = getenv("WINE_SYSCALL_LOG");
+#ifdef DEBUG_SYSCALL
+    if (!wine_log) wine_log = LOG_FILE;
+#endif
+    if (wine_log && *wine_log && strcmp(wine_log, "0"))
+    {
+        wine_log_set_ring_slot(get_log_ring_slot);
+        wine_log_init(strcmp(wine_log, "1") ? wine_log : LOG_FILE);
+    }
 }
 
 #define NORMALIZE(x, addr)   if (x) x = (typeof(x))((unsigned long)(x) + (unsigned long)(addr))
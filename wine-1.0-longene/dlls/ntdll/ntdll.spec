@@ -286,6 +286,7 @@
 @ stub NtReleaseProcessMutant
 @ stdcall NtReleaseSemaphore(long long ptr)
 @ stdcall NtRemoveIoCompletion(ptr ptr ptr ptr ptr)
+@ stdcall NtRemoveIoCompletionEx(ptr ptr long ptr ptr long)
 # @ stub NtRemoveProcessDebug
 # @ stub NtRenameKey
 @ stdcall NtReplaceKey(ptr long ptr)
@@ -1130,6 +1131,7 @@
 @ stub ZwReleaseProcessMutant
 @ stdcall ZwReleaseSemaphore(long long ptr) NtReleaseSemaphore
 @ stdcall ZwRemoveIoCompletion(ptr ptr ptr ptr ptr) NtRemoveIoCompletion
+@ stdcall ZwRemoveIoCompletionEx(ptr ptr long ptr ptr long) NtRemoveIoCompletionEx
 # @ stub ZwRemoveProcessDebug
 # @ stub ZwRenameKey
 @ stdcall ZwReplaceKey(ptr long ptr) NtReplaceKey
@@ -1373,6 +1375,8 @@
 
 # Server interface
 @ cdecl -norelay wine_server_call(ptr)
+@ cdecl -norelay wine_server_call_async(ptr)
+@ cdecl -norelay wine_server_get_queue_status()
 @ cdecl wine_server_fd_to_handle(long long long ptr)
 @ cdecl wine_server_handle_to_fd(long long ptr ptr)
 @ cdecl wine_server_release_fd(long long)
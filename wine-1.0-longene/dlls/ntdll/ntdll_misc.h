@@ -67,6 +67,7 @@ extern timeout_t server_start_time;
 extern void server_init_process(void);
 extern NTSTATUS server_init_process_done(void);
 extern size_t server_init_thread( int unix_pid, int unix_tid, void *entry_point );
+extern void server_free_request_ring(void);
 
 extern void server_protocol_error( const char *err, ... );
 extern void server_protocol_perror( const char *err );
@@ -180,8 +181,8 @@ struct ntdll_thread_data
     int                reply_fd;      /* 1e4 fd for receiving server replies */
     int                wait_fd[2];    /* 1e8 fd for sleeping server requests */
     void              *vm86_ptr;      /* 1f0 data for vm86 mode */
-
-    void              *pad[2];        /* 1f4 change this if you add fields! */
+    struct uk_request_ring *req_ring; /* 1f4 request ring shared with the kernel */
+    void              *log_ring;      /* 1f8 LOG() ring, see libs/wine/log.c; no room left after this */
 };
 
 static inline struct ntdll_thread_data *ntdll_get_thread_data(void)
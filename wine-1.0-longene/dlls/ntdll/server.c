@@ -132,6 +132,49 @@ NtWineService(struct __server_request_info * ReqMsg)
     return ret /* ret */; //wine service returns its status in req_reply
 }
 
+static NTSTATUS WINAPI
+NtRegisterWineServiceRing(struct uk_request_ring *ring)
+{
+    NTSTATUS ret;
+
+    __asm__ __volatile__ (
+            "movl $0xea,%%eax\n\t"
+            "lea 8(%%ebp),%%edx\n\t"
+            "int $0x2E\n\t"
+            :"=a" (ret)
+            );
+    return ret;
+}
+
+static NTSTATUS WINAPI
+NtSubmitWineServiceRing(void)
+{
+    NTSTATUS ret;
+
+    __asm__ __volatile__ (
+            "movl $0xeb,%%eax\n\t"
+            "int $0x2E\n\t"
+            :"=a" (ret)
+            :
+            :"memory"
+            );
+    return ret;
+}
+
+static NTSTATUS WINAPI
+NtRegisterQueueStatus(struct uk_queue_status *status)
+{
+    NTSTATUS ret;
+
+    __asm__ __volatile__ (
+            "movl $0xed,%%eax\n\t"
+            "lea 8(%%ebp),%%edx\n\t"
+            "int $0x2E\n\t"
+            :"=a" (ret)
+            );
+    return ret;
+}
+
 /* die on a fatal error; use only during initialization */
 static void fatal_error( const char *err, ... )
 {
@@ -172,6 +215,8 @@ void server_exit_thread( int status )
 
     sigprocmask( SIG_BLOCK, &server_block_set, NULL );
 
+    server_free_request_ring();
+    wine_log_thread_exit();
     NtTerminateThread(GetCurrentThread(),0);
 }
 
@@ -186,6 +231,7 @@ int server_abort_thread( int status )
     close( ntdll_get_thread_data()->wait_fd[1] );
     close( ntdll_get_thread_data()->reply_fd );
     close( ntdll_get_thread_data()->request_fd );
+    wine_log_thread_exit();
 
     return NtTerminateThread(GetCurrentThread(), status);
 }
@@ -281,10 +327,202 @@ static inline unsigned int wait_reply( struct __server_request_info *req )
  *|     SERVER_END_REQ;
  */
 
+/*
+ * take the request ring of the thread, returns NULL if there is none or if
+ * we interrupted its owner, in a signal handler or an APC; such calls go
+ * around the ring, the kernel drains it first anyway
+ */
+static struct uk_request_ring *enter_request_ring(void)
+{
+    struct uk_request_ring *ring = ntdll_get_thread_data()->req_ring;
+
+    if (!ring || ring->busy) return NULL;
+    ring->busy = 1;
+    __asm__ __volatile__( "" : : : "memory" );
+    return ring;
+}
+
+static inline void leave_request_ring( struct uk_request_ring *ring )
+{
+    __asm__ __volatile__( "" : : : "memory" );
+    ring->busy = 0;
+}
+
+/* copy a request into the next free ring entry, returns NULL if it doesn't fit */
+static struct uk_ring_entry *queue_ring_request( struct uk_request_ring *ring,
+                                                 struct __server_request_info *req )
+{
+    struct uk_ring_entry *entry;
+    char *data;
+    unsigned int i;
+
+    if (req->u.req.request_header.request_size > UK_RING_DATA_SIZE) return NULL;
+    if (ring->head - ring->tail >= UK_RING_ENTRIES)
+    {
+        /* the kernel drains the whole ring, unless it has dropped it */
+        if (NtSubmitWineServiceRing() || ring->head - ring->tail >= UK_RING_ENTRIES) return NULL;
+    }
+
+    entry = &ring->entries[ring->head % UK_RING_ENTRIES];
+    entry->u.req = req->u.req;
+    entry->flags = 0;
+    entry->reply_data = req->reply_data;
+    for (i = 0, data = entry->data; i < req->data_count; i++)
+    {
+        memcpy( data, req->data[i].ptr, req->data[i].size );
+        data += req->data[i].size;
+    }
+    return entry;
+}
+
+/* make the entry visible to the kernel */
+static inline void submit_ring_entry( struct uk_request_ring *ring )
+{
+    __asm__ __volatile__( "" : : : "memory" );
+    ring->head++;
+}
+
 unsigned int wine_server_call( void *req_ptr )
 {
-     struct __server_request_info * const req = req_ptr;
-	 return NtWineService( req );
+    struct __server_request_info * const req = req_ptr;
+    struct uk_request_ring *ring;
+    struct uk_ring_entry *entry;
+
+    if (!(ring = enter_request_ring())) return NtWineService( req );
+    if (!(entry = queue_ring_request( ring, req )))
+    {
+        leave_request_ring( ring );
+        return NtWineService( req );
+    }
+
+    submit_ring_entry( ring );
+    if (NtSubmitWineServiceRing() || !(entry->flags & UK_RING_DONE))
+    {
+        /* the kernel doesn't drain the ring, it won't run the entry later either */
+        ERR( "request ring not drained, falling back to plain service calls\n" );
+        leave_request_ring( ring );
+        server_free_request_ring();
+        return NtWineService( req );
+    }
+    req->u.reply = entry->u.reply;
+    leave_request_ring( ring );
+    return req->u.reply.reply_header.error;
+}
+
+
+/***********************************************************************
+ *           wine_server_call_async (NTDLL.@)
+ *
+ * Queue a server call whose reply is not needed.
+ *
+ * PARAMS
+ *     req_ptr [I] Function dependent data
+ *
+ * NOTES
+ *     The request is only queued in the thread request ring, the kernel
+ *     runs it in order before the next server call or wait of the thread,
+ *     so several such calls cost no syscall at all.
+ */
+void wine_server_call_async( void *req_ptr )
+{
+    struct __server_request_info * const req = req_ptr;
+    struct uk_request_ring *ring;
+    struct uk_ring_entry *entry;
+
+    if (!(ring = enter_request_ring()))
+    {
+        NtWineService( req );
+        return;
+    }
+    if (!(entry = queue_ring_request( ring, req )))
+    {
+        leave_request_ring( ring );
+        NtWineService( req );
+        return;
+    }
+    entry->flags = UK_RING_NOREPLY;
+    entry->reply_data = NULL;
+    submit_ring_entry( ring );
+    leave_request_ring( ring );
+}
+
+
+/* the queue status page follows the request ring page */
+#define QUEUE_STATUS_OFFSET 0x1000
+
+static int queue_status_registered = -1;  /* -1 until the kernel has been asked */
+
+static inline struct uk_queue_status *get_queue_status_page( struct uk_request_ring *ring )
+{
+    return (struct uk_queue_status *)((char *)ring + QUEUE_STATUS_OFFSET);
+}
+
+
+/***********************************************************************
+ *           server_init_request_ring
+ *
+ * Allocate and register the request ring and queue status page of the current thread.
+ */
+static void server_init_request_ring(void)
+{
+    void *addr = NULL, *status;
+    SIZE_T size = QUEUE_STATUS_OFFSET + sizeof(struct uk_queue_status);
+    ULONG old_prot;
+
+    if (NtAllocateVirtualMemory( NtCurrentProcess(), &addr, 0, &size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE ))
+        return;
+    if (NtRegisterWineServiceRing( addr ))
+    {
+        size = 0;
+        NtFreeVirtualMemory( NtCurrentProcess(), &addr, &size, MEM_RELEASE );
+        return;
+    }
+    ntdll_get_thread_data()->req_ring = addr;
+
+    /* only the kernel writes the status, it does so through its own mapping */
+    status = get_queue_status_page( addr );
+    if (queue_status_registered && !NtRegisterQueueStatus( status ))
+    {
+        queue_status_registered = 1;
+        size = sizeof(struct uk_queue_status);
+        NtProtectVirtualMemory( NtCurrentProcess(), &status, &size, PAGE_READONLY, &old_prot );
+    }
+    else queue_status_registered = 0;
+}
+
+
+/***********************************************************************
+ *           wine_server_get_queue_status (NTDLL.@)
+ *
+ * Return the message queue status that the kernel publishes for the
+ * current thread, or NULL if it doesn't.  Requests still queued in the
+ * ring are submitted first, so that the status includes them.
+ */
+const struct uk_queue_status *wine_server_get_queue_status(void)
+{
+    struct uk_request_ring *ring = ntdll_get_thread_data()->req_ring;
+
+    if (queue_status_registered <= 0 || !ring) return NULL;
+    if (ring->head != ring->tail) NtSubmitWineServiceRing();
+    return get_queue_status_page( ring );
+}
+
+
+/***********************************************************************
+ *           server_free_request_ring
+ *
+ * Flush and release the request ring of the current thread.
+ */
+void server_free_request_ring(void)
+{
+    void *addr = ntdll_get_thread_data()->req_ring;
+    SIZE_T size = 0;
+
+    if (!addr) return;
+    ntdll_get_thread_data()->req_ring = NULL;
+    if (queue_status_registered > 0) NtRegisterQueueStatus( NULL );
+    NtRegisterWineServiceRing( NULL );
+    NtFreeVirtualMemory( NtCurrentProcess(), &addr, &size, MEM_RELEASE );
 }
 
 /***********************************************************************
@@ -750,6 +988,7 @@ size_t server_init_thread( int unix_pid, int unix_tid, void *entry_point )
     }
     SERVER_END_REQ;
 
+    server_init_request_ring();
     return info_size;
 }
 
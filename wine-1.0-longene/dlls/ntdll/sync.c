@@ -927,11 +927,12 @@ typedef struct _OBJECT_HANDLE_ATTRIBUTE_INFORMATION {
 
 #define ObjectHandleInformation ObjectDataInformation
 
-void obj_type(DWORD count, const HANDLE *handles)
+/* one NtQueryObject per handle, only call it when LOG() is on */
+static void obj_type(DWORD count, const HANDLE *handles)
 {
 		unsigned int type=0, i;
 		OBJECT_BASIC_INFORMATION ObjectInfo;
-		char buf[128], *s;
+		char buf[MAXIMUM_WAIT_OBJECTS * 32], *s;
 
 		s = buf;
 		sprintf(s, ": ");
@@ -965,7 +966,8 @@ NTSTATUS WINAPI NtWaitForMultipleObjects( DWORD count, const HANDLE *handles,
 
 	if (count) {
 		LOG(LOG_FILE, 0, 0, "count %d, handle %p, timeout %p, %llx\n", count, *handles, timeout, timeout ? timeout->QuadPart : 0);
-		obj_type(count, handles);  /* for debug */
+		if (wine_log_enabled)
+			obj_type(count, handles);  /* for debug */
 	} else
 		LOG(LOG_FILE, 0, 0, "count %d, timeout %p, %llx\n", count, timeout, timeout ? timeout->QuadPart : 0);
     do{
@@ -1006,8 +1008,11 @@ NTSTATUS WINAPI NtSignalAndWaitForSingleObject( HANDLE hSignalObject, HANDLE hWa
 	NTSTATUS ret;
 
     LOG(LOG_FILE, 0, 0, "\n");
-    obj_type(1, &hSignalObject); 	/* for debug */
-    obj_type(1, &hWaitObject);
+    if (wine_log_enabled)
+    {
+        obj_type(1, &hSignalObject); 	/* for debug */
+        obj_type(1, &hWaitObject);
+    }
     if (!hSignalObject) return STATUS_INVALID_HANDLE;
 
     do{                                                                        
@@ -1180,25 +1185,51 @@ NTSTATUS WINAPI NtRemoveIoCompletion( HANDLE CompletionPort, PULONG_PTR Completi
     TRACE("(%p, %p, %p, %p, %p)\n", CompletionPort, CompletionKey,
           CompletionValue, iosb, WaitTime);
 
-    for(;;)
-    {
-        SERVER_START_REQ( remove_completion )
-        {
-            req->handle = CompletionPort;
-            if (!(status = wine_server_call( req )))
-            {
-                *CompletionKey    = reply->ckey;
-                *CompletionValue  = reply->cvalue;
-                iosb->Information = reply->information;
-                iosb->u.Status    = reply->status;
-            }
-        }
-        SERVER_END_REQ;
-        if (status != STATUS_PENDING) break;
+    /* the module waits for a packet itself, an interrupted wait is restarted */
+    do {
+	    __asm__ __volatile__ (
+     	            "movl $0x9F,%%eax\n\t"
+                    "lea 8(%%ebp),%%edx\n\t"
+                    "int $0x2E\n\t"
+                    :"=a" (status)
+                    );
+    } while (-EINTR == status);
+
+    return status;
+}
+
+/******************************************************************
+ *              NtRemoveIoCompletionEx (NTDLL.@)
+ *              ZwRemoveIoCompletionEx (NTDLL.@)
+ *
+ * (Wait for and) retrieve up to count completion messages in one call
+ *
+ * PARAMS
+ *      CompletionPort  [I] HANDLE to I/O completion object
+ *      info            [O] array of count completion messages
+ *      count           [I] size of the info array
+ *      removed         [O] number of messages retrieved
+ *      WaitTime        [I] optional wait time in NTDLL format
+ *      alertable       [I] whether user APCs end the wait
+ *
+ */
+NTSTATUS WINAPI NtRemoveIoCompletionEx( HANDLE CompletionPort, PFILE_IO_COMPLETION_INFORMATION info,
+                                        ULONG count, PULONG removed, PLARGE_INTEGER WaitTime,
+                                        BOOLEAN alertable )
+{
+    NTSTATUS status;
+
+    TRACE("(%p, %p, %u, %p, %p, %d)\n", CompletionPort, info, count, removed, WaitTime, alertable);
+
+    do {
+	    __asm__ __volatile__ (
+     	            "movl $0xEC,%%eax\n\t"
+                    "lea 8(%%ebp),%%edx\n\t"
+                    "int $0x2E\n\t"
+                    :"=a" (status)
+                    );
+    } while (-EINTR == status);
 
-        status = NtWaitForSingleObject( CompletionPort, FALSE, WaitTime );
-        if (status != WAIT_OBJECT_0) break;
-    }
     return status;
 }
 
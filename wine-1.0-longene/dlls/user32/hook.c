@@ -434,10 +434,11 @@ LRESULT HOOK_CallHooks( INT id, INT code, WPARAM wparam, LPARAM lparam, BOOL uni
     if (!info.tid && !info.proc) return 0;
     ret = call_hook( &info, code, wparam, lparam );
 
+    /* nothing is read back, the kernel runs it before the next call of the thread */
     SERVER_START_REQ( finish_hook_chain )
     {
         req->id = id;
-        wine_server_call( req );
+        wine_server_call_async( req );
     }
     SERVER_END_REQ;
     return ret;
@@ -281,6 +281,7 @@ SHORT WINAPI GetAsyncKeyState(INT nKey)
  */
 DWORD WINAPI GetQueueStatus( UINT flags )
 {
+    struct queue_bits bits;
     DWORD ret = 0;
 
     if (flags & ~(QS_ALLINPUT | QS_ALLPOSTMESSAGE | QS_SMRESULT))
@@ -292,6 +293,10 @@ DWORD WINAPI GetQueueStatus( UINT flags )
     /* check for pending X events */
     USER_Driver->pMsgWaitForMultipleObjectsEx( 0, NULL, 0, flags, 0 );
 
+    /* the request is only needed to clear the changed bits */
+    if (MSG_GetQueueBits( &bits ) && !bits.changed_bits)
+        return MAKELONG( 0, bits.wake_bits & flags );
+
     SERVER_START_REQ( get_queue_status )
     {
         req->clear = 1;
@@ -308,11 +313,14 @@ DWORD WINAPI GetQueueStatus( UINT flags )
  */
 BOOL WINAPI GetInputState(void)
 {
+    struct queue_bits bits;
     DWORD ret = 0;
 
     /* check for pending X events */
     USER_Driver->pMsgWaitForMultipleObjectsEx( 0, NULL, 0, QS_INPUT, 0 );
 
+    if (MSG_GetQueueBits( &bits )) return bits.wake_bits & (QS_KEY | QS_MOUSEBUTTON);
+
     SERVER_START_REQ( get_queue_status )
     {
         req->clear = 0;
@@ -473,8 +481,17 @@ BOOL WINAPI AttachThreadInput( DWORD from, DWORD to, BOOL attach )
  */
 SHORT WINAPI GetKeyState(INT vkey)
 {
+    const struct uk_queue_status *status = wine_server_get_queue_status();
     SHORT retval = 0;
 
+    /* a single byte, no need to check the sequence number */
+    if (status && status->queue)
+    {
+        if (vkey >= 0) retval = (signed char)status->keystate[vkey & 0xff];
+        TRACE("key (0x%x) -> %x\n", vkey, retval);
+        return retval;
+    }
+
     SERVER_START_REQ( get_key_state )
     {
         req->tid = GetCurrentThreadId();
@@ -492,11 +509,25 @@ SHORT WINAPI GetKeyState(INT vkey)
  */
 BOOL WINAPI GetKeyboardState( LPBYTE state )
 {
+    const struct uk_queue_status *status;
+    unsigned int seq;
     BOOL ret;
 
     TRACE("(%p)\n", state);
 
     memset( state, 0, 256 );
+    if ((status = wine_server_get_queue_status()) && status->queue)
+    {
+        do
+        {
+            while ((seq = status->seq) & 1) /* nothing */;
+            __asm__ __volatile__( "" : : : "memory" );
+            memcpy( state, status->keystate, 256 );
+            __asm__ __volatile__( "" : : : "memory" );
+        } while (status->seq != seq);
+        return TRUE;
+    }
+
     SERVER_START_REQ( get_key_state )
     {
         req->tid = GetCurrentThreadId();
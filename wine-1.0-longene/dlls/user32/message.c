@@ -1994,6 +1994,57 @@ static inline void call_sendmsg_callback( SENDASYNCPROC callback, HWND hwnd, UIN
 }
 
 
+/***********************************************************************
+ *           MSG_GetQueueBits
+ *
+ * Read the queue bits that the kernel publishes for the current thread.
+ * Return FALSE if they are not available or the thread has no queue yet.
+ */
+BOOL MSG_GetQueueBits( struct queue_bits *bits )
+{
+    const struct uk_queue_status *status = wine_server_get_queue_status();
+    unsigned int seq, queue;
+
+    if (!status) return FALSE;
+    do
+    {
+        while ((seq = status->seq) & 1) /* nothing */;
+        __asm__ __volatile__( "" : : : "memory" );
+        queue              = status->queue;
+        bits->wake_bits    = status->wake_bits;
+        bits->changed_bits = status->changed_bits;
+        bits->wake_mask    = status->wake_mask;
+        bits->changed_mask = status->changed_mask;
+        bits->quit_message = status->quit_message;
+        __asm__ __volatile__( "" : : : "memory" );
+    } while (status->seq != seq);
+    return queue != 0;
+}
+
+
+/***********************************************************************
+ *           queue_is_empty
+ *
+ * Check from the published queue bits that a get_message request with
+ * these parameters would neither find a message nor change the queue.
+ */
+static BOOL queue_is_empty( UINT flags, unsigned int wake_mask, unsigned int changed_mask )
+{
+    struct queue_bits bits;
+    unsigned int filter = HIWORD(flags), mask;
+
+    if (!MSG_GetQueueBits( &bits )) return FALSE;
+    if (bits.quit_message) return FALSE;
+    if (bits.wake_mask != wake_mask || bits.changed_mask != changed_mask) return FALSE;
+
+    if (!filter) filter = QS_ALLINPUT;
+    mask = filter | QS_SENDMESSAGE;
+    if (filter & QS_POSTMESSAGE) mask |= QS_POSTMESSAGE | QS_HOTKEY | QS_TIMER | QS_ALLPOSTMESSAGE;
+    if (filter & QS_INPUT) mask |= QS_INPUT;
+    return !((bits.wake_bits | bits.changed_bits) & mask);
+}
+
+
 /***********************************************************************
  *           peek_message
  *
@@ -2019,6 +2070,9 @@ static BOOL peek_message( MSG *msg, HWND hwnd, UINT first, UINT last, UINT flags
         void *buffer = NULL;
         size_t size = 0, buffer_size = 0;
 
+        /* nothing to get and nothing to release, spare the request */
+        if (!hw_id && queue_is_empty( flags, wake_mask, changed_mask )) return FALSE;
+
         do  /* loop while buffer is too small */
         {
             if (buffer_size && !(buffer = HeapAlloc( GetProcessHeap(), 0, buffer_size )))
@@ -216,6 +216,16 @@ struct hook_extra_info
     LPARAM lparam;
 };
 
+/* queue bits published by the kernel, see MSG_GetQueueBits */
+struct queue_bits
+{
+    UINT wake_bits;
+    UINT changed_bits;
+    UINT wake_mask;
+    UINT changed_mask;
+    BOOL quit_message;
+};
+
 static inline struct user_thread_info *get_user_thread_info(void)
 {
     return (struct user_thread_info *)NtCurrentTeb()->Win32ClientInfo;
@@ -243,6 +253,7 @@ extern void erase_now( HWND hwnd, UINT rdw_flags ) DECLSPEC_HIDDEN;
 extern void *get_hook_proc( void *proc, const WCHAR *module );
 extern LRESULT call_current_hook( HHOOK hhook, INT code, WPARAM wparam, LPARAM lparam ) DECLSPEC_HIDDEN;
 extern BOOL map_wparam_AtoW( UINT message, WPARAM *wparam, enum wm_char_mapping mapping ) DECLSPEC_HIDDEN;
+extern BOOL MSG_GetQueueBits( struct queue_bits *bits ) DECLSPEC_HIDDEN;
 extern LRESULT MSG_SendInternalMessageTimeout( DWORD dest_pid, DWORD dest_tid,
                                                UINT msg, WPARAM wparam, LPARAM lparam,
                                                UINT flags, UINT timeout, PDWORD_PTR res_ptr ) DECLSPEC_HIDDEN;
@@ -9,72 +9,38 @@
 
 #define LOG_FILE	"/tmp/unified.trace"
 
-#ifdef DEBUG_SYSCALL
-
-static inline unsigned long long rdtsc()
-{
-	unsigned long long      ret;
-
-	asm volatile ("rdtsc\n" : "=A"(ret));
-	return ret >> 20;
-}
+/*
+ * LOG() lines go to per-thread rings collected into one file by libwine
+ * (libs/wine/log.c), the file argument is kept for the callers but ignored.
+ * They are always compiled in and cost a load and a branch until
+ * WINE_SYSCALL_LOG is set, to a file name or to 1 for LOG_FILE.
+ * With DEBUG_SYSCALL, LOG_FILE is used when it is not set.
+ */
+extern int wine_log_enabled;
+extern void wine_log_init( const char *path );
+extern void wine_log_printf( const char *func, int trace, int status, const char *format, ... )
+    __attribute__((format(printf,4,5)));
+extern void wine_log_flush(void);
+extern void wine_log_thread_exit(void);
+extern void wine_log_set_ring_slot( void **(*get_slot)(void) );
 
 #define LOG_NO_FUNC(file, fmt...) \
 	do \
 	{ \
-		FILE	*fp; \
-		if ((fp = fopen((file), "a+"))) \
-		{ \
-			fprintf(fp, "%08llx: p %lx t %lx ", rdtsc(), \
-					(unsigned long)getpid(), (unsigned long)gettid()); \
-			fprintf(fp, fmt); \
-			fclose(fp); \
-		} \
-		else \
-			fprintf(stderr, "can not open file %s\n", (file)); \
+		if (__builtin_expect(wine_log_enabled, 0)) \
+			wine_log_printf(NULL, 0, 0, fmt); \
 	} while (0)
 
 #define	LOG(file, trace, status, fmt...) \
 	do \
 	{ \
-		FILE	*fp; \
-		if ((fp = fopen((file), "a+"))) \
-		{ \
-			fprintf(fp, "%08llx: p %lx t %lx %s ", rdtsc(), \
-				(unsigned long)getpid(), (unsigned long)gettid(), __FUNCTION__); \
-			if (status) \
-				fprintf(fp, "ERR: " fmt); \
-			else \
-				fprintf(fp, fmt); \
-			if (trace) \
-			{ \
-				unsigned long	*frame; \
-				unsigned long	ebp, esp; \
-				asm volatile ("movl %%esp, %%eax\nmovl %%ebp, %%edx" : "=&a"(esp), "=&d"(ebp)); \
-				frame = (unsigned long *)ebp; \
-				fprintf(fp, "call trace:\n"); \
-				while (ebp && ebp > esp && ebp < esp + 0x10000) \
-				{ \
-					fprintf(fp, "\treturn address 0x%lx\n", frame[1]); \
-					ebp = *frame; \
-					frame = (unsigned long *)ebp; \
-				} \
-			} \
-			fclose(fp); \
-		} \
-		else \
-			fprintf(stderr, "can not open file %s,%s\n", __FILE__, __FUNCTION__); \
+		if (__builtin_expect(wine_log_enabled, 0)) \
+			wine_log_printf(__FUNCTION__, (trace), (status) != 0, fmt); \
 	} while (0)
 
-#else
-
-#define	LOG(file, trace, status, fmt...)	do { } while (0)
-#define LOG_NO_FUNC(file, fmt...)	 	do { } while (0)
 #define LOG_SIMPLIFY_START(file, trace, fmt...)	do { } while (0)
 #define LOG_SIMPLIFY_END(file, status, fmt...) 	do { } while (0)
 
-#endif	/* DEBUG_SYSCALL */
-
 #define	LOG_NO_TRACE(file, status, fmt...)	LOG(file, 0, status, fmt)
 #define	LOG_NO_STATUS(file, trace, fmt...)	LOG(file, trace, 0, fmt)
 #define	LOG_NO_TRACE_STATUS(file, fmt...)	LOG(file, 0, 0, fmt)
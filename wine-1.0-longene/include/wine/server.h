@@ -49,7 +49,52 @@ struct __server_request_info
     struct __server_iovec data[__SERVER_MAX_DATA];  /* request variable size data */
 };
 
+/* per-thread request ring shared with the kernel, must match the module definition */
+
+#define UK_RING_ENTRIES   8
+#define UK_RING_DATA_SIZE 384
+
+#define UK_RING_NOREPLY   0x0001  /* fire and forget, reply is discarded */
+#define UK_RING_DONE      0x8000  /* set by the kernel once the reply is valid */
+
+struct uk_ring_entry
+{
+    union
+    {
+        union generic_request req;    /* request structure */
+        union generic_reply   reply;  /* reply structure */
+    } u;
+    unsigned int          flags;      /* UK_RING_* flags */
+    void                 *reply_data; /* reply data pointer, may be NULL */
+    char                  data[UK_RING_DATA_SIZE];  /* inline request data */
+};
+
+struct uk_request_ring
+{
+    volatile unsigned int head;       /* next entry to fill, written by ntdll */
+    volatile unsigned int tail;       /* next entry to consume, written by the kernel */
+    volatile unsigned int busy;       /* the thread is using the ring, a signal handler goes around it */
+    struct uk_ring_entry  entries[UK_RING_ENTRIES];
+};
+
+/* message queue status of the thread, written only by the kernel, must match the module definition */
+
+struct uk_queue_status
+{
+    volatile unsigned int seq;           /* odd while the kernel updates it */
+    unsigned int          queue;         /* the thread has a message queue */
+    unsigned int          wake_bits;     /* wakeup bits */
+    unsigned int          changed_bits;  /* changed wakeup bits */
+    unsigned int          wake_mask;     /* wakeup mask */
+    unsigned int          changed_mask;  /* changed wakeup mask */
+    int                   paint_count;   /* pending paint messages count */
+    int                   quit_message;  /* is there a pending quit message? */
+    unsigned char         keystate[256]; /* state of each key of the thread input */
+};
+
 extern unsigned int wine_server_call( void *req_ptr );
+extern void wine_server_call_async( void *req_ptr );
+extern const struct uk_queue_status *wine_server_get_queue_status(void);
 extern void wine_server_send_fd( int fd );
 extern int wine_server_fd_to_handle( int fd, unsigned int access, unsigned int attributes, obj_handle_t *handle );
 extern int wine_server_handle_to_fd( obj_handle_t handle, unsigned int access, int *unix_fd, unsigned int *options );
@@ -1312,6 +1312,17 @@ struct console_renderer_event
 };
 
 
+struct console_output_shm
+{
+    unsigned int size;
+    int          width;
+    int          height;
+    unsigned int pending_offset;
+    unsigned int dirty_offset;
+    unsigned int data_offset;
+};
+
+
 struct get_console_renderer_events_request
 {
     struct request_header __header;
@@ -0,0 +1,316 @@
+/*
+ * Buffered output of the LOG() syscall trace
+ *
+ * Copyright 2026 Insigma Co., Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Every thread that logs owns one ring in a region shared by the whole
+ * process, and formats its lines straight into it without a syscall.
+ * A ring is collected, with a single write() of everything pending, when
+ * it is half full, when its thread exits and when the process exits.
+ *
+ * The region is backed by /dev/shm/wine-log-<pid>, so the lines still
+ * pending when a process dies without exiting can be read from there.
+ * The file is removed after the last collection of a normal exit.
+ */
+
+#include "config.h"
+#include "wine/port.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#include "wine/log.h"
+
+#define LOG_NB_RINGS   64
+#define LOG_RING_SIZE  (64 * 1024)     /* power of 2 */
+#define LOG_LINE_MAX   1024            /* longest line, longer ones are cut */
+
+struct log_ring
+{
+    int           owner;      /* unix tid of the writer, 0 if free */
+    int           collecting; /* someone is writing out the ring */
+    unsigned int  head;       /* bytes ever stored, only moved by the owner */
+    unsigned int  tail;       /* bytes ever collected, only moved by the collector */
+    unsigned int  dropped;    /* lines lost because the ring was full */
+    char          data[LOG_RING_SIZE];
+};
+
+struct log_region
+{
+    int              pid;
+    struct log_ring  rings[LOG_NB_RINGS];
+};
+
+int wine_log_enabled = 0;
+
+static struct log_region *log_region;
+static int log_fd = -1;
+static char log_shm_name[32];
+static void **(*log_get_slot)(void);
+
+static inline unsigned long long log_time(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__( "rdtsc" : "=a" (lo), "=d" (hi) );
+    return (((unsigned long long)hi << 32) | lo) >> 20;
+#else
+    return 0;
+#endif
+}
+
+/* write out the pending part of a ring, unless someone else is already doing it */
+static void collect_ring( struct log_ring *ring )
+{
+    unsigned int head, tail, start, len;
+
+    if (interlocked_cmpxchg( &ring->collecting, 1, 0 )) return;
+
+    head = *(volatile unsigned int *)&ring->head;
+    tail = ring->tail;
+    while (tail != head)
+    {
+        start = tail & (LOG_RING_SIZE - 1);
+        len = head - tail;
+        if (len > LOG_RING_SIZE - start) len = LOG_RING_SIZE - start;
+        if (write( log_fd, ring->data + start, len ) < 0 && errno == EINTR) continue;
+        tail += len;  /* drop the data on any other error */
+    }
+    *(volatile unsigned int *)&ring->tail = tail;
+
+    if (ring->dropped)
+    {
+        char buf[64];
+        int n = snprintf( buf, sizeof(buf), "%08llx: p %lx t %lx %u lines dropped\n", log_time(),
+                          (unsigned long)getpid(), (unsigned long)ring->owner, ring->dropped );
+        ring->dropped = 0;
+        write( log_fd, buf, n );
+    }
+    *(volatile int *)&ring->collecting = 0;
+}
+
+static struct log_ring *claim_ring(void)
+{
+    int i, tid = gettid();
+
+    for (i = 0; i < LOG_NB_RINGS; i++)
+    {
+        struct log_ring *ring = &log_region->rings[i];
+
+        if (ring->owner == tid) return ring;
+        if (!ring->owner && !interlocked_cmpxchg( &ring->owner, tid, 0 )) return ring;
+    }
+    return NULL;
+}
+
+static struct log_ring *get_ring(void)
+{
+    void **slot;
+
+    if (!log_get_slot) return claim_ring();
+    slot = log_get_slot();
+    if (!*slot) *slot = claim_ring();
+    return *slot;
+}
+
+/* copy a line into the ring, the ring has room for it */
+static void store_line( struct log_ring *ring, const char *line, unsigned int len )
+{
+    unsigned int start = ring->head & (LOG_RING_SIZE - 1);
+    unsigned int first = len < LOG_RING_SIZE - start ? len : LOG_RING_SIZE - start;
+
+    memcpy( ring->data + start, line, first );
+    memcpy( ring->data, line + first, len - first );
+    __asm__ __volatile__( "" ::: "memory" );  /* data before head, the collector reads them in order */
+    *(volatile unsigned int *)&ring->head = ring->head + len;
+}
+
+/***********************************************************************
+ *		wine_log_printf
+ *
+ * Format one trace line into the ring of the current thread.
+ */
+void wine_log_printf( const char *func, int trace, int status, const char *format, ... )
+{
+    char line[LOG_LINE_MAX];
+    struct log_ring *ring;
+    va_list args;
+    int len, n;
+
+    if (!log_region || !(ring = get_ring())) return;
+
+    len = snprintf( line, sizeof(line), "%08llx: p %lx t %lx ", log_time(),
+                    (unsigned long)log_region->pid, (unsigned long)ring->owner );
+    if (func) len += snprintf( line + len, sizeof(line) - len, "%s ", func );
+    if (status) len += snprintf( line + len, sizeof(line) - len, "ERR: " );
+    va_start( args, format );
+    n = vsnprintf( line + len, sizeof(line) - len, format, args );
+    va_end( args );
+    len = (n < 0 || n >= (int)sizeof(line) - len) ? sizeof(line) - 1 : len + n;
+
+    if (trace)
+    {
+        unsigned long *frame = __builtin_frame_address( 0 );
+        unsigned long *limit = (unsigned long *)((char *)frame + 0x10000);
+
+        len += snprintf( line + len, sizeof(line) - len, "call trace:\n" );
+        while (frame && frame < limit && len < (int)sizeof(line) - 32)
+        {
+            len += snprintf( line + len, sizeof(line) - len, "\treturn address 0x%lx\n", frame[1] );
+            if ((unsigned long *)frame[0] <= frame) break;
+            frame = (unsigned long *)frame[0];
+        }
+        if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+    }
+
+    if (ring->head - ring->tail + len > LOG_RING_SIZE / 2) collect_ring( ring );
+    if (ring->head - ring->tail + len > LOG_RING_SIZE)
+    {
+        ring->dropped++;
+        return;
+    }
+    store_line( ring, line, len );
+}
+
+/***********************************************************************
+ *		wine_log_flush
+ *
+ * Collect the rings of all threads.
+ */
+void wine_log_flush(void)
+{
+    int i;
+
+    if (!log_region) return;
+    for (i = 0; i < LOG_NB_RINGS; i++)
+        if (log_region->rings[i].head != log_region->rings[i].tail || log_region->rings[i].dropped)
+            collect_ring( &log_region->rings[i] );
+}
+
+/***********************************************************************
+ *		wine_log_thread_exit
+ *
+ * Collect and release the ring of the current thread.
+ */
+void wine_log_thread_exit(void)
+{
+    struct log_ring *ring;
+    void **slot = NULL;
+
+    if (!log_region) return;
+    if (log_get_slot)
+    {
+        slot = log_get_slot();
+        ring = *slot;
+    }
+    else
+    {
+        int i, tid = gettid();
+
+        for (i = 0, ring = NULL; i < LOG_NB_RINGS && !ring; i++)
+            if (log_region->rings[i].owner == tid) ring = &log_region->rings[i];
+    }
+    if (!ring) return;
+
+    collect_ring( ring );
+    if (slot) *slot = NULL;
+    *(volatile int *)&ring->owner = 0;
+}
+
+/***********************************************************************
+ *		wine_log_set_ring_slot
+ *
+ * Let the caller keep the ring of each thread in its own thread data,
+ * get_slot returns the address of a pointer that starts out NULL.
+ */
+void wine_log_set_ring_slot( void **(*get_slot)(void) )
+{
+    log_get_slot = get_slot;
+}
+
+static void log_exit(void)
+{
+    wine_log_enabled = 0;
+    wine_log_flush();
+    if (log_shm_name[0] && log_region->pid == getpid()) unlink( log_shm_name );
+}
+
+static void *map_region(void)
+{
+    void *ptr;
+    int fd;
+
+    sprintf( log_shm_name, "/dev/shm/wine-log-%d", (int)getpid() );
+    if ((fd = open( log_shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600 )) != -1)
+    {
+        if (!ftruncate( fd, sizeof(struct log_region) ))
+        {
+            ptr = mmap( NULL, sizeof(struct log_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            close( fd );
+            if (ptr != MAP_FAILED) return ptr;
+        }
+        else close( fd );
+        unlink( log_shm_name );
+    }
+    log_shm_name[0] = 0;
+
+#ifdef MAP_ANONYMOUS
+    ptr = mmap( NULL, sizeof(struct log_region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if (ptr != MAP_FAILED) return ptr;
+#endif
+    return NULL;
+}
+
+/***********************************************************************
+ *		wine_log_init
+ *
+ * Start sending LOG() lines to the given file.
+ */
+void wine_log_init( const char *path )
+{
+    if (log_region) return;
+
+    if ((log_fd = open( path, O_WRONLY | O_CREAT | O_APPEND, 0666 )) == -1)
+    {
+        fprintf( stderr, "wine: cannot open log file %s\n", path );
+        return;
+    }
+    fcntl( log_fd, F_SETFD, FD_CLOEXEC );
+    if (!(log_region = map_region()))
+    {
+        fprintf( stderr, "wine: cannot allocate log buffers\n" );
+        close( log_fd );
+        log_fd = -1;
+        return;
+    }
+    log_region->pid = getpid();
+    atexit( log_exit );
+    wine_log_enabled = 1;
+}
@@ -52,6 +52,7 @@ struct inner_data {
     struct config_data  curcfg;
 
     CHAR_INFO*		cells;		/* local copy of cells (sb_width * sb_height) */
+    struct console_output_shm* shm;	/* cells of the active screen buffer, shared with the server */
 
     COORD		cursor;		/* position in cells of cursor */
 
@@ -23,6 +23,13 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+# include <sys/ioctl.h>
+#endif
 #include "wine/server.h"
 #include "winecon_private.h"
 #include "winnls.h"
@@ -59,6 +66,51 @@ static void WINECON_Usage(void)
     printf_res(IDS_USAGE_FOOTER);
 }
 
+/* registers the mapping of the cells; must match CONSOLE_SHM_RENDERER in the kernel */
+#define CONSOLE_SHM_RENDERER _IO('c', 0xd0)
+
+/******************************************************************
+ *		WINECON_MapCells
+ *
+ * maps the cells of the active screen buffer, the server replaces them on resize
+ * the header can only be mapped read only, the pages after it are mapped
+ * over the end of that mapping; the server only leaves the dirty rows to us
+ * once the whole mapping is registered
+ */
+static void WINECON_MapCells(struct inner_data* data)
+{
+    struct console_output_shm* shm;
+    unsigned int size, writable;
+    int fd;
+
+    if (data->shm) munmap(data->shm, data->shm->size);
+    data->shm = NULL;
+
+    if (wine_server_handle_to_fd(data->hConOut, FILE_READ_DATA, &fd, NULL)) return;
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    if (shm != MAP_FAILED)
+    {
+        size = shm->size;
+        writable = shm->pending_offset;
+        munmap(shm, sizeof(*shm));
+        shm = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (shm != MAP_FAILED)
+        {
+            if (mmap((char*)shm + writable, size - writable, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, writable) != MAP_FAILED)
+            {
+                data->shm = shm;
+                if (ioctl(fd, CONSOLE_SHM_RENDERER) == -1)
+                    WINE_WARN("could not register the cells mapping, using update events\n");
+            }
+            else
+                munmap(shm, size);
+        }
+    }
+    wine_server_release_fd(data->hConOut, fd);
+    WINE_TRACE("cells mapped at %p\n", data->shm);
+}
+
 /******************************************************************
  *		WINECON_FetchCells
  *
@@ -66,21 +118,70 @@ static void WINECON_Usage(void)
  */
 void WINECON_FetchCells(struct inner_data* data, int upd_tp, int upd_bm)
 {
-    SERVER_START_REQ( read_console_output )
+    const struct console_output_shm* shm = data->shm;
+
+    if (shm && shm->width == data->curcfg.sb_width && shm->height == data->curcfg.sb_height)
     {
-        req->handle = data->hConOut;
-        req->x      = 0;
-        req->y      = upd_tp;
-        req->mode   = CHAR_INFO_MODE_TEXTATTR;
-        req->wrap   = TRUE;
-        wine_server_set_reply( req, &data->cells[upd_tp * data->curcfg.sb_width],
-                               (upd_bm-upd_tp+1) * data->curcfg.sb_width * sizeof(CHAR_INFO) );
-        wine_server_call( req );
+        if (upd_tp < 0) upd_tp = 0;
+        if (upd_bm >= shm->height) upd_bm = shm->height - 1;
+        if (upd_tp > upd_bm) return;
+        memcpy(&data->cells[upd_tp * shm->width], (const char*)shm + shm->data_offset +
+               upd_tp * shm->width * sizeof(CHAR_INFO), (upd_bm-upd_tp+1) * shm->width * sizeof(CHAR_INFO));
+    }
+    else
+    {
+        SERVER_START_REQ( read_console_output )
+        {
+            req->handle = data->hConOut;
+            req->x      = 0;
+            req->y      = upd_tp;
+            req->mode   = CHAR_INFO_MODE_TEXTATTR;
+            req->wrap   = TRUE;
+            wine_server_set_reply( req, &data->cells[upd_tp * data->curcfg.sb_width],
+                                   (upd_bm-upd_tp+1) * data->curcfg.sb_width * sizeof(CHAR_INFO) );
+            wine_server_call( req );
+        }
+        SERVER_END_REQ;
     }
-    SERVER_END_REQ;
     data->fnRefresh(data, upd_tp, upd_bm);
 }
 
+/******************************************************************
+ *		WINECON_FetchDirtyCells
+ *
+ * updates the local copy of the rows the server marked dirty in the shared cells
+ */
+static void WINECON_FetchDirtyCells(struct inner_data* data)
+{
+    struct console_output_shm* shm = data->shm;
+    int* dirty = (int*)((char*)shm + shm->dirty_offset);
+    BOOL same_size = shm->width == data->curcfg.sb_width && shm->height == data->curcfg.sb_height;
+    unsigned int bits;
+    int i, row, top = -1;
+
+    /* rows marked from now on come with a new event */
+    interlocked_xchg((int*)((char*)shm + shm->pending_offset), 0);
+    for (i = 0; i < (shm->height + 31) / 32; i++)
+    {
+        bits = interlocked_xchg(&dirty[i], 0);
+        if (!same_size) continue;
+        for (row = i * 32; row < (i + 1) * 32; row++)
+        {
+            if (bits & (1u << (row & 31)))
+            {
+                if (top == -1) top = row;
+            }
+            else if (top != -1)
+            {
+                WINECON_FetchCells(data, top, row - 1);
+                top = -1;
+            }
+        }
+    }
+    if (!same_size) WINECON_FetchCells(data, 0, data->curcfg.sb_height - 1);
+    else if (top != -1) WINECON_FetchCells(data, top, shm->height - 1);
+}
+
 /******************************************************************
  *		WINECON_NotifyWindowChange
  *
@@ -309,6 +410,7 @@ int	WINECON_GrabChanges(struct inner_data* data)
 	    {
 		CloseHandle(data->hConOut);
 		data->hConOut = h;
+		WINECON_MapCells(data);
 	    }
 	    break;
 	case CONSOLE_RENDERER_SB_RESIZE_EVENT:
@@ -326,10 +428,14 @@ int	WINECON_GrabChanges(struct inner_data* data)
 		data->fnResizeScreenBuffer(data);
 		data->fnComputePositions(data);
 	    }
+	    /* the server moved the cells to a new area */
+	    WINECON_MapCells(data);
 	    break;
 	case CONSOLE_RENDERER_UPDATE_EVENT:
 	    WINE_TRACE(" update(%d,%d)", evts[i].u.update.top, evts[i].u.update.bottom);
 	    WINECON_FetchCells(data, evts[i].u.update.top, evts[i].u.update.bottom);
+	    /* with the cells mapped, the event only covers the first rows that changed */
+	    if (data->shm) WINECON_FetchDirtyCells(data);
 	    break;
 	case CONSOLE_RENDERER_CURSOR_POS_EVENT:
 	    if (evts[i].u.cursor_pos.x != data->cursor.X || evts[i].u.cursor_pos.y != data->cursor.Y)
@@ -535,6 +641,7 @@ static void WINECON_Delete(struct inner_data* data)
 
     if (data->fnDeleteBackend)  data->fnDeleteBackend(data);
     if (data->hConIn)		CloseHandle(data->hConIn);
+    if (data->shm)		munmap(data->shm, data->shm->size);
     if (data->hConOut)		CloseHandle(data->hConOut);
     if (data->hSynchro)		CloseHandle(data->hSynchro);
     HeapFree(GetProcessHeap(), 0, data->cells);
@@ -654,6 +761,7 @@ static struct inner_data* WINECON_Init(HINSTANCE hInst, DWORD pid, LPCWSTR appna
     SERVER_END_REQ;
     if (!ret) goto error;
     WINE_TRACE("using hConOut %p\n", data->hConOut);
+    WINECON_MapCells(data);
 
     /* filling data->curcfg from cfg */
     switch ((*backend)(data))